@@ -0,0 +1,184 @@
+/*
+ * Times the intersection kernels from intersect.h on pairs of real posting
+ * lists, grouped by how much longer the longer list is, to find where
+ * galloping overtakes the block kernels (INTERSECT_GALLOP_RATIO).
+ *
+ * Usage: bench_intersect <index_dir> [pairs_per_bucket] [repeats]
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "block_codec.h"
+#include "index_format.h"
+#include "intersect.h"
+#include "pef_codec.h"
+#include "roaring.h"
+
+static bool read_file(const std::string& path, std::vector<unsigned char>& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    out.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool load_lists(const std::string& index_dir, std::vector<std::vector<std::uint32_t>>& lists) {
+    std::vector<unsigned char> lexicon;
+    std::vector<unsigned char> postings;
+    if (!read_file(index_dir + "/lexicon.bin", lexicon) || !read_file(index_dir + "/postings.bin", postings)) {
+        std::cerr << "Failed to read index files in " << index_dir << "\n";
+        return false;
+    }
+    LexiconHeaderV2 lh;
+    PostingsHeaderV2 ph;
+    if (lexicon.size() < sizeof(lh) || postings.size() < sizeof(ph)) {
+        std::cerr << "Index files are truncated\n";
+        return false;
+    }
+    std::memcpy(&lh, lexicon.data(), sizeof(lh));
+    std::memcpy(&ph, postings.data(), sizeof(ph));
+    if (lh.version != INDEX_VERSION_MAPPED || ph.version != INDEX_VERSION_MAPPED ||
+        lh.records_offset + lh.term_count * sizeof(LexiconRecord) > lexicon.size() ||
+        ph.data_offset + ph.data_bytes > postings.size()) {
+        std::cerr << "bench_intersect needs a valid --format 2 index\n";
+        return false;
+    }
+
+    const unsigned char* data = postings.data() + ph.data_offset;
+    for (std::uint32_t t = 0; t < lh.term_count; ++t) {
+        LexiconRecord rec;
+        std::memcpy(&rec, lexicon.data() + lh.records_offset + t * sizeof(LexiconRecord), sizeof(rec));
+        if (rec.postings_count == 0 || rec.postings_offset >= ph.data_bytes) {
+            continue;
+        }
+        std::vector<std::uint32_t> ids(rec.postings_count);
+        const unsigned char* p = data + rec.postings_offset;
+        if (ph.codec == INDEX_CODEC_RAW) {
+            std::memcpy(ids.data(), p, sizeof(std::uint32_t) * ids.size());
+        } else if (ph.codec == INDEX_CODEC_BLOCK) {
+            block_codec_decode(p, rec.postings_count, ids.data());
+        } else if (ph.codec == INDEX_CODEC_PEF) {
+            pef_codec_decode(p, rec.postings_count, ids.data());
+        } else {
+            RoaringSet set;
+            if (!roaring_view(p, &set)) {
+                return false;
+            }
+            roaring_extract(&set, 0, rec.postings_count, ids.data());
+            roaring_free(&set);
+        }
+        lists.push_back(std::move(ids));
+    }
+    return true;
+}
+
+struct Pair {
+    std::uint32_t a;
+    std::uint32_t b;
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: bench_intersect <index_dir> [pairs_per_bucket] [repeats]\n";
+        return 1;
+    }
+    std::uint32_t pairs_per_bucket = (argc > 2) ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 200;
+    std::uint32_t repeats = (argc > 3) ? static_cast<std::uint32_t>(std::stoul(argv[3])) : 20;
+
+    std::vector<std::vector<std::uint32_t>> lists;
+    if (!load_lists(argv[1], lists)) {
+        return 1;
+    }
+    if (lists.size() < 2) {
+        std::cerr << "Index has too few non-empty terms\n";
+        return 1;
+    }
+
+    /* Pair up random terms; bucket b holds pairs whose length ratio is in [2^b, 2^(b+1)). */
+    const std::uint32_t bucket_count = 12;
+    std::vector<std::vector<Pair>> buckets(bucket_count);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::uint32_t> pick(0, static_cast<std::uint32_t>(lists.size() - 1));
+    for (std::uint64_t attempt = 0; attempt < 2000000; ++attempt) {
+        Pair p{pick(rng), pick(rng)};
+        std::uint64_t na = lists[p.a].size();
+        std::uint64_t nb = lists[p.b].size();
+        if (p.a == p.b || na > nb || na < 4) {
+            continue;
+        }
+        std::uint32_t bucket = 0;
+        while (bucket + 1 < bucket_count && (na << (bucket + 1)) <= nb) {
+            ++bucket;
+        }
+        if (buckets[bucket].size() < pairs_per_bucket) {
+            buckets[bucket].push_back(p);
+        }
+    }
+
+    std::vector<std::uint32_t> out;
+    std::uint64_t checksum = 0;
+    int crossover = -1;
+    std::cout << "terms=" << lists.size() << "\n";
+    for (std::uint32_t bucket = 0; bucket < bucket_count; ++bucket) {
+        const std::vector<Pair>& pairs = buckets[bucket];
+        if (pairs.empty()) {
+            continue;
+        }
+        std::uint64_t short_sum = 0;
+        std::uint64_t long_sum = 0;
+        for (const Pair& p : pairs) {
+            short_sum += lists[p.a].size();
+            long_sum += lists[p.b].size();
+            if (out.size() < lists[p.a].size()) {
+                out.resize(lists[p.a].size());
+            }
+        }
+
+        std::cout << "ratio=" << (1u << bucket) << (bucket + 1 < bucket_count ? "-" + std::to_string(2u << bucket) : "+")
+                  << " pairs=" << pairs.size() << " avg_short=" << short_sum / pairs.size()
+                  << " avg_long=" << long_sum / pairs.size();
+        double best_ns = 0.0;
+        int best = -1;
+        for (int kernel = 0; kernel < INTERSECT_KERNEL_COUNT; ++kernel) {
+            if (!intersect_kernel_available(kernel)) {
+                continue;
+            }
+            auto started = std::chrono::steady_clock::now();
+            for (std::uint32_t r = 0; r < repeats; ++r) {
+                for (const Pair& p : pairs) {
+                    const std::vector<std::uint32_t>& a = lists[p.a];
+                    const std::vector<std::uint32_t>& b = lists[p.b];
+                    checksum += intersect_with(kernel, a.data(), static_cast<std::uint32_t>(a.size()), b.data(),
+                                               static_cast<std::uint32_t>(b.size()), out.data());
+                }
+            }
+            auto ended = std::chrono::steady_clock::now();
+            double ns = std::chrono::duration<double, std::nano>(ended - started).count() /
+                        (static_cast<double>(repeats) * static_cast<double>(pairs.size()));
+            std::cout << " " << intersect_kernel_name(kernel) << "_ns=" << static_cast<std::uint64_t>(ns);
+            if (best < 0 || ns < best_ns) {
+                best = kernel;
+                best_ns = ns;
+            }
+        }
+        std::cout << " best=" << intersect_kernel_name(best) << "\n";
+        if (best == INTERSECT_GALLOP && crossover < 0) {
+            crossover = static_cast<int>(1u << bucket);
+        }
+        if (best != INTERSECT_GALLOP) {
+            crossover = -1;
+        }
+    }
+    std::cout << "gallop_from_ratio=" << crossover << "\n";
+    std::cout << "configured_gallop_ratio=" << INTERSECT_GALLOP_RATIO << "\n";
+    std::cout << "checksum=" << checksum << "\n";
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Times reading a file line by line the way each tool did before
+ * line_reader.h and the way it does now, counting lines and tab-separated
+ * columns so that every line is looked at:
+ *
+ *   fgetc     read_line with one fgetc per byte: stemmer, term_stats and
+ *             index_builder (shards and forward file) before
+ *   getline   std::getline on an ifstream: tokenizer before
+ *   buffered  LineReader reading 1 MiB blocks: any tool reading a pipe
+ *   mmap      LineReader over a mapping: term_stats, index_builder
+ *   block     LineReader handing out 256 KiB runs of whole lines, as the
+ *             pipeline source does for tokenizer, stemmer and ingest
+ *
+ * The file is read once first so that every variant finds it in the page
+ * cache; the best of the repeats is reported.
+ *
+ * Usage: bench_line_reader <file> [repeats]
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "line_reader.h"
+
+struct Counts {
+    std::uint64_t lines;
+    std::uint64_t columns;
+    std::uint64_t bytes;
+};
+
+static int read_line(FILE* in, char** buffer, size_t* capacity) {
+    if (*buffer == nullptr || *capacity == 0) {
+        *capacity = 4096;
+        *buffer = static_cast<char*>(std::malloc(*capacity));
+        if (!*buffer) {
+            return -1;
+        }
+    }
+    size_t len = 0;
+    while (1) {
+        int c = std::fgetc(in);
+        if (c == EOF) {
+            if (len == 0) {
+                return -1;
+            }
+            break;
+        }
+        if (len + 1 >= *capacity) {
+            size_t new_cap = (*capacity) * 2;
+            char* new_buf = static_cast<char*>(std::realloc(*buffer, new_cap));
+            if (!new_buf) {
+                return -1;
+            }
+            *buffer = new_buf;
+            *capacity = new_cap;
+        }
+        (*buffer)[len++] = static_cast<char>(c);
+        if (c == '\n') {
+            break;
+        }
+    }
+    (*buffer)[len] = '\0';
+    return static_cast<int>(len);
+}
+
+static void count_view(LineView line, Counts* counts) {
+    ++counts->lines;
+    counts->bytes += line.len + 1;
+    for (const char* tab = line_view_find(line, '\t'); tab; tab = line_view_find(line, '\t')) {
+        ++counts->columns;
+        line = LineView{tab + 1, static_cast<size_t>(line.data + line.len - tab - 1)};
+    }
+}
+
+static bool run_fgetc(const char* path, Counts* counts) {
+    FILE* in = std::fopen(path, "rb");
+    if (!in) {
+        return false;
+    }
+    char* line = nullptr;
+    size_t cap = 0;
+    int n = 0;
+    while ((n = read_line(in, &line, &cap)) >= 0) {
+        ++counts->lines;
+        counts->bytes += static_cast<std::uint64_t>(n);
+        for (char* tab = std::strchr(line, '\t'); tab; tab = std::strchr(tab + 1, '\t')) {
+            ++counts->columns;
+        }
+    }
+    std::free(line);
+    std::fclose(in);
+    return true;
+}
+
+static bool run_getline(const char* path, Counts* counts) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        count_view(LineView{line.data(), line.size()}, counts);
+    }
+    return true;
+}
+
+static bool run_reader(const char* path, int mode, Counts* counts) {
+    LineReader in;
+    if (!line_reader_open(&in, path, mode)) {
+        return false;
+    }
+    LineView line;
+    while (line_reader_next(&in, &line)) {
+        count_view(line, counts);
+    }
+    bool ok = !in.error;
+    line_reader_close(&in);
+    return ok;
+}
+
+static bool run_block(const char* path, Counts* counts) {
+    LineReader in;
+    if (!line_reader_open(&in, path, LINE_READER_AUTO)) {
+        return false;
+    }
+    LineView block;
+    while (line_reader_next_block(&in, 256 * 1024, &block)) {
+        const char* end = block.data + block.len;
+        for (const char* p = block.data; p < end;) {
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+            nl = nl ? nl : end;
+            count_view(LineView{p, static_cast<size_t>(nl - p)}, counts);
+            p = nl + 1;
+        }
+    }
+    bool ok = !in.error;
+    line_reader_close(&in);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: bench_line_reader <file> [repeats]\n";
+        return 1;
+    }
+    const char* path = argv[1];
+    std::uint32_t repeats = (argc > 2) ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 5;
+    const char* names[] = {"fgetc", "getline", "buffered", "mmap", "block"};
+    const int variants = 5;
+
+    Counts warm{};
+    if (!run_reader(path, LINE_READER_BUFFERED, &warm)) {
+        std::cerr << "Failed to read " << path << "\n";
+        return 1;
+    }
+
+    double best[variants] = {0.0, 0.0, 0.0, 0.0, 0.0};
+    Counts counts[variants] = {};
+    for (std::uint32_t r = 0; r < repeats; ++r) {
+        for (int v = 0; v < variants; ++v) {
+            Counts c{};
+            auto started = std::chrono::steady_clock::now();
+            bool ok = false;
+            if (v == 0) {
+                ok = run_fgetc(path, &c);
+            } else if (v == 1) {
+                ok = run_getline(path, &c);
+            } else if (v == 2) {
+                ok = run_reader(path, LINE_READER_BUFFERED, &c);
+            } else if (v == 3) {
+                ok = run_reader(path, LINE_READER_MMAP, &c);
+            } else {
+                ok = run_block(path, &c);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            if (!ok) {
+                std::cerr << names[v] << " failed on " << path << "\n";
+                return 1;
+            }
+            if (r == 0 || seconds < best[v]) {
+                best[v] = seconds;
+            }
+            counts[v] = c;
+        }
+    }
+
+    for (int v = 0; v < variants; ++v) {
+        double mb = static_cast<double>(warm.bytes) / (1024.0 * 1024.0);
+        std::cout << "reader=" << names[v] << " lines=" << counts[v].lines << " columns=" << counts[v].columns
+                  << " seconds=" << best[v] << " mb_per_second=" << (best[v] > 0.0 ? mb / best[v] : 0.0) << "\n";
+    }
+    return 0;
+}
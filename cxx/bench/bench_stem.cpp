@@ -0,0 +1,164 @@
+/*
+ * Times stem_token from stem.h, which matches every rule in one pass of the
+ * suffix automaton, against the chain of ends_with tests it replaced
+ * ("chain"), on every token of a tokenized.txt already in memory. Also
+ * times the same tokens through a StemCache of the default size ("cache").
+ * Every variant's stems are compared with the chain's; a mismatch fails
+ * the run.
+ *
+ * Usage: bench_stem <tokenized.txt> [repeats]
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "stem.h"
+
+static int ends_with(const char* s, std::size_t n, const char* suffix) {
+    std::size_t m = std::strlen(suffix);
+    if (n < m) {
+        return 0;
+    }
+    return std::memcmp(s + n - m, suffix, m) == 0;
+}
+
+static std::size_t cut(char* token, std::size_t n) {
+    token[n] = '\0';
+    return n;
+}
+
+static std::size_t stem_chain(char* token, std::size_t len) {
+    std::size_t n = len;
+    if (n <= 2) {
+        return cut(token, n);
+    }
+    if (n > 5 && ends_with(token, n, "ingly")) {
+        return cut(token, n - 5);
+    }
+    if (n > 4 && ends_with(token, n, "edly")) {
+        return cut(token, n - 4);
+    }
+    if (n > 4 && ends_with(token, n, "ing")) {
+        return cut(token, n - 3);
+    }
+    if (n > 3 && ends_with(token, n, "ed")) {
+        return cut(token, n - 2);
+    }
+    if (n > 4 && ends_with(token, n, "ies")) {
+        token[n - 3] = 'y';
+        return cut(token, n - 2);
+    }
+    if (n > 3 && ends_with(token, n, "es")) {
+        return cut(token, n - 2);
+    }
+    if (n > 3 && ends_with(token, n, "ly")) {
+        return cut(token, n - 2);
+    }
+    if (n > 3 && token[n - 1] == 's') {
+        return cut(token, n - 1);
+    }
+    return cut(token, n);
+}
+
+/* Start and length of every space-separated token after the tab of each line. */
+static void split_tokens(const std::vector<char>& data, std::vector<std::size_t>& starts,
+                         std::vector<std::size_t>& lens) {
+    std::size_t pos = 0;
+    while (pos < data.size()) {
+        const char* line = data.data() + pos;
+        const char* nl = static_cast<const char*>(std::memchr(line, '\n', data.size() - pos));
+        std::size_t len = nl ? static_cast<std::size_t>(nl - line) : data.size() - pos;
+        const char* tab = static_cast<const char*>(std::memchr(line, '\t', len));
+        for (std::size_t i = tab ? static_cast<std::size_t>(tab - line) + 1 : len; i < len;) {
+            if (line[i] == ' ') {
+                ++i;
+                continue;
+            }
+            std::size_t start = i;
+            while (i < len && line[i] != ' ') {
+                ++i;
+            }
+            starts.push_back(pos + start);
+            lens.push_back(i - start);
+        }
+        pos += len + 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: bench_stem <tokenized.txt> [repeats]\n";
+        return 1;
+    }
+    std::uint32_t repeats = (argc > 2) ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 5;
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Failed to open " << argv[1] << "\n";
+        return 1;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::size_t> starts;
+    std::vector<std::size_t> lens;
+    split_tokens(data, starts, lens);
+    std::size_t longest = 0;
+    for (std::size_t len : lens) {
+        longest = (len > longest) ? len : longest;
+    }
+
+    std::vector<char> token(longest + 1);
+    std::vector<char> expected;
+    std::vector<std::size_t> expected_lens(starts.size());
+    for (std::size_t t = 0; t < starts.size(); ++t) {
+        std::memcpy(token.data(), &data[starts[t]], lens[t]);
+        expected_lens[t] = stem_chain(token.data(), lens[t]);
+        expected.insert(expected.end(), token.data(), token.data() + expected_lens[t]);
+    }
+
+    const char* names[] = {"chain", "automaton", "cache"};
+    for (int variant = 0; variant < 3; ++variant) {
+        StemCache cache;
+        if (variant == 2 && !stem_cache_init(&cache, 0)) {
+            std::cerr << "Failed to allocate stem cache\n";
+            return 1;
+        }
+        double best = 0.0;
+        bool match = true;
+        for (std::uint32_t r = 0; r < repeats; ++r) {
+            std::size_t at = 0;
+            auto started = std::chrono::steady_clock::now();
+            for (std::size_t t = 0; t < starts.size(); ++t) {
+                std::memcpy(token.data(), &data[starts[t]], lens[t]);
+                std::size_t n = (variant == 0)   ? stem_chain(token.data(), lens[t])
+                                : (variant == 1) ? stem_token(token.data(), lens[t])
+                                                 : stem_cache_stem(&cache, token.data(), lens[t]);
+                if (r == 0 && (n != expected_lens[t] || std::memcmp(token.data(), &expected[at], n) != 0)) {
+                    match = false;
+                }
+                at += expected_lens[t];
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            if (r == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        double tokens = static_cast<double>(starts.size());
+        std::cout << "stemmer=" << names[variant] << " tokens=" << starts.size() << " seconds=" << best
+                  << " ns_per_token=" << (tokens > 0.0 ? best * 1e9 / tokens : 0.0)
+                  << " match=" << (match ? "yes" : "no");
+        if (variant == 2) {
+            std::uint64_t lookups = cache.hits + cache.misses;
+            std::cout << " hit_rate=" << (lookups > 0 ? static_cast<double>(cache.hits) / lookups : 0.0);
+            stem_cache_free(&cache);
+        }
+        std::cout << "\n";
+        if (!match) {
+            return 1;
+        }
+    }
+    return 0;
+}
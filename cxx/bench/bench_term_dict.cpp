@@ -0,0 +1,167 @@
+/*
+ * Times the hashing phase of term_stats and index_builder: every token of a
+ * stemmed file, already in memory, is looked up in (and if new added to)
+ *
+ *   fixed     the fixed-capacity table the tools used before term_dict.h:
+ *             djb2 modulo the capacity, linear probing, strcmp per probe
+ *   dict      TermDict grown from its minimum size
+ *   presized  TermDict created with room for the whole vocabulary
+ *
+ * Usage: bench_term_dict <stemmed.txt> [repeats] [fixed_capacity]
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "term_dict.h"
+
+struct FixedSlot {
+    char* term;
+    std::uint32_t count;
+    int used;
+};
+
+static std::uint64_t djb2(const char* s) {
+    std::uint64_t hash = 5381;
+    while (*s) {
+        hash = ((hash << 5) + hash) + static_cast<unsigned char>(*s);
+        ++s;
+    }
+    return hash;
+}
+
+static bool fixed_add(std::vector<FixedSlot>& table, const char* term, std::uint64_t* unique) {
+    std::size_t capacity = table.size();
+    std::size_t idx = static_cast<std::size_t>(djb2(term) % capacity);
+    for (std::size_t step = 0; step < capacity; ++step) {
+        FixedSlot* slot = &table[idx];
+        if (!slot->used) {
+            slot->term = strdup(term);
+            slot->count = 1;
+            slot->used = 1;
+            ++*unique;
+            return true;
+        }
+        if (std::strcmp(slot->term, term) == 0) {
+            slot->count += 1;
+            return true;
+        }
+        idx = (idx + 1) % capacity;
+    }
+    return false;
+}
+
+/* Splits the body of every "doc_id\ttokens" line into NUL-terminated tokens inside text. */
+static void split_tokens(std::vector<char>& text, std::vector<std::uint32_t>& starts,
+                         std::vector<std::uint32_t>& lens) {
+    std::size_t i = 0;
+    while (i < text.size()) {
+        std::size_t eol = i;
+        while (eol < text.size() && text[eol] != '\n') {
+            ++eol;
+        }
+        std::size_t p = i;
+        while (p < eol && text[p] != '\t') {
+            ++p;
+        }
+        for (++p; p < eol;) {
+            while (p < eol && (text[p] == ' ' || text[p] == '\r')) {
+                text[p++] = '\0';
+            }
+            std::size_t start = p;
+            while (p < eol && text[p] != ' ' && text[p] != '\r') {
+                ++p;
+            }
+            if (p > start) {
+                starts.push_back(static_cast<std::uint32_t>(start));
+                lens.push_back(static_cast<std::uint32_t>(p - start));
+            }
+        }
+        if (eol < text.size()) {
+            text[eol] = '\0';
+        }
+        i = eol + 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: bench_term_dict <stemmed.txt> [repeats] [fixed_capacity]\n";
+        return 1;
+    }
+    std::uint32_t repeats = (argc > 2) ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 5;
+    std::size_t fixed_capacity = (argc > 3) ? static_cast<std::size_t>(std::stoull(argv[3])) : (1u << 20);
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Failed to open " << argv[1] << "\n";
+        return 1;
+    }
+    std::vector<char> text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    text.push_back('\0');
+    std::vector<std::uint32_t> starts;
+    std::vector<std::uint32_t> lens;
+    split_tokens(text, starts, lens);
+    if (text.size() > UINT32_MAX || starts.empty()) {
+        std::cerr << "Input is empty or larger than 4 GiB\n";
+        return 1;
+    }
+
+    double best[3] = {0.0, 0.0, 0.0};
+    std::uint64_t unique[3] = {0, 0, 0};
+    for (std::uint32_t r = 0; r < repeats; ++r) {
+        for (int variant = 0; variant < 3; ++variant) {
+            std::vector<FixedSlot> table;
+            TermDict dict;
+            std::uint64_t terms = 0;
+            bool ok = true;
+            if (variant == 0) {
+                table.assign(fixed_capacity, FixedSlot{nullptr, 0, 0});
+            } else {
+                ok = term_dict_init(&dict, (variant == 2) ? unique[0] * 8 / 7 + 1 : 0, sizeof(std::uint32_t));
+            }
+            auto started = std::chrono::steady_clock::now();
+            for (std::size_t t = 0; ok && t < starts.size(); ++t) {
+                const char* term = &text[starts[t]];
+                if (variant == 0) {
+                    ok = fixed_add(table, term, &terms);
+                } else {
+                    std::uint32_t id = 0;
+                    int inserted = 0;
+                    ok = term_dict_intern(&dict, term, lens[t], &id, &inserted);
+                    *static_cast<std::uint32_t*>(term_dict_value(&dict, id)) += 1;
+                }
+            }
+            auto ended = std::chrono::steady_clock::now();
+            if (!ok) {
+                std::cerr << (variant == 0 ? "Fixed table is full; pass a larger fixed_capacity\n" : "Out of memory\n");
+                return 1;
+            }
+            if (variant == 0) {
+                for (const FixedSlot& slot : table) {
+                    std::free(slot.term);
+                }
+            } else {
+                terms = dict.count;
+                term_dict_free(&dict);
+            }
+            double ns = std::chrono::duration<double, std::nano>(ended - started).count() /
+                        static_cast<double>(starts.size());
+            best[variant] = (r == 0 || ns < best[variant]) ? ns : best[variant];
+            unique[variant] = terms;
+        }
+    }
+    std::cout << "tokens=" << starts.size() << " unique_terms=" << unique[0] << "\n";
+    std::cout << "fixed_ns_per_token=" << best[0] << " dict_ns_per_token=" << best[1]
+              << " presized_ns_per_token=" << best[2] << "\n";
+    if (unique[1] != unique[0] || unique[2] != unique[0]) {
+        std::cerr << "Dictionaries disagree on the vocabulary\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Times the tokenizer kernels from tokenize.h on the text column of every
+ * raw_text.tsv line, already in memory, against the ASCII-only
+ * std::isalnum / std::tolower loop tokenize_text used before them
+ * ("isalnum"). Every kernel's output is compared with the scalar kernel's,
+ * the UTF-8 reference; a mismatch fails the run. The isalnum loop splits
+ * words at every non-ASCII byte, so it is timed but not compared.
+ *
+ * Usage: bench_tokenize <raw_text.tsv> [repeats]
+ */
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "tokenize.h"
+
+static std::size_t tokenize_isalnum(const char* text, std::size_t len, char* out, std::uint64_t* tokens) {
+    std::size_t n = 0;
+    std::uint64_t count = 0;
+    int in_token = 0;
+    for (std::size_t i = 0; i < len; ++i) {
+        unsigned char ch = static_cast<unsigned char>(text[i]);
+        if (!std::isalnum(ch)) {
+            in_token = 0;
+            continue;
+        }
+        if (!in_token) {
+            if (count > 0) {
+                out[n++] = ' ';
+            }
+            ++count;
+            in_token = 1;
+        }
+        out[n++] = static_cast<char>(std::tolower(ch));
+    }
+    *tokens = count;
+    return n;
+}
+
+/* Start and length of the text after the fourth tab of every line that has one. */
+static void split_texts(const std::vector<char>& data, std::vector<std::size_t>& starts,
+                        std::vector<std::size_t>& lens) {
+    std::size_t pos = 0;
+    while (pos < data.size()) {
+        const char* line = data.data() + pos;
+        const char* nl = static_cast<const char*>(std::memchr(line, '\n', data.size() - pos));
+        std::size_t len = nl ? static_cast<std::size_t>(nl - line) : data.size() - pos;
+        const char* p = line;
+        int tabs = 0;
+        while (tabs < 4 && (p = static_cast<const char*>(std::memchr(p, '\t', len - (p - line)))) != nullptr) {
+            ++p;
+            ++tabs;
+        }
+        if (tabs == 4) {
+            starts.push_back(static_cast<std::size_t>(p - data.data()));
+            lens.push_back(len - static_cast<std::size_t>(p - line));
+        }
+        pos += len + 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: bench_tokenize <raw_text.tsv> [repeats]\n";
+        return 1;
+    }
+    std::uint32_t repeats = (argc > 2) ? static_cast<std::uint32_t>(std::stoul(argv[2])) : 5;
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Failed to open " << argv[1] << "\n";
+        return 1;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::size_t> starts;
+    std::vector<std::size_t> lens;
+    split_texts(data, starts, lens);
+    std::size_t text_bytes = 0;
+    std::size_t longest = 0;
+    for (std::size_t len : lens) {
+        text_bytes += len;
+        longest = (len > longest) ? len : longest;
+    }
+
+    std::vector<char> expected(text_bytes + TOKENIZE_OUT_SLACK);
+    std::vector<std::size_t> expected_lens(lens.size());
+    std::uint64_t expected_tokens = 0;
+    std::size_t at = 0;
+    for (std::size_t d = 0; d < starts.size(); ++d) {
+        std::uint64_t tokens = 0;
+        expected_lens[d] = tokenize_text_with(TOKENIZE_SCALAR, &data[starts[d]], lens[d], &expected[at], &tokens);
+        at += expected_lens[d];
+        expected_tokens += tokens;
+    }
+
+    std::vector<char> out(longest + TOKENIZE_OUT_SLACK);
+    double mb = static_cast<double>(text_bytes) / (1024.0 * 1024.0);
+    for (int kernel = -1; kernel < TOKENIZE_KERNEL_COUNT; ++kernel) {
+        const char* name = (kernel < 0) ? "isalnum" : tokenize_kernel_name(kernel);
+        if (kernel >= 0 && !tokenize_kernel_available(kernel)) {
+            std::cout << "kernel=" << name << " available=no\n";
+            continue;
+        }
+        double best = 0.0;
+        bool match = true;
+        std::uint64_t tokens = 0;
+        for (std::uint32_t r = 0; r < repeats; ++r) {
+            tokens = 0;
+            at = 0;
+            auto started = std::chrono::steady_clock::now();
+            for (std::size_t d = 0; d < starts.size(); ++d) {
+                std::uint64_t doc_tokens = 0;
+                std::size_t n = (kernel < 0)
+                                    ? tokenize_isalnum(&data[starts[d]], lens[d], out.data(), &doc_tokens)
+                                    : tokenize_text_with(kernel, &data[starts[d]], lens[d], out.data(), &doc_tokens);
+                tokens += doc_tokens;
+                if (r == 0 && (n != expected_lens[d] || std::memcmp(out.data(), &expected[at], n) != 0)) {
+                    match = false;
+                }
+                at += expected_lens[d];
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            if (r == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        match = match && tokens == expected_tokens;
+        std::cout << "kernel=" << name << " documents=" << starts.size() << " tokens=" << tokens
+                  << " seconds=" << best << " mb_per_second=" << (best > 0.0 ? mb / best : 0.0)
+                  << " match=" << (kernel < 0 ? "n/a" : match ? "yes" : "no") << "\n";
+        if (kernel >= 0 && !match) {
+            return 1;
+        }
+    }
+    return 0;
+}
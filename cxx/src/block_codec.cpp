@@ -0,0 +1,219 @@
+#include "block_codec.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static std::uint32_t block_count_for(std::uint32_t count) {
+    return (count + BLOCK_CODEC_SIZE - 1) / BLOCK_CODEC_SIZE;
+}
+
+#if !defined(__SSE2__)
+static std::uint32_t load_u32(const unsigned char* p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+#endif
+
+static std::uint32_t bit_width(std::uint32_t v) {
+    return v == 0 ? 0 : 32 - static_cast<std::uint32_t>(__builtin_clz(v));
+}
+
+size_t block_codec_max_bytes(std::uint32_t count) {
+    size_t skips = (count >= BLOCK_CODEC_SIZE) ? block_count_for(count) * sizeof(BlockSkip) : 0;
+    size_t full = static_cast<size_t>(count / BLOCK_CODEC_SIZE) * 16 * 32;
+    size_t tail = static_cast<size_t>(count % BLOCK_CODEC_SIZE) * 5;
+    return skips + full + tail + 3;
+}
+
+static size_t pack_block(const std::uint32_t* gaps, unsigned char* out) {
+    std::uint32_t all_bits = 0;
+    for (std::uint32_t i = 0; i < BLOCK_CODEC_SIZE; ++i) {
+        all_bits |= gaps[i];
+    }
+    std::uint32_t width = bit_width(all_bits);
+    std::uint32_t words[4 * 32];
+    std::memset(words, 0, sizeof(words));
+    for (std::uint32_t lane = 0; lane < 4; ++lane) {
+        std::uint32_t bitpos = 0;
+        for (std::uint32_t k = 0; k < 32; ++k) {
+            std::uint32_t v = gaps[k * 4 + lane];
+            std::uint32_t w = bitpos >> 5;
+            std::uint32_t s = bitpos & 31;
+            words[w * 4 + lane] |= v << s;
+            if (s + width > 32) {
+                words[(w + 1) * 4 + lane] |= v >> (32 - s);
+            }
+            bitpos += width;
+        }
+    }
+    std::memcpy(out, words, 16 * width);
+    return 16 * width;
+}
+
+static void unpack_block(const unsigned char* in, std::uint32_t width, std::uint32_t base, std::uint32_t* out) {
+    if (width == 0) {
+        for (std::uint32_t i = 0; i < BLOCK_CODEC_SIZE; ++i) {
+            out[i] = base;
+        }
+        return;
+    }
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi32(width == 32 ? -1 : static_cast<int>((1U << width) - 1));
+    const __m128i* words = reinterpret_cast<const __m128i*>(in);
+    __m128i prev = _mm_set1_epi32(static_cast<int>(base));
+    for (std::uint32_t k = 0; k < 32; ++k) {
+        std::uint32_t bitpos = k * width;
+        std::uint32_t w = bitpos >> 5;
+        std::uint32_t s = bitpos & 31;
+        __m128i v = _mm_srl_epi32(_mm_loadu_si128(words + w), _mm_cvtsi32_si128(static_cast<int>(s)));
+        if (s + width > 32) {
+            v = _mm_or_si128(v, _mm_sll_epi32(_mm_loadu_si128(words + w + 1),
+                                              _mm_cvtsi32_si128(static_cast<int>(32 - s))));
+        }
+        v = _mm_and_si128(v, mask);
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, prev);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + k * 4), v);
+        prev = _mm_shuffle_epi32(v, 0xFF);
+    }
+#else
+    const std::uint32_t mask = (width == 32) ? 0xFFFFFFFFU : ((1U << width) - 1);
+    std::uint32_t prev = base;
+    for (std::uint32_t k = 0; k < 32; ++k) {
+        std::uint32_t bitpos = k * width;
+        std::uint32_t w = bitpos >> 5;
+        std::uint32_t s = bitpos & 31;
+        for (std::uint32_t lane = 0; lane < 4; ++lane) {
+            std::uint32_t v = load_u32(in + (w * 4 + lane) * 4) >> s;
+            if (s + width > 32) {
+                v |= load_u32(in + ((w + 1) * 4 + lane) * 4) << (32 - s);
+            }
+            prev += v & mask;
+            out[k * 4 + lane] = prev;
+        }
+    }
+#endif
+}
+
+static size_t put_varint(std::uint32_t v, unsigned char* out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = static_cast<unsigned char>(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = static_cast<unsigned char>(v);
+    return n;
+}
+
+size_t block_codec_encode(const std::uint32_t* ids, std::uint32_t count, unsigned char* out) {
+    std::uint32_t block_count = block_count_for(count);
+    size_t skips_bytes = (count >= BLOCK_CODEC_SIZE) ? block_count * sizeof(BlockSkip) : 0;
+    unsigned char* payload = out + skips_bytes;
+    size_t pos = 0;
+    std::uint32_t prev = 0;
+    std::uint32_t gaps[BLOCK_CODEC_SIZE];
+
+    for (std::uint32_t b = 0; b < block_count; ++b) {
+        std::uint32_t start = b * BLOCK_CODEC_SIZE;
+        std::uint32_t n = (count - start < BLOCK_CODEC_SIZE) ? count - start : BLOCK_CODEC_SIZE;
+        for (std::uint32_t i = 0; i < n; ++i) {
+            gaps[i] = ids[start + i] - prev;
+            prev = ids[start + i];
+        }
+        if (n == BLOCK_CODEC_SIZE) {
+            pos += pack_block(gaps, payload + pos);
+        } else {
+            for (std::uint32_t i = 0; i < n; ++i) {
+                pos += put_varint(gaps[i], payload + pos);
+            }
+        }
+        if (skips_bytes > 0) {
+            BlockSkip skip{prev, static_cast<std::uint32_t>(pos)};
+            std::memcpy(out + b * sizeof(BlockSkip), &skip, sizeof(skip));
+        }
+    }
+
+    size_t total = skips_bytes + pos;
+    while (total % 4 != 0) {
+        out[total++] = 0;
+    }
+    return total;
+}
+
+/* Decodes block b of a list into out and returns the number of ids in it. */
+static std::uint32_t decode_block(const BlockSkip* skips, const unsigned char* payload, std::uint32_t count,
+                                  std::uint32_t b, std::uint32_t* out) {
+    std::uint32_t start = (b > 0) ? skips[b - 1].end_offset : 0;
+    std::uint32_t base = (b > 0) ? skips[b - 1].last_doc_id : 0;
+    std::uint32_t first = b * BLOCK_CODEC_SIZE;
+    std::uint32_t n = (count - first < BLOCK_CODEC_SIZE) ? count - first : BLOCK_CODEC_SIZE;
+    if (n == BLOCK_CODEC_SIZE) {
+        unpack_block(payload + start, (skips[b].end_offset - start) / 16, base, out);
+        return n;
+    }
+    const unsigned char* p = payload + start;
+    std::uint32_t prev = base;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        std::uint32_t v = 0;
+        std::uint32_t shift = 0;
+        while (*p & 0x80) {
+            v |= static_cast<std::uint32_t>(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        v |= static_cast<std::uint32_t>(*p++) << shift;
+        prev += v;
+        out[i] = prev;
+    }
+    return n;
+}
+
+void block_codec_decode(const unsigned char* data, std::uint32_t count, std::uint32_t* out) {
+    BlockCursor cur;
+    block_cursor_init(&cur, data, count);
+    for (std::uint32_t b = 0; b < cur.block_count; ++b) {
+        decode_block(cur.skips, cur.payload, count, b, out + b * BLOCK_CODEC_SIZE);
+    }
+}
+
+void block_cursor_init(BlockCursor* cur, const unsigned char* data, std::uint32_t count) {
+    cur->count = count;
+    cur->block_count = block_count_for(count);
+    if (count >= BLOCK_CODEC_SIZE) {
+        cur->skips = reinterpret_cast<const BlockSkip*>(data);
+        cur->payload = data + cur->block_count * sizeof(BlockSkip);
+    } else {
+        cur->skips = nullptr;
+        cur->payload = data;
+    }
+    cur->block = 0;
+    cur->pos = 0;
+    cur->buf_len = 0;
+}
+
+int block_cursor_next_geq(BlockCursor* cur, std::uint32_t target, std::uint32_t* out) {
+    while (cur->block < cur->block_count) {
+        if (cur->buf_len == 0) {
+            if (cur->skips && cur->skips[cur->block].last_doc_id < target) {
+                cur->block++;
+                continue;
+            }
+            cur->buf_len = decode_block(cur->skips, cur->payload, cur->count, cur->block, cur->buf);
+            cur->pos = 0;
+        }
+        while (cur->pos < cur->buf_len && cur->buf[cur->pos] < target) {
+            cur->pos++;
+        }
+        if (cur->pos < cur->buf_len) {
+            *out = cur->buf[cur->pos];
+            return 1;
+        }
+        cur->block++;
+        cur->buf_len = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Block-packed posting lists (postings codec INDEX_CODEC_BLOCK).
+ *
+ * Doc ids are stored as gaps (id - previous id, the first against 0) in
+ * blocks of BLOCK_CODEC_SIZE ids. A full block is bit-packed with the
+ * smallest width that fits all of its gaps, in four interleaved 32-bit
+ * lanes (gap i goes to lane i % 4) so SSE2 can unpack four gaps per
+ * instruction; it takes exactly 16 * width bytes. The trailing partial
+ * block is stored as LEB128 varints.
+ *
+ * Lists with more than one block start with a skip table of
+ * BlockSkip[block_count], giving for each block its last doc id and the
+ * end offset of its payload, so readers can skip whole blocks without
+ * decoding them. Every encoded list is padded to a multiple of 4 bytes.
+ */
+
+const std::uint32_t BLOCK_CODEC_SIZE = 128;
+
+struct BlockSkip {
+    std::uint32_t last_doc_id;
+    std::uint32_t end_offset; /* end of this block's payload, relative to the first payload byte */
+};
+
+/* Upper bound on the encoded size of a list of count ids. */
+size_t block_codec_max_bytes(std::uint32_t count);
+
+/* Encodes strictly increasing ids into out; returns the number of bytes written. */
+size_t block_codec_encode(const std::uint32_t* ids, std::uint32_t count, unsigned char* out);
+
+/* Decodes a whole list of count ids into out. */
+void block_codec_decode(const unsigned char* data, std::uint32_t count, std::uint32_t* out);
+
+/* Forward-only cursor that decodes one block at a time. */
+struct BlockCursor {
+    const BlockSkip* skips;
+    const unsigned char* payload;
+    std::uint32_t count;
+    std::uint32_t block_count;
+    std::uint32_t block; /* current block; decoded into buf when buf_len > 0 */
+    std::uint32_t pos;
+    std::uint32_t buf_len;
+    std::uint32_t buf[BLOCK_CODEC_SIZE];
+};
+
+void block_cursor_init(BlockCursor* cur, const unsigned char* data, std::uint32_t count);
+
+/*
+ * Moves to the first id >= target and stores it in *out; returns 0 when the
+ * list has no such id. Targets must not decrease between calls.
+ */
+int block_cursor_next_geq(BlockCursor* cur, std::uint32_t target, std::uint32_t* out);
@@ -0,0 +1,1367 @@
+#include "index_build.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "block_codec.h"
+#include "index_format.h"
+#include "pef_codec.h"
+#include "roaring.h"
+
+static char* xstrndup(const char* s, size_t n) {
+    char* out = static_cast<char*>(std::malloc(n + 1));
+    if (!out) {
+        return nullptr;
+    }
+    std::memcpy(out, s, n);
+    out[n] = '\0';
+    return out;
+}
+
+static int ensure_postings_cap(TermEntry* entry, std::uint32_t need) {
+    if (entry->postings_cap >= need) {
+        return 1;
+    }
+    std::uint32_t new_cap = entry->postings_cap == 0 ? 8 : entry->postings_cap;
+    while (new_cap < need) {
+        if (new_cap > 0x7fffffffU) {
+            return 0;
+        }
+        new_cap *= 2;
+    }
+    std::uint32_t* new_data = static_cast<std::uint32_t*>(
+        std::realloc(entry->postings, static_cast<size_t>(new_cap) * sizeof(std::uint32_t)));
+    if (!new_data) {
+        return 0;
+    }
+    entry->postings = new_data;
+    entry->postings_cap = new_cap;
+    return 1;
+}
+
+/* Malloc bookkeeping per block, counted against --memory-mb along with the block itself. */
+const std::uint64_t BUILD_MALLOC_OVERHEAD = 16;
+
+/* heap_bytes grows by the postings memory the call allocates. */
+static int add_entry_doc(TermEntry* entry, std::uint32_t doc_id, std::uint64_t* heap_bytes) {
+    entry->term_freq += 1;
+    if (entry->postings_count == 0 || entry->last_doc_id != doc_id) {
+        std::uint32_t old_cap = entry->postings_cap;
+        if (!ensure_postings_cap(entry, entry->postings_count + 1)) {
+            return 0;
+        }
+        if (entry->postings_cap != old_cap) {
+            *heap_bytes += static_cast<std::uint64_t>(entry->postings_cap - old_cap) * sizeof(std::uint32_t) +
+                           ((old_cap == 0) ? BUILD_MALLOC_OVERHEAD : 0);
+        }
+        entry->postings[entry->postings_count] = doc_id;
+        entry->postings_count += 1;
+        entry->last_doc_id = doc_id;
+    }
+    return 1;
+}
+
+/* Two-pass mode, first pass: postings_count counts the term's documents and nothing is stored. */
+static void count_entry_doc(TermEntry* entry, std::uint32_t doc_id) {
+    entry->term_freq += 1;
+    if (entry->postings_count == 0 || entry->last_doc_id != doc_id) {
+        entry->postings_count += 1;
+        entry->last_doc_id = doc_id;
+    }
+}
+
+/* Second pass: the term's segment of the slab was sized by the first, so it never grows. */
+static int fill_entry_doc(TermEntry* entry, std::uint32_t doc_id) {
+    if (entry->postings_count == 0 || entry->last_doc_id != doc_id) {
+        if (entry->postings_count >= entry->postings_cap) {
+            return 0;
+        }
+        entry->postings[entry->postings_count] = doc_id;
+        entry->postings_count += 1;
+        entry->last_doc_id = doc_id;
+    }
+    return 1;
+}
+
+static int cmp_term_ptrs(const void* a, const void* b) {
+    const TermEntry* ta = *static_cast<TermEntry* const*>(a);
+    const TermEntry* tb = *static_cast<TermEntry* const*>(b);
+    return std::strcmp(ta->term, tb->term);
+}
+
+const std::uint64_t BUILD_MIN_SHARD_BYTES = 1 << 20; /* smaller ranges are not worth a thread and a table */
+
+/*
+ * Run file: one record per term in strcmp order,
+ *   uint32 term_len | term bytes | uint32 count | uint32 doc_ids[count]
+ */
+static void run_path(char* out, size_t cap, const char* dir, std::uint32_t shard, std::uint32_t run) {
+    std::snprintf(out, cap, "%s/spill-%u-%u.run", dir, shard, run);
+}
+
+void remove_runs(const BuildShard* shards, std::uint32_t count) {
+    char path[2048];
+    for (std::uint32_t s = 0; s < count; ++s) {
+        for (std::uint32_t r = 0; r < shards[s].run_count; ++r) {
+            run_path(path, sizeof(path), shards[s].run_dir, shards[s].id, r);
+            std::remove(path);
+        }
+    }
+}
+
+/* Terms the shard has an entry for: those of its table, or every id of its token stream. */
+static std::uint32_t shard_term_slots(const BuildShard* shard) {
+    return shard->stream_terms ? shard->stream_terms->count : shard->dict.count;
+}
+
+static TermEntry* shard_entry(const BuildShard* shard, std::uint32_t id) {
+    return shard->stream_terms ? &shard->by_id[id] : static_cast<TermEntry*>(term_dict_value(&shard->dict, id));
+}
+
+/* Fills shard->sorted with the shard's terms in strcmp order. */
+static int sort_shard_terms(BuildShard* shard) {
+    std::uint32_t slots = shard_term_slots(shard);
+    shard->sorted = static_cast<TermEntry**>(std::malloc(sizeof(TermEntry*) * (static_cast<size_t>(slots) + 1)));
+    if (!shard->sorted) {
+        return 0;
+    }
+    std::uint32_t n = 0;
+    for (std::uint32_t id = 0; id < slots; ++id) {
+        TermEntry* e = shard_entry(shard, id);
+        if (shard->stream_terms) {
+            if (e->term_freq == 0) {
+                continue; /* the term only occurs in other shards' ranges */
+            }
+            e->term = token_stream_term(shard->stream_terms, id);
+        } else {
+            e->term = term_dict_key(&shard->dict, id);
+        }
+        shard->sorted[n++] = e;
+    }
+    std::qsort(shard->sorted, static_cast<size_t>(n), sizeof(TermEntry*), cmp_term_ptrs);
+    shard->unique_terms = n;
+    return 1;
+}
+
+static void free_shard_postings(BuildShard* shard) {
+    if (shard->slab) {
+        return;
+    }
+    if (shard->stream_terms && !shard->by_id) {
+        return;
+    }
+    for (std::uint32_t id = 0; id < shard_term_slots(shard); ++id) {
+        std::free(shard_entry(shard, id)->postings);
+    }
+}
+
+/* Writes the shard's table as the next sorted run and empties it. */
+static int spill_run(BuildShard* shard) {
+    if (!sort_shard_terms(shard)) {
+        return 0;
+    }
+    std::uint64_t n = shard->unique_terms;
+    char path[2048];
+    run_path(path, sizeof(path), shard->run_dir, shard->id, shard->run_count++);
+    FILE* out = std::fopen(path, "wb");
+    int ok = out != nullptr;
+    for (std::uint64_t i = 0; ok && i < n; ++i) {
+        const TermEntry* e = shard->sorted[i];
+        std::uint32_t len = static_cast<std::uint32_t>(std::strlen(e->term));
+        ok = std::fwrite(&len, sizeof(len), 1, out) == 1 && std::fwrite(e->term, 1, len, out) == len &&
+             std::fwrite(&e->postings_count, sizeof(e->postings_count), 1, out) == 1 &&
+             std::fwrite(e->postings, sizeof(std::uint32_t), e->postings_count, out) == e->postings_count;
+    }
+    if (out && std::fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        std::fprintf(stderr, "Failed to write spill run %s\n", path);
+    }
+
+    std::free(shard->sorted);
+    shard->sorted = nullptr;
+    free_shard_postings(shard);
+    shard->unique_terms = 0;
+    shard->heap_bytes = 0;
+    if (shard->stream_terms) {
+        std::memset(shard->by_id, 0, sizeof(TermEntry) * shard->stream_terms->count);
+        return ok;
+    }
+    return term_dict_clear(&shard->dict) && ok;
+}
+
+void free_shards(BuildShard* shards, std::uint32_t count) {
+    for (std::uint32_t s = 0; s < count; ++s) {
+        /* merge_shards resets the lists it moves, so every list is freed once. */
+        free_shard_postings(&shards[s]);
+        term_dict_free(&shards[s].dict);
+        std::free(shards[s].sorted);
+        std::free(shards[s].by_id);
+    }
+    if (count > 0) {
+        std::free(shards[0].slab);
+        if (shards[0].stream_terms) {
+            token_stream_dict_free(shards[0].stream_terms);
+            std::free(shards[0].stream_terms);
+        }
+    }
+    std::free(shards);
+}
+
+/* Moves the first byte past the end of the line that contains offset - 1. */
+static int align_to_line(LineReader* in, std::uint64_t* offset) {
+    if (*offset == 0) {
+        return 1;
+    }
+    if (!line_reader_seek(in, *offset - 1)) {
+        return 0;
+    }
+    LineView line;
+    line_reader_next(in, &line);
+    *offset = in->offset;
+    return !in->error;
+}
+
+int build_shard_init(BuildShard* shard, size_t capacity, int pass) {
+    *shard = BuildShard{};
+    shard->pass = pass;
+    return term_dict_init(&shard->dict, capacity, sizeof(TermEntry));
+}
+
+/* Adds one token whose entry is *entry, or has to be looked up (entry null) in the shard's table. */
+static int shard_add_entry(BuildShard* shard, TermEntry* entry, const char* term, size_t len, std::uint32_t doc_id) {
+    std::uint32_t id = 0;
+    int inserted = 0;
+    if (shard->pass == BUILD_PASS_FILL) {
+        if (!entry && !term_dict_find(&shard->dict, term, len, &id)) {
+            return 0;
+        }
+        entry = entry ? entry : static_cast<TermEntry*>(term_dict_value(&shard->dict, id));
+        if (!fill_entry_doc(entry, doc_id)) {
+            return 0;
+        }
+    } else {
+        /* a token stream's entry array never grows, and run_shards takes it off spill_bytes */
+        std::uint64_t table_bytes = shard->stream_terms ? 0 : term_dict_bytes(&shard->dict);
+        if (shard->pass == BUILD_PASS_COLLECT && shard->spill_bytes > 0 &&
+            shard->heap_bytes + table_bytes >= shard->spill_bytes && !spill_run(shard)) {
+            return 0;
+        }
+        if (!entry && !term_dict_intern(&shard->dict, term, len, &id, &inserted)) {
+            return 0;
+        }
+        entry = entry ? entry : static_cast<TermEntry*>(term_dict_value(&shard->dict, id));
+        if (shard->pass == BUILD_PASS_COUNT) {
+            count_entry_doc(entry, doc_id);
+        } else if (!add_entry_doc(entry, doc_id, &shard->heap_bytes)) {
+            return 0;
+        }
+    }
+    ++shard->tokens_seen;
+    return 1;
+}
+
+int build_shard_add(BuildShard* shard, const char* term, size_t len, std::uint32_t doc_id) {
+    return shard_add_entry(shard, nullptr, term, len, doc_id);
+}
+
+int build_shard_add_id(BuildShard* shard, std::uint32_t id, std::uint32_t doc_id) {
+    return shard_add_entry(shard, &shard->by_id[id], nullptr, 0, doc_id);
+}
+
+int build_shard_finish(BuildShard* shard) {
+    if (shard->pass == BUILD_PASS_FILL) {
+        shard->ok = 1; /* sorted by the counting pass */
+    } else if (shard->spill_bytes > 0) {
+        /* a token stream's entries are never removed; any postings since the last run say there are terms */
+        int empty = shard->stream_terms ? shard->heap_bytes == 0 : shard->dict.count == 0;
+        shard->ok = empty || spill_run(shard);
+    } else {
+        shard->ok = sort_shard_terms(shard);
+    }
+    return shard->ok;
+}
+
+int build_shard_add_line(BuildShard* shard, LineView line) {
+    line = line_view_cstr(line);
+    const char* tab = line_view_find(line, '\t');
+    if (!tab) {
+        return 1;
+    }
+    std::uint32_t doc_id = line_parse_u32(line.data, static_cast<size_t>(tab - line.data));
+    const char* end = line.data + line.len;
+    for (const char* p = tab + 1; p < end;) {
+        if (line_is_space(static_cast<unsigned char>(*p))) {
+            ++p;
+            continue;
+        }
+        const char* start = p;
+        while (p < end && !line_is_space(static_cast<unsigned char>(*p))) {
+            ++p;
+        }
+        if (!build_shard_add(shard, start, static_cast<size_t>(p - start), doc_id)) {
+            return 0;
+        }
+    }
+    ++shard->docs_indexed;
+    return 1;
+}
+
+int index_stage_run(void* ctx, DocBatch* batch) {
+    BuildShard* shard = static_cast<BuildShard*>(ctx);
+    const char* text_end = batch->text.data + batch->text.len;
+    for (const char* line = batch->text.data; line < text_end;) {
+        const char* nl = static_cast<const char*>(std::memchr(line, '\n', static_cast<size_t>(text_end - line)));
+        if (!build_shard_add_line(shard, LineView{line, static_cast<size_t>(nl - line)})) {
+            std::fprintf(stderr, "Failed to add term to index (out of memory)\n");
+            return 0;
+        }
+        line = nl + 1;
+    }
+    return 1;
+}
+
+/* Adds the documents of one token stream block; its terms are in the shard's dictionary already. */
+static int build_shard_add_block(BuildShard* shard, const TokenStreamBlock* block) {
+    const unsigned char* p = block->docs;
+    for (std::uint32_t d = 0; d < block->doc_count; ++d) {
+        std::uint32_t doc_id = 0;
+        std::uint32_t tokens = 0;
+        if (!token_stream_varint(&p, block->docs_end, &doc_id) || !token_stream_varint(&p, block->docs_end, &tokens)) {
+            return 0;
+        }
+        for (std::uint32_t t = 0; t < tokens; ++t) {
+            std::uint32_t id = 0;
+            if (!token_stream_varint(&p, block->docs_end, &id) || id >= shard->stream_terms->count ||
+                !build_shard_add_id(shard, id, doc_id)) {
+                return 0;
+            }
+        }
+        ++shard->docs_indexed;
+    }
+    return 1;
+}
+
+static void build_stream_shard(BuildShard* shard) {
+    TokenStreamReader in;
+    if (!token_stream_open(&in, shard->path)) {
+        return;
+    }
+    int ok = token_stream_seek(&in, shard->start);
+    const char* data = nullptr;
+    std::size_t len = 0;
+    TokenStreamBlock block;
+    while (ok && in.offset < shard->end && token_stream_next(&in, &data, &len, &block)) {
+        ok = build_shard_add_block(shard, &block);
+    }
+    ok = ok && !in.error;
+    token_stream_close(&in);
+    if (ok) {
+        build_shard_finish(shard);
+    }
+}
+
+static void* build_shard(void* arg) {
+    BuildShard* shard = static_cast<BuildShard*>(arg);
+    shard->ok = 0;
+    if (shard->stream_terms) {
+        build_stream_shard(shard);
+        return nullptr;
+    }
+    LineReader in;
+    if (!line_reader_open(&in, shard->path, shard->reader_mode)) {
+        return nullptr;
+    }
+    int ok = line_reader_seek(&in, shard->start);
+    LineView line;
+    while (ok && in.offset < shard->end && line_reader_next(&in, &line)) {
+        ok = build_shard_add_line(shard, line);
+    }
+    ok = ok && !in.error;
+    line_reader_close(&in);
+    if (ok) {
+        build_shard_finish(shard);
+    }
+    return nullptr;
+}
+
+/* Appends the next part (count > 0) of a term's list, dropping its first id if dst already ends with it. */
+static int append_postings(TermEntry* dst, const std::uint32_t* ids, std::uint32_t count) {
+    std::uint32_t skip = (dst->postings_count > 0 && ids[0] == dst->last_doc_id) ? 1 : 0;
+    std::uint32_t extra = count - skip;
+    if (extra > 0) {
+        if (!ensure_postings_cap(dst, dst->postings_count + extra)) {
+            return 0;
+        }
+        /* In two-pass mode ids is the next segment of dst's own region, so the ranges can overlap. */
+        std::memmove(dst->postings + dst->postings_count, ids + skip, sizeof(std::uint32_t) * extra);
+        dst->postings_count += extra;
+        dst->last_doc_id = ids[count - 1];
+    }
+    return 1;
+}
+
+/* Smallest term at the shards' positions, or null once every shard is used up. */
+static const char* next_shard_term(const BuildShard* shards, std::uint32_t count, const std::uint64_t* pos) {
+    const char* min_term = nullptr;
+    for (std::uint32_t s = 0; s < count; ++s) {
+        if (pos[s] < shards[s].unique_terms &&
+            (!min_term || std::strcmp(shards[s].sorted[pos[s]]->term, min_term) < 0)) {
+            min_term = shards[s].sorted[pos[s]]->term;
+        }
+    }
+    return min_term;
+}
+
+/*
+ * Two-pass mode, between the passes: lays the terms out in the slab in
+ * sorted order and points every entry at its segment. The first shard's
+ * entry gets the whole region as capacity, so merge_shards can move the
+ * later segments down over the duplicates at range boundaries in place.
+ */
+static int layout_postings(BuildShard* shards, std::uint32_t count) {
+    std::uint64_t total = 0;
+    for (std::uint32_t s = 0; s < count; ++s) {
+        for (std::uint64_t i = 0; i < shards[s].unique_terms; ++i) {
+            total += shards[s].sorted[i]->postings_count;
+        }
+    }
+    std::uint32_t* slab = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * (total + 1)));
+    std::uint64_t* pos = static_cast<std::uint64_t*>(std::calloc(count, sizeof(std::uint64_t)));
+    if (!slab || !pos) {
+        std::free(slab);
+        std::free(pos);
+        return 0;
+    }
+    for (std::uint32_t s = 0; s < count; ++s) {
+        shards[s].slab = slab;
+    }
+    std::uint64_t offset = 0;
+    const char* term = nullptr;
+    while ((term = next_shard_term(shards, count, pos)) != nullptr) {
+        TermEntry* first = nullptr;
+        std::uint64_t region = offset;
+        for (std::uint32_t s = 0; s < count; ++s) {
+            if (pos[s] >= shards[s].unique_terms || std::strcmp(shards[s].sorted[pos[s]]->term, term) != 0) {
+                continue;
+            }
+            TermEntry* e = shards[s].sorted[pos[s]++];
+            e->postings = slab + offset;
+            e->postings_cap = e->postings_count;
+            offset += e->postings_count;
+            e->postings_count = 0;
+            first = first ? first : e;
+        }
+        first->postings_cap = static_cast<std::uint32_t>(offset - region);
+    }
+    std::free(pos);
+    return 1;
+}
+
+TermEntry** merge_shards(BuildShard* shards, std::uint32_t count, std::uint64_t* unique_terms) {
+    if (count == 1) {
+        *unique_terms = shards[0].unique_terms;
+        TermEntry** sorted = shards[0].sorted;
+        shards[0].sorted = nullptr;
+        return sorted;
+    }
+    std::uint64_t bound = 0;
+    for (std::uint32_t s = 0; s < count; ++s) {
+        bound += shards[s].unique_terms;
+    }
+    TermEntry** merged = static_cast<TermEntry**>(std::malloc(sizeof(TermEntry*) * (bound + 1)));
+    std::uint64_t* pos = static_cast<std::uint64_t*>(std::calloc(count, sizeof(std::uint64_t)));
+    if (!merged || !pos) {
+        std::free(merged);
+        std::free(pos);
+        return nullptr;
+    }
+    std::uint64_t k = 0;
+    int ok = 1;
+    while (ok) {
+        const char* min_term = next_shard_term(shards, count, pos);
+        if (!min_term) {
+            break;
+        }
+        TermEntry* dst = nullptr;
+        for (std::uint32_t s = 0; ok && s < count; ++s) {
+            if (pos[s] >= shards[s].unique_terms || std::strcmp(shards[s].sorted[pos[s]]->term, min_term) != 0) {
+                continue;
+            }
+            TermEntry* e = shards[s].sorted[pos[s]++];
+            if (!dst) {
+                dst = e;
+            } else {
+                ok = append_postings(dst, e->postings, e->postings_count);
+                dst->term_freq += e->term_freq;
+                if (!shards[s].slab) {
+                    std::free(e->postings);
+                }
+                e->postings = nullptr;
+                e->postings_count = 0;
+            }
+        }
+        merged[k++] = dst;
+    }
+    std::free(pos);
+    if (!ok) {
+        std::free(merged);
+        return nullptr;
+    }
+    *unique_terms = k;
+    return merged;
+}
+
+/* Runs one pass of every shard. Shard 0 runs on this thread; shards whose thread cannot be started run here after. */
+static void run_shard_threads(BuildShard* shards, std::uint32_t count) {
+    pthread_t* threads = static_cast<pthread_t*>(std::calloc(count, sizeof(pthread_t)));
+    int* started = static_cast<int*>(std::calloc(count, sizeof(int)));
+    int can_spawn = threads && started;
+    for (std::uint32_t s = 1; can_spawn && s < count; ++s) {
+        started[s] = pthread_create(&threads[s], nullptr, build_shard, &shards[s]) == 0;
+    }
+    build_shard(&shards[0]);
+    for (std::uint32_t s = 1; s < count; ++s) {
+        if (can_spawn && started[s]) {
+            pthread_join(threads[s], nullptr);
+        } else {
+            build_shard(&shards[s]);
+        }
+    }
+    std::free(threads);
+    std::free(started);
+}
+
+static int shards_ok(const BuildShard* shards, std::uint32_t count) {
+    for (std::uint32_t s = 0; s < count; ++s) {
+        if (!shards[s].ok) {
+            std::fprintf(stderr, "Failed to add term to index (out of memory)\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* First block of a token stream starting at or after offset, or the end of the stream. */
+static std::uint64_t align_to_block(const std::uint64_t* block_starts, std::uint64_t blocks, std::uint64_t size,
+                                    std::uint64_t offset) {
+    std::uint64_t lo = 0;
+    std::uint64_t hi = blocks;
+    while (lo < hi) {
+        std::uint64_t mid = lo + (hi - lo) / 2;
+        if (block_starts[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < blocks) ? block_starts[lo] : size;
+}
+
+/* Reads the dictionary of a token stream and where its blocks start; *size gets the stream's length. */
+static TokenStreamDict* load_stream_terms(const char* path, std::uint64_t** block_starts, std::uint64_t* blocks,
+                                          std::uint64_t* size) {
+    TokenStreamDict* dict = static_cast<TokenStreamDict*>(std::calloc(1, sizeof(TokenStreamDict)));
+    TokenStreamReader in;
+    int ok = dict && token_stream_open(&in, path);
+    if (ok) {
+        ok = token_stream_load_dict(&in, dict, block_starts, blocks);
+        *size = in.offset;
+        token_stream_close(&in);
+    }
+    if (!ok) {
+        std::fprintf(stderr, "Failed to read the dictionary of token stream %s\n", path);
+        if (dict) {
+            token_stream_dict_free(dict);
+        }
+        std::free(dict);
+        std::free(*block_starts);
+        *block_starts = nullptr;
+        return nullptr;
+    }
+    return dict;
+}
+
+int run_shards(const char* stemmed_path, std::uint32_t thread_count, size_t capacity, std::uint64_t memory_budget,
+               int two_pass, const char* run_dir, BuildShard** out_shards, std::uint32_t* out_shard_count,
+               std::uint64_t* docs_indexed, std::uint64_t* tokens_seen) {
+    LineReader in;
+    int reader_mode = (memory_budget > 0) ? LINE_READER_BUFFERED : LINE_READER_AUTO;
+    TokenStreamDict* stream_terms = nullptr;
+    std::uint64_t* block_starts = nullptr;
+    std::uint64_t blocks = 0;
+    std::uint64_t size = 0;
+    if (token_stream_is_file(stemmed_path)) {
+        stream_terms = load_stream_terms(stemmed_path, &block_starts, &blocks, &size);
+        if (!stream_terms) {
+            return 0;
+        }
+        in = LineReader{};
+        in.fd = -1;
+    } else {
+        if (!line_reader_open(&in, stemmed_path, reader_mode)) {
+            std::fprintf(stderr, "Failed to open stemmed file: %s\n", stemmed_path);
+            return 0;
+        }
+        size = in.size;
+    }
+    if (thread_count > size / BUILD_MIN_SHARD_BYTES + 1) {
+        thread_count = static_cast<std::uint32_t>(size / BUILD_MIN_SHARD_BYTES + 1);
+    }
+    std::uint64_t spill_bytes = 0;
+    int ok = 1;
+    if (memory_budget > 0) {
+        /*
+         * A shard spills once its table and postings reach two thirds of its share; the last third stays
+         * free for the copies a growing list or table needs while it is reallocated, and for the sort buffer.
+         * The table starts no bigger than a quarter of the share so that an emptied table fits.
+         */
+        std::uint64_t share = memory_budget / thread_count;
+        std::uint64_t slots = share / 4 / (1 + sizeof(std::uint32_t));
+        capacity = (slots < capacity) ? static_cast<size_t>(slots) : capacity;
+        spill_bytes = (share >= 3) ? share / 3 * 2 : 1;
+        if (stream_terms) {
+            /* a token stream's shards hold an entry for every term from the start */
+            std::uint64_t table_bytes = static_cast<std::uint64_t>(stream_terms->count) * sizeof(TermEntry);
+            if (table_bytes >= spill_bytes) {
+                std::fprintf(stderr, "--memory-mb is too small for the %u terms of %s\n", stream_terms->count,
+                             stemmed_path);
+                ok = 0;
+            }
+            spill_bytes -= ok ? table_bytes : 0;
+        }
+    }
+
+    BuildShard* shards = ok ? static_cast<BuildShard*>(std::calloc(thread_count, sizeof(BuildShard))) : nullptr;
+    if (!shards) {
+        if (ok) {
+            std::fprintf(stderr, "Failed to allocate term table\n");
+        }
+        line_reader_close(&in);
+        if (stream_terms) {
+            token_stream_dict_free(stream_terms);
+        }
+        std::free(stream_terms);
+        std::free(block_starts);
+        return 0;
+    }
+    *out_shards = shards;
+    *out_shard_count = thread_count;
+    shards[0].stream_terms = stream_terms;
+    std::uint64_t prev = 0;
+    for (std::uint32_t s = 0; s < thread_count && ok; ++s) {
+        std::uint64_t end = (s + 1 == thread_count) ? UINT64_MAX : size / thread_count * (s + 1);
+        if (end != UINT64_MAX) {
+            end = (end < prev) ? prev : end;
+            if (stream_terms) {
+                end = align_to_block(block_starts, blocks, size, end);
+            } else {
+                ok = align_to_line(&in, &end);
+            }
+        }
+        ok = ok && build_shard_init(&shards[s], capacity, two_pass ? BUILD_PASS_COUNT : BUILD_PASS_COLLECT);
+        shards[s].path = stemmed_path;
+        shards[s].start = (stream_terms && s == 0) ? align_to_block(block_starts, blocks, size, 0) : prev;
+        shards[s].end = end;
+        shards[s].run_dir = run_dir;
+        shards[s].id = s;
+        shards[s].spill_bytes = spill_bytes;
+        shards[s].reader_mode = reader_mode;
+        if (stream_terms) {
+            shards[s].stream_terms = stream_terms;
+            shards[s].by_id = static_cast<TermEntry*>(std::calloc(stream_terms->count + 1, sizeof(TermEntry)));
+            ok = ok && shards[s].by_id;
+        }
+        prev = end;
+    }
+    line_reader_close(&in);
+    std::free(block_starts);
+    if (!ok) {
+        std::fprintf(stderr, "Failed to allocate term table\n");
+        return 0;
+    }
+
+    run_shard_threads(shards, thread_count);
+    if (!shards_ok(shards, thread_count)) {
+        return 0;
+    }
+    if (two_pass) {
+        if (!layout_postings(shards, thread_count)) {
+            std::fprintf(stderr, "Failed to allocate postings\n");
+            return 0;
+        }
+        for (std::uint32_t s = 0; s < thread_count; ++s) {
+            shards[s].pass = BUILD_PASS_FILL;
+            shards[s].docs_indexed = 0;
+            shards[s].tokens_seen = 0;
+        }
+        run_shard_threads(shards, thread_count);
+        if (!shards_ok(shards, thread_count)) {
+            return 0;
+        }
+    }
+
+    *docs_indexed = 0;
+    *tokens_seen = 0;
+    for (std::uint32_t s = 0; s < thread_count; ++s) {
+        *docs_indexed += shards[s].docs_indexed;
+        *tokens_seen += shards[s].tokens_seen;
+    }
+    return 1;
+}
+
+static int write_u16(FILE* out, std::uint16_t v) {
+    return std::fwrite(&v, sizeof(v), 1, out) == 1;
+}
+
+static int write_u32(FILE* out, std::uint32_t v) {
+    return std::fwrite(&v, sizeof(v), 1, out) == 1;
+}
+
+static int write_u64(FILE* out, std::uint64_t v) {
+    return std::fwrite(&v, sizeof(v), 1, out) == 1;
+}
+
+static int write_zeros(FILE* out, std::uint64_t n) {
+    static const char zeros[INDEX_SECTION_ALIGN] = {0};
+    while (n > 0) {
+        size_t chunk = n < sizeof(zeros) ? static_cast<size_t>(n) : sizeof(zeros);
+        if (std::fwrite(zeros, 1, chunk, out) != chunk) {
+            return 0;
+        }
+        n -= chunk;
+    }
+    return 1;
+}
+
+/* Writes one term's postings with the given codec and reports the encoded size. */
+static int write_term_postings(FILE* out, const TermEntry* e, std::uint32_t codec, unsigned char** scratch,
+                               size_t* scratch_cap, std::uint64_t* bytes) {
+    if (codec == INDEX_CODEC_RAW) {
+        if (std::fwrite(e->postings, sizeof(std::uint32_t), e->postings_count, out) != e->postings_count) {
+            return 0;
+        }
+        *bytes = static_cast<std::uint64_t>(e->postings_count) * sizeof(std::uint32_t);
+        return 1;
+    }
+
+    size_t need = block_codec_max_bytes(e->postings_count);
+    if (codec == INDEX_CODEC_PEF) {
+        need = pef_codec_max_bytes(e->postings_count);
+    } else if (codec == INDEX_CODEC_HYBRID) {
+        need = roaring_codec_max_bytes(e->postings_count);
+    }
+    if (need > *scratch_cap) {
+        unsigned char* grown = static_cast<unsigned char*>(std::realloc(*scratch, need));
+        if (!grown) {
+            return 0;
+        }
+        *scratch = grown;
+        *scratch_cap = need;
+    }
+    size_t n = 0;
+    if (codec == INDEX_CODEC_PEF) {
+        n = pef_codec_encode(e->postings, e->postings_count, *scratch);
+    } else if (codec == INDEX_CODEC_HYBRID) {
+        n = roaring_codec_encode(e->postings, e->postings_count, *scratch);
+    } else {
+        n = block_codec_encode(e->postings, e->postings_count, *scratch);
+    }
+    if (std::fwrite(*scratch, 1, n, out) != n) {
+        return 0;
+    }
+    *bytes = n;
+    return 1;
+}
+
+static int write_lexicon_v2(FILE* out, TermEntry** terms, std::uint64_t count) {
+    std::uint64_t records_end = INDEX_SECTION_ALIGN + count * sizeof(LexiconRecord);
+    std::uint64_t strings_bytes = 0;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        strings_bytes += std::strlen(terms[i]->term) + 1;
+    }
+    if (strings_bytes > INDEX_NO_STRING) {
+        std::fprintf(stderr, "Lexicon strings exceed 4 GiB\n");
+        return 0;
+    }
+
+    LexiconHeaderV2 header{};
+    header.magic = INDEX_LEXICON_MAGIC;
+    header.version = INDEX_VERSION_MAPPED;
+    header.term_count = static_cast<std::uint32_t>(count);
+    header.records_offset = INDEX_SECTION_ALIGN;
+    header.strings_offset = index_align_up(records_end);
+    header.strings_bytes = strings_bytes;
+    if (std::fwrite(&header, sizeof(header), 1, out) != 1) {
+        return 0;
+    }
+
+    std::uint32_t term_offset = 0;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        LexiconRecord rec{};
+        rec.postings_offset = terms[i]->postings_offset_bytes;
+        rec.postings_count = terms[i]->postings_count;
+        rec.term_offset = term_offset;
+        if (std::fwrite(&rec, sizeof(rec), 1, out) != 1) {
+            return 0;
+        }
+        term_offset += static_cast<std::uint32_t>(std::strlen(terms[i]->term) + 1);
+    }
+    if (!write_zeros(out, header.strings_offset - records_end)) {
+        return 0;
+    }
+    for (std::uint64_t i = 0; i < count; ++i) {
+        size_t len = std::strlen(terms[i]->term) + 1;
+        if (std::fwrite(terms[i]->term, 1, len, out) != len) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int begin_postings(FILE* out, std::uint32_t format) {
+    if (format == INDEX_VERSION_MAPPED) {
+        PostingsHeaderV2 header{};
+        return std::fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    return write_u32(out, INDEX_POSTINGS_MAGIC) && write_u32(out, format) && write_u64(out, 0);
+}
+
+/* Fills in the header fields that are only known once every list is written. */
+static int finish_postings(FILE* out, std::uint32_t format, std::uint32_t codec, std::uint64_t total_postings,
+                           std::uint64_t data_bytes) {
+    if (format == INDEX_VERSION_MAPPED) {
+        PostingsHeaderV2 header{};
+        header.magic = INDEX_POSTINGS_MAGIC;
+        header.version = format;
+        header.total_postings = total_postings;
+        header.data_offset = sizeof(header);
+        header.data_bytes = data_bytes;
+        header.codec = codec;
+        return std::fseek(out, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    return std::fseek(out, static_cast<long>(sizeof(std::uint32_t) * 2), SEEK_SET) == 0 &&
+           write_u64(out, total_postings);
+}
+
+static int write_lexicon_v1_record(FILE* out, const TermEntry* e) {
+    size_t term_len = std::strlen(e->term);
+    if (term_len > 65535) {
+        term_len = 65535;
+    }
+    return write_u16(out, static_cast<std::uint16_t>(term_len)) && std::fwrite(e->term, 1, term_len, out) == term_len &&
+           write_u64(out, e->postings_offset_bytes) && write_u32(out, e->postings_count);
+}
+
+int write_sorted_terms(TermEntry** terms, std::uint64_t count, const char* postings_path, const char* lexicon_path,
+                       std::uint32_t format, std::uint32_t codec, std::uint64_t* total_postings,
+                       std::uint64_t* data_bytes) {
+    FILE* postings = std::fopen(postings_path, "wb");
+    if (!postings) {
+        std::fprintf(stderr, "Failed to open postings output\n");
+        return 0;
+    }
+    *total_postings = 0;
+    std::uint64_t offset = 0;
+    unsigned char* scratch = nullptr;
+    size_t scratch_cap = 0;
+    int postings_ok = begin_postings(postings, format);
+    for (std::uint64_t i = 0; i < count && postings_ok; ++i) {
+        TermEntry* e = terms[i];
+        e->postings_offset_bytes = offset;
+        if (e->postings_count > 0) {
+            std::uint64_t bytes = 0;
+            postings_ok = write_term_postings(postings, e, codec, &scratch, &scratch_cap, &bytes);
+            offset += bytes;
+            *total_postings += e->postings_count;
+        }
+    }
+    std::free(scratch);
+    postings_ok = postings_ok && finish_postings(postings, format, codec, *total_postings, offset);
+    if (std::fclose(postings) != 0) {
+        postings_ok = 0;
+    }
+    if (!postings_ok) {
+        std::fprintf(stderr, "Failed to write postings output\n");
+        return 0;
+    }
+    *data_bytes = offset;
+
+    FILE* lexicon = std::fopen(lexicon_path, "wb");
+    if (!lexicon) {
+        std::fprintf(stderr, "Failed to open lexicon output\n");
+        return 0;
+    }
+    int lexicon_ok = 1;
+    if (format == INDEX_VERSION_MAPPED) {
+        lexicon_ok = write_lexicon_v2(lexicon, terms, count);
+    } else {
+        lexicon_ok = write_u32(lexicon, INDEX_LEXICON_MAGIC) && write_u32(lexicon, format) &&
+                     write_u32(lexicon, static_cast<std::uint32_t>(count));
+        for (std::uint64_t i = 0; i < count && lexicon_ok; ++i) {
+            lexicon_ok = write_lexicon_v1_record(lexicon, terms[i]);
+        }
+    }
+    if (std::fclose(lexicon) != 0) {
+        lexicon_ok = 0;
+    }
+    if (!lexicon_ok) {
+        std::fprintf(stderr, "Failed to write lexicon output\n");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Lexicon writer for terms that arrive one at a time in sorted order. Version
+ * 2 records go straight to the file and the strings to a temporary file that
+ * is appended once the record count, and so the strings offset, is known.
+ */
+struct LexiconStream {
+    FILE* out;
+    FILE* strings;
+    std::uint32_t format;
+    std::uint64_t count;
+    std::uint64_t strings_bytes;
+};
+
+static int lexicon_stream_begin(LexiconStream* ls, FILE* out, std::uint32_t format) {
+    *ls = LexiconStream{out, nullptr, format, 0, 0};
+    if (format == INDEX_VERSION_MAPPED) {
+        LexiconHeaderV2 header{};
+        ls->strings = std::tmpfile();
+        return ls->strings && std::fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    return write_u32(out, INDEX_LEXICON_MAGIC) && write_u32(out, format) && write_u32(out, 0);
+}
+
+static int lexicon_stream_add(LexiconStream* ls, const TermEntry* e) {
+    ++ls->count;
+    if (ls->format != INDEX_VERSION_MAPPED) {
+        return write_lexicon_v1_record(ls->out, e);
+    }
+    size_t len = std::strlen(e->term) + 1;
+    if (ls->strings_bytes + len > INDEX_NO_STRING) {
+        std::fprintf(stderr, "Lexicon strings exceed 4 GiB\n");
+        return 0;
+    }
+    LexiconRecord rec{};
+    rec.postings_offset = e->postings_offset_bytes;
+    rec.postings_count = e->postings_count;
+    rec.term_offset = static_cast<std::uint32_t>(ls->strings_bytes);
+    ls->strings_bytes += len;
+    return std::fwrite(&rec, sizeof(rec), 1, ls->out) == 1 && std::fwrite(e->term, 1, len, ls->strings) == len;
+}
+
+static int lexicon_stream_finish(LexiconStream* ls) {
+    if (ls->format != INDEX_VERSION_MAPPED) {
+        return std::fseek(ls->out, static_cast<long>(sizeof(std::uint32_t) * 2), SEEK_SET) == 0 &&
+               write_u32(ls->out, static_cast<std::uint32_t>(ls->count));
+    }
+    std::uint64_t records_end = INDEX_SECTION_ALIGN + ls->count * sizeof(LexiconRecord);
+    LexiconHeaderV2 header{};
+    header.magic = INDEX_LEXICON_MAGIC;
+    header.version = INDEX_VERSION_MAPPED;
+    header.term_count = static_cast<std::uint32_t>(ls->count);
+    header.records_offset = INDEX_SECTION_ALIGN;
+    header.strings_offset = index_align_up(records_end);
+    header.strings_bytes = ls->strings_bytes;
+    int ok = write_zeros(ls->out, header.strings_offset - records_end) && std::fseek(ls->strings, 0, SEEK_SET) == 0;
+    char buf[1 << 16];
+    size_t n = 0;
+    while (ok && (n = std::fread(buf, 1, sizeof(buf), ls->strings)) > 0) {
+        ok = std::fwrite(buf, 1, n, ls->out) == n;
+    }
+    ok = ok && !std::ferror(ls->strings);
+    return ok && std::fseek(ls->out, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, ls->out) == 1;
+}
+
+/* A spilled run being read back; rec holds its current term. */
+struct RunReader {
+    FILE* in;
+    TermEntry rec;
+    char* term_buf;
+    size_t term_cap;
+};
+
+/* Loads the next record; *live is cleared at the end of the run. */
+static int run_reader_next(RunReader* r, int* live) {
+    std::uint32_t len = 0;
+    if (std::fread(&len, sizeof(len), 1, r->in) != 1) {
+        *live = 0;
+        return !std::ferror(r->in);
+    }
+    if (len + 1 > r->term_cap) {
+        char* grown = static_cast<char*>(std::realloc(r->term_buf, len + 1));
+        if (!grown) {
+            return 0;
+        }
+        r->term_buf = grown;
+        r->rec.term = grown;
+        r->term_cap = len + 1;
+    }
+    std::uint32_t count = 0;
+    if (std::fread(r->term_buf, 1, len, r->in) != len || std::fread(&count, sizeof(count), 1, r->in) != 1 ||
+        count == 0 || !ensure_postings_cap(&r->rec, count) ||
+        std::fread(r->rec.postings, sizeof(std::uint32_t), count, r->in) != count) {
+        return 0;
+    }
+    r->term_buf[len] = '\0';
+    r->rec.postings_count = count;
+    *live = 1;
+    return 1;
+}
+
+/* Heap order: term, then run order, so equal terms come out in range order. */
+static int run_before(const RunReader* readers, std::uint32_t a, std::uint32_t b) {
+    int c = std::strcmp(readers[a].rec.term, readers[b].rec.term);
+    return c < 0 || (c == 0 && a < b);
+}
+
+static void run_sift_down(const RunReader* readers, std::uint32_t* heap, std::uint32_t size, std::uint32_t i) {
+    while (true) {
+        std::uint32_t l = 2 * i + 1;
+        if (l >= size) {
+            return;
+        }
+        std::uint32_t m = (l + 1 < size && run_before(readers, heap[l + 1], heap[l])) ? l + 1 : l;
+        if (!run_before(readers, heap[m], heap[i])) {
+            return;
+        }
+        std::uint32_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+int write_spilled_terms(const BuildShard* shards, std::uint32_t shard_count, const char* postings_path,
+                        const char* lexicon_path, std::uint32_t format, std::uint32_t codec,
+                        std::uint64_t* unique_terms, std::uint64_t* total_postings, std::uint64_t* data_bytes) {
+    std::uint32_t run_count = 0;
+    for (std::uint32_t s = 0; s < shard_count; ++s) {
+        run_count += shards[s].run_count;
+    }
+    RunReader* readers = static_cast<RunReader*>(std::calloc(run_count + 1, sizeof(RunReader)));
+    std::uint32_t* heap = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * (run_count + 1)));
+    FILE* postings = std::fopen(postings_path, "wb");
+    FILE* lexicon = std::fopen(lexicon_path, "wb");
+    int ok = readers && heap && postings && lexicon;
+    if (!postings || !lexicon) {
+        std::fprintf(stderr, "Failed to open %s output\n", postings ? "lexicon" : "postings");
+    }
+
+    std::uint32_t size = 0;
+    char path[2048];
+    for (std::uint32_t s = 0, i = 0; ok && s < shard_count; ++s) {
+        for (std::uint32_t r = 0; ok && r < shards[s].run_count; ++r, ++i) {
+            run_path(path, sizeof(path), shards[s].run_dir, shards[s].id, r);
+            readers[i].in = std::fopen(path, "rb");
+            int live = 0;
+            ok = readers[i].in && run_reader_next(&readers[i], &live);
+            if (!ok) {
+                std::fprintf(stderr, "Failed to read spill run %s\n", path);
+            } else if (live) {
+                heap[size++] = i;
+            }
+        }
+    }
+    for (std::uint32_t i = size / 2; i-- > 0;) {
+        run_sift_down(readers, heap, size, i);
+    }
+
+    LexiconStream lex{};
+    TermEntry merged{};
+    char* merged_term = nullptr;
+    size_t merged_cap = 0;
+    unsigned char* scratch = nullptr;
+    size_t scratch_cap = 0;
+    std::uint64_t offset = 0;
+    *unique_terms = 0;
+    *total_postings = 0;
+    ok = ok && begin_postings(postings, format) && lexicon_stream_begin(&lex, lexicon, format);
+    while (ok && size > 0) {
+        const char* term = readers[heap[0]].rec.term;
+        size_t len = std::strlen(term) + 1;
+        if (len > merged_cap) {
+            char* grown = static_cast<char*>(std::realloc(merged_term, len));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            merged_term = grown;
+            merged_cap = len;
+        }
+        std::memcpy(merged_term, term, len);
+        merged.term = merged_term;
+        merged.postings_count = 0;
+        while (ok && size > 0 && std::strcmp(readers[heap[0]].rec.term, merged.term) == 0) {
+            RunReader* r = &readers[heap[0]];
+            int live = 0;
+            ok = append_postings(&merged, r->rec.postings, r->rec.postings_count) && run_reader_next(r, &live);
+            if (ok && !live) {
+                heap[0] = heap[--size];
+            }
+            run_sift_down(readers, heap, size, 0);
+        }
+        if (!ok) {
+            std::fprintf(stderr, "Failed to merge spill runs\n");
+            break;
+        }
+        std::uint64_t bytes = 0;
+        merged.postings_offset_bytes = offset;
+        ok = write_term_postings(postings, &merged, codec, &scratch, &scratch_cap, &bytes) &&
+             lexicon_stream_add(&lex, &merged);
+        offset += bytes;
+        *total_postings += merged.postings_count;
+        ++*unique_terms;
+    }
+    ok = ok && finish_postings(postings, format, codec, *total_postings, offset) && lexicon_stream_finish(&lex);
+    *data_bytes = offset;
+
+    std::free(scratch);
+    std::free(merged_term);
+    std::free(merged.postings);
+    if (lex.strings) {
+        std::fclose(lex.strings);
+    }
+    for (std::uint32_t i = 0; readers && i < run_count; ++i) {
+        if (readers[i].in) {
+            std::fclose(readers[i].in);
+        }
+        std::free(readers[i].term_buf);
+        std::free(readers[i].rec.postings);
+    }
+    std::free(readers);
+    std::free(heap);
+    if (postings && std::fclose(postings) != 0) {
+        ok = 0;
+    }
+    if (lexicon && std::fclose(lexicon) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        std::fprintf(stderr, "Failed to write postings and lexicon from spill runs\n");
+    }
+    return ok;
+}
+
+static int write_forward_v2(FILE* out, const DocMeta* metas, std::uint32_t metas_cap, std::uint32_t docs,
+                            std::uint32_t max_doc_id) {
+    std::uint64_t strings_bytes = 0;
+    for (std::uint32_t i = 1; i <= max_doc_id && i < metas_cap; ++i) {
+        if (metas[i].doc_id != 0) {
+            strings_bytes += std::strlen(metas[i].title) + 1 + std::strlen(metas[i].url) + 1;
+        }
+    }
+    if (strings_bytes > INDEX_NO_STRING) {
+        std::fprintf(stderr, "Forward strings exceed 4 GiB\n");
+        return 0;
+    }
+
+    ForwardHeaderV2 header{};
+    header.magic = INDEX_FORWARD_MAGIC;
+    header.version = INDEX_VERSION_MAPPED;
+    header.docs = docs;
+    header.max_doc_id = max_doc_id;
+    header.doc_ids_offset = INDEX_SECTION_ALIGN;
+    std::uint64_t doc_ids_end = header.doc_ids_offset + static_cast<std::uint64_t>(docs) * sizeof(std::uint32_t);
+    header.slots_offset = index_align_up(doc_ids_end);
+    std::uint64_t slots_end = header.slots_offset + static_cast<std::uint64_t>(docs) * sizeof(ForwardSlot);
+    header.strings_offset = index_align_up(slots_end);
+    header.strings_bytes = strings_bytes;
+    if (std::fwrite(&header, sizeof(header), 1, out) != 1) {
+        return 0;
+    }
+
+    for (std::uint32_t i = 1; i <= max_doc_id && i < metas_cap; ++i) {
+        if (metas[i].doc_id != 0 && !write_u32(out, i)) {
+            return 0;
+        }
+    }
+    if (!write_zeros(out, header.slots_offset - doc_ids_end)) {
+        return 0;
+    }
+
+    std::uint32_t string_offset = 0;
+    for (std::uint32_t i = 1; i <= max_doc_id && i < metas_cap; ++i) {
+        if (metas[i].doc_id == 0) {
+            continue;
+        }
+        ForwardSlot slot{};
+        slot.title_offset = string_offset;
+        string_offset += static_cast<std::uint32_t>(std::strlen(metas[i].title) + 1);
+        slot.url_offset = string_offset;
+        string_offset += static_cast<std::uint32_t>(std::strlen(metas[i].url) + 1);
+        if (std::fwrite(&slot, sizeof(slot), 1, out) != 1) {
+            return 0;
+        }
+    }
+    if (!write_zeros(out, header.strings_offset - slots_end)) {
+        return 0;
+    }
+
+    for (std::uint32_t i = 1; i <= max_doc_id && i < metas_cap; ++i) {
+        if (metas[i].doc_id == 0) {
+            continue;
+        }
+        size_t title_len = std::strlen(metas[i].title) + 1;
+        size_t url_len = std::strlen(metas[i].url) + 1;
+        if (std::fwrite(metas[i].title, 1, title_len, out) != title_len ||
+            std::fwrite(metas[i].url, 1, url_len, out) != url_len) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int parse_codec_name(const char* name, std::uint32_t* codec) {
+    if (std::strcmp(name, "raw") == 0) {
+        *codec = INDEX_CODEC_RAW;
+    } else if (std::strcmp(name, "block") == 0) {
+        *codec = INDEX_CODEC_BLOCK;
+    } else if (std::strcmp(name, "pef") == 0) {
+        *codec = INDEX_CODEC_PEF;
+    } else if (std::strcmp(name, "hybrid") == 0) {
+        *codec = INDEX_CODEC_HYBRID;
+    } else {
+        std::fprintf(stderr, "Unknown postings codec %s (expected raw, block, pef or hybrid)\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+static int ensure_doc_meta_cap(DocMetaTable* table, std::uint32_t need) {
+    if (table->cap > need) {
+        return 1;
+    }
+    std::uint32_t new_cap = (table->cap == 0) ? 1024 : table->cap;
+    while (new_cap <= need) {
+        if (new_cap > 0x7fffffffU) {
+            return 0;
+        }
+        new_cap *= 2;
+    }
+    DocMeta* new_arr = static_cast<DocMeta*>(std::realloc(table->metas, sizeof(DocMeta) * new_cap));
+    if (!new_arr) {
+        return 0;
+    }
+    for (std::uint32_t i = table->cap; i < new_cap; ++i) {
+        new_arr[i].doc_id = 0;
+        new_arr[i].title = nullptr;
+        new_arr[i].url = nullptr;
+    }
+    table->metas = new_arr;
+    table->cap = new_cap;
+    return 1;
+}
+
+int doc_meta_add_line(DocMetaTable* table, LineView line) {
+    line = line_view_cstr(line);
+    const char* tabs[4];
+    LineView rest = line;
+    for (int t = 0; t < 4; ++t) {
+        tabs[t] = line_view_find(rest, '\t');
+        if (!tabs[t]) {
+            return 1;
+        }
+        rest = LineView{tabs[t] + 1, static_cast<size_t>(line.data + line.len - tabs[t] - 1)};
+    }
+
+    std::uint32_t doc_id = line_parse_u32(line.data, static_cast<size_t>(tabs[0] - line.data));
+    if (doc_id == 0) {
+        return 1;
+    }
+    if (!ensure_doc_meta_cap(table, doc_id)) {
+        std::fprintf(stderr, "Failed to allocate doc meta array\n");
+        return 0;
+    }
+    DocMeta* meta = &table->metas[doc_id];
+    if (meta->doc_id == 0) {
+        meta->doc_id = doc_id;
+        meta->url = xstrndup(tabs[1] + 1, static_cast<size_t>(tabs[2] - tabs[1] - 1));
+        meta->title = xstrndup(tabs[2] + 1, static_cast<size_t>(tabs[3] - tabs[2] - 1));
+        if (!meta->title || !meta->url) {
+            std::fprintf(stderr, "Out of memory for doc meta strings\n");
+            return 0;
+        }
+        ++table->docs;
+        if (doc_id > table->max_doc_id) {
+            table->max_doc_id = doc_id;
+        }
+    }
+    return 1;
+}
+
+int collect_doc_meta(const char* raw_text_path, DocMetaTable* table, int reader_mode) {
+    LineReader in;
+    if (!line_reader_open(&in, raw_text_path, reader_mode)) {
+        std::fprintf(stderr, "Failed to open raw_text.tsv: %s\n", raw_text_path);
+        return 0;
+    }
+    LineView line;
+    int ok = 1;
+    while (ok && line_reader_next(&in, &line)) {
+        ok = doc_meta_add_line(table, line);
+    }
+    if (ok && in.error) {
+        std::fprintf(stderr, "Failed to read raw_text.tsv: %s\n", raw_text_path);
+        ok = 0;
+    }
+    line_reader_close(&in);
+    return ok;
+}
+
+static int write_forward_v1(FILE* out, const DocMetaTable* table) {
+    write_u32(out, INDEX_FORWARD_MAGIC);
+    write_u32(out, INDEX_VERSION_STREAM);
+    write_u32(out, table->docs);
+    write_u32(out, table->max_doc_id);
+    for (std::uint32_t i = 1; i <= table->max_doc_id; ++i) {
+        if (i >= table->cap || table->metas[i].doc_id == 0) {
+            continue;
+        }
+        const DocMeta* meta = &table->metas[i];
+        std::uint16_t title_len = static_cast<std::uint16_t>(std::strlen(meta->title));
+        std::uint16_t url_len = static_cast<std::uint16_t>(std::strlen(meta->url));
+        write_u32(out, meta->doc_id);
+        write_u16(out, title_len);
+        write_u16(out, url_len);
+        std::fwrite(meta->title, 1, title_len, out);
+        std::fwrite(meta->url, 1, url_len, out);
+    }
+    return 1;
+}
+
+int write_forward(const char* forward_path, const DocMetaTable* table, std::uint32_t format) {
+    FILE* out = std::fopen(forward_path, "wb");
+    if (!out) {
+        std::fprintf(stderr, "Failed to open forward output\n");
+        return 0;
+    }
+    int ok = (format == INDEX_VERSION_MAPPED)
+                 ? write_forward_v2(out, table->metas, table->cap, table->docs, table->max_doc_id)
+                 : write_forward_v1(out, table);
+    if (std::fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        std::fprintf(stderr, "Failed to write forward output\n");
+    }
+    return ok;
+}
+
+void doc_meta_free(DocMetaTable* table) {
+    for (std::uint32_t i = 0; i < table->cap; ++i) {
+        std::free(table->metas[i].title);
+        std::free(table->metas[i].url);
+    }
+    std::free(table->metas);
+    *table = DocMetaTable{};
+}
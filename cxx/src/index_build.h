@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "line_reader.h"
+#include "pipeline.h"
+#include "term_dict.h"
+#include "token_stream.h"
+
+/*
+ * Index construction shared by index_builder (stemmed file in, index out)
+ * and ingest (raw TSV in, index and term frequencies out): the term
+ * tables, the postings and lexicon writers and the forward file.
+ */
+
+/* A term's postings; term points into the term dictionary or a run reader and is set once the term is final. */
+struct TermEntry {
+    const char* term;
+    std::uint32_t* postings;
+    std::uint32_t postings_count;
+    std::uint32_t postings_cap;
+    std::uint32_t last_doc_id;
+    std::uint32_t term_freq; /* tokens of the term; not kept in spilled runs */
+    std::uint64_t postings_offset_bytes;
+};
+
+struct DocMeta {
+    std::uint32_t doc_id;
+    char* title;
+    char* url;
+};
+
+/* Title and url per document id, first occurrence wins; what forward.bin holds. */
+struct DocMetaTable {
+    DocMeta* metas; /* indexed by doc id; doc_id is 0 in unused slots */
+    std::uint32_t cap;
+    std::uint32_t docs;
+    std::uint32_t max_doc_id;
+};
+
+/*
+ * Term collection, split across threads. The stemmed file is cut into byte
+ * ranges that start on line boundaries and every shard builds its own term
+ * table over one range. The shards' sorted term lists are then merged: a
+ * term's postings are the shards' lists concatenated in range order, with
+ * the duplicate dropped where one shard ends and the next starts in the same
+ * document, which is exactly what a single pass over the file produces.
+ *
+ * With a memory budget (--memory-mb) a shard does not keep its table until
+ * the end: whenever the table and its postings reach the shard's share of
+ * the budget, it is written out as a sorted run and emptied (SPIMI). The
+ * runs are then merged the same way, streaming, into postings.bin and
+ * lexicon.bin.
+ *
+ * In two-pass mode (--two-pass) the shards first only count each term's
+ * documents. Every term then gets an exactly sized region of one postings
+ * slab, the shards' segments back to back in range order, and a second
+ * pass over the same ranges fills them in. No list is ever reallocated and
+ * all postings go away with a single free.
+ *
+ * The stemmed input can also be a token stream (token_stream.h). Its
+ * dictionary is read first, the ranges then start on block boundaries, and
+ * a shard's table is an array of entries indexed by term id instead of a
+ * hash table: no token is split or hashed. Terms get their strings from
+ * the dictionary when the shard sorts them, and from there on everything
+ * is the same.
+ */
+const int BUILD_PASS_COLLECT = 0; /* grow each term's list (and spill, with a budget) */
+const int BUILD_PASS_COUNT = 1;
+const int BUILD_PASS_FILL = 2;
+
+struct BuildShard {
+    const char* path;
+    std::uint64_t start; /* first byte of the range, always the start of a line */
+    std::uint64_t end;   /* lines starting at or past end belong to the next shard */
+    TermDict dict; /* values are TermEntry */
+    TermEntry** sorted;
+    std::uint64_t unique_terms;
+    std::uint64_t docs_indexed;
+    std::uint64_t tokens_seen;
+    int ok;
+    int pass;
+    std::uint32_t* slab; /* two-pass mode: holds every shard's postings; freed through shard 0 */
+    TokenStreamDict* stream_terms; /* a token stream's dictionary, shared by every shard; freed through shard 0 */
+    TermEntry* by_id;              /* token stream: the shard's entry for every term id */
+
+    const char* run_dir;
+    std::uint32_t id;
+    std::uint64_t spill_bytes; /* spill once the table and postings reach this; 0 = keep everything */
+    int reader_mode;           /* LINE_READER_BUFFERED under a budget: a mapped input would count against it */
+    std::uint64_t heap_bytes;  /* postings */
+    std::uint32_t run_count;
+};
+
+/* Empties *shard and gives it a term table; everything else is the caller's to set. */
+int build_shard_init(BuildShard* shard, std::size_t capacity, int pass);
+
+/* Adds one token of doc_id in the shard's current pass. Documents must arrive in the order of the input. */
+int build_shard_add(BuildShard* shard, const char* term, std::size_t len, std::uint32_t doc_id);
+
+/* build_shard_add for term id of the shard's token stream. */
+int build_shard_add_id(BuildShard* shard, std::uint32_t id, std::uint32_t doc_id);
+
+/* Adds the terms of one stemmed.txt line, "doc_id\tterm term ..."; lines without a tab are skipped. */
+int build_shard_add_line(BuildShard* shard, LineView line);
+
+/* Pipeline stage over stemmed lines, adding them to the BuildShard in ctx. */
+int index_stage_run(void* ctx, DocBatch* batch);
+
+/* Ends the shard's pass: sorts its terms, or writes its last run with a budget. Also sets shard->ok. */
+int build_shard_finish(BuildShard* shard);
+
+/*
+ * Indexes stemmed_path, text or token stream, with thread_count shards. Without a memory budget the
+ * shards end up holding their sorted tables; with one, their runs in run_dir.
+ */
+int run_shards(const char* stemmed_path, std::uint32_t thread_count, std::size_t capacity, std::uint64_t memory_budget,
+               int two_pass, const char* run_dir, BuildShard** out_shards, std::uint32_t* out_shard_count,
+               std::uint64_t* docs_indexed, std::uint64_t* tokens_seen);
+
+/* Merges the shards' sorted terms into one sorted list; terms keep the entry of their first shard. */
+TermEntry** merge_shards(BuildShard* shards, std::uint32_t count, std::uint64_t* unique_terms);
+
+void remove_runs(const BuildShard* shards, std::uint32_t count);
+void free_shards(BuildShard* shards, std::uint32_t count);
+
+/* Writes postings.bin and lexicon.bin from terms already sorted in memory. */
+int write_sorted_terms(TermEntry** terms, std::uint64_t count, const char* postings_path, const char* lexicon_path,
+                       std::uint32_t format, std::uint32_t codec, std::uint64_t* total_postings,
+                       std::uint64_t* data_bytes);
+
+/* K-way merges the shards' runs into postings.bin and lexicon.bin. */
+int write_spilled_terms(const BuildShard* shards, std::uint32_t shard_count, const char* postings_path,
+                        const char* lexicon_path, std::uint32_t format, std::uint32_t codec,
+                        std::uint64_t* unique_terms, std::uint64_t* total_postings, std::uint64_t* data_bytes);
+
+/* raw, block, pef or hybrid to its INDEX_CODEC_ value; complains and returns 0 on anything else. */
+int parse_codec_name(const char* name, std::uint32_t* codec);
+
+/*
+ * Records the title and url of one raw_text.tsv line. Lines with fewer than
+ * five columns or a doc id of 0 are skipped.
+ */
+int doc_meta_add_line(DocMetaTable* table, LineView line);
+
+/* doc_meta_add_line over every line of raw_text.tsv, read in reader_mode (line_reader.h). */
+int collect_doc_meta(const char* raw_text_path, DocMetaTable* table, int reader_mode);
+
+int write_forward(const char* forward_path, const DocMetaTable* table, std::uint32_t format);
+void doc_meta_free(DocMetaTable* table);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * On-disk index layout shared by index_builder and search_cli.
+ *
+ * Version 1 files are streams of variable-length records that the reader has
+ * to parse field by field. Version 2 files are meant to be mmapped and used in
+ * place: each file starts with a 64-byte header, every section starts on a
+ * 64-byte boundary, tables are fixed-width, and strings live in one
+ * NUL-terminated blob addressed by 32-bit offsets.
+ *
+ *   lexicon.bin   header | LexiconRecord[term_count] | term strings
+ *   postings.bin  header | posting lists in lexicon order, encoded with the
+ *                          codec named in the header
+ *   forward.bin   header | uint32 doc_ids[docs] (ascending)
+ *                        | ForwardSlot[docs], parallel to doc_ids | title/url strings
+ *
+ * All integers are little-endian, as written by the build host.
+ */
+
+const std::uint32_t INDEX_POSTINGS_MAGIC = 0x504F5354U;
+const std::uint32_t INDEX_LEXICON_MAGIC = 0x4C455849U;
+const std::uint32_t INDEX_FORWARD_MAGIC = 0x46575244U;
+
+const std::uint32_t INDEX_VERSION_STREAM = 1;
+const std::uint32_t INDEX_VERSION_MAPPED = 2;
+
+const std::uint32_t INDEX_CODEC_RAW = 0;    /* uint32 doc ids */
+const std::uint32_t INDEX_CODEC_BLOCK = 1;  /* block-packed gaps, see block_codec.h */
+const std::uint32_t INDEX_CODEC_PEF = 2;    /* partitioned Elias-Fano, see pef_codec.h */
+const std::uint32_t INDEX_CODEC_HYBRID = 3; /* roaring-style containers, see roaring.h */
+
+const std::uint32_t INDEX_SECTION_ALIGN = 64;
+const std::uint32_t INDEX_NO_STRING = 0xFFFFFFFFU;
+
+struct PostingsHeaderV2 {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t total_postings;
+    std::uint64_t data_offset;
+    std::uint64_t data_bytes;
+    std::uint32_t codec;
+    std::uint32_t reserved[7];
+};
+
+struct LexiconHeaderV2 {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t term_count;
+    std::uint32_t reserved0;
+    std::uint64_t records_offset;
+    std::uint64_t strings_offset;
+    std::uint64_t strings_bytes;
+    std::uint32_t reserved[6];
+};
+
+/* Terms are sorted by strcmp order; postings_offset is in bytes from the start of the data section. */
+struct LexiconRecord {
+    std::uint64_t postings_offset;
+    std::uint32_t postings_count;
+    std::uint32_t term_offset;
+};
+
+struct ForwardHeaderV2 {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t docs;
+    std::uint32_t max_doc_id;
+    std::uint64_t doc_ids_offset;
+    std::uint64_t slots_offset;
+    std::uint64_t strings_offset;
+    std::uint64_t strings_bytes;
+    std::uint32_t reserved[4];
+};
+
+/* Slot i belongs to doc_ids[i], so the table stays as long as the doc count however sparse the ids are. */
+struct ForwardSlot {
+    std::uint32_t title_offset;
+    std::uint32_t url_offset;
+};
+
+static_assert(sizeof(PostingsHeaderV2) == INDEX_SECTION_ALIGN, "postings header must fill one section");
+static_assert(sizeof(LexiconHeaderV2) == INDEX_SECTION_ALIGN, "lexicon header must fill one section");
+static_assert(sizeof(ForwardHeaderV2) == INDEX_SECTION_ALIGN, "forward header must fill one section");
+static_assert(sizeof(LexiconRecord) == 16, "lexicon record must stay fixed-width");
+static_assert(sizeof(ForwardSlot) == 8, "forward slot must stay fixed-width");
+
+inline std::uint64_t index_align_up(std::uint64_t v) {
+    return (v + INDEX_SECTION_ALIGN - 1) & ~static_cast<std::uint64_t>(INDEX_SECTION_ALIGN - 1);
+}
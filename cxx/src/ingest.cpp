@@ -0,0 +1,191 @@
+/*
+ * raw_text.tsv -> index_dir/{postings,lexicon,forward}.bin and term_freq.csv
+ * in one pass. The raw file is read once and its lines go through the
+ * tokenizer, stemmer and index stages of a pipeline (pipeline.h), with the
+ * titles and urls taken from the same lines, so neither tokenized.txt nor
+ * stemmed.txt is written. The output is byte for byte what tokenizer,
+ * stemmer, term_stats and index_builder write for the same input and
+ * options.
+ */
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "index_build.h"
+#include "index_format.h"
+#include "pipeline.h"
+#include "stem.h"
+#include "term_freq.h"
+#include "tokenize.h"
+
+static std::uint32_t parse_u32(const char* s) {
+    return static_cast<std::uint32_t>(std::strtoul(s, nullptr, 10));
+}
+
+static int record_doc_meta(void* ctx, const char* line, std::size_t len) {
+    return doc_meta_add_line(static_cast<DocMetaTable*>(ctx), LineView{line, len});
+}
+
+static int write_term_freq_csv(const char* path, TermEntry** terms, std::uint64_t count) {
+    FILE* out = std::fopen(path, "wb");
+    if (!out) {
+        std::fprintf(stderr, "Failed to open output: %s\n", path);
+        return 0;
+    }
+    TermFreqRow* rows = static_cast<TermFreqRow*>(std::malloc(sizeof(TermFreqRow) * (count + 1)));
+    int ok = rows != nullptr;
+    for (std::uint64_t i = 0; ok && i < count; ++i) {
+        rows[i].term = terms[i]->term;
+        rows[i].count = terms[i]->term_freq;
+    }
+    ok = ok && write_term_freq(out, rows, count);
+    std::free(rows);
+    if (std::fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        std::fprintf(stderr, "Failed to write output: %s\n", path);
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::fprintf(stderr,
+                     "Usage: ingest <raw_text.tsv> <index_dir> <term_freq.csv> [hash_capacity] [--format 1|2]\n"
+                     "              [--codec raw|block|pef|hybrid] [--stages threads|inline]\n");
+        return 1;
+    }
+
+    const char* raw_text_path = argv[1];
+    const char* out_dir = argv[2];
+    const char* term_freq_path = argv[3];
+    size_t term_hash_capacity = 0; /* initial table size; the table grows with the vocabulary */
+    std::uint32_t format = INDEX_VERSION_MAPPED;
+    std::uint32_t codec = INDEX_CODEC_RAW;
+    int threaded = pipeline_threads_default();
+    for (int i = 4; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            format = parse_u32(argv[++i]);
+        } else if (std::strcmp(argv[i], "--codec") == 0 && i + 1 < argc) {
+            if (!parse_codec_name(argv[++i], &codec)) {
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--stages") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "threads") != 0 && std::strcmp(argv[i], "inline") != 0) {
+                std::fprintf(stderr, "Unknown stage mode %s (expected threads or inline)\n", argv[i]);
+                return 1;
+            }
+            threaded = std::strcmp(argv[i], "threads") == 0;
+        } else if (i == 4 && std::isdigit(static_cast<unsigned char>(argv[i][0]))) {
+            term_hash_capacity = static_cast<size_t>(std::strtoull(argv[i], nullptr, 10));
+        } else {
+            std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (format != INDEX_VERSION_STREAM && format != INDEX_VERSION_MAPPED) {
+        std::fprintf(stderr, "Unsupported index format %u (expected 1 or 2)\n", format);
+        return 1;
+    }
+    if (codec != INDEX_CODEC_RAW && format != INDEX_VERSION_MAPPED) {
+        std::fprintf(stderr, "Compressed postings require --format 2\n");
+        return 1;
+    }
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        std::fprintf(stderr, "Failed to create index dir %s: %s\n", out_dir, std::strerror(errno));
+        return 1;
+    }
+
+    LineSource source;
+    if (!line_source_open(&source, raw_text_path)) {
+        std::fprintf(stderr, "Failed to open raw_text.tsv: %s\n", raw_text_path);
+        return 1;
+    }
+    BuildShard* shard = static_cast<BuildShard*>(std::calloc(1, sizeof(BuildShard)));
+    if (!shard || !build_shard_init(shard, term_hash_capacity, BUILD_PASS_COLLECT)) {
+        std::fprintf(stderr, "Failed to allocate term table\n");
+        line_source_close(&source);
+        free_shards(shard, shard ? 1 : 0);
+        return 1;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    DocMetaTable docs{};
+    TokenizeStage tokenize{};
+    tokenize.raw_line = record_doc_meta;
+    tokenize.raw_line_ctx = &docs;
+    StemStage stem{};
+    PipeStage stages[] = {
+        pipe_stage("read", line_source_run, &source),
+        pipe_stage("tokenize", tokenize_stage_run, &tokenize),
+        pipe_stage("stem", stem_stage_run, &stem),
+        pipe_stage("index", index_stage_run, shard),
+    };
+    std::uint32_t stage_count = sizeof(stages) / sizeof(stages[0]);
+    int ok = pipeline_run(stages, stage_count, threaded);
+    line_source_close(&source);
+
+    std::uint64_t unique_terms = 0;
+    TermEntry** sorted_terms = nullptr;
+    if (ok && !build_shard_finish(shard)) {
+        std::fprintf(stderr, "Failed to allocate sorted term list\n");
+        ok = 0;
+    }
+    if (ok) {
+        sorted_terms = merge_shards(shard, 1, &unique_terms);
+    }
+
+    char postings_path[2048];
+    char lexicon_path[2048];
+    char forward_path[2048];
+    std::snprintf(postings_path, sizeof(postings_path), "%s/postings.bin", out_dir);
+    std::snprintf(lexicon_path, sizeof(lexicon_path), "%s/lexicon.bin", out_dir);
+    std::snprintf(forward_path, sizeof(forward_path), "%s/forward.bin", out_dir);
+
+    std::uint64_t total_postings = 0;
+    std::uint64_t offset = 0;
+    ok = ok &&
+         write_sorted_terms(sorted_terms, unique_terms, postings_path, lexicon_path, format, codec, &total_postings,
+                            &offset) &&
+         write_forward(forward_path, &docs, format) && write_term_freq_csv(term_freq_path, sorted_terms, unique_terms);
+    if (ok) {
+        double elapsed_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::uint64_t term_length_sum = 0;
+        for (std::uint64_t i = 0; i < unique_terms; ++i) {
+            term_length_sum += std::strlen(sorted_terms[i]->term) * sorted_terms[i]->term_freq;
+        }
+        double tokens = static_cast<double>(tokenize.tokens);
+        double avg_token_len = tokenize.tokens == 0 ? 0.0 : static_cast<double>(tokenize.token_length_sum) / tokens;
+        double avg_term_len = tokenize.tokens == 0 ? 0.0 : static_cast<double>(term_length_sum) / tokens;
+        std::printf("Ingest finished\n");
+        std::printf("documents=%llu\n", static_cast<unsigned long long>(tokenize.docs));
+        std::printf("tokens=%llu\n", static_cast<unsigned long long>(tokenize.tokens));
+        std::printf("avg_token_length=%.4f\n", avg_token_len);
+        std::printf("avg_term_length=%.4f\n", avg_term_len);
+        std::printf("unique_terms=%llu\n", static_cast<unsigned long long>(unique_terms));
+        std::printf("total_postings=%llu\n", static_cast<unsigned long long>(total_postings));
+        std::printf("docs_with_meta=%u\n", docs.docs);
+        std::printf("format=%u\n", format);
+        std::printf("postings_bytes=%llu\n", static_cast<unsigned long long>(offset));
+        std::printf("elapsed_seconds=%.3f\n", elapsed_sec);
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            std::printf("peak_rss_kb=%ld\n", usage.ru_maxrss);
+        }
+        std::printf("stages=%s\n", threaded ? "threads" : "inline");
+        pipeline_print_stats(stdout, stages, stage_count);
+    }
+
+    std::free(sorted_terms);
+    free_shards(shard, 1);
+    doc_meta_free(&docs);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+#include "intersect.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INTERSECT_X86 1
+#endif
+
+static std::uint32_t scalar_merge(const std::uint32_t* a, std::uint32_t na, const std::uint32_t* b, std::uint32_t nb,
+                                  std::uint32_t* out, std::uint32_t i, std::uint32_t j, std::uint32_t k) {
+    while (i < na && j < nb) {
+        if (a[i] == b[j]) {
+            out[k++] = a[i];
+            ++i;
+            ++j;
+        } else if (a[i] < b[j]) {
+            ++i;
+        } else {
+            ++j;
+        }
+    }
+    return k;
+}
+
+static std::uint32_t gallop(const std::uint32_t* small, std::uint32_t ns, const std::uint32_t* large, std::uint32_t nl,
+                            std::uint32_t* out) {
+    std::uint32_t j = 0;
+    std::uint32_t k = 0;
+    for (std::uint32_t i = 0; i < ns && j < nl; ++i) {
+        std::uint32_t x = small[i];
+        if (large[j] < x) {
+            /* large[j + bound / 2] < x holds on exit; the first id >= x lies in (j + bound / 2, j + bound]. */
+            std::uint32_t bound = 1;
+            while (bound < nl - j && large[j + bound] < x) {
+                bound <<= 1;
+            }
+            std::uint32_t lo = j + bound / 2 + 1;
+            std::uint32_t hi = (bound < nl - j) ? j + bound : nl;
+            while (lo < hi) {
+                std::uint32_t mid = lo + (hi - lo) / 2;
+                if (large[mid] < x) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            j = lo;
+        }
+        if (j < nl && large[j] == x) {
+            out[k++] = x;
+            ++j;
+        }
+    }
+    return k;
+}
+
+#if defined(INTERSECT_X86)
+static std::uint32_t sse2_blocks(const std::uint32_t* a, std::uint32_t na, const std::uint32_t* b, std::uint32_t nb,
+                                 std::uint32_t* out) {
+    std::uint32_t i = 0, j = 0, k = 0;
+    std::uint32_t na4 = na & ~3U;
+    std::uint32_t nb4 = nb & ~3U;
+    while (i < na4 && j < nb4) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        __m128i eq = _mm_cmpeq_epi32(va, vb);
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+        while (mask) {
+            out[k++] = a[i + static_cast<std::uint32_t>(__builtin_ctz(mask))];
+            mask &= mask - 1;
+        }
+        std::uint32_t a_last = a[i + 3];
+        std::uint32_t b_last = b[j + 3];
+        if (a_last <= b_last) {
+            i += 4;
+        }
+        if (b_last <= a_last) {
+            j += 4;
+        }
+    }
+    return scalar_merge(a, na, b, nb, out, i, j, k);
+}
+
+__attribute__((target("avx2"))) static std::uint32_t avx2_blocks(const std::uint32_t* a, std::uint32_t na,
+                                                                  const std::uint32_t* b, std::uint32_t nb,
+                                                                  std::uint32_t* out) {
+    std::uint32_t i = 0, j = 0, k = 0;
+    std::uint32_t na8 = na & ~7U;
+    std::uint32_t nb8 = nb & ~7U;
+    const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    while (i < na8 && j < nb8) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; ++r) {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+        }
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+        while (mask) {
+            out[k++] = a[i + static_cast<std::uint32_t>(__builtin_ctz(mask))];
+            mask &= mask - 1;
+        }
+        std::uint32_t a_last = a[i + 7];
+        std::uint32_t b_last = b[j + 7];
+        if (a_last <= b_last) {
+            i += 8;
+        }
+        if (b_last <= a_last) {
+            j += 8;
+        }
+    }
+    return scalar_merge(a, na, b, nb, out, i, j, k);
+}
+#endif
+
+int intersect_kernel_available(int kernel) {
+    if (kernel == INTERSECT_SCALAR || kernel == INTERSECT_GALLOP) {
+        return 1;
+    }
+#if defined(INTERSECT_X86)
+    if (kernel == INTERSECT_SSE2) {
+        return 1;
+    }
+    if (kernel == INTERSECT_AVX2) {
+        static const int has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        return has_avx2;
+    }
+#endif
+    return 0;
+}
+
+const char* intersect_kernel_name(int kernel) {
+    switch (kernel) {
+    case INTERSECT_SCALAR:
+        return "scalar";
+    case INTERSECT_GALLOP:
+        return "gallop";
+    case INTERSECT_SSE2:
+        return "sse2";
+    case INTERSECT_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+std::uint32_t intersect_with(int kernel, const std::uint32_t* a, std::uint32_t na, const std::uint32_t* b,
+                             std::uint32_t nb, std::uint32_t* out) {
+    if (kernel == INTERSECT_GALLOP) {
+        return (na <= nb) ? gallop(a, na, b, nb, out) : gallop(b, nb, a, na, out);
+    }
+#if defined(INTERSECT_X86)
+    if (kernel == INTERSECT_AVX2 && intersect_kernel_available(INTERSECT_AVX2)) {
+        return avx2_blocks(a, na, b, nb, out);
+    }
+    if (kernel == INTERSECT_SSE2 || kernel == INTERSECT_AVX2) {
+        return sse2_blocks(a, na, b, nb, out);
+    }
+#endif
+    return scalar_merge(a, na, b, nb, out, 0, 0, 0);
+}
+
+std::uint32_t intersect_sorted(const std::uint32_t* a, std::uint32_t na, const std::uint32_t* b, std::uint32_t nb,
+                               std::uint32_t* out) {
+    static const int block_kernel = intersect_kernel_available(INTERSECT_AVX2)   ? INTERSECT_AVX2
+                                    : intersect_kernel_available(INTERSECT_SSE2) ? INTERSECT_SSE2
+                                                                                 : INTERSECT_SCALAR;
+    std::uint32_t shorter = (na < nb) ? na : nb;
+    std::uint32_t longer = (na < nb) ? nb : na;
+    if (shorter == 0) {
+        return 0;
+    }
+    if (longer / shorter >= INTERSECT_GALLOP_RATIO) {
+        return (na <= nb) ? gallop(a, na, b, nb, out) : gallop(b, nb, a, na, out);
+    }
+    return intersect_with(block_kernel, a, na, b, nb, out);
+}
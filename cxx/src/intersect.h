@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Intersection kernels for sorted, strictly increasing doc id lists.
+ *
+ *   INTERSECT_SCALAR  two-pointer merge
+ *   INTERSECT_GALLOP  walks the shorter list and finds each id in the longer
+ *                     one by exponential then binary search
+ *   INTERSECT_SSE2    compares 4x4 blocks of ids per step
+ *   INTERSECT_AVX2    compares 8x8 blocks of ids per step
+ *
+ * Every kernel writes the common ids, in order, to out (which needs room for
+ * the shorter list) and returns how many it wrote. The SIMD kernels fall back
+ * to the scalar merge where the CPU or the compiler lacks the instructions.
+ */
+
+const int INTERSECT_SCALAR = 0;
+const int INTERSECT_GALLOP = 1;
+const int INTERSECT_SSE2 = 2;
+const int INTERSECT_AVX2 = 3;
+const int INTERSECT_KERNEL_COUNT = 4;
+
+/*
+ * intersect_sorted gallops once the longer list is at least this many times
+ * longer than the shorter one; below that the block kernels win. Measured
+ * with bench_intersect on the project corpus.
+ */
+const std::uint32_t INTERSECT_GALLOP_RATIO = 64;
+
+/* Whether the kernel runs natively on this CPU (otherwise it uses the scalar merge). */
+int intersect_kernel_available(int kernel);
+const char* intersect_kernel_name(int kernel);
+
+std::uint32_t intersect_with(int kernel, const std::uint32_t* a, std::uint32_t na, const std::uint32_t* b,
+                             std::uint32_t nb, std::uint32_t* out);
+
+/* Picks galloping or the widest available block kernel from the size ratio. */
+std::uint32_t intersect_sorted(const std::uint32_t* a, std::uint32_t na, const std::uint32_t* b, std::uint32_t nb,
+                               std::uint32_t* out);
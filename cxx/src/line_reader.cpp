@@ -0,0 +1,219 @@
+#include "line_reader.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int line_reader_open(LineReader* r, const char* path, int mode) {
+    *r = LineReader{};
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(r->fd, &st) != 0) {
+        line_reader_close(r);
+        return 0;
+    }
+    if (S_ISREG(st.st_mode)) {
+        r->size = static_cast<std::uint64_t>(st.st_size);
+    }
+    if (mode != LINE_READER_BUFFERED && S_ISREG(st.st_mode)) {
+        void* map = nullptr;
+        if (r->size > 0) {
+            map = mmap(nullptr, static_cast<std::size_t>(r->size), PROT_READ, MAP_PRIVATE, r->fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            if (map) {
+                madvise(map, static_cast<std::size_t>(r->size), MADV_SEQUENTIAL);
+            }
+            r->mapped = 1;
+            r->data = static_cast<const char*>(map);
+            r->len = static_cast<std::size_t>(r->size);
+            r->eof = 1;
+            return 1;
+        }
+    }
+    if (mode == LINE_READER_MMAP) {
+        int saved = S_ISREG(st.st_mode) ? errno : ENODEV;
+        line_reader_close(r);
+        errno = saved;
+        return 0;
+    }
+    r->cap = LINE_READER_BLOCK_BYTES;
+    r->buf = static_cast<char*>(std::malloc(r->cap));
+    if (!r->buf) {
+        line_reader_close(r);
+        errno = ENOMEM;
+        return 0;
+    }
+    r->data = r->buf;
+    return 1;
+}
+
+void line_reader_close(LineReader* r) {
+    if (r->mapped && r->size > 0) {
+        munmap(const_cast<char*>(r->data), static_cast<std::size_t>(r->size));
+    }
+    std::free(r->buf);
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    *r = LineReader{};
+    r->fd = -1;
+}
+
+int line_reader_seek(LineReader* r, std::uint64_t offset) {
+    if (r->mapped) {
+        r->pos = (offset < r->len) ? static_cast<std::size_t>(offset) : r->len;
+        r->offset = r->pos;
+        return 1;
+    }
+    if (lseek(r->fd, static_cast<off_t>(offset), SEEK_SET) < 0) {
+        r->error = 1;
+        return 0;
+    }
+    r->pos = 0;
+    r->len = 0;
+    r->offset = offset;
+    r->eof = 0;
+    return 1;
+}
+
+/* Buffered readers: moves the unread bytes to the front and reads until there are want of them or the file ends. */
+static int fill(LineReader* r, std::size_t want) {
+    std::size_t have = r->len - r->pos;
+    if (r->pos > 0) {
+        std::memmove(r->buf, r->buf + r->pos, have);
+        r->pos = 0;
+        r->len = have;
+    }
+    if (want > r->cap) {
+        std::size_t new_cap = (r->cap * 2 > want) ? r->cap * 2 : want;
+        char* grown = static_cast<char*>(std::realloc(r->buf, new_cap));
+        if (!grown) {
+            r->error = 1;
+            return 0;
+        }
+        r->buf = grown;
+        r->cap = new_cap;
+        r->data = grown;
+    }
+    while (!r->eof && r->len < want) {
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            r->error = 1;
+            return 0;
+        }
+        if (n == 0) {
+            r->eof = 1;
+        }
+        r->len += static_cast<std::size_t>(n);
+    }
+    return 1;
+}
+
+static void take(LineReader* r, std::size_t n) {
+    r->pos += n;
+    r->offset += n;
+}
+
+int line_reader_next(LineReader* r, LineView* line) {
+    std::size_t scanned = 0; /* bytes past pos known to hold no '\n' */
+    while (1) {
+        const char* p = r->data + r->pos;
+        std::size_t avail = r->len - r->pos;
+        const char* nl = (avail > scanned)
+                             ? static_cast<const char*>(std::memchr(p + scanned, '\n', avail - scanned))
+                             : nullptr;
+        if (nl) {
+            *line = LineView{p, static_cast<std::size_t>(nl - p)};
+            take(r, line->len + 1);
+            return 1;
+        }
+        if (r->eof) {
+            if (avail == 0) {
+                return 0;
+            }
+            *line = LineView{p, avail};
+            take(r, avail);
+            return 1;
+        }
+        scanned = avail;
+        if (!fill(r, avail + 1)) {
+            return 0;
+        }
+    }
+}
+
+int line_reader_next_block(LineReader* r, std::size_t max_bytes, LineView* block) {
+    while (1) {
+        const char* p = r->data + r->pos;
+        std::size_t avail = r->len - r->pos;
+        if (r->eof && avail == 0) {
+            return 0;
+        }
+        if (avail >= max_bytes || r->eof) {
+            std::size_t n = (avail < max_bytes) ? avail : max_bytes;
+            const char* end = static_cast<const char*>(memrchr(p, '\n', n));
+            if (!end && avail > n) {
+                end = static_cast<const char*>(std::memchr(p + n, '\n', avail - n));
+            }
+            if (end || r->eof) {
+                std::size_t len = end ? static_cast<std::size_t>(end + 1 - p) : avail;
+                *block = LineView{p, len};
+                take(r, len);
+                return 1;
+            }
+        }
+        if (!fill(r, (avail < max_bytes) ? max_bytes : avail + 1)) {
+            return 0;
+        }
+    }
+}
+
+int line_reader_done(const LineReader* r) {
+    return r->eof && r->pos == r->len;
+}
+
+LineView line_view_cstr(LineView line) {
+    const char* nul = line_view_find(line, '\0');
+    return nul ? LineView{line.data, static_cast<std::size_t>(nul - line.data)} : line;
+}
+
+const char* line_view_find(LineView line, char c) {
+    return (line.len > 0) ? static_cast<const char*>(std::memchr(line.data, c, line.len)) : nullptr;
+}
+
+std::uint32_t line_parse_u32(const char* s, std::size_t len) {
+    const char* end = s + len;
+    while (s < end && line_is_space(static_cast<unsigned char>(*s))) {
+        ++s;
+    }
+    int negative = 0;
+    if (s < end && (*s == '+' || *s == '-')) {
+        negative = *s == '-';
+        ++s;
+    }
+    unsigned long value = 0;
+    int overflow = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+        unsigned long digit = static_cast<unsigned long>(*s - '0');
+        if (value > (ULONG_MAX - digit) / 10) {
+            overflow = 1;
+        }
+        value = value * 10 + digit;
+    }
+    if (overflow) {
+        return static_cast<std::uint32_t>(ULONG_MAX);
+    }
+    return static_cast<std::uint32_t>(negative ? 0 - value : value);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Line input shared by the tools. A reader either maps the whole file or
+ * reads it in large blocks, and hands out lines as views into that memory,
+ * found with memchr, instead of copying them out a byte at a time. A view
+ * stays valid until the next call on the reader and is not NUL-terminated.
+ */
+
+const int LINE_READER_AUTO = 0;     /* map regular files, read anything else */
+const int LINE_READER_MMAP = 1;     /* map the file; fails on pipes */
+const int LINE_READER_BUFFERED = 2; /* read(2) into a growing buffer */
+
+const std::size_t LINE_READER_BLOCK_BYTES = 1 << 20; /* a buffered reader's read size */
+
+/* len bytes at data; a line's view does not include its '\n'. */
+struct LineView {
+    const char* data;
+    std::size_t len;
+};
+
+struct LineReader {
+    int fd;
+    int mapped;
+    const char* data; /* the mapping, or buf */
+    char* buf;
+    std::size_t cap;
+    std::size_t pos; /* unread bytes are data[pos, len) */
+    std::size_t len;
+    std::uint64_t offset; /* file offset of data[pos] */
+    std::uint64_t size;   /* of the file, 0 when not known (a pipe) */
+    int eof;              /* no bytes past data[len] */
+    int error;
+};
+
+/* Opens path in the given mode; returns 0 with errno set on failure. */
+int line_reader_open(LineReader* r, const char* path, int mode);
+void line_reader_close(LineReader* r);
+
+/* Continues from byte offset of the file; fails on pipes. */
+int line_reader_seek(LineReader* r, std::uint64_t offset);
+
+/* Next line without its '\n'; a last line without one is returned as is. Returns 0 at the end or on error. */
+int line_reader_next(LineReader* r, LineView* line);
+
+/*
+ * Next run of whole lines, '\n' included except possibly on the very last
+ * line of the file: about max_bytes of them, or a single longer line.
+ * Returns 0 at the end or on error.
+ */
+int line_reader_next_block(LineReader* r, std::size_t max_bytes, LineView* block);
+
+/* The end of the file has been reached. */
+int line_reader_done(const LineReader* r);
+
+/* The part of line before its first NUL, which is all that C string functions see of it. */
+LineView line_view_cstr(LineView line);
+
+/* std::isspace in the C locale, without a libc call per byte. */
+inline int line_is_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* First c in line, or nullptr. */
+const char* line_view_find(LineView line, char c);
+
+/* std::strtoul(s, nullptr, 10) cast to 32 bits, for s[0, len) that need not be NUL-terminated. */
+std::uint32_t line_parse_u32(const char* s, std::size_t len);
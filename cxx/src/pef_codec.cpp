@@ -0,0 +1,287 @@
+#include "pef_codec.h"
+
+#include <cstring>
+
+static std::uint32_t partition_count_for(std::uint32_t count) {
+    return (count + PEF_PARTITION_SIZE - 1) / PEF_PARTITION_SIZE;
+}
+
+static std::uint64_t load_word(const unsigned char* bits, std::uint64_t w) {
+    std::uint64_t v;
+    std::memcpy(&v, bits + w * 8, sizeof(v));
+    return v;
+}
+
+static std::uint32_t get_bits(const unsigned char* bits, std::uint64_t pos, std::uint32_t width) {
+    if (width == 0) {
+        return 0;
+    }
+    std::uint64_t w = pos >> 6;
+    std::uint32_t s = static_cast<std::uint32_t>(pos & 63);
+    std::uint64_t v = load_word(bits, w) >> s;
+    if (s + width > 64) {
+        v |= load_word(bits, w + 1) << (64 - s);
+    }
+    return static_cast<std::uint32_t>(v & ((1ULL << width) - 1));
+}
+
+static void put_bits(std::uint64_t* words, std::uint64_t pos, std::uint32_t width, std::uint64_t value) {
+    if (width == 0) {
+        return;
+    }
+    std::uint64_t w = pos >> 6;
+    std::uint32_t s = static_cast<std::uint32_t>(pos & 63);
+    words[w] |= value << s;
+    if (s + width > 64) {
+        words[w + 1] |= value >> (64 - s);
+    }
+}
+
+/* Absolute position of the next set bit at or after pos; the caller guarantees one exists. */
+static std::uint64_t next_one(const unsigned char* bits, std::uint64_t pos) {
+    std::uint64_t w = pos >> 6;
+    std::uint64_t word = load_word(bits, w) & (~0ULL << (pos & 63));
+    while (word == 0) {
+        word = load_word(bits, ++w);
+    }
+    return (w << 6) + static_cast<std::uint64_t>(__builtin_ctzll(word));
+}
+
+/* Absolute position of the k-th (k >= 1) clear bit at or after start; the caller guarantees it exists. */
+static std::uint64_t select_zero(const unsigned char* bits, std::uint64_t start, std::uint64_t k) {
+    std::uint64_t w = start >> 6;
+    std::uint64_t word = ~load_word(bits, w) & (~0ULL << (start & 63));
+    while (true) {
+        std::uint64_t c = static_cast<std::uint64_t>(__builtin_popcountll(word));
+        if (c >= k) {
+            while (--k > 0) {
+                word &= word - 1;
+            }
+            return (w << 6) + static_cast<std::uint64_t>(__builtin_ctzll(word));
+        }
+        k -= c;
+        word = ~load_word(bits, ++w);
+    }
+}
+
+static std::uint32_t ef_low_bits(std::uint64_t universe, std::uint32_t n) {
+    std::uint64_t ratio = (universe + 1) / n;
+    return ratio > 1 ? 63 - static_cast<std::uint32_t>(__builtin_clzll(ratio)) : 0;
+}
+
+size_t pef_codec_max_bytes(std::uint32_t count) {
+    size_t parts = partition_count_for(count);
+    size_t skips = (count > PEF_PARTITION_SIZE) ? parts * sizeof(PefSkip) : 0;
+    return skips + parts * (sizeof(PefPartHeader) + 16) + static_cast<size_t>(count) * 5;
+}
+
+static size_t encode_partition(const std::uint32_t* ids, std::uint32_t n, std::uint32_t base, unsigned char* out) {
+    PefPartHeader header{};
+    std::uint64_t universe = ids[n - 1] - base;
+    std::uint32_t low_bits = ef_low_bits(universe, n);
+    std::uint64_t ef_bits = static_cast<std::uint64_t>(n) * low_bits + n + (universe >> low_bits) + 1;
+    header.universe = static_cast<std::uint32_t>(universe);
+
+    std::uint64_t nbits = 0;
+    if (universe + 1 == n) {
+        header.type = PEF_PART_RUN;
+    } else if (universe + 1 <= ef_bits) {
+        header.type = PEF_PART_BITMAP;
+        nbits = universe + 1;
+    } else {
+        header.type = PEF_PART_EF;
+        header.low_bits = static_cast<std::uint8_t>(low_bits);
+        nbits = ef_bits;
+    }
+    std::memcpy(out, &header, sizeof(header));
+
+    /* A partition never needs more bits than EF with the widest gaps: 128 * (32 + 1) + 2 * 128 + 1. */
+    std::uint64_t words[72];
+    std::uint64_t nwords = (nbits + 63) / 64;
+    std::memset(words, 0, sizeof(words));
+    if (header.type == PEF_PART_BITMAP) {
+        for (std::uint32_t i = 0; i < n; ++i) {
+            put_bits(words, ids[i] - base, 1, 1);
+        }
+    } else if (header.type == PEF_PART_EF) {
+        std::uint64_t high_start = static_cast<std::uint64_t>(n) * low_bits;
+        std::uint64_t low_mask = (1ULL << low_bits) - 1;
+        for (std::uint32_t i = 0; i < n; ++i) {
+            std::uint64_t v = ids[i] - base;
+            put_bits(words, static_cast<std::uint64_t>(i) * low_bits, low_bits, v & low_mask);
+            put_bits(words, high_start + (v >> low_bits) + i, 1, 1);
+        }
+    }
+    std::memcpy(out + sizeof(header), words, nwords * 8);
+    return sizeof(header) + nwords * 8;
+}
+
+size_t pef_codec_encode(const std::uint32_t* ids, std::uint32_t count, unsigned char* out) {
+    std::uint32_t partition_count = partition_count_for(count);
+    size_t skips_bytes = (count > PEF_PARTITION_SIZE) ? partition_count * sizeof(PefSkip) : 0;
+    unsigned char* parts = out + skips_bytes;
+    size_t pos = 0;
+    std::uint32_t base = 0;
+    for (std::uint32_t p = 0; p < partition_count; ++p) {
+        std::uint32_t start = p * PEF_PARTITION_SIZE;
+        std::uint32_t n = (count - start < PEF_PARTITION_SIZE) ? count - start : PEF_PARTITION_SIZE;
+        pos += encode_partition(ids + start, n, base, parts + pos);
+        std::uint32_t last = ids[start + n - 1];
+        if (skips_bytes > 0) {
+            PefSkip skip{last, static_cast<std::uint32_t>(pos)};
+            std::memcpy(out + p * sizeof(PefSkip), &skip, sizeof(skip));
+        }
+        base = last + 1;
+    }
+    return skips_bytes + pos;
+}
+
+static void load_partition(PefCursor* cur, std::uint32_t p) {
+    std::uint32_t start = (p > 0) ? cur->skips[p - 1].end_offset : 0;
+    PefPartHeader header;
+    std::memcpy(&header, cur->parts + start, sizeof(header));
+    std::uint32_t first = p * PEF_PARTITION_SIZE;
+    cur->bits = cur->parts + start + sizeof(header);
+    cur->type = header.type;
+    cur->low_bits = header.low_bits;
+    cur->universe = header.universe;
+    cur->base = (p > 0) ? cur->skips[p - 1].last_doc_id + 1 : 0;
+    cur->part_count = (cur->count - first < PEF_PARTITION_SIZE) ? cur->count - first : PEF_PARTITION_SIZE;
+    cur->i = 0;
+    cur->pos = (header.type == PEF_PART_EF) ? static_cast<std::uint64_t>(cur->part_count) * header.low_bits : 0;
+}
+
+static int partition_next_geq(PefCursor* cur, std::uint32_t target, std::uint32_t* out) {
+    std::uint64_t v = (target <= cur->base) ? 0 : static_cast<std::uint64_t>(target - cur->base);
+    if (v > cur->universe) {
+        return 0;
+    }
+    if (cur->type == PEF_PART_RUN) {
+        if (v > cur->i) {
+            cur->i = static_cast<std::uint32_t>(v);
+        }
+        *out = cur->base + cur->i;
+        return 1;
+    }
+    if (cur->type == PEF_PART_BITMAP) {
+        if (v > cur->pos) {
+            cur->pos = v;
+        }
+        std::uint64_t w = cur->pos >> 6;
+        std::uint64_t word = load_word(cur->bits, w) & (~0ULL << (cur->pos & 63));
+        while (word == 0) {
+            if ((++w << 6) > cur->universe) {
+                return 0;
+            }
+            word = load_word(cur->bits, w);
+        }
+        std::uint64_t bit = (w << 6) + static_cast<std::uint64_t>(__builtin_ctzll(word));
+        if (bit > cur->universe) {
+            return 0;
+        }
+        cur->pos = bit;
+        *out = cur->base + static_cast<std::uint32_t>(bit);
+        return 1;
+    }
+
+    std::uint64_t high_start = static_cast<std::uint64_t>(cur->part_count) * cur->low_bits;
+    std::uint64_t high = v >> cur->low_bits;
+    if (high > 0) {
+        /* Ids with high part >= high start right after the high-th zero of the unary section. */
+        std::uint64_t after = select_zero(cur->bits, high_start, high) + 1;
+        std::uint64_t before = after - high_start - high;
+        if (before > cur->i) {
+            cur->i = static_cast<std::uint32_t>(before);
+            cur->pos = after;
+        }
+    }
+    while (cur->i < cur->part_count) {
+        std::uint64_t q = next_one(cur->bits, cur->pos);
+        std::uint64_t value = ((q - high_start - cur->i) << cur->low_bits) |
+                              get_bits(cur->bits, static_cast<std::uint64_t>(cur->i) * cur->low_bits, cur->low_bits);
+        if (value >= v) {
+            cur->pos = q;
+            *out = cur->base + static_cast<std::uint32_t>(value);
+            return 1;
+        }
+        cur->i++;
+        cur->pos = q + 1;
+    }
+    return 0;
+}
+
+void pef_cursor_init(PefCursor* cur, const unsigned char* data, std::uint32_t count) {
+    cur->count = count;
+    cur->partition_count = partition_count_for(count);
+    if (count > PEF_PARTITION_SIZE) {
+        cur->skips = reinterpret_cast<const PefSkip*>(data);
+        cur->parts = data + cur->partition_count * sizeof(PefSkip);
+    } else {
+        cur->skips = nullptr;
+        cur->parts = data;
+    }
+    cur->part = 0;
+    cur->bits = nullptr;
+}
+
+int pef_cursor_next_geq(PefCursor* cur, std::uint32_t target, std::uint32_t* out) {
+    while (cur->part < cur->partition_count) {
+        if (!cur->bits) {
+            if (cur->skips && cur->skips[cur->part].last_doc_id < target) {
+                std::uint32_t lo = cur->part + 1;
+                std::uint32_t hi = cur->partition_count;
+                while (lo < hi) {
+                    std::uint32_t mid = lo + (hi - lo) / 2;
+                    if (cur->skips[mid].last_doc_id < target) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                cur->part = lo;
+                continue;
+            }
+            load_partition(cur, cur->part);
+        }
+        if (partition_next_geq(cur, target, out)) {
+            return 1;
+        }
+        cur->part++;
+        cur->bits = nullptr;
+    }
+    return 0;
+}
+
+void pef_codec_decode(const unsigned char* data, std::uint32_t count, std::uint32_t* out) {
+    PefCursor cur;
+    pef_cursor_init(&cur, data, count);
+    for (std::uint32_t p = 0; p < cur.partition_count; ++p) {
+        load_partition(&cur, p);
+        std::uint32_t* dst = out + p * PEF_PARTITION_SIZE;
+        std::uint32_t n = cur.part_count;
+        if (cur.type == PEF_PART_RUN) {
+            for (std::uint32_t i = 0; i < n; ++i) {
+                dst[i] = cur.base + i;
+            }
+            continue;
+        }
+        std::uint64_t start = cur.pos;
+        std::uint64_t w = start >> 6;
+        std::uint64_t word = load_word(cur.bits, w) & (~0ULL << (start & 63));
+        for (std::uint32_t i = 0; i < n; ++i) {
+            while (word == 0) {
+                word = load_word(cur.bits, ++w);
+            }
+            std::uint64_t q = (w << 6) + static_cast<std::uint64_t>(__builtin_ctzll(word));
+            word &= word - 1;
+            if (cur.type == PEF_PART_BITMAP) {
+                dst[i] = cur.base + static_cast<std::uint32_t>(q);
+            } else {
+                std::uint64_t high = q - start - i;
+                dst[i] = cur.base + static_cast<std::uint32_t>(
+                                        (high << cur.low_bits) |
+                                        get_bits(cur.bits, static_cast<std::uint64_t>(i) * cur.low_bits, cur.low_bits));
+            }
+        }
+    }
+}
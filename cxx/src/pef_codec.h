@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Partitioned Elias-Fano posting lists (postings codec INDEX_CODEC_PEF).
+ *
+ * A list is cut into partitions of PEF_PARTITION_SIZE ids. Partition p
+ * covers the doc id range [base, base + universe], where base is one past
+ * the previous partition's last id (0 for the first partition), and is
+ * stored as whichever of these is smallest:
+ *
+ *   PEF_PART_RUN     every id in the range is present; no payload
+ *   PEF_PART_BITMAP  one bit per id in the range
+ *   PEF_PART_EF      Elias-Fano: low_bits low bits per id, followed by the
+ *                    high parts in unary (bit high + i set for id i)
+ *
+ * Each partition starts with a PefPartHeader and its bits are padded to
+ * whole 64-bit words. Lists with more than one partition start with a skip
+ * table PefSkip[partition_count], so a cursor can binary-search to the
+ * partition holding a target and then jump inside it with one select over
+ * the high bits, without touching anything in between. Encoded lists are
+ * padded to a multiple of 8 bytes.
+ */
+
+const std::uint32_t PEF_PARTITION_SIZE = 128;
+
+const std::uint8_t PEF_PART_RUN = 0;
+const std::uint8_t PEF_PART_BITMAP = 1;
+const std::uint8_t PEF_PART_EF = 2;
+
+struct PefSkip {
+    std::uint32_t last_doc_id;
+    std::uint32_t end_offset; /* end of this partition, relative to the first partition byte */
+};
+
+struct PefPartHeader {
+    std::uint8_t type;
+    std::uint8_t low_bits;
+    std::uint16_t reserved;
+    std::uint32_t universe; /* last id - base */
+};
+
+/* Upper bound on the encoded size of a list of count ids. */
+size_t pef_codec_max_bytes(std::uint32_t count);
+
+/* Encodes strictly increasing ids into out; returns the number of bytes written. */
+size_t pef_codec_encode(const std::uint32_t* ids, std::uint32_t count, unsigned char* out);
+
+/* Decodes a whole list of count ids into out. */
+void pef_codec_decode(const unsigned char* data, std::uint32_t count, std::uint32_t* out);
+
+/* Forward-only cursor supporting next_geq without decoding skipped ids. */
+struct PefCursor {
+    const PefSkip* skips;
+    const unsigned char* parts;
+    std::uint32_t count;
+    std::uint32_t partition_count;
+    std::uint32_t part; /* current partition; loaded when bits != nullptr */
+
+    const unsigned char* bits;
+    std::uint32_t type;
+    std::uint32_t low_bits;
+    std::uint32_t part_count;
+    std::uint32_t base;
+    std::uint32_t universe;
+    std::uint32_t i;   /* index of the current id inside the partition */
+    std::uint64_t pos; /* bit where the search for the current id starts */
+};
+
+void pef_cursor_init(PefCursor* cur, const unsigned char* data, std::uint32_t count);
+
+/*
+ * Moves to the first id >= target and stores it in *out; returns 0 when the
+ * list has no such id. Targets must not decrease between calls.
+ */
+int pef_cursor_next_geq(PefCursor* cur, std::uint32_t target, std::uint32_t* out);
@@ -0,0 +1,446 @@
+#include "pipeline.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static std::uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<std::uint64_t>(ts.tv_nsec);
+}
+
+/* Spins briefly, then yields, then sleeps: a stage waiting on a slow neighbour must not take its core. */
+static void backoff(std::uint32_t round) {
+    if (round < 64) {
+#if defined(__SSE2__)
+        _mm_pause();
+#endif
+    } else if (round < 256) {
+        sched_yield();
+    } else {
+        struct timespec ts = {0, 50000};
+        nanosleep(&ts, nullptr);
+    }
+}
+
+int spsc_ring_init(SpscRing* ring, std::uint64_t capacity) {
+    std::uint64_t cap = 2;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    ring->slots = static_cast<void**>(std::calloc(cap, sizeof(void*)));
+    ring->mask = cap - 1;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->cached_head = 0;
+    ring->cached_tail = 0;
+    return ring->slots != nullptr;
+}
+
+void spsc_ring_free(SpscRing* ring) {
+    std::free(ring->slots);
+    ring->slots = nullptr;
+}
+
+void spsc_ring_push(SpscRing* ring, void* item, std::uint64_t* wait_ns) {
+    std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->cached_head > ring->mask) {
+        ring->cached_head = ring->head.load(std::memory_order_acquire);
+        if (tail - ring->cached_head > ring->mask) {
+            std::uint64_t started = now_ns();
+            for (std::uint32_t round = 0; tail - ring->cached_head > ring->mask; ++round) {
+                backoff(round);
+                ring->cached_head = ring->head.load(std::memory_order_acquire);
+            }
+            *wait_ns += now_ns() - started;
+        }
+    }
+    ring->slots[tail & ring->mask] = item;
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+void* spsc_ring_pop(SpscRing* ring, std::uint64_t* wait_ns) {
+    std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head == ring->cached_tail) {
+        ring->cached_tail = ring->tail.load(std::memory_order_acquire);
+        if (head == ring->cached_tail) {
+            std::uint64_t started = now_ns();
+            for (std::uint32_t round = 0; head == ring->cached_tail; ++round) {
+                backoff(round);
+                ring->cached_tail = ring->tail.load(std::memory_order_acquire);
+            }
+            *wait_ns += now_ns() - started;
+        }
+    }
+    void* item = ring->slots[head & ring->mask];
+    ring->head.store(head + 1, std::memory_order_release);
+    return item;
+}
+
+/* Batch buffer (re)allocations made by the stage running on this thread. */
+static thread_local std::uint64_t buf_allocations = 0;
+
+int pipe_buf_reserve(PipeBuf* buf, std::size_t extra) {
+    if (buf->cap - buf->len >= extra) {
+        return 1;
+    }
+    std::size_t new_cap = (buf->cap == 0) ? 4096 : buf->cap;
+    while (new_cap - buf->len < extra) {
+        new_cap *= 2;
+    }
+    char* grown = static_cast<char*>(std::realloc(buf->data, new_cap));
+    if (!grown) {
+        return 0;
+    }
+    buf->data = grown;
+    buf->cap = new_cap;
+    ++buf_allocations;
+    return 1;
+}
+
+void doc_batch_swap(DocBatch* batch) {
+    PipeBuf t = batch->text;
+    batch->text = batch->next;
+    batch->next = t;
+    batch->next.len = 0;
+}
+
+/* Only the source ends a run: after a failure it sends an empty last batch and the others pass batches on. */
+static void run_stage(PipeStage* stage, DocBatch* batch, int is_source, std::atomic<int>* failed) {
+    std::uint64_t started = now_ns();
+    std::uint64_t allocations = buf_allocations;
+    stage->docs_in += batch->docs;
+    stage->bytes_in += batch->text.len;
+    int fail = failed->load(std::memory_order_relaxed);
+    if (!fail && !stage->run(stage->ctx, batch)) {
+        failed->store(1, std::memory_order_relaxed);
+        fail = 1;
+    }
+    if (fail && is_source) {
+        batch->text.len = 0;
+        batch->docs = 0;
+        batch->last = 1;
+    }
+    stage->docs_out += batch->docs;
+    stage->bytes_out += batch->text.len;
+    ++stage->batches;
+    stage->allocations += buf_allocations - allocations;
+    stage->busy_ns += now_ns() - started;
+}
+
+static std::uint32_t stage_width(const PipeStage* stage) {
+    return stage->workers ? stage->worker_count : 1;
+}
+
+/* The stage itself, or the worker of it that runs batch k. */
+static PipeStage* stage_unit(PipeStage* stage, std::uint64_t k) {
+    return stage->workers ? &stage->workers[k % stage->worker_count] : stage;
+}
+
+static void reset_counters(PipeStage* stage) {
+    stage->batches = stage->docs_in = stage->docs_out = 0;
+    stage->bytes_in = stage->bytes_out = stage->busy_ns = stage->wait_ns = stage->allocations = 0;
+}
+
+static void sum_worker_counters(PipeStage* stage) {
+    for (std::uint32_t w = 0; stage->workers && w < stage->worker_count; ++w) {
+        const PipeStage* worker = &stage->workers[w];
+        stage->batches += worker->batches;
+        stage->docs_in += worker->docs_in;
+        stage->docs_out += worker->docs_out;
+        stage->bytes_in += worker->bytes_in;
+        stage->bytes_out += worker->bytes_out;
+        stage->busy_ns += worker->busy_ns;
+        stage->wait_ns += worker->wait_ns;
+        stage->allocations += worker->allocations;
+    }
+}
+
+struct PipeRun {
+    PipeStage* stages;
+    std::uint32_t count;
+    SpscRing* rings;         /* into stage i from worker v of the stage before it to its worker w: see ring_into */
+    std::uint32_t* ring_base; /* index of stage i's first ring; stage 0's rings bring batches back from the last */
+    std::uint32_t widest;           /* the most workers any stage has */
+    std::atomic<std::uint64_t> end; /* once the source is done: one past the sequence number of its last batch */
+    std::atomic<int> failed;
+};
+
+struct PipeWorker {
+    PipeRun* run;
+    std::uint32_t index;
+    std::uint32_t worker;
+};
+
+static SpscRing* ring_into(PipeRun* run, std::uint32_t i, std::uint32_t from, std::uint32_t to) {
+    return &run->rings[run->ring_base[i] + from * stage_width(&run->stages[i]) + to];
+}
+
+/*
+ * Worker w of a stage with n workers runs batches w, w + n, ... of the run.
+ * The source ends it with as many empty last batches as the widest stage
+ * has workers, so that every worker is sent one, and a worker stops after
+ * the last batch it is sent.
+ */
+static void* stage_loop(void* arg) {
+    PipeWorker* worker = static_cast<PipeWorker*>(arg);
+    PipeRun* run = worker->run;
+    std::uint32_t i = worker->index;
+    std::uint32_t w = worker->worker;
+    PipeStage* stage = stage_unit(&run->stages[i], w);
+    std::uint32_t width = stage_width(&run->stages[i]);
+    std::uint32_t prev = (i == 0) ? run->count - 1 : i - 1;
+    std::uint32_t next = (i + 1 == run->count) ? 0 : i + 1;
+    std::uint32_t prev_width = stage_width(&run->stages[prev]);
+    std::uint32_t next_width = stage_width(&run->stages[next]);
+    for (std::uint64_t k = w;; k += width) {
+        DocBatch* batch = static_cast<DocBatch*>(spsc_ring_pop(ring_into(run, i, k % prev_width, w), &stage->wait_ns));
+        if (i == 0) {
+            batch->text.len = 0;
+            batch->next.len = 0;
+            batch->docs = 0;
+            if (run->end.load(std::memory_order_relaxed) > 0) {
+                batch->last = 1; /* one of the extra last batches for the other workers */
+            } else {
+                run_stage(stage, batch, 1, &run->failed);
+                if (batch->last) {
+                    run->end.store(k + run->widest, std::memory_order_relaxed);
+                }
+            }
+        } else {
+            run_stage(stage, batch, 0, &run->failed);
+        }
+        int last = batch->last;
+        spsc_ring_push(ring_into(run, next, w, static_cast<std::uint32_t>(k % next_width)), batch, &stage->wait_ns);
+        /* the ring that brought a last batch made the source's store of end visible */
+        if (last && k + width >= run->end.load(std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+static int run_inline(PipeStage* stages, std::uint32_t count) {
+    DocBatch batch{};
+    std::atomic<int> failed(0);
+    for (std::uint64_t k = 0; !batch.last; ++k) {
+        batch.text.len = 0;
+        batch.next.len = 0;
+        batch.docs = 0;
+        for (std::uint32_t i = 0; i < count; ++i) {
+            run_stage(stage_unit(&stages[i], k), &batch, i == 0, &failed);
+        }
+    }
+    std::free(batch.text.data);
+    std::free(batch.next.data);
+    return !failed.load();
+}
+
+PipeStage pipe_stage(const char* name, PipeStageFn run, void* ctx) {
+    PipeStage stage{};
+    stage.name = name;
+    stage.run = run;
+    stage.ctx = ctx;
+    return stage;
+}
+
+PipeStage pipe_stage_workers(const char* name, PipeStage* workers, std::uint32_t count) {
+    PipeStage stage{};
+    stage.name = name;
+    stage.workers = workers;
+    stage.worker_count = count;
+    return stage;
+}
+
+int pipeline_threads_default() {
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+static int run_threads(PipeStage* stages, std::uint32_t count) {
+    /* Two batches per worker: one being worked on, one waiting in an input ring. */
+    std::uint32_t ring_count = 0;
+    std::uint32_t thread_count = 0;
+    std::uint32_t widest = 1;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        ring_count += stage_width(&stages[(i == 0) ? count - 1 : i - 1]) * stage_width(&stages[i]);
+        thread_count += stage_width(&stages[i]);
+        widest = (stage_width(&stages[i]) > widest) ? stage_width(&stages[i]) : widest;
+    }
+    std::uint32_t batch_count = thread_count * 2;
+    PipeRun run;
+    run.stages = stages;
+    run.count = count;
+    run.widest = widest;
+    run.end.store(0);
+    run.failed.store(0);
+    run.rings = static_cast<SpscRing*>(std::calloc(ring_count, sizeof(SpscRing)));
+    run.ring_base = static_cast<std::uint32_t*>(std::calloc(count, sizeof(std::uint32_t)));
+    DocBatch* batches = static_cast<DocBatch*>(std::calloc(batch_count, sizeof(DocBatch)));
+    PipeWorker* workers = static_cast<PipeWorker*>(std::calloc(thread_count, sizeof(PipeWorker)));
+    pthread_t* threads = static_cast<pthread_t*>(std::calloc(thread_count, sizeof(pthread_t)));
+    int ok = run.rings && run.ring_base && batches && workers && threads;
+    std::uint32_t base = 0;
+    for (std::uint32_t i = 0; ok && i < count; ++i) {
+        run.ring_base[i] = base;
+        base += stage_width(&stages[(i == 0) ? count - 1 : i - 1]) * stage_width(&stages[i]);
+    }
+    /* Every ring can hold every batch, so a push never waits for a worker that has stopped. */
+    for (std::uint32_t r = 0; ok && r < ring_count; ++r) {
+        ok = spsc_ring_init(&run.rings[r], batch_count);
+    }
+    if (!ok) {
+        std::fprintf(stderr, "Failed to allocate pipeline\n");
+    }
+    std::uint64_t unused = 0;
+    std::uint32_t last_width = stage_width(&stages[count - 1]);
+    for (std::uint32_t b = 0; ok && b < batch_count; ++b) {
+        spsc_ring_push(ring_into(&run, 0, b % last_width, 0), &batches[b], &unused);
+    }
+
+    std::uint32_t t = 0;
+    for (std::uint32_t i = 0; ok && i < count; ++i) {
+        for (std::uint32_t w = 0; w < stage_width(&stages[i]); ++w) {
+            workers[t++] = PipeWorker{&run, i, w};
+        }
+    }
+    std::uint32_t started = 1;
+    for (; ok && started < thread_count; ++started) {
+        if (pthread_create(&threads[started], nullptr, stage_loop, &workers[started]) != 0) {
+            std::fprintf(stderr, "Failed to start pipeline stage %s\n", stages[workers[started].index].name);
+            /* The source only sends empty last batches now; workers already running pass them on and stop. */
+            run.failed.store(1);
+            break;
+        }
+    }
+    if (ok) {
+        stage_loop(&workers[0]);
+        for (std::uint32_t s = 1; s < started; ++s) {
+            pthread_join(threads[s], nullptr);
+        }
+    }
+
+    for (std::uint32_t b = 0; batches && b < batch_count; ++b) {
+        std::free(batches[b].text.data);
+        std::free(batches[b].next.data);
+    }
+    for (std::uint32_t r = 0; run.rings && r < ring_count; ++r) {
+        spsc_ring_free(&run.rings[r]);
+    }
+    std::free(run.rings);
+    std::free(run.ring_base);
+    std::free(batches);
+    std::free(workers);
+    std::free(threads);
+    return ok && !run.failed.load();
+}
+
+int pipeline_run(PipeStage* stages, std::uint32_t count, int threaded) {
+    if (count > 0 && stages[0].workers) {
+        std::fprintf(stderr, "Pipeline source %s cannot have workers\n", stages[0].name);
+        return 0;
+    }
+    for (std::uint32_t i = 0; i < count; ++i) {
+        reset_counters(&stages[i]);
+        for (std::uint32_t w = 0; stages[i].workers && w < stages[i].worker_count; ++w) {
+            reset_counters(&stages[i].workers[w]);
+        }
+    }
+    int ok = (!threaded || count < 2) ? run_inline(stages, count) : run_threads(stages, count);
+    for (std::uint32_t i = 0; i < count; ++i) {
+        sum_worker_counters(&stages[i]);
+    }
+    return ok;
+}
+
+static void print_stage(FILE* out, const PipeStage* s, const char* name, int is_source) {
+    double busy = static_cast<double>(s->busy_ns) / 1e9;
+    std::uint64_t bytes = is_source ? s->bytes_out : s->bytes_in; /* a source takes no input */
+    double mb_per_s = (busy > 0.0) ? static_cast<double>(bytes) / (1024.0 * 1024.0) / busy : 0.0;
+    std::fprintf(out,
+                 "stage=%s batches=%llu docs_in=%llu docs_out=%llu bytes_in=%llu bytes_out=%llu "
+                 "busy_seconds=%.3f wait_seconds=%.3f mb_per_second=%.1f buffer_allocations=%llu\n",
+                 name, static_cast<unsigned long long>(s->batches), static_cast<unsigned long long>(s->docs_in),
+                 static_cast<unsigned long long>(s->docs_out), static_cast<unsigned long long>(s->bytes_in),
+                 static_cast<unsigned long long>(s->bytes_out), busy, static_cast<double>(s->wait_ns) / 1e9, mb_per_s,
+                 static_cast<unsigned long long>(s->allocations));
+}
+
+void pipeline_print_stats(FILE* out, const PipeStage* stages, std::uint32_t count) {
+    for (std::uint32_t i = 0; i < count; ++i) {
+        const PipeStage* s = &stages[i];
+        print_stage(out, s, s->name, i == 0);
+        if (!s->workers) {
+            continue;
+        }
+        std::uint64_t busiest = 0;
+        for (std::uint32_t w = 0; w < s->worker_count; ++w) {
+            char name[256];
+            std::snprintf(name, sizeof(name), "%s.%u", s->name, w);
+            print_stage(out, &s->workers[w], name, 0);
+            busiest = (s->workers[w].busy_ns > busiest) ? s->workers[w].busy_ns : busiest;
+        }
+        double mean = static_cast<double>(s->busy_ns) / s->worker_count;
+        std::fprintf(out, "stage=%s workers=%u busiest_seconds=%.3f mean_busy_seconds=%.3f imbalance=%.3f\n", s->name,
+                     s->worker_count, static_cast<double>(busiest) / 1e9, mean / 1e9,
+                     (mean > 0.0) ? static_cast<double>(busiest) / mean : 1.0);
+    }
+}
+
+static std::uint64_t count_lines(const char* p, std::size_t len) {
+    std::uint64_t n = 0;
+    const char* end = p + len;
+    while (p < end && (p = static_cast<const char*>(std::memchr(p, '\n', static_cast<std::size_t>(end - p))))) {
+        ++n;
+        ++p;
+    }
+    return n;
+}
+
+int line_source_open(LineSource* src, const char* path) {
+    return line_reader_open(&src->reader, path, LINE_READER_AUTO);
+}
+
+void line_source_close(LineSource* src) {
+    line_reader_close(&src->reader);
+}
+
+int line_source_run(void* ctx, DocBatch* batch) {
+    LineSource* src = static_cast<LineSource*>(ctx);
+    PipeBuf* text = &batch->text;
+    text->len = 0;
+    LineView block;
+    if (line_reader_next_block(&src->reader, PIPE_BATCH_BYTES, &block)) {
+        if (!pipe_buf_reserve(text, block.len + 1)) {
+            std::fprintf(stderr, "Failed to allocate pipeline batch\n");
+            return 0;
+        }
+        std::memcpy(text->data, block.data, block.len);
+        text->len = block.len;
+        if (text->data[text->len - 1] != '\n') {
+            text->data[text->len++] = '\n';
+        }
+    } else if (src->reader.error) {
+        std::fprintf(stderr, "Failed to read input\n");
+        return 0;
+    }
+    batch->docs = count_lines(text->data, text->len);
+    batch->last = line_reader_done(&src->reader);
+    return 1;
+}
+
+int line_sink_run(void* ctx, DocBatch* batch) {
+    LineSink* sink = static_cast<LineSink*>(ctx);
+    if (batch->text.len > 0 && std::fwrite(batch->text.data, 1, batch->text.len, sink->out) != batch->text.len) {
+        std::fprintf(stderr, "Failed to write output\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "line_reader.h"
+
+/*
+ * Staged document pipeline. A source stage fills batches of whole lines,
+ * every later stage rewrites or consumes them in order, and the last one
+ * hands each batch back to the source. With threads every stage runs on its
+ * own thread and consecutive stages are joined by bounded single-producer /
+ * single-consumer rings, so a stage that gets ahead blocks on a full ring
+ * (backpressure) instead of growing a queue. Inline, one batch goes through
+ * every stage in turn on the calling thread. Either way the output is the
+ * same; only the overlap differs.
+ *
+ * A stage other than the source can also be run by several workers, each
+ * with its own context and thread: batch k of the run goes to worker
+ * k % workers. Every worker of one stage has a ring to every worker of the
+ * next, and a worker takes its batches in sequence order from the ring of
+ * the worker that produced each one, so batches still leave every stage in
+ * the order the source made them.
+ */
+
+const std::size_t PIPE_BATCH_BYTES = 256 * 1024; /* lines a source puts in one batch, unless a line is longer */
+
+/* Lock-free ring of pointers between one producer and one consumer thread. */
+struct SpscRing {
+    void** slots;
+    std::uint64_t mask; /* capacity - 1, capacity a power of two */
+    char pad0[64];
+    std::atomic<std::uint64_t> head; /* next slot to pop; written by the consumer */
+    std::uint64_t cached_tail;       /* consumer's last look at tail */
+    char pad1[64];
+    std::atomic<std::uint64_t> tail; /* next slot to push; written by the producer */
+    std::uint64_t cached_head;       /* producer's last look at head */
+    char pad2[64];
+};
+
+int spsc_ring_init(SpscRing* ring, std::uint64_t capacity);
+void spsc_ring_free(SpscRing* ring);
+
+/* Block while the ring is full (empty), adding the time spent waiting to *wait_ns. */
+void spsc_ring_push(SpscRing* ring, void* item, std::uint64_t* wait_ns);
+void* spsc_ring_pop(SpscRing* ring, std::uint64_t* wait_ns);
+
+/* Growable byte buffer. */
+struct PipeBuf {
+    char* data;
+    std::size_t len;
+    std::size_t cap;
+};
+
+int pipe_buf_reserve(PipeBuf* buf, std::size_t extra);
+
+/*
+ * A run of whole lines, each ending in '\n', back to back in text. A stage
+ * that rewrites lines appends the new ones to next and calls
+ * doc_batch_swap.
+ */
+struct DocBatch {
+    PipeBuf text;
+    PipeBuf next;
+    std::uint64_t docs; /* lines in text */
+    int last;           /* set by the source on the final batch, which may be empty */
+};
+
+void doc_batch_swap(DocBatch* batch);
+
+/* Returns 0 on failure, after printing why; the pipeline then drains and stops. */
+typedef int (*PipeStageFn)(void* ctx, DocBatch* batch);
+
+struct PipeStage {
+    const char* name;
+    PipeStageFn run;
+    void* ctx;
+    PipeStage* workers; /* a stage run by worker_count workers, see pipe_stage_workers; otherwise null */
+    std::uint32_t worker_count;
+
+    /* Set by pipeline_run. in is what the stage was given, out what it passed on. */
+    std::uint64_t batches;
+    std::uint64_t docs_in;
+    std::uint64_t docs_out;
+    std::uint64_t bytes_in;
+    std::uint64_t bytes_out;
+    std::uint64_t busy_ns;
+    std::uint64_t wait_ns;     /* blocked on an empty input ring or a full output ring */
+    std::uint64_t allocations; /* batch buffers grown; these stop once the buffers fit the largest batch */
+};
+
+/* A stage with its counters zeroed. */
+PipeStage pipe_stage(const char* name, PipeStageFn run, void* ctx);
+
+/*
+ * A stage run by workers[0, count), pipe_stage()s with their own contexts;
+ * with threads each one gets a thread. A worker's counters are its own and
+ * the stage's are their sums. Not for the source.
+ */
+PipeStage pipe_stage_workers(const char* name, PipeStage* workers, std::uint32_t count);
+
+/* Threads pay off once there is more than one core to put them on. */
+int pipeline_threads_default();
+
+/* Runs stages[0] (the source) to the end of its input through the rest. Returns 0 when a stage failed. */
+int pipeline_run(PipeStage* stages, std::uint32_t count, int threaded);
+
+/*
+ * One stats line per stage: counts, busy and waiting time, input throughput
+ * while busy and buffer allocations. A stage with workers also gets one such
+ * line per worker and a line with its imbalance, the busiest worker's busy
+ * time over the mean (1 is even).
+ */
+void pipeline_print_stats(FILE* out, const PipeStage* stages, std::uint32_t count);
+
+/* Source stage: reads a file into batches of whole lines; a last line without '\n' gets one. */
+struct LineSource {
+    LineReader reader;
+};
+
+/* Returns 0 with errno set when path cannot be opened. */
+int line_source_open(LineSource* src, const char* path);
+void line_source_close(LineSource* src);
+int line_source_run(void* ctx, DocBatch* batch);
+
+/* Sink stage: writes the lines out. */
+struct LineSink {
+    FILE* out;
+};
+
+int line_sink_run(void* ctx, DocBatch* batch);
@@ -0,0 +1,609 @@
+#include "roaring.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static size_t align8(size_t v) {
+    return (v + 7) & ~static_cast<size_t>(7);
+}
+
+/* Per-operation work space: two expanded operands, one result bitmap and a value buffer. */
+struct RoaringScratch {
+    std::uint64_t a[ROARING_BITMAP_WORDS];
+    std::uint64_t b[ROARING_BITMAP_WORDS];
+    std::uint64_t r[ROARING_BITMAP_WORDS];
+    std::uint16_t vals[2 * ROARING_ARRAY_MAX];
+};
+
+size_t roaring_codec_max_bytes(std::uint32_t count) {
+    /* At most one container per id, and the chosen payload is never larger than the array form. */
+    return sizeof(RoaringListHeader) + static_cast<size_t>(count) * (sizeof(RoaringRecord) + 2 + 7);
+}
+
+static std::uint32_t chunk_end(const std::uint32_t* ids, std::uint32_t count, std::uint32_t start) {
+    std::uint32_t key = ids[start] >> 16;
+    std::uint32_t end = start + 1;
+    while (end < count && (ids[end] >> 16) == key) {
+        ++end;
+    }
+    return end;
+}
+
+static void set_range(std::uint64_t* words, std::uint32_t first, std::uint32_t last) {
+    std::uint32_t fw = first >> 6;
+    std::uint32_t lw = last >> 6;
+    std::uint64_t first_mask = ~0ULL << (first & 63);
+    std::uint64_t last_mask = ~0ULL >> (63 - (last & 63));
+    if (fw == lw) {
+        words[fw] |= first_mask & last_mask;
+        return;
+    }
+    words[fw] |= first_mask;
+    for (std::uint32_t w = fw + 1; w < lw; ++w) {
+        words[w] = ~0ULL;
+    }
+    words[lw] |= last_mask;
+}
+
+size_t roaring_codec_encode(const std::uint32_t* ids, std::uint32_t count, unsigned char* out) {
+    RoaringListHeader header{};
+    for (std::uint32_t s = 0; s < count; s = chunk_end(ids, count, s)) {
+        header.container_count++;
+    }
+    std::memcpy(out, &header, sizeof(header));
+    unsigned char* records = out + sizeof(header);
+    unsigned char* payload = records + header.container_count * sizeof(RoaringRecord);
+
+    size_t pos = 0;
+    std::uint32_t c = 0;
+    for (std::uint32_t s = 0; s < count; ++c) {
+        std::uint32_t e = chunk_end(ids, count, s);
+        std::uint32_t n = e - s;
+        std::uint32_t runs = 1;
+        for (std::uint32_t i = s + 1; i < e; ++i) {
+            if (ids[i] != ids[i - 1] + 1) {
+                ++runs;
+            }
+        }
+
+        RoaringRecord rec{};
+        rec.key = static_cast<std::uint16_t>(ids[s] >> 16);
+        rec.cardinality = n;
+        rec.offset = static_cast<std::uint32_t>(pos);
+        size_t array_bytes = 2 * static_cast<size_t>(n);
+        size_t run_bytes = 4 * static_cast<size_t>(runs);
+        size_t bitmap_bytes = ROARING_BITMAP_WORDS * 8;
+        unsigned char* dst = payload + pos;
+        if (run_bytes < array_bytes && run_bytes < bitmap_bytes) {
+            rec.type = ROARING_RUN;
+            rec.runs = runs;
+            std::uint16_t pair[2] = {static_cast<std::uint16_t>(ids[s]), 0};
+            for (std::uint32_t i = s + 1; i <= e; ++i) {
+                if (i == e || ids[i] != ids[i - 1] + 1) {
+                    pair[1] = static_cast<std::uint16_t>(ids[i - 1] - (ids[s] & 0xFFFF0000U) - pair[0]);
+                    std::memcpy(dst, pair, sizeof(pair));
+                    dst += sizeof(pair);
+                    if (i < e) {
+                        pair[0] = static_cast<std::uint16_t>(ids[i]);
+                    }
+                }
+            }
+            pos += run_bytes;
+        } else if (array_bytes <= bitmap_bytes) {
+            rec.type = ROARING_ARRAY;
+            for (std::uint32_t i = s; i < e; ++i) {
+                std::uint16_t low = static_cast<std::uint16_t>(ids[i]);
+                std::memcpy(dst + 2 * (i - s), &low, sizeof(low));
+            }
+            pos += array_bytes;
+        } else {
+            rec.type = ROARING_BITMAP;
+            std::uint64_t words[ROARING_BITMAP_WORDS];
+            std::memset(words, 0, sizeof(words));
+            for (std::uint32_t i = s; i < e; ++i) {
+                std::uint32_t low = ids[i] & 0xFFFFU;
+                words[low >> 6] |= 1ULL << (low & 63);
+            }
+            std::memcpy(dst, words, sizeof(words));
+            pos += bitmap_bytes;
+        }
+        while (pos % 8 != 0) {
+            payload[pos++] = 0;
+        }
+        std::memcpy(records + c * sizeof(RoaringRecord), &rec, sizeof(rec));
+        s = e;
+    }
+    return align8(static_cast<size_t>(payload - out) + pos);
+}
+
+static int push_container(RoaringSet* set, const RoaringContainer& c) {
+    if (set->count >= set->cap) {
+        std::uint32_t new_cap = (set->cap == 0) ? 4 : set->cap * 2;
+        RoaringContainer* grown =
+            static_cast<RoaringContainer*>(std::realloc(set->containers, sizeof(RoaringContainer) * new_cap));
+        if (!grown) {
+            return 0;
+        }
+        set->containers = grown;
+        set->cap = new_cap;
+    }
+    set->containers[set->count++] = c;
+    set->cardinality += c.cardinality;
+    return 1;
+}
+
+static size_t payload_bytes(const RoaringContainer* c) {
+    if (c->type == ROARING_BITMAP) {
+        return ROARING_BITMAP_WORDS * 8;
+    }
+    if (c->type == ROARING_RUN) {
+        return 4 * static_cast<size_t>(c->runs);
+    }
+    return 2 * static_cast<size_t>(c->cardinality);
+}
+
+/* Adds a container to a result: borrowed payloads are shared, owned ones are copied. */
+static int emit_shared(RoaringSet* out, const RoaringContainer* c) {
+    if (!c->owned) {
+        return push_container(out, *c);
+    }
+    size_t bytes = payload_bytes(c);
+    void* data = std::malloc(bytes);
+    if (!data) {
+        return 0;
+    }
+    std::memcpy(data, c->data, bytes);
+    RoaringContainer copy = *c;
+    copy.data = data;
+    if (!push_container(out, copy)) {
+        std::free(data);
+        return 0;
+    }
+    return 1;
+}
+
+static int emit_bitmap(RoaringSet* out, std::uint16_t key, const std::uint64_t* words, std::uint32_t card) {
+    if (card == 0) {
+        return 1;
+    }
+    RoaringContainer c{key, ROARING_BITMAP, 1, card, 0, nullptr};
+    if (card <= ROARING_ARRAY_MAX) {
+        std::uint16_t* vals = static_cast<std::uint16_t*>(std::malloc(sizeof(std::uint16_t) * card));
+        if (!vals) {
+            return 0;
+        }
+        std::uint32_t k = 0;
+        for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+            std::uint64_t word = words[w];
+            while (word) {
+                vals[k++] = static_cast<std::uint16_t>((w << 6) + static_cast<std::uint32_t>(__builtin_ctzll(word)));
+                word &= word - 1;
+            }
+        }
+        c.type = ROARING_ARRAY;
+        c.data = vals;
+    } else {
+        void* copy = std::malloc(ROARING_BITMAP_WORDS * 8);
+        if (!copy) {
+            return 0;
+        }
+        std::memcpy(copy, words, ROARING_BITMAP_WORDS * 8);
+        c.data = copy;
+    }
+    if (!push_container(out, c)) {
+        std::free(const_cast<void*>(c.data));
+        return 0;
+    }
+    return 1;
+}
+
+static int emit_array(RoaringSet* out, std::uint16_t key, const std::uint16_t* vals, std::uint32_t card,
+                      std::uint64_t* scratch_words) {
+    if (card == 0) {
+        return 1;
+    }
+    if (card > ROARING_ARRAY_MAX) {
+        std::memset(scratch_words, 0, ROARING_BITMAP_WORDS * 8);
+        for (std::uint32_t i = 0; i < card; ++i) {
+            scratch_words[vals[i] >> 6] |= 1ULL << (vals[i] & 63);
+        }
+        return emit_bitmap(out, key, scratch_words, card);
+    }
+    std::uint16_t* copy = static_cast<std::uint16_t*>(std::malloc(sizeof(std::uint16_t) * card));
+    if (!copy) {
+        return 0;
+    }
+    std::memcpy(copy, vals, sizeof(std::uint16_t) * card);
+    RoaringContainer c{key, ROARING_ARRAY, 1, card, 0, copy};
+    if (!push_container(out, c)) {
+        std::free(copy);
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns the container as a bitmap, expanding arrays and runs into scratch. */
+static const std::uint64_t* as_bitmap(const RoaringContainer* c, std::uint64_t* scratch) {
+    if (c->type == ROARING_BITMAP) {
+        return static_cast<const std::uint64_t*>(c->data);
+    }
+    std::memset(scratch, 0, ROARING_BITMAP_WORDS * 8);
+    if (c->type == ROARING_RUN) {
+        const std::uint16_t* runs = static_cast<const std::uint16_t*>(c->data);
+        for (std::uint32_t r = 0; r < c->runs; ++r) {
+            set_range(scratch, runs[2 * r], static_cast<std::uint32_t>(runs[2 * r]) + runs[2 * r + 1]);
+        }
+    } else {
+        const std::uint16_t* vals = static_cast<const std::uint16_t*>(c->data);
+        for (std::uint32_t i = 0; i < c->cardinality; ++i) {
+            scratch[vals[i] >> 6] |= 1ULL << (vals[i] & 63);
+        }
+    }
+    return scratch;
+}
+
+static int bit_test(const std::uint64_t* words, std::uint16_t v) {
+    return static_cast<int>((words[v >> 6] >> (v & 63)) & 1);
+}
+
+static int and_containers(const RoaringContainer* a, const RoaringContainer* b, RoaringSet* out,
+                          RoaringScratch* s) {
+    std::uint32_t k = 0;
+    if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY) {
+        const std::uint16_t* x = static_cast<const std::uint16_t*>(a->data);
+        const std::uint16_t* y = static_cast<const std::uint16_t*>(b->data);
+        std::uint32_t i = 0, j = 0;
+        while (i < a->cardinality && j < b->cardinality) {
+            if (x[i] == y[j]) {
+                s->vals[k++] = x[i];
+                ++i;
+                ++j;
+            } else if (x[i] < y[j]) {
+                ++i;
+            } else {
+                ++j;
+            }
+        }
+        return emit_array(out, a->key, s->vals, k, s->r);
+    }
+    if (a->type == ROARING_ARRAY || b->type == ROARING_ARRAY) {
+        const RoaringContainer* arr = (a->type == ROARING_ARRAY) ? a : b;
+        const std::uint64_t* bits = as_bitmap((arr == a) ? b : a, s->a);
+        const std::uint16_t* x = static_cast<const std::uint16_t*>(arr->data);
+        for (std::uint32_t i = 0; i < arr->cardinality; ++i) {
+            if (bit_test(bits, x[i])) {
+                s->vals[k++] = x[i];
+            }
+        }
+        return emit_array(out, a->key, s->vals, k, s->r);
+    }
+    const std::uint64_t* x = as_bitmap(a, s->a);
+    const std::uint64_t* y = as_bitmap(b, s->b);
+    for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+        s->r[w] = x[w] & y[w];
+        k += static_cast<std::uint32_t>(__builtin_popcountll(s->r[w]));
+    }
+    return emit_bitmap(out, a->key, s->r, k);
+}
+
+static int or_containers(const RoaringContainer* a, const RoaringContainer* b, RoaringSet* out, RoaringScratch* s) {
+    std::uint32_t k = 0;
+    if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY) {
+        const std::uint16_t* x = static_cast<const std::uint16_t*>(a->data);
+        const std::uint16_t* y = static_cast<const std::uint16_t*>(b->data);
+        std::uint32_t i = 0, j = 0;
+        while (i < a->cardinality && j < b->cardinality) {
+            if (x[i] == y[j]) {
+                s->vals[k++] = x[i];
+                ++i;
+                ++j;
+            } else if (x[i] < y[j]) {
+                s->vals[k++] = x[i++];
+            } else {
+                s->vals[k++] = y[j++];
+            }
+        }
+        while (i < a->cardinality) {
+            s->vals[k++] = x[i++];
+        }
+        while (j < b->cardinality) {
+            s->vals[k++] = y[j++];
+        }
+        return emit_array(out, a->key, s->vals, k, s->r);
+    }
+    const RoaringContainer* dense = (a->type == ROARING_ARRAY) ? b : a;
+    const RoaringContainer* other = (dense == a) ? b : a;
+    std::memcpy(s->r, as_bitmap(dense, s->a), ROARING_BITMAP_WORDS * 8);
+    if (other->type == ROARING_ARRAY) {
+        const std::uint16_t* y = static_cast<const std::uint16_t*>(other->data);
+        for (std::uint32_t i = 0; i < other->cardinality; ++i) {
+            s->r[y[i] >> 6] |= 1ULL << (y[i] & 63);
+        }
+    } else {
+        const std::uint64_t* y = as_bitmap(other, s->b);
+        for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+            s->r[w] |= y[w];
+        }
+    }
+    for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+        k += static_cast<std::uint32_t>(__builtin_popcountll(s->r[w]));
+    }
+    return emit_bitmap(out, a->key, s->r, k);
+}
+
+static int andnot_containers(const RoaringContainer* a, const RoaringContainer* b, RoaringSet* out,
+                             RoaringScratch* s) {
+    std::uint32_t k = 0;
+    if (a->type == ROARING_ARRAY) {
+        const std::uint16_t* x = static_cast<const std::uint16_t*>(a->data);
+        if (b->type == ROARING_ARRAY) {
+            const std::uint16_t* y = static_cast<const std::uint16_t*>(b->data);
+            std::uint32_t i = 0, j = 0;
+            while (i < a->cardinality) {
+                if (j >= b->cardinality || x[i] < y[j]) {
+                    s->vals[k++] = x[i++];
+                } else if (x[i] == y[j]) {
+                    ++i;
+                    ++j;
+                } else {
+                    ++j;
+                }
+            }
+        } else {
+            const std::uint64_t* bits = as_bitmap(b, s->b);
+            for (std::uint32_t i = 0; i < a->cardinality; ++i) {
+                if (!bit_test(bits, x[i])) {
+                    s->vals[k++] = x[i];
+                }
+            }
+        }
+        return emit_array(out, a->key, s->vals, k, s->r);
+    }
+    std::memcpy(s->r, as_bitmap(a, s->a), ROARING_BITMAP_WORDS * 8);
+    if (b->type == ROARING_ARRAY) {
+        const std::uint16_t* y = static_cast<const std::uint16_t*>(b->data);
+        for (std::uint32_t i = 0; i < b->cardinality; ++i) {
+            s->r[y[i] >> 6] &= ~(1ULL << (y[i] & 63));
+        }
+    } else {
+        const std::uint64_t* y = as_bitmap(b, s->b);
+        for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+            s->r[w] &= ~y[w];
+        }
+    }
+    for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+        k += static_cast<std::uint32_t>(__builtin_popcountll(s->r[w]));
+    }
+    return emit_bitmap(out, a->key, s->r, k);
+}
+
+int roaring_view(const unsigned char* data, RoaringSet* out) {
+    RoaringListHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    const unsigned char* records = data + sizeof(header);
+    const unsigned char* payload = records + header.container_count * sizeof(RoaringRecord);
+
+    std::memset(out, 0, sizeof(*out));
+    if (header.container_count == 0) {
+        return 1;
+    }
+    out->containers = static_cast<RoaringContainer*>(std::malloc(sizeof(RoaringContainer) * header.container_count));
+    if (!out->containers) {
+        return 0;
+    }
+    out->cap = header.container_count;
+    for (std::uint32_t i = 0; i < header.container_count; ++i) {
+        RoaringRecord rec;
+        std::memcpy(&rec, records + i * sizeof(RoaringRecord), sizeof(rec));
+        RoaringContainer c{rec.key, rec.type, 0, rec.cardinality, rec.runs, payload + rec.offset};
+        push_container(out, c);
+    }
+    return 1;
+}
+
+int roaring_from_sorted(const std::uint32_t* ids, std::uint32_t count, RoaringSet* out) {
+    std::memset(out, 0, sizeof(*out));
+    for (std::uint32_t s = 0; s < count;) {
+        std::uint32_t e = chunk_end(ids, count, s);
+        std::uint32_t n = e - s;
+        std::uint16_t key = static_cast<std::uint16_t>(ids[s] >> 16);
+        RoaringContainer c{key, ROARING_ARRAY, 1, n, 0, nullptr};
+        if (n <= ROARING_ARRAY_MAX) {
+            std::uint16_t* vals = static_cast<std::uint16_t*>(std::malloc(sizeof(std::uint16_t) * n));
+            if (!vals) {
+                roaring_free(out);
+                return 0;
+            }
+            for (std::uint32_t i = s; i < e; ++i) {
+                vals[i - s] = static_cast<std::uint16_t>(ids[i]);
+            }
+            c.data = vals;
+        } else {
+            std::uint64_t* words = static_cast<std::uint64_t*>(std::calloc(ROARING_BITMAP_WORDS, 8));
+            if (!words) {
+                roaring_free(out);
+                return 0;
+            }
+            for (std::uint32_t i = s; i < e; ++i) {
+                std::uint32_t low = ids[i] & 0xFFFFU;
+                words[low >> 6] |= 1ULL << (low & 63);
+            }
+            c.type = ROARING_BITMAP;
+            c.data = words;
+        }
+        if (!push_container(out, c)) {
+            std::free(const_cast<void*>(c.data));
+            roaring_free(out);
+            return 0;
+        }
+        s = e;
+    }
+    return 1;
+}
+
+int roaring_copy(const RoaringSet* set, RoaringSet* out) {
+    std::memset(out, 0, sizeof(*out));
+    for (std::uint32_t i = 0; i < set->count; ++i) {
+        if (!emit_shared(out, &set->containers[i])) {
+            roaring_free(out);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* op: 0 = and, 1 = or, 2 = and-not */
+static int combine(const RoaringSet* a, const RoaringSet* b, RoaringSet* out, int op) {
+    std::memset(out, 0, sizeof(*out));
+    RoaringScratch* s = static_cast<RoaringScratch*>(std::malloc(sizeof(RoaringScratch)));
+    if (!s) {
+        return 0;
+    }
+    std::uint32_t i = 0, j = 0;
+    int ok = 1;
+    while (ok && (i < a->count || j < b->count)) {
+        if (op == 0 && (i >= a->count || j >= b->count)) {
+            break;
+        }
+        const RoaringContainer* x = (i < a->count) ? &a->containers[i] : nullptr;
+        const RoaringContainer* y = (j < b->count) ? &b->containers[j] : nullptr;
+        if (x && y && x->key == y->key) {
+            if (op == 0) {
+                ok = and_containers(x, y, out, s);
+            } else if (op == 1) {
+                ok = or_containers(x, y, out, s);
+            } else {
+                ok = andnot_containers(x, y, out, s);
+            }
+            ++i;
+            ++j;
+        } else if (x && (!y || x->key < y->key)) {
+            if (op != 0) {
+                ok = emit_shared(out, x);
+            }
+            ++i;
+        } else {
+            if (op == 1) {
+                ok = emit_shared(out, y);
+            }
+            ++j;
+        }
+    }
+    std::free(s);
+    if (!ok) {
+        roaring_free(out);
+    }
+    return ok;
+}
+
+int roaring_and(const RoaringSet* a, const RoaringSet* b, RoaringSet* out) {
+    return combine(a, b, out, 0);
+}
+
+int roaring_or(const RoaringSet* a, const RoaringSet* b, RoaringSet* out) {
+    return combine(a, b, out, 1);
+}
+
+int roaring_andnot(const RoaringSet* a, const RoaringSet* b, RoaringSet* out) {
+    return combine(a, b, out, 2);
+}
+
+std::uint64_t roaring_rank(const RoaringSet* set, std::uint32_t value) {
+    std::uint64_t rank = 0;
+    std::uint32_t key = value >> 16;
+    std::uint32_t low = value & 0xFFFFU;
+    for (std::uint32_t c = 0; c < set->count && set->containers[c].key <= key; ++c) {
+        const RoaringContainer* ct = &set->containers[c];
+        if (ct->key < key) {
+            rank += ct->cardinality;
+        } else if (ct->type == ROARING_ARRAY) {
+            const std::uint16_t* vals = static_cast<const std::uint16_t*>(ct->data);
+            std::uint32_t lo = 0, hi = ct->cardinality;
+            while (lo < hi) {
+                std::uint32_t mid = lo + (hi - lo) / 2;
+                if (vals[mid] <= low) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            rank += lo;
+        } else if (ct->type == ROARING_RUN) {
+            const std::uint16_t* runs = static_cast<const std::uint16_t*>(ct->data);
+            for (std::uint32_t r = 0; r < ct->runs && runs[2 * r] <= low; ++r) {
+                std::uint32_t last = static_cast<std::uint32_t>(runs[2 * r]) + runs[2 * r + 1];
+                rank += ((last < low) ? last : low) - runs[2 * r] + 1;
+            }
+        } else {
+            const std::uint64_t* words = static_cast<const std::uint64_t*>(ct->data);
+            for (std::uint32_t w = 0; w < (low >> 6); ++w) {
+                rank += static_cast<std::uint64_t>(__builtin_popcountll(words[w]));
+            }
+            std::uint64_t mask = ((low & 63) == 63) ? ~0ULL : ((1ULL << ((low & 63) + 1)) - 1);
+            rank += static_cast<std::uint64_t>(__builtin_popcountll(words[low >> 6] & mask));
+        }
+    }
+    return rank;
+}
+
+std::uint32_t roaring_extract(const RoaringSet* set, std::uint64_t offset, std::uint32_t limit, std::uint32_t* out) {
+    std::uint32_t k = 0;
+    for (std::uint32_t c = 0; c < set->count && k < limit; ++c) {
+        const RoaringContainer* ct = &set->containers[c];
+        if (offset >= ct->cardinality) {
+            offset -= ct->cardinality;
+            continue;
+        }
+        std::uint32_t base = static_cast<std::uint32_t>(ct->key) << 16;
+        if (ct->type == ROARING_ARRAY) {
+            const std::uint16_t* vals = static_cast<const std::uint16_t*>(ct->data);
+            for (std::uint64_t i = offset; i < ct->cardinality && k < limit; ++i) {
+                out[k++] = base | vals[i];
+            }
+        } else if (ct->type == ROARING_RUN) {
+            const std::uint16_t* runs = static_cast<const std::uint16_t*>(ct->data);
+            for (std::uint32_t r = 0; r < ct->runs && k < limit; ++r) {
+                std::uint32_t len = static_cast<std::uint32_t>(runs[2 * r + 1]) + 1;
+                if (offset >= len) {
+                    offset -= len;
+                    continue;
+                }
+                for (std::uint32_t v = runs[2 * r] + static_cast<std::uint32_t>(offset);
+                     v <= static_cast<std::uint32_t>(runs[2 * r]) + runs[2 * r + 1] && k < limit; ++v) {
+                    out[k++] = base | v;
+                }
+                offset = 0;
+            }
+        } else {
+            const std::uint64_t* words = static_cast<const std::uint64_t*>(ct->data);
+            for (std::uint32_t w = 0; w < ROARING_BITMAP_WORDS && k < limit; ++w) {
+                std::uint64_t word = words[w];
+                std::uint64_t pc = static_cast<std::uint64_t>(__builtin_popcountll(word));
+                if (offset >= pc) {
+                    offset -= pc;
+                    continue;
+                }
+                while (offset > 0) {
+                    word &= word - 1;
+                    --offset;
+                }
+                while (word && k < limit) {
+                    out[k++] = base | ((w << 6) + static_cast<std::uint32_t>(__builtin_ctzll(word)));
+                    word &= word - 1;
+                }
+            }
+        }
+        offset = 0;
+    }
+    return k;
+}
+
+void roaring_free(RoaringSet* set) {
+    for (std::uint32_t i = 0; i < set->count; ++i) {
+        if (set->containers[i].owned) {
+            std::free(const_cast<void*>(set->containers[i].data));
+        }
+    }
+    std::free(set->containers);
+    std::memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Roaring-style hybrid posting lists (postings codec INDEX_CODEC_HYBRID) and
+ * the in-memory sets search_cli evaluates them with.
+ *
+ * Doc ids are split into 64K chunks by their high 16 bits. Each non-empty
+ * chunk is one container holding the low 16 bits in whichever form is
+ * smallest:
+ *
+ *   ROARING_ARRAY   sorted uint16 values (at most ROARING_ARRAY_MAX)
+ *   ROARING_BITMAP  1024 uint64 words, one bit per value
+ *   ROARING_RUN     uint16 (start, length - 1) pairs
+ *
+ * An encoded list is a RoaringListHeader, RoaringRecord[container_count]
+ * sorted by key, then the payloads, each padded to 8 bytes. Encoded lists
+ * are padded to a multiple of 8 bytes, so mapped bitmaps are word-aligned.
+ */
+
+const std::uint32_t ROARING_ARRAY_MAX = 4096;
+const std::uint32_t ROARING_BITMAP_WORDS = 1024;
+
+const std::uint8_t ROARING_ARRAY = 0;
+const std::uint8_t ROARING_BITMAP = 1;
+const std::uint8_t ROARING_RUN = 2;
+
+struct RoaringListHeader {
+    std::uint32_t container_count;
+    std::uint32_t reserved;
+};
+
+struct RoaringRecord {
+    std::uint16_t key;
+    std::uint8_t type;
+    std::uint8_t reserved;
+    std::uint32_t cardinality;
+    std::uint32_t runs;   /* ROARING_RUN only */
+    std::uint32_t offset; /* relative to the first payload byte */
+};
+
+/* Upper bound on the encoded size of a list of count ids. */
+size_t roaring_codec_max_bytes(std::uint32_t count);
+
+/* Encodes strictly increasing ids into out; returns the number of bytes written. */
+size_t roaring_codec_encode(const std::uint32_t* ids, std::uint32_t count, unsigned char* out);
+
+struct RoaringContainer {
+    std::uint16_t key;
+    std::uint8_t type;
+    std::uint8_t owned; /* data was malloc'd for this set */
+    std::uint32_t cardinality;
+    std::uint32_t runs;
+    const void* data;
+};
+
+/*
+ * A set of doc ids as containers sorted by key. Views of encoded lists
+ * borrow their payloads; results of the set operations own theirs, except
+ * containers passed through unchanged from a borrowed operand.
+ */
+struct RoaringSet {
+    RoaringContainer* containers;
+    std::uint32_t count;
+    std::uint32_t cap;
+    std::uint64_t cardinality;
+};
+
+/* All functions returning int return 0 on allocation failure. */
+int roaring_view(const unsigned char* data, RoaringSet* out);
+int roaring_from_sorted(const std::uint32_t* ids, std::uint32_t count, RoaringSet* out);
+int roaring_copy(const RoaringSet* set, RoaringSet* out);
+
+int roaring_and(const RoaringSet* a, const RoaringSet* b, RoaringSet* out);
+int roaring_or(const RoaringSet* a, const RoaringSet* b, RoaringSet* out);
+int roaring_andnot(const RoaringSet* a, const RoaringSet* b, RoaringSet* out);
+
+/* Number of ids in the set that are <= value. */
+std::uint64_t roaring_rank(const RoaringSet* set, std::uint32_t value);
+
+/* Writes up to limit ids starting at rank offset; returns how many were written. */
+std::uint32_t roaring_extract(const RoaringSet* set, std::uint64_t offset, std::uint32_t limit, std::uint32_t* out);
+
+void roaring_free(RoaringSet* set);
@@ -1,8 +1,30 @@
+#include <arpa/inet.h>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "block_codec.h"
+#include "index_format.h"
+#include "intersect.h"
+#include "pef_codec.h"
+#include "roaring.h"
+#include "stem.h"
+#include "term_dict.h"
+#include "tokenize.h"
 
 enum TokenType {
     TOK_TERM = 1,
@@ -13,30 +35,42 @@ enum TokenType {
     TOK_RPAREN = 6
 };
 
-struct LexEntry {
-    char* term;
-    std::uint64_t postings_offset;
-    std::uint32_t postings_count;
-};
-
-struct DocMeta {
-    char* title;
-    char* url;
+/* Memory backing part of the index: a heap block (v1 files) or a file mapping (v2 files). */
+struct IndexRegion {
+    void* base;
+    size_t size;
+    int mapped;
 };
 
+/*
+ * The in-memory index always has the v2 shape (fixed-width tables pointing
+ * into string blobs), so v2 files are used in place and v1 files are parsed
+ * into a handful of heap blocks of the same shape.
+ */
 struct IndexData {
-    LexEntry* lexicon;
+    const LexiconRecord* lexicon;
+    const char* lexicon_strings;
+    std::uint64_t lexicon_strings_bytes;
     std::uint32_t term_count;
 
-    std::uint32_t* postings_data;
+    const std::uint32_t* postings_data; /* INDEX_CODEC_RAW only */
+    const unsigned char* postings_bytes;
+    std::uint64_t postings_data_bytes;
     std::uint64_t postings_total;
+    std::uint32_t postings_codec;
 
-    DocMeta* metas_by_id;
+    const ForwardSlot* doc_slots; /* parallel to universe_ids */
+    const char* forward_strings;
+    std::uint64_t forward_strings_bytes;
     std::uint32_t max_doc_id;
     std::uint32_t docs_with_meta;
 
-    std::uint32_t* universe_ids;
+    const std::uint32_t* universe_ids;
     std::uint32_t universe_count;
+    RoaringSet universe_set; /* INDEX_CODEC_HYBRID only, for NOT */
+
+    IndexRegion regions[8];
+    std::uint32_t region_count;
 };
 
 struct Token {
@@ -44,9 +78,16 @@ struct Token {
     char* text;
 };
 
+/*
+ * A result list. It never owns its ids: they point into the index, the
+ * document set or the query arena. Compressed term lists start out packed
+ * (ids == nullptr) and are only decoded when an operator needs every id;
+ * op_and can step through them with a cursor instead.
+ */
 struct PostingList {
-    std::uint32_t* ids;
+    const std::uint32_t* ids;
     std::uint32_t count;
+    const unsigned char* packed;
 };
 
 static int read_u16(FILE* in, std::uint16_t* out) {
@@ -59,78 +100,91 @@ static int read_u64(FILE* in, std::uint64_t* out) {
     return std::fread(out, sizeof(*out), 1, in) == 1;
 }
 
-static char* xstrndup(const char* s, size_t n) {
-    char* out = static_cast<char*>(std::malloc(n + 1));
+static char* path_join3(const char* dir, const char* name) {
+    size_t a = std::strlen(dir);
+    size_t b = std::strlen(name);
+    size_t need = a + 1 + b + 1;
+    char* out = static_cast<char*>(std::malloc(need));
     if (!out) {
         return nullptr;
     }
-    if (n > 0) {
-        std::memcpy(out, s, n);
-    }
-    out[n] = '\0';
+    std::snprintf(out, need, "%s/%s", dir, name);
     return out;
 }
 
-static int ends_with(const char* s, int n, const char* suffix) {
-    int m = static_cast<int>(std::strlen(suffix));
-    if (n < m) {
+static int add_region(IndexData* idx, void* base, size_t size, int mapped) {
+    if (idx->region_count >= sizeof(idx->regions) / sizeof(idx->regions[0])) {
         return 0;
     }
-    return std::memcmp(s + n - m, suffix, static_cast<size_t>(m)) == 0;
+    idx->regions[idx->region_count].base = base;
+    idx->regions[idx->region_count].size = size;
+    idx->regions[idx->region_count].mapped = mapped;
+    idx->region_count++;
+    return 1;
 }
 
-static void stem_term_inplace(char* token) {
-    int n = static_cast<int>(std::strlen(token));
-    if (n <= 2) {
-        return;
-    }
-    if (n > 5 && ends_with(token, n, "ingly")) {
-        token[n - 5] = '\0';
-        return;
-    }
-    if (n > 4 && ends_with(token, n, "edly")) {
-        token[n - 4] = '\0';
-        return;
-    }
-    if (n > 4 && ends_with(token, n, "ing")) {
-        token[n - 3] = '\0';
-        return;
+static int peek_version(const char* path, std::uint32_t magic, std::uint32_t* version) {
+    FILE* in = std::fopen(path, "rb");
+    if (!in) {
+        std::fprintf(stderr, "Failed to open %s\n", path);
+        return 0;
     }
-    if (n > 3 && ends_with(token, n, "ed")) {
-        token[n - 2] = '\0';
-        return;
+    std::uint32_t file_magic = 0;
+    int ok = read_u32(in, &file_magic) && read_u32(in, version);
+    std::fclose(in);
+    if (!ok || file_magic != magic) {
+        std::fprintf(stderr, "Invalid header in %s\n", path);
+        return 0;
     }
-    if (n > 4 && ends_with(token, n, "ies")) {
-        token[n - 3] = 'y';
-        token[n - 2] = '\0';
-        return;
+    return 1;
+}
+
+/*
+ * Maps a whole v2 file read-only and shared, so replicas serving the same
+ * index share one copy in the page cache. With prefault the pages are read
+ * in up front (MAP_POPULATE); otherwise they fault in on first use, using
+ * the given madvise() access hint.
+ */
+static const unsigned char* map_index_file(IndexData* idx, const char* path, size_t header_size, int prefault,
+                                           int advice, size_t* size_out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        std::fprintf(stderr, "Failed to open %s\n", path);
+        return nullptr;
     }
-    if (n > 3 && ends_with(token, n, "es")) {
-        token[n - 2] = '\0';
-        return;
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || static_cast<std::uint64_t>(st.st_size) < header_size) {
+        std::fprintf(stderr, "Truncated index file %s\n", path);
+        close(fd);
+        return nullptr;
     }
-    if (n > 3 && ends_with(token, n, "ly")) {
-        token[n - 2] = '\0';
-        return;
+    size_t size = static_cast<size_t>(st.st_size);
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (prefault) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void* base = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::fprintf(stderr, "Failed to mmap %s: %s\n", path, std::strerror(errno));
+        return nullptr;
     }
-    if (n > 3 && token[n - 1] == 's') {
-        token[n - 1] = '\0';
+    if (!add_region(idx, base, size, 1)) {
+        munmap(base, size);
+        return nullptr;
     }
+    madvise(base, size, prefault ? MADV_WILLNEED : advice);
+    *size_out = size;
+    return static_cast<const unsigned char*>(base);
 }
 
-static char* path_join3(const char* dir, const char* name) {
-    size_t a = std::strlen(dir);
-    size_t b = std::strlen(name);
-    size_t need = a + 1 + b + 1;
-    char* out = static_cast<char*>(std::malloc(need));
-    if (!out) {
-        return nullptr;
-    }
-    std::snprintf(out, need, "%s/%s", dir, name);
-    return out;
+static int section_fits(std::uint64_t offset, std::uint64_t bytes, size_t file_size) {
+    return offset % sizeof(std::uint64_t) == 0 && offset <= file_size && bytes <= file_size - offset;
 }
 
-static int load_postings(IndexData* idx, const char* postings_path) {
+static int load_postings_v1(IndexData* idx, const char* postings_path) {
     FILE* in = std::fopen(postings_path, "rb");
     if (!in) {
         std::fprintf(stderr, "Failed to open %s\n", postings_path);
@@ -143,26 +197,58 @@ static int load_postings(IndexData* idx, const char* postings_path) {
         std::fclose(in);
         return 0;
     }
-    if (magic != 0x504F5354U || version != 1) {
+    if (magic != INDEX_POSTINGS_MAGIC || version != INDEX_VERSION_STREAM) {
         std::fclose(in);
         std::fprintf(stderr, "Invalid postings header\n");
         return 0;
     }
-    idx->postings_data = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * static_cast<size_t>(total)));
-    if (!idx->postings_data && total > 0) {
+    std::uint32_t* data = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * static_cast<size_t>(total)));
+    if (!data && total > 0) {
+        std::fclose(in);
+        return 0;
+    }
+    if (!add_region(idx, data, 0, 0)) {
+        std::free(data);
         std::fclose(in);
         return 0;
     }
-    if (total > 0 && std::fread(idx->postings_data, sizeof(std::uint32_t), static_cast<size_t>(total), in) != total) {
+    if (total > 0 && std::fread(data, sizeof(std::uint32_t), static_cast<size_t>(total), in) != total) {
         std::fclose(in);
         return 0;
     }
     std::fclose(in);
+    idx->postings_data = data;
+    idx->postings_bytes = reinterpret_cast<const unsigned char*>(data);
+    idx->postings_data_bytes = total * sizeof(std::uint32_t);
     idx->postings_total = total;
+    idx->postings_codec = INDEX_CODEC_RAW;
     return 1;
 }
 
-static int load_lexicon(IndexData* idx, const char* lexicon_path) {
+static int load_postings_v2(IndexData* idx, const char* postings_path, int prefault) {
+    size_t size = 0;
+    const unsigned char* base =
+        map_index_file(idx, postings_path, sizeof(PostingsHeaderV2), prefault, MADV_RANDOM, &size);
+    if (!base) {
+        return 0;
+    }
+    const PostingsHeaderV2* header = reinterpret_cast<const PostingsHeaderV2*>(base);
+    if ((header->codec != INDEX_CODEC_RAW && header->codec != INDEX_CODEC_BLOCK && header->codec != INDEX_CODEC_PEF &&
+         header->codec != INDEX_CODEC_HYBRID) ||
+        !section_fits(header->data_offset, header->data_bytes, size) ||
+        (header->codec == INDEX_CODEC_RAW && header->total_postings * sizeof(std::uint32_t) > header->data_bytes)) {
+        std::fprintf(stderr, "Invalid postings header\n");
+        return 0;
+    }
+    idx->postings_bytes = base + header->data_offset;
+    idx->postings_data = reinterpret_cast<const std::uint32_t*>(idx->postings_bytes);
+    idx->postings_data_bytes = header->data_bytes;
+    idx->postings_total = header->total_postings;
+    idx->postings_codec = header->codec;
+    return 1;
+}
+
+static int load_lexicon_v1(IndexData* idx, const char* lexicon_path) {
     FILE* in = std::fopen(lexicon_path, "rb");
     if (!in) {
         std::fprintf(stderr, "Failed to open %s\n", lexicon_path);
@@ -175,16 +261,23 @@ static int load_lexicon(IndexData* idx, const char* lexicon_path) {
         std::fclose(in);
         return 0;
     }
-    if (magic != 0x4C455849U || version != 1) {
+    if (magic != INDEX_LEXICON_MAGIC || version != INDEX_VERSION_STREAM) {
         std::fclose(in);
         std::fprintf(stderr, "Invalid lexicon header\n");
         return 0;
     }
-    idx->lexicon = static_cast<LexEntry*>(std::calloc(term_count, sizeof(LexEntry)));
-    if (!idx->lexicon && term_count > 0) {
+    LexiconRecord* records = static_cast<LexiconRecord*>(std::calloc(term_count, sizeof(LexiconRecord)));
+    if ((!records && term_count > 0) || !add_region(idx, records, 0, 0)) {
+        std::free(records);
         std::fclose(in);
         return 0;
     }
+    if (!add_region(idx, nullptr, 0, 0)) {
+        std::fclose(in);
+        return 0;
+    }
+    IndexRegion* strings = &idx->regions[idx->region_count - 1];
+    size_t strings_len = 0;
 
     for (std::uint32_t i = 0; i < term_count; ++i) {
         std::uint16_t term_len = 0;
@@ -192,53 +285,63 @@ static int load_lexicon(IndexData* idx, const char* lexicon_path) {
             std::fclose(in);
             return 0;
         }
-        idx->lexicon[i].term = static_cast<char*>(std::malloc(static_cast<size_t>(term_len) + 1));
-        if (!idx->lexicon[i].term) {
-            std::fclose(in);
-            return 0;
-        }
-        if (term_len > 0) {
-            if (std::fread(idx->lexicon[i].term, 1, term_len, in) != term_len) {
+        if (strings_len + term_len + 1 > strings->size) {
+            size_t new_size = (strings->size == 0) ? 65536 : strings->size;
+            while (new_size < strings_len + term_len + 1) {
+                new_size *= 2;
+            }
+            void* grown = std::realloc(strings->base, new_size);
+            if (!grown) {
                 std::fclose(in);
                 return 0;
             }
+            strings->base = grown;
+            strings->size = new_size;
+        }
+        char* term = static_cast<char*>(strings->base) + strings_len;
+        if (term_len > 0 && std::fread(term, 1, term_len, in) != term_len) {
+            std::fclose(in);
+            return 0;
         }
-        idx->lexicon[i].term[term_len] = '\0';
-        if (!read_u64(in, &idx->lexicon[i].postings_offset) || !read_u32(in, &idx->lexicon[i].postings_count)) {
+        term[term_len] = '\0';
+        records[i].term_offset = static_cast<std::uint32_t>(strings_len);
+        strings_len += static_cast<size_t>(term_len) + 1;
+        if (!read_u64(in, &records[i].postings_offset) || !read_u32(in, &records[i].postings_count)) {
             std::fclose(in);
             return 0;
         }
     }
     std::fclose(in);
+    idx->lexicon = records;
+    idx->lexicon_strings = static_cast<const char*>(strings->base);
+    idx->lexicon_strings_bytes = strings_len;
     idx->term_count = term_count;
     return 1;
 }
 
-static int ensure_meta_cap(DocMeta** metas, std::uint32_t* cap, std::uint32_t need) {
-    if (*cap > need) {
-        return 1;
-    }
-    std::uint32_t new_cap = (*cap == 0) ? 1024 : *cap;
-    while (new_cap <= need) {
-        if (new_cap > 0x7fffffffU) {
-            return 0;
-        }
-        new_cap *= 2;
-    }
-    DocMeta* arr = static_cast<DocMeta*>(std::realloc(*metas, sizeof(DocMeta) * new_cap));
-    if (!arr) {
+static int load_lexicon_v2(IndexData* idx, const char* lexicon_path, int prefault) {
+    size_t size = 0;
+    const unsigned char* base =
+        map_index_file(idx, lexicon_path, sizeof(LexiconHeaderV2), prefault, MADV_WILLNEED, &size);
+    if (!base) {
         return 0;
     }
-    for (std::uint32_t i = *cap; i < new_cap; ++i) {
-        arr[i].title = nullptr;
-        arr[i].url = nullptr;
+    const LexiconHeaderV2* header = reinterpret_cast<const LexiconHeaderV2*>(base);
+    std::uint64_t records_bytes = static_cast<std::uint64_t>(header->term_count) * sizeof(LexiconRecord);
+    if (!section_fits(header->records_offset, records_bytes, size) ||
+        !section_fits(header->strings_offset, header->strings_bytes, size) ||
+        (header->strings_bytes > 0 && base[header->strings_offset + header->strings_bytes - 1] != '\0')) {
+        std::fprintf(stderr, "Invalid lexicon header\n");
+        return 0;
     }
-    *metas = arr;
-    *cap = new_cap;
+    idx->lexicon = reinterpret_cast<const LexiconRecord*>(base + header->records_offset);
+    idx->lexicon_strings = reinterpret_cast<const char*>(base + header->strings_offset);
+    idx->lexicon_strings_bytes = header->strings_bytes;
+    idx->term_count = header->term_count;
     return 1;
 }
 
-static int load_forward(IndexData* idx, const char* forward_path) {
+static int load_forward_v1(IndexData* idx, const char* forward_path) {
     FILE* in = std::fopen(forward_path, "rb");
     if (!in) {
         std::fprintf(stderr, "Failed to open %s\n", forward_path);
@@ -252,7 +355,7 @@ static int load_forward(IndexData* idx, const char* forward_path) {
         std::fclose(in);
         return 0;
     }
-    if (magic != 0x46575244U || version != 1) {
+    if (magic != INDEX_FORWARD_MAGIC || version != INDEX_VERSION_STREAM) {
         std::fclose(in);
         std::fprintf(stderr, "Invalid forward header\n");
         return 0;
@@ -260,20 +363,28 @@ static int load_forward(IndexData* idx, const char* forward_path) {
     idx->docs_with_meta = docs;
     idx->max_doc_id = max_doc_id;
 
-    DocMeta* metas = nullptr;
-    std::uint32_t metas_cap = 0;
-    if (!ensure_meta_cap(&metas, &metas_cap, max_doc_id)) {
+    ForwardSlot* slots = static_cast<ForwardSlot*>(std::malloc(sizeof(ForwardSlot) * docs));
+    if ((!slots && docs > 0) || !add_region(idx, slots, 0, 0)) {
+        std::free(slots);
         std::fclose(in);
         return 0;
     }
 
     std::uint32_t* universe = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * docs));
-    if (!universe && docs > 0) {
+    if ((!universe && docs > 0) || !add_region(idx, universe, 0, 0)) {
+        std::free(universe);
         std::fclose(in);
         return 0;
     }
     std::uint32_t ucount = 0;
 
+    if (!add_region(idx, nullptr, 0, 0)) {
+        std::fclose(in);
+        return 0;
+    }
+    IndexRegion* strings = &idx->regions[idx->region_count - 1];
+    size_t strings_len = 0;
+
     for (std::uint32_t i = 0; i < docs; ++i) {
         std::uint32_t doc_id = 0;
         std::uint16_t title_len = 0;
@@ -282,12 +393,27 @@ static int load_forward(IndexData* idx, const char* forward_path) {
             std::fclose(in);
             return 0;
         }
-        char* title = static_cast<char*>(std::malloc(static_cast<size_t>(title_len) + 1));
-        char* url = static_cast<char*>(std::malloc(static_cast<size_t>(url_len) + 1));
-        if ((!title && title_len > 0) || (!url && url_len > 0)) {
+        if (doc_id > max_doc_id || (ucount > 0 && doc_id <= universe[ucount - 1])) {
             std::fclose(in);
+            std::fprintf(stderr, "Invalid forward record for doc %u\n", doc_id);
             return 0;
         }
+        size_t need = strings_len + title_len + 1 + url_len + 1;
+        if (need > strings->size) {
+            size_t new_size = (strings->size == 0) ? 1u << 20 : strings->size;
+            while (new_size < need) {
+                new_size *= 2;
+            }
+            void* grown = std::realloc(strings->base, new_size);
+            if (!grown) {
+                std::fclose(in);
+                return 0;
+            }
+            strings->base = grown;
+            strings->size = new_size;
+        }
+        char* title = static_cast<char*>(strings->base) + strings_len;
+        char* url = title + title_len + 1;
         if (title_len > 0 && std::fread(title, 1, title_len, in) != title_len) {
             std::fclose(in);
             return 0;
@@ -299,41 +425,109 @@ static int load_forward(IndexData* idx, const char* forward_path) {
         title[title_len] = '\0';
         url[url_len] = '\0';
 
-        if (!ensure_meta_cap(&metas, &metas_cap, doc_id)) {
-            std::fclose(in);
-            return 0;
-        }
-        metas[doc_id].title = title;
-        metas[doc_id].url = url;
+        slots[ucount].title_offset = static_cast<std::uint32_t>(strings_len);
+        slots[ucount].url_offset = static_cast<std::uint32_t>(strings_len + title_len + 1);
+        strings_len = need;
         universe[ucount++] = doc_id;
     }
     std::fclose(in);
 
-    idx->metas_by_id = metas;
+    idx->doc_slots = slots;
+    idx->forward_strings = static_cast<const char*>(strings->base);
+    idx->forward_strings_bytes = strings_len;
     idx->universe_ids = universe;
     idx->universe_count = ucount;
     return 1;
 }
 
+static int load_forward_v2(IndexData* idx, const char* forward_path, int prefault) {
+    size_t size = 0;
+    const unsigned char* base =
+        map_index_file(idx, forward_path, sizeof(ForwardHeaderV2), prefault, MADV_RANDOM, &size);
+    if (!base) {
+        return 0;
+    }
+    const ForwardHeaderV2* header = reinterpret_cast<const ForwardHeaderV2*>(base);
+    std::uint64_t doc_ids_bytes = static_cast<std::uint64_t>(header->docs) * sizeof(std::uint32_t);
+    std::uint64_t slots_bytes = static_cast<std::uint64_t>(header->docs) * sizeof(ForwardSlot);
+    if (!section_fits(header->doc_ids_offset, doc_ids_bytes, size) ||
+        !section_fits(header->slots_offset, slots_bytes, size) ||
+        !section_fits(header->strings_offset, header->strings_bytes, size) ||
+        (header->strings_bytes > 0 && base[header->strings_offset + header->strings_bytes - 1] != '\0')) {
+        std::fprintf(stderr, "Invalid forward header\n");
+        return 0;
+    }
+    idx->docs_with_meta = header->docs;
+    idx->max_doc_id = header->max_doc_id;
+    idx->doc_slots = reinterpret_cast<const ForwardSlot*>(base + header->slots_offset);
+    idx->forward_strings = reinterpret_cast<const char*>(base + header->strings_offset);
+    idx->forward_strings_bytes = header->strings_bytes;
+    idx->universe_ids = reinterpret_cast<const std::uint32_t*>(base + header->doc_ids_offset);
+    idx->universe_count = header->docs;
+    return 1;
+}
+
+static int load_index(IndexData* idx, const char* postings_path, const char* lexicon_path, const char* forward_path,
+                      int prefault) {
+    std::uint32_t postings_version = 0;
+    std::uint32_t lexicon_version = 0;
+    std::uint32_t forward_version = 0;
+    if (!peek_version(postings_path, INDEX_POSTINGS_MAGIC, &postings_version) ||
+        !peek_version(lexicon_path, INDEX_LEXICON_MAGIC, &lexicon_version) ||
+        !peek_version(forward_path, INDEX_FORWARD_MAGIC, &forward_version)) {
+        return 0;
+    }
+    int ok = (postings_version == INDEX_VERSION_MAPPED) ? load_postings_v2(idx, postings_path, prefault)
+                                                         : load_postings_v1(idx, postings_path);
+    ok = ok && ((lexicon_version == INDEX_VERSION_MAPPED) ? load_lexicon_v2(idx, lexicon_path, prefault)
+                                                           : load_lexicon_v1(idx, lexicon_path));
+    ok = ok && ((forward_version == INDEX_VERSION_MAPPED) ? load_forward_v2(idx, forward_path, prefault)
+                                                           : load_forward_v1(idx, forward_path));
+    if (ok && idx->postings_codec == INDEX_CODEC_HYBRID &&
+        !roaring_from_sorted(idx->universe_ids, idx->universe_count, &idx->universe_set)) {
+        std::fprintf(stderr, "Failed to allocate document set\n");
+        return 0;
+    }
+    return ok;
+}
+
 static void free_index(IndexData* idx) {
     if (!idx) {
         return;
     }
-    if (idx->lexicon) {
-        for (std::uint32_t i = 0; i < idx->term_count; ++i) {
-            std::free(idx->lexicon[i].term);
+    for (std::uint32_t i = 0; i < idx->region_count; ++i) {
+        if (idx->regions[i].mapped) {
+            munmap(idx->regions[i].base, idx->regions[i].size);
+        } else {
+            std::free(idx->regions[i].base);
         }
-        std::free(idx->lexicon);
     }
-    std::free(idx->postings_data);
-    if (idx->metas_by_id) {
-        for (std::uint32_t i = 0; i <= idx->max_doc_id; ++i) {
-            std::free(idx->metas_by_id[i].title);
-            std::free(idx->metas_by_id[i].url);
+    idx->region_count = 0;
+    roaring_free(&idx->universe_set);
+}
+
+static const char* lexicon_term(const IndexData* idx, std::uint32_t i) {
+    std::uint32_t off = idx->lexicon[i].term_offset;
+    return (off < idx->lexicon_strings_bytes) ? idx->lexicon_strings + off : "";
+}
+
+static const char* forward_string(const IndexData* idx, std::uint32_t off) {
+    return (off < idx->forward_strings_bytes) ? idx->forward_strings + off : nullptr;
+}
+
+/* Binary search of the ascending doc id table; nullptr for ids without metadata. */
+static const ForwardSlot* forward_slot(const IndexData* idx, std::uint32_t doc_id) {
+    std::uint32_t lo = 0;
+    std::uint32_t hi = idx->universe_count;
+    while (lo < hi) {
+        std::uint32_t mid = lo + (hi - lo) / 2;
+        if (idx->universe_ids[mid] < doc_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        std::free(idx->metas_by_id);
     }
-    std::free(idx->universe_ids);
+    return (lo < idx->universe_count && idx->universe_ids[lo] == doc_id) ? &idx->doc_slots[lo] : nullptr;
 }
 
 static int lexicon_find(const IndexData* idx, const char* term, std::uint64_t* offset, std::uint32_t* count) {
@@ -341,7 +535,7 @@ static int lexicon_find(const IndexData* idx, const char* term, std::uint64_t* o
     std::int64_t hi = static_cast<std::int64_t>(idx->term_count) - 1;
     while (lo <= hi) {
         std::int64_t mid = (lo + hi) / 2;
-        int cmp = std::strcmp(term, idx->lexicon[mid].term);
+        int cmp = std::strcmp(term, lexicon_term(idx, static_cast<std::uint32_t>(mid)));
         if (cmp == 0) {
             *offset = idx->lexicon[mid].postings_offset;
             *count = idx->lexicon[mid].postings_count;
@@ -356,19 +550,81 @@ static int lexicon_find(const IndexData* idx, const char* term, std::uint64_t* o
     return 0;
 }
 
-static int token_push(Token** arr, std::uint32_t* count, std::uint32_t* cap, Token t) {
-    if (*count >= *cap) {
-        std::uint32_t new_cap = (*cap == 0) ? 16 : (*cap * 2);
-        Token* new_arr = static_cast<Token*>(std::realloc(*arr, sizeof(Token) * new_cap));
-        if (!new_arr) {
-            return 0;
+/*
+ * Per-query bump allocator. The query's tokens, RPN and plan, operator
+ * outputs and their scratch come from here and are dropped together when
+ * the query is done, so the evaluator never frees intermediate lists one by
+ * one and can hand out borrowed views (term lists in the index, the
+ * document set, cached results) instead of copies. The counters back
+ * --profile; on a hybrid index the container sets that roaring.cpp
+ * allocates are not part of them.
+ */
+const size_t ARENA_MIN_CHUNK = 64 * 1024;
+const size_t ARENA_ALIGN = 16;
+
+struct ArenaChunk {
+    ArenaChunk* next;
+    size_t size;
+    size_t used;
+};
+
+const size_t ARENA_HEADER = (sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+struct QueryArena {
+    ArenaChunk* head;
+    std::uint64_t allocs;      /* arena_alloc calls */
+    std::uint64_t heap_allocs; /* chunks taken from malloc */
+    std::uint64_t bytes;       /* bytes handed out */
+    std::uint64_t copied;      /* bytes memcpy'd while evaluating */
+};
+
+static void* arena_alloc(QueryArena* arena, size_t bytes) {
+    bytes = (bytes + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    ArenaChunk* c = arena->head;
+    if (!c || c->size - c->used < bytes) {
+        size_t size = c ? c->size * 2 : ARENA_MIN_CHUNK;
+        if (size < bytes) {
+            size = bytes;
         }
-        *arr = new_arr;
-        *cap = new_cap;
-    }
-    (*arr)[*count] = t;
-    (*count)++;
-    return 1;
+        c = static_cast<ArenaChunk*>(std::malloc(ARENA_HEADER + size));
+        if (!c) {
+            return nullptr;
+        }
+        c->next = arena->head;
+        c->size = size;
+        c->used = 0;
+        arena->head = c;
+        ++arena->heap_allocs;
+    }
+    void* p = reinterpret_cast<unsigned char*>(c) + ARENA_HEADER + c->used;
+    c->used += bytes;
+    ++arena->allocs;
+    arena->bytes += bytes;
+    return p;
+}
+
+static std::uint32_t* arena_ids(QueryArena* arena, std::uint64_t count) {
+    return static_cast<std::uint32_t*>(arena_alloc(arena, sizeof(std::uint32_t) * count));
+}
+
+/* Drops everything but the oldest (smallest) chunk and clears the counters. */
+static void arena_reset(QueryArena* arena) {
+    ArenaChunk* c = arena->head;
+    while (c && c->next) {
+        ArenaChunk* next = c->next;
+        std::free(c);
+        c = next;
+    }
+    if (c) {
+        c->used = 0;
+    }
+    *arena = QueryArena{c, 0, 0, 0, 0};
+}
+
+static void arena_free(QueryArena* arena) {
+    arena_reset(arena);
+    std::free(arena->head);
+    arena->head = nullptr;
 }
 
 static int is_operand_end(int type) {
@@ -379,12 +635,15 @@ static int is_operand_start(int type) {
     return type == TOK_TERM || type == TOK_LPAREN || type == TOK_NOT;
 }
 
-static int tokenize_query(const char* query, Token** out_tokens, std::uint32_t* out_count) {
-    Token* raw = nullptr;
+/* Tokens and term strings live in the arena; every token takes at least one byte of the query. */
+static int tokenize_query(QueryArena* arena, const char* query, Token** out_tokens, std::uint32_t* out_count) {
+    size_t n = std::strlen(query);
+    Token* raw = static_cast<Token*>(arena_alloc(arena, sizeof(Token) * n));
+    if (!raw) {
+        return 0;
+    }
     std::uint32_t raw_count = 0;
-    std::uint32_t raw_cap = 0;
 
-    size_t n = std::strlen(query);
     size_t i = 0;
     while (i < n) {
         unsigned char ch = static_cast<unsigned char>(query[i]);
@@ -393,77 +652,65 @@ static int tokenize_query(const char* query, Token** out_tokens, std::uint32_t*
             continue;
         }
         if (ch == '&' && i + 1 < n && query[i + 1] == '&') {
-            if (!token_push(&raw, &raw_count, &raw_cap, Token{TOK_AND, nullptr})) {
-                return 0;
-            }
+            raw[raw_count++] = Token{TOK_AND, nullptr};
             i += 2;
             continue;
         }
         if (ch == '|' && i + 1 < n && query[i + 1] == '|') {
-            if (!token_push(&raw, &raw_count, &raw_cap, Token{TOK_OR, nullptr})) {
-                return 0;
-            }
+            raw[raw_count++] = Token{TOK_OR, nullptr};
             i += 2;
             continue;
         }
         if (ch == '!') {
-            if (!token_push(&raw, &raw_count, &raw_cap, Token{TOK_NOT, nullptr})) {
-                return 0;
-            }
+            raw[raw_count++] = Token{TOK_NOT, nullptr};
             ++i;
             continue;
         }
         if (ch == '(') {
-            if (!token_push(&raw, &raw_count, &raw_cap, Token{TOK_LPAREN, nullptr})) {
-                return 0;
-            }
+            raw[raw_count++] = Token{TOK_LPAREN, nullptr};
             ++i;
             continue;
         }
         if (ch == ')') {
-            if (!token_push(&raw, &raw_count, &raw_cap, Token{TOK_RPAREN, nullptr})) {
-                return 0;
-            }
+            raw[raw_count++] = Token{TOK_RPAREN, nullptr};
             ++i;
             continue;
         }
-        if (std::isalnum(ch)) {
+        size_t char_len = token_char_length(query + i, n - i);
+        if (char_len > 0) {
             size_t start = i;
-            while (i < n && std::isalnum(static_cast<unsigned char>(query[i]))) {
-                ++i;
+            while (char_len > 0) {
+                i += char_len;
+                char_len = token_char_length(query + i, n - i);
             }
-            size_t len = i - start;
-            char* term = xstrndup(query + start, len);
+            /* the same folding as the documents got; one token, so no separators */
+            char* term = static_cast<char*>(arena_alloc(arena, i - start + TOKENIZE_OUT_SLACK));
             if (!term) {
                 return 0;
             }
-            for (size_t k = 0; k < len; ++k) {
-                term[k] = static_cast<char>(std::tolower(static_cast<unsigned char>(term[k])));
-            }
-            stem_term_inplace(term);
-            if (!token_push(&raw, &raw_count, &raw_cap, Token{TOK_TERM, term})) {
-                return 0;
-            }
+            std::uint64_t term_tokens = 0;
+            size_t len = tokenize_text(query + start, i - start, term, &term_tokens);
+            term[len] = '\0';
+            stem_token(term, len);
+            raw[raw_count++] = Token{TOK_TERM, term};
             continue;
         }
         ++i;
     }
 
-    Token* expanded = nullptr;
+    /* at most one implicit AND goes in before each token */
+    Token* expanded = static_cast<Token*>(arena_alloc(arena, sizeof(Token) * 2 * raw_count));
+    if (!expanded) {
+        return 0;
+    }
     std::uint32_t exp_count = 0;
-    std::uint32_t exp_cap = 0;
     for (std::uint32_t t = 0; t < raw_count; ++t) {
         if (t > 0 && is_operand_end(raw[t - 1].type) && is_operand_start(raw[t].type)) {
-            if (!token_push(&expanded, &exp_count, &exp_cap, Token{TOK_AND, nullptr})) {
-                return 0;
-            }
-        }
-        if (!token_push(&expanded, &exp_count, &exp_cap, raw[t])) {
-            return 0;
+            expanded[exp_count++] = Token{TOK_AND, nullptr};
         }
+        expanded[exp_count++] = raw[t];
     }
 
-    std::free(raw);
     *out_tokens = expanded;
     *out_count = exp_count;
     return 1;
@@ -486,20 +733,21 @@ static int is_right_assoc(int t) {
     return t == TOK_NOT;
 }
 
-static int to_rpn(Token* in_tokens, std::uint32_t in_count, Token** out_rpn, std::uint32_t* out_count) {
-    Token* out = nullptr;
+/* Shunting-yard; the output and the operator stack hold at most in_count tokens and live in the arena. */
+static int to_rpn(QueryArena* arena, const Token* in_tokens, std::uint32_t in_count, Token** out_rpn,
+                  std::uint32_t* out_count) {
+    Token* out = static_cast<Token*>(arena_alloc(arena, sizeof(Token) * in_count));
+    Token* ops = static_cast<Token*>(arena_alloc(arena, sizeof(Token) * in_count));
+    if (!out || !ops) {
+        return 0;
+    }
     std::uint32_t out_n = 0;
-    std::uint32_t out_cap = 0;
-    Token* ops = nullptr;
     std::uint32_t ops_n = 0;
-    std::uint32_t ops_cap = 0;
 
     for (std::uint32_t i = 0; i < in_count; ++i) {
         Token t = in_tokens[i];
         if (t.type == TOK_TERM) {
-            if (!token_push(&out, &out_n, &out_cap, t)) {
-                return 0;
-            }
+            out[out_n++] = t;
             continue;
         }
         if (t.type == TOK_AND || t.type == TOK_OR || t.type == TOK_NOT) {
@@ -511,23 +759,17 @@ static int to_rpn(Token* in_tokens, std::uint32_t in_count, Token** out_rpn, std
                 int p_top = precedence(top.type);
                 int p_cur = precedence(t.type);
                 if (p_top > p_cur || (p_top == p_cur && !is_right_assoc(t.type))) {
-                    if (!token_push(&out, &out_n, &out_cap, top)) {
-                        return 0;
-                    }
+                    out[out_n++] = top;
                     --ops_n;
                 } else {
                     break;
                 }
             }
-            if (!token_push(&ops, &ops_n, &ops_cap, t)) {
-                return 0;
-            }
+            ops[ops_n++] = t;
             continue;
         }
         if (t.type == TOK_LPAREN) {
-            if (!token_push(&ops, &ops_n, &ops_cap, t)) {
-                return 0;
-            }
+            ops[ops_n++] = t;
             continue;
         }
         if (t.type == TOK_RPAREN) {
@@ -539,13 +781,9 @@ static int to_rpn(Token* in_tokens, std::uint32_t in_count, Token** out_rpn, std
                     found_lparen = 1;
                     break;
                 }
-                if (!token_push(&out, &out_n, &out_cap, top)) {
-                    return 0;
-                }
+                out[out_n++] = top;
             }
             if (!found_lparen) {
-                std::free(ops);
-                std::free(out);
                 return 0;
             }
             continue;
@@ -556,290 +794,1673 @@ static int to_rpn(Token* in_tokens, std::uint32_t in_count, Token** out_rpn, std
         Token top = ops[ops_n - 1];
         --ops_n;
         if (top.type == TOK_LPAREN || top.type == TOK_RPAREN) {
-            std::free(ops);
-            std::free(out);
-            return 0;
-        }
-        if (!token_push(&out, &out_n, &out_cap, top)) {
             return 0;
         }
+        out[out_n++] = top;
     }
-    std::free(ops);
     *out_rpn = out;
     *out_count = out_n;
     return 1;
 }
 
-static void free_tokens(Token* tokens, std::uint32_t count) {
-    if (!tokens) {
-        return;
+/* Cursor over a compressed term list in the index's postings codec. */
+struct PackedCursor {
+    std::uint32_t codec;
+    BlockCursor block;
+    PefCursor pef;
+};
+
+static void packed_cursor_init(PackedCursor* cur, std::uint32_t codec, const PostingList& pl) {
+    cur->codec = codec;
+    if (codec == INDEX_CODEC_PEF) {
+        pef_cursor_init(&cur->pef, pl.packed, pl.count);
+    } else {
+        block_cursor_init(&cur->block, pl.packed, pl.count);
     }
-    for (std::uint32_t i = 0; i < count; ++i) {
-        if (tokens[i].type == TOK_TERM) {
-            std::free(tokens[i].text);
-        }
+}
+
+static int packed_cursor_next_geq(PackedCursor* cur, std::uint32_t target, std::uint32_t* out) {
+    if (cur->codec == INDEX_CODEC_PEF) {
+        return pef_cursor_next_geq(&cur->pef, target, out);
     }
-    std::free(tokens);
+    return block_cursor_next_geq(&cur->block, target, out);
 }
 
-static PostingList clone_postings(const std::uint32_t* src, std::uint32_t count) {
-    PostingList out{nullptr, 0};
-    if (count == 0) {
-        return out;
+/* Decodes a packed term list into the arena; returns 0 on allocation failure. */
+static int materialize(const IndexData* idx, QueryArena* arena, PostingList* pl) {
+    if (!pl->packed) {
+        return 1;
     }
-    out.ids = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * count));
-    if (!out.ids) {
-        return PostingList{nullptr, 0};
+    std::uint32_t* ids = arena_ids(arena, pl->count);
+    if (!ids) {
+        return 0;
     }
-    std::memcpy(out.ids, src, sizeof(std::uint32_t) * count);
-    out.count = count;
-    return out;
+    if (idx->postings_codec == INDEX_CODEC_PEF) {
+        pef_codec_decode(pl->packed, pl->count, ids);
+    } else {
+        block_codec_decode(pl->packed, pl->count, ids);
+    }
+    pl->ids = ids;
+    pl->packed = nullptr;
+    return 1;
 }
 
-static PostingList op_and(const PostingList& a, const PostingList& b) {
-    PostingList out{nullptr, 0};
-    std::uint32_t max_size = (a.count < b.count) ? a.count : b.count;
-    out.ids = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * max_size));
-    if (!out.ids && max_size > 0) {
-        return PostingList{nullptr, 0};
-    }
-    std::uint32_t i = 0, j = 0, k = 0;
-    while (i < a.count && j < b.count) {
-        if (a.ids[i] == b.ids[j]) {
-            out.ids[k++] = a.ids[i];
+/*
+ * Intersects a decoded list with a packed one. The cursor only touches the
+ * parts of the packed list that can hold a match: block-coded lists skip
+ * whole blocks, Elias-Fano lists jump straight to the target.
+ */
+static PostingList op_and_packed(const IndexData* idx, QueryArena* arena, const PostingList& a,
+                                 const PostingList& packed) {
+    std::uint32_t max_size = (a.count < packed.count) ? a.count : packed.count;
+    std::uint32_t* ids = arena_ids(arena, max_size);
+    if (!ids) {
+        return PostingList{nullptr, 0, nullptr};
+    }
+    PackedCursor cur;
+    packed_cursor_init(&cur, idx->postings_codec, packed);
+    std::uint32_t i = 0, k = 0;
+    std::uint32_t found = 0;
+    while (i < a.count && packed_cursor_next_geq(&cur, a.ids[i], &found)) {
+        if (found == a.ids[i]) {
+            ids[k++] = found;
             ++i;
-            ++j;
-        } else if (a.ids[i] < b.ids[j]) {
+            continue;
+        }
+        while (i < a.count && a.ids[i] < found) {
             ++i;
-        } else {
-            ++j;
         }
     }
-    out.count = k;
-    return out;
+    return PostingList{ids, k, nullptr};
 }
 
-static PostingList op_or(const PostingList& a, const PostingList& b) {
-    PostingList out{nullptr, 0};
-    std::uint32_t max_size = a.count + b.count;
-    out.ids = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * max_size));
-    if (!out.ids && max_size > 0) {
-        return PostingList{nullptr, 0};
-    }
-    std::uint32_t i = 0, j = 0, k = 0;
-    while (i < a.count && j < b.count) {
-        if (a.ids[i] == b.ids[j]) {
-            out.ids[k++] = a.ids[i];
-            ++i;
-            ++j;
-        } else if (a.ids[i] < b.ids[j]) {
-            out.ids[k++] = a.ids[i++];
-        } else {
-            out.ids[k++] = b.ids[j++];
-        }
-    }
-    while (i < a.count) {
-        out.ids[k++] = a.ids[i++];
-    }
-    while (j < b.count) {
-        out.ids[k++] = b.ids[j++];
+static PostingList op_and(QueryArena* arena, const PostingList& a, const PostingList& b) {
+    std::uint32_t max_size = (a.count < b.count) ? a.count : b.count;
+    std::uint32_t* ids = arena_ids(arena, max_size);
+    if (!ids) {
+        return PostingList{nullptr, 0, nullptr};
     }
-    out.count = k;
-    return out;
+    return PostingList{ids, intersect_sorted(a.ids, a.count, b.ids, b.count, ids), nullptr};
 }
 
-static PostingList op_not(const IndexData* idx, const PostingList& a) {
-    PostingList out{nullptr, 0};
-    out.ids = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * idx->universe_count));
-    if (!out.ids && idx->universe_count > 0) {
-        return PostingList{nullptr, 0};
+static PostingList op_not(const IndexData* idx, QueryArena* arena, const PostingList& a) {
+    std::uint32_t* ids = arena_ids(arena, idx->universe_count);
+    if (!ids) {
+        return PostingList{nullptr, 0, nullptr};
     }
     std::uint32_t i = 0, j = 0, k = 0;
     while (i < idx->universe_count) {
         if (j >= a.count) {
-            out.ids[k++] = idx->universe_ids[i++];
+            ids[k++] = idx->universe_ids[i++];
             continue;
         }
         if (idx->universe_ids[i] == a.ids[j]) {
             ++i;
             ++j;
         } else if (idx->universe_ids[i] < a.ids[j]) {
-            out.ids[k++] = idx->universe_ids[i++];
+            ids[k++] = idx->universe_ids[i++];
         } else {
             ++j;
         }
     }
-    out.count = k;
-    return out;
+    return PostingList{ids, k, nullptr};
 }
 
-static int posting_push(PostingList** arr, std::uint32_t* count, std::uint32_t* cap, PostingList v) {
-    if (*count >= *cap) {
-        std::uint32_t new_cap = (*cap == 0) ? 16 : (*cap * 2);
-        PostingList* new_arr = static_cast<PostingList*>(std::realloc(*arr, sizeof(PostingList) * new_cap));
-        if (!new_arr) {
-            return 0;
+static PostingList op_andnot(QueryArena* arena, const PostingList& a, const PostingList& b) {
+    std::uint32_t* ids = arena_ids(arena, a.count);
+    if (!ids) {
+        return PostingList{nullptr, 0, nullptr};
+    }
+    std::uint32_t i = 0, j = 0, k = 0;
+    while (i < a.count) {
+        if (j >= b.count || a.ids[i] < b.ids[j]) {
+            ids[k++] = a.ids[i++];
+        } else if (a.ids[i] == b.ids[j]) {
+            ++i;
+            ++j;
+        } else {
+            ++j;
         }
-        *arr = new_arr;
-        *cap = new_cap;
     }
-    (*arr)[*count] = v;
-    (*count)++;
-    return 1;
+    return PostingList{ids, k, nullptr};
 }
 
-static PostingList posting_pop(PostingList* arr, std::uint32_t* count) {
-    PostingList empty{nullptr, 0};
-    if (*count == 0) {
-        return empty;
+/* Removes the ids of a packed list from a decoded one, probing the packed side with a cursor. */
+static PostingList op_andnot_packed(const IndexData* idx, QueryArena* arena, const PostingList& a,
+                                    const PostingList& packed) {
+    std::uint32_t* ids = arena_ids(arena, a.count);
+    if (!ids) {
+        return PostingList{nullptr, 0, nullptr};
+    }
+    PackedCursor cur;
+    packed_cursor_init(&cur, idx->postings_codec, packed);
+    std::uint32_t found = 0;
+    int has = a.count > 0 && packed_cursor_next_geq(&cur, a.ids[0], &found);
+    std::uint32_t k = 0;
+    for (std::uint32_t i = 0; i < a.count; ++i) {
+        if (has && found < a.ids[i]) {
+            has = packed_cursor_next_geq(&cur, a.ids[i], &found);
+        }
+        if (!has || found != a.ids[i]) {
+            ids[k++] = a.ids[i];
+        }
     }
-    (*count)--;
-    return arr[*count];
+    return PostingList{ids, k, nullptr};
 }
 
-static PostingList eval_rpn(const IndexData* idx, Token* rpn, std::uint32_t rpn_count, int* ok) {
-    PostingList* stack = nullptr;
-    std::uint32_t sp = 0;
-    std::uint32_t sc = 0;
-    *ok = 0;
+/*
+ * N-ary union. Wide ORs whose inputs could fill a noticeable part of the doc
+ * id space are OR-ed into a bitmap and read back in order; sparse ones go
+ * through a min-heap merge of the inputs. Either way packed inputs are read
+ * straight from the index (decoded into one shared buffer, or stepped with
+ * cursors) and all scratch comes from the query arena.
+ */
+const std::uint32_t UNION_BITMAP_SPARSITY = 64; /* bitmap once inputs hold >= 1 id per 64 doc ids */
 
-    for (std::uint32_t i = 0; i < rpn_count; ++i) {
-        Token t = rpn[i];
-        if (t.type == TOK_TERM) {
-            std::uint64_t offset = 0;
-            std::uint32_t cnt = 0;
-            if (!lexicon_find(idx, t.text, &offset, &cnt)) {
-                PostingList pl{nullptr, 0};
-                if (!posting_push(&stack, &sp, &sc, pl)) {
-                    return PostingList{nullptr, 0};
-                }
-            } else {
-                std::uint64_t start = offset / sizeof(std::uint32_t);
-                if (start + cnt > idx->postings_total) {
-                    return PostingList{nullptr, 0};
-                }
-                PostingList pl = clone_postings(idx->postings_data + start, cnt);
-                if (cnt > 0 && !pl.ids) {
-                    return PostingList{nullptr, 0};
-                }
-                if (!posting_push(&stack, &sp, &sc, pl)) {
-                    return PostingList{nullptr, 0};
-                }
-            }
-            continue;
-        }
-        if (t.type == TOK_NOT) {
-            if (sp < 1) {
-                return PostingList{nullptr, 0};
-            }
-            PostingList a = posting_pop(stack, &sp);
-            PostingList c = op_not(idx, a);
-            std::free(a.ids);
-            if (idx->universe_count > 0 && !c.ids) {
-                return PostingList{nullptr, 0};
-            }
-            if (!posting_push(&stack, &sp, &sc, c)) {
-                return PostingList{nullptr, 0};
-            }
-            continue;
-        }
-        if (t.type == TOK_AND || t.type == TOK_OR) {
-            if (sp < 2) {
-                return PostingList{nullptr, 0};
-            }
-            PostingList b = posting_pop(stack, &sp);
-            PostingList a = posting_pop(stack, &sp);
-            PostingList c = (t.type == TOK_AND) ? op_and(a, b) : op_or(a, b);
-            std::free(a.ids);
-            std::free(b.ids);
-            if (((t.type == TOK_AND ? (a.count < b.count ? a.count : b.count) : (a.count + b.count)) > 0) && !c.ids) {
-                return PostingList{nullptr, 0};
-            }
-            if (!posting_push(&stack, &sp, &sc, c)) {
-                return PostingList{nullptr, 0};
-            }
-            continue;
+struct UnionInput {
+    const PostingList* list;
+    PackedCursor cur;
+    std::uint32_t pos;
+    std::uint32_t head;
+};
+
+static int union_input_next(UnionInput* in) {
+    if (!in->list->packed) {
+        if (in->pos >= in->list->count) {
+            return 0;
         }
+        in->head = in->list->ids[in->pos++];
+        return 1;
+    }
+    if (in->pos++ >= in->list->count) {
+        return 0;
     }
+    return packed_cursor_next_geq(&in->cur, (in->pos == 1) ? 0 : in->head + 1, &in->head);
+}
 
-    if (sp != 1) {
-        if (stack) {
-            for (std::uint32_t i = 0; i < sp; ++i) {
-                std::free(stack[i].ids);
-            }
-            std::free(stack);
+static void union_sift_down(UnionInput* inputs, std::uint32_t* heap, std::uint32_t size, std::uint32_t i) {
+    while (true) {
+        std::uint32_t l = 2 * i + 1;
+        if (l >= size) {
+            return;
+        }
+        std::uint32_t m = (l + 1 < size && inputs[heap[l + 1]].head < inputs[heap[l]].head) ? l + 1 : l;
+        if (inputs[heap[i]].head <= inputs[heap[m]].head) {
+            return;
         }
-        return PostingList{nullptr, 0};
+        std::uint32_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
     }
-    PostingList out = stack[0];
-    std::free(stack);
-    *ok = 1;
-    return out;
 }
 
-static void print_results(const IndexData* idx, const PostingList& res, std::uint32_t offset, std::uint32_t limit) {
-    std::printf("TOTAL\t%u\n", res.count);
-    if (offset >= res.count) {
-        return;
+static PostingList union_heap(const IndexData* idx, QueryArena* arena, const PostingList* lists, std::uint32_t n,
+                              std::uint64_t total) {
+    UnionInput* inputs = static_cast<UnionInput*>(arena_alloc(arena, sizeof(UnionInput) * n));
+    std::uint32_t* heap = arena_ids(arena, n);
+    std::uint32_t* ids = arena_ids(arena, total);
+    if (!inputs || !heap || !ids) {
+        return PostingList{nullptr, 0, nullptr};
+    }
+    std::uint32_t size = 0;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        inputs[i].list = &lists[i];
+        inputs[i].pos = 0;
+        if (lists[i].packed) {
+            packed_cursor_init(&inputs[i].cur, idx->postings_codec, lists[i]);
+        }
+        if (union_input_next(&inputs[i])) {
+            heap[size++] = i;
+        }
     }
-    std::uint32_t end = offset + limit;
-    if (end > res.count) {
-        end = res.count;
+    for (std::uint32_t i = size / 2; i-- > 0;) {
+        union_sift_down(inputs, heap, size, i);
     }
-    for (std::uint32_t i = offset; i < end; ++i) {
-        std::uint32_t doc_id = res.ids[i];
-        const char* title = "";
-        const char* url = "";
-        if (doc_id <= idx->max_doc_id && idx->metas_by_id[doc_id].title && idx->metas_by_id[doc_id].url) {
-            title = idx->metas_by_id[doc_id].title;
-            url = idx->metas_by_id[doc_id].url;
+    std::uint32_t k = 0;
+    while (size > 0) {
+        UnionInput* top = &inputs[heap[0]];
+        if (k == 0 || ids[k - 1] != top->head) {
+            ids[k++] = top->head;
         }
-        std::printf("DOC\t%u\t%s\t%s\n", doc_id, title, url);
+        if (!union_input_next(top)) {
+            heap[0] = heap[--size];
+        }
+        union_sift_down(inputs, heap, size, 0);
     }
+    return PostingList{ids, k, nullptr};
 }
 
-static int run_single_query(const IndexData* idx, const char* query, std::uint32_t offset, std::uint32_t limit) {
-    Token* tokens = nullptr;
-    std::uint32_t tok_count = 0;
-    if (!tokenize_query(query, &tokens, &tok_count)) {
-        std::fprintf(stderr, "Failed to tokenize query\n");
-        return 0;
-    }
-    if (tok_count == 0) {
-        std::printf("TOTAL\t0\n");
-        std::free(tokens);
+static int bitmap_set_ids(QueryArena* arena, std::uint64_t** words, std::uint64_t* word_count,
+                          const std::uint32_t* ids, std::uint32_t count) {
+    if (count == 0) {
         return 1;
     }
+    std::uint64_t need = static_cast<std::uint64_t>(ids[count - 1] >> 6) + 1;
+    if (need > *word_count) {
+        std::uint64_t* grown = static_cast<std::uint64_t*>(arena_alloc(arena, sizeof(std::uint64_t) * need));
+        if (!grown) {
+            return 0;
+        }
+        std::memcpy(grown, *words, sizeof(std::uint64_t) * *word_count);
+        std::memset(grown + *word_count, 0, sizeof(std::uint64_t) * (need - *word_count));
+        arena->copied += sizeof(std::uint64_t) * *word_count;
+        *words = grown;
+        *word_count = need;
+    }
+    for (std::uint32_t i = 0; i < count; ++i) {
+        (*words)[ids[i] >> 6] |= 1ULL << (ids[i] & 63);
+    }
+    return 1;
+}
+
+static PostingList union_bitmap(const IndexData* idx, QueryArena* arena, const PostingList* lists, std::uint32_t n) {
+    std::uint64_t word_count = static_cast<std::uint64_t>(idx->max_doc_id >> 6) + 1;
+    std::uint64_t* words = static_cast<std::uint64_t*>(arena_alloc(arena, sizeof(std::uint64_t) * word_count));
+    if (words) {
+        std::memset(words, 0, sizeof(std::uint64_t) * word_count);
+    }
+    std::uint32_t scratch_count = 0;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        if (lists[i].packed && lists[i].count > scratch_count) {
+            scratch_count = lists[i].count;
+        }
+    }
+    std::uint32_t* scratch = arena_ids(arena, scratch_count);
+    int ok = words && scratch;
+    for (std::uint32_t i = 0; ok && i < n; ++i) {
+        const std::uint32_t* ids = lists[i].ids;
+        if (lists[i].packed) {
+            if (idx->postings_codec == INDEX_CODEC_PEF) {
+                pef_codec_decode(lists[i].packed, lists[i].count, scratch);
+            } else {
+                block_codec_decode(lists[i].packed, lists[i].count, scratch);
+            }
+            ids = scratch;
+        }
+        ok = bitmap_set_ids(arena, &words, &word_count, ids, lists[i].count);
+    }
+
+    std::uint64_t count = 0;
+    for (std::uint64_t w = 0; ok && w < word_count; ++w) {
+        count += static_cast<std::uint64_t>(__builtin_popcountll(words[w]));
+    }
+    std::uint32_t* out = ok ? arena_ids(arena, count) : nullptr;
+    if (!out) {
+        return PostingList{nullptr, 0, nullptr};
+    }
+    std::uint32_t k = 0;
+    for (std::uint64_t w = 0; w < word_count; ++w) {
+        std::uint64_t word = words[w];
+        while (word) {
+            out[k++] = static_cast<std::uint32_t>((w << 6) + static_cast<std::uint64_t>(__builtin_ctzll(word)));
+            word &= word - 1;
+        }
+    }
+    return PostingList{out, k, nullptr};
+}
+
+/* Unions n lists (decoded or packed); returns 0 on allocation failure. */
+static int op_union(const IndexData* idx, QueryArena* arena, const PostingList* lists, std::uint32_t n,
+                    PostingList* out) {
+    std::uint64_t total = 0;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        total += lists[i].count;
+    }
+    *out = PostingList{nullptr, 0, nullptr};
+    if (total == 0) {
+        return 1;
+    }
+    if (total >= (static_cast<std::uint64_t>(idx->max_doc_id) + 1) / UNION_BITMAP_SPARSITY) {
+        *out = union_bitmap(idx, arena, lists, n);
+    } else {
+        *out = union_heap(idx, arena, lists, n, total);
+    }
+    return out->ids != nullptr;
+}
+
+/*
+ * Query planning. The RPN is turned into a tree of QueryNodes that is
+ * simplified while it is built:
+ *   - nested AND/OR are flattened into n-ary nodes, !!x becomes x; a run of
+ *     one operator is collected from the RPN whole and sorted once, so a
+ *     long "a || b || c ..." costs O(n log n) rather than a node per step;
+ *   - terms missing from the lexicon become NODE_EMPTY and are folded away
+ *     (x && EMPTY = EMPTY, x || EMPTY = x, !EMPTY = ALL, ...);
+ *   - nodes are hash-consed, so repeated subexpressions share one node,
+ *     duplicate operands disappear and x && !x / x || !x fold to constants.
+ * Evaluation then intersects AND operands from the cheapest (fewest
+ * postings) up and applies negated operands as differences against that
+ * result, so "a && !b" never builds the complement of b.
+ */
+enum {
+    NODE_EMPTY = 0,
+    NODE_ALL = 1,
+    NODE_TERM = 2,
+    NODE_NOT = 3,
+    NODE_AND = 4,
+    NODE_OR = 5
+};
+
+struct QueryNode {
+    int type;
+    std::uint64_t postings_offset; /* NODE_TERM */
+    std::uint32_t postings_count;  /* NODE_TERM */
+    std::uint32_t* kids;           /* node indices, sorted; NODE_NOT has one */
+    std::uint32_t kid_count;
+    std::uint64_t cost; /* upper bound on the result size */
+    std::uint32_t uses; /* references from the final plan */
+};
+
+const std::uint32_t PLAN_NO_NODE = 0xFFFFFFFFU;
+
+/* Everything a plan points to lives in its query's arena. */
+struct QueryPlan {
+    QueryArena* arena;
+    QueryNode* nodes;
+    std::uint32_t count;
+    std::uint32_t cap; /* every RPN entry adds at most one node */
+    std::uint32_t root;
+    std::uint64_t universe;
+    std::uint32_t* table; /* node indices by shape hash, PLAN_NO_NODE when free; open addressing */
+    std::uint32_t table_mask;
+};
+
+static std::uint64_t node_cost(const QueryPlan* plan, const QueryNode& n) {
+    if (n.type == NODE_EMPTY) {
+        return 0;
+    }
+    if (n.type == NODE_ALL) {
+        return plan->universe;
+    }
+    if (n.type == NODE_TERM) {
+        return n.postings_count;
+    }
+    if (n.type == NODE_NOT) {
+        std::uint64_t inner = plan->nodes[n.kids[0]].cost;
+        return (inner < plan->universe) ? plan->universe - inner : 0;
+    }
+    std::uint64_t cost = (n.type == NODE_AND) ? plan->universe : 0;
+    for (std::uint32_t i = 0; i < n.kid_count; ++i) {
+        std::uint64_t c = plan->nodes[n.kids[i]].cost;
+        if (n.type == NODE_AND) {
+            cost = (c < cost) ? c : cost;
+        } else {
+            cost += c;
+        }
+    }
+    return (cost < plan->universe) ? cost : plan->universe;
+}
+
+static std::uint64_t node_hash(int type, std::uint64_t postings_offset, const std::uint32_t* kids,
+                               std::uint32_t kid_count) {
+    std::uint64_t key[2] = {postings_offset, (term_hash(reinterpret_cast<const char*>(kids),
+                                                        sizeof(std::uint32_t) * kid_count) << 3) |
+                                                 static_cast<std::uint64_t>(type)};
+    return term_hash(reinterpret_cast<const char*>(key), sizeof(key));
+}
+
+/* Returns the index of the node with this shape, adding it if it is new. */
+static int plan_intern(QueryPlan* plan, int type, std::uint64_t postings_offset, std::uint32_t postings_count,
+                       const std::uint32_t* kids, std::uint32_t kid_count, std::uint32_t* out) {
+    std::uint32_t slot =
+        static_cast<std::uint32_t>(node_hash(type, postings_offset, kids, kid_count)) & plan->table_mask;
+    for (; plan->table[slot] != PLAN_NO_NODE; slot = (slot + 1) & plan->table_mask) {
+        const QueryNode& n = plan->nodes[plan->table[slot]];
+        if (n.type == type && n.postings_offset == postings_offset && n.kid_count == kid_count &&
+            (kid_count == 0 || std::memcmp(n.kids, kids, sizeof(std::uint32_t) * kid_count) == 0)) {
+            *out = plan->table[slot];
+            return 1;
+        }
+    }
+    if (plan->count >= plan->cap) {
+        return 0;
+    }
+    QueryNode n{type, postings_offset, postings_count, nullptr, kid_count, 0, 0};
+    if (kid_count > 0) {
+        n.kids = arena_ids(plan->arena, kid_count);
+        if (!n.kids) {
+            return 0;
+        }
+        std::memcpy(n.kids, kids, sizeof(std::uint32_t) * kid_count);
+    }
+    n.cost = node_cost(plan, n);
+    plan->nodes[plan->count] = n;
+    plan->table[slot] = plan->count;
+    *out = plan->count++;
+    return 1;
+}
+
+static int plan_not(QueryPlan* plan, std::uint32_t kid, std::uint32_t* out) {
+    const QueryNode& k = plan->nodes[kid];
+    if (k.type == NODE_NOT) {
+        *out = k.kids[0];
+        return 1;
+    }
+    if (k.type == NODE_EMPTY || k.type == NODE_ALL) {
+        return plan_intern(plan, k.type == NODE_EMPTY ? NODE_ALL : NODE_EMPTY, 0, 0, nullptr, 0, out);
+    }
+    return plan_intern(plan, NODE_NOT, 0, 0, &kid, 1, out);
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    std::uint32_t x = *static_cast<const std::uint32_t*>(a);
+    std::uint32_t y = *static_cast<const std::uint32_t*>(b);
+    return (x > y) - (x < y);
+}
+
+static int sorted_contains_u32(const std::uint32_t* arr, std::uint32_t n, std::uint32_t v) {
+    std::uint32_t lo = 0;
+    std::uint32_t hi = n;
+    while (lo < hi) {
+        std::uint32_t mid = lo + (hi - lo) / 2;
+        if (arr[mid] < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && arr[lo] == v;
+}
+
+/*
+ * Builds the AND or OR of the n operand nodes of one run, flattening operands of the same type, folding
+ * constants and deduping. kids is arena scratch for *kids_cap ids, replaced by a larger one when flattening
+ * needs more.
+ */
+static int plan_nary(QueryPlan* plan, int type, const std::uint32_t* operands, std::uint32_t n,
+                     std::uint32_t** kids, std::uint32_t* kids_cap, std::uint32_t* out) {
+    int absorbing = (type == NODE_AND) ? NODE_EMPTY : NODE_ALL;
+    int neutral = (type == NODE_AND) ? NODE_ALL : NODE_EMPTY;
+    std::uint32_t count = 0;
+    int absorbed = 0;
+    for (std::uint32_t i = 0; i < n && !absorbed; ++i) {
+        const QueryNode& op = plan->nodes[operands[i]];
+        const std::uint32_t* src = (op.type == type) ? op.kids : &operands[i];
+        std::uint32_t src_count = (op.type == type) ? op.kid_count : 1;
+        if (count + src_count > *kids_cap) {
+            std::uint32_t new_cap = (*kids_cap * 2 > count + src_count) ? *kids_cap * 2 : count + src_count;
+            std::uint32_t* grown = arena_ids(plan->arena, new_cap);
+            if (!grown) {
+                return 0;
+            }
+            std::memcpy(grown, *kids, sizeof(std::uint32_t) * count);
+            *kids = grown;
+            *kids_cap = new_cap;
+        }
+        for (std::uint32_t j = 0; j < src_count; ++j) {
+            int kt = plan->nodes[src[j]].type;
+            if (kt == absorbing) {
+                absorbed = 1;
+            } else if (kt != neutral) {
+                (*kids)[count++] = src[j];
+            }
+        }
+    }
+
+    std::uint32_t* k = *kids;
+    if (!absorbed && count > 1) {
+        std::qsort(k, count, sizeof(std::uint32_t), cmp_u32);
+        std::uint32_t unique = 1;
+        for (std::uint32_t i = 1; i < count; ++i) {
+            if (k[i] != k[unique - 1]) {
+                k[unique++] = k[i];
+            }
+        }
+        count = unique;
+        for (std::uint32_t i = 0; i < count && !absorbed; ++i) {
+            const QueryNode& kid = plan->nodes[k[i]];
+            absorbed = kid.type == NODE_NOT && sorted_contains_u32(k, count, kid.kids[0]);
+        }
+    }
+
+    if (absorbed || count == 0) {
+        return plan_intern(plan, absorbed ? absorbing : neutral, 0, 0, nullptr, 0, out);
+    }
+    if (count == 1) {
+        *out = k[0];
+        return 1;
+    }
+    return plan_intern(plan, type, 0, 0, k, count, out);
+}
+
+static void plan_count_uses(QueryPlan* plan, std::uint32_t node) {
+    QueryNode& n = plan->nodes[node];
+    if (n.uses++ > 0) {
+        return;
+    }
+    for (std::uint32_t i = 0; i < n.kid_count; ++i) {
+        plan_count_uses(plan, n.kids[i]);
+    }
+}
+
+/*
+ * Builds the plan bottom-up over the RPN. An AND or OR whose parent is the same operator is not planned on
+ * its own: the topmost operator of such a run collects the run's operands by walking down through it and
+ * builds one n-ary node from them.
+ */
+static int build_plan(const IndexData* idx, QueryArena* arena, const Token* rpn, std::uint32_t rpn_count,
+                      QueryPlan* plan) {
+    *plan = QueryPlan{arena, nullptr, 0, 0, 0, idx->universe_count, nullptr, 0};
+    std::uint32_t table_size = 16;
+    while (table_size < rpn_count * 2) {
+        table_size *= 2;
+    }
+    std::uint32_t scratch_count = rpn_count + 1;
+    plan->nodes = static_cast<QueryNode*>(arena_alloc(arena, sizeof(QueryNode) * scratch_count));
+    plan->cap = scratch_count;
+    plan->table = arena_ids(arena, table_size);
+    plan->table_mask = table_size - 1;
+    /* per RPN entry: its operands' entries, its node, and whether it belongs to its parent's run */
+    std::uint32_t* lhs = arena_ids(arena, scratch_count);
+    std::uint32_t* rhs = arena_ids(arena, scratch_count);
+    std::uint32_t* nodes = arena_ids(arena, scratch_count);
+    unsigned char* in_run = static_cast<unsigned char*>(arena_alloc(arena, scratch_count));
+    std::uint32_t* stack = arena_ids(arena, scratch_count);
+    std::uint32_t* operands = arena_ids(arena, scratch_count);
+    std::uint32_t kids_cap = scratch_count;
+    std::uint32_t* kids = arena_ids(arena, kids_cap);
+    int ok = plan->nodes && plan->table && lhs && rhs && nodes && in_run && stack && operands && kids;
+    if (ok) {
+        std::memset(plan->table, 0xFF, sizeof(std::uint32_t) * table_size);
+        std::memset(in_run, 0, scratch_count);
+    }
+
+    std::uint32_t sp = 0;
+    for (std::uint32_t i = 0; ok && i < rpn_count; ++i) {
+        int type = rpn[i].type;
+        if (type == TOK_NOT) {
+            ok = sp >= 1;
+            lhs[i] = ok ? stack[--sp] : 0;
+        } else if (type == TOK_AND || type == TOK_OR) {
+            ok = sp >= 2;
+            if (ok) {
+                rhs[i] = stack[--sp];
+                lhs[i] = stack[--sp];
+                in_run[lhs[i]] = rpn[lhs[i]].type == type;
+                in_run[rhs[i]] = rpn[rhs[i]].type == type;
+            }
+        } else if (type != TOK_TERM) {
+            continue;
+        }
+        stack[sp++] = i;
+    }
+    ok = ok && sp == 1;
+    std::uint32_t root = ok ? stack[0] : 0;
+
+    for (std::uint32_t i = 0; ok && i < rpn_count; ++i) {
+        Token t = rpn[i];
+        if (t.type == TOK_TERM) {
+            std::uint64_t offset = 0;
+            std::uint32_t cnt = 0;
+            if (lexicon_find(idx, t.text, &offset, &cnt)) {
+                ok = plan_intern(plan, NODE_TERM, offset, cnt, nullptr, 0, &nodes[i]);
+            } else {
+                ok = plan_intern(plan, NODE_EMPTY, 0, 0, nullptr, 0, &nodes[i]);
+            }
+        } else if (t.type == TOK_NOT) {
+            ok = plan_not(plan, nodes[lhs[i]], &nodes[i]);
+        } else if ((t.type == TOK_AND || t.type == TOK_OR) && !in_run[i]) {
+            std::uint32_t n = 0;
+            sp = 0;
+            stack[sp++] = i;
+            while (sp > 0) {
+                std::uint32_t e = stack[--sp];
+                if (rpn[e].type == t.type) {
+                    stack[sp++] = rhs[e];
+                    stack[sp++] = lhs[e];
+                } else {
+                    operands[n++] = nodes[e];
+                }
+            }
+            ok = plan_nary(plan, t.type == TOK_AND ? NODE_AND : NODE_OR, operands, n, &kids, &kids_cap, &nodes[i]);
+        }
+    }
+    if (ok) {
+        plan->root = nodes[root];
+        plan_count_uses(plan, plan->root);
+    }
+    return ok;
+}
+
+/*
+ * Operand order for an n-ary node: for AND, plain operands by increasing
+ * cost followed by the negated ones (stored as their inner node, flagged in
+ * negated); for OR, all operands by increasing cost.
+ */
+static void order_operands(const QueryPlan* plan, const QueryNode& n, std::uint32_t* order, int* negated,
+                           std::uint32_t* positive_count) {
+    std::uint32_t pos = 0;
+    for (std::uint32_t i = 0; i < n.kid_count; ++i) {
+        const QueryNode& k = plan->nodes[n.kids[i]];
+        int neg = n.type == NODE_AND && k.type == NODE_NOT;
+        order[i] = neg ? k.kids[0] : n.kids[i];
+        negated[i] = neg;
+        pos += neg ? 0 : 1;
+    }
+    for (std::uint32_t i = 1; i < n.kid_count; ++i) {
+        std::uint32_t v = order[i];
+        int neg = negated[i];
+        std::uint64_t key = plan->nodes[v].cost;
+        std::uint32_t j = i;
+        for (; j > 0 && (negated[j - 1] > neg || (negated[j - 1] == neg && plan->nodes[order[j - 1]].cost > key));
+             --j) {
+            order[j] = order[j - 1];
+            negated[j] = negated[j - 1];
+        }
+        order[j] = v;
+        negated[j] = neg;
+    }
+    *positive_count = pos;
+}
+
+struct NodeResult {
+    PostingList list;
+    int ready;
+};
+
+static int eval_node(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, std::uint32_t node,
+                     NodeResult* cache, PostingList* out);
+
+/* Evaluates an operand, decoding it unless the caller can consume a packed list. */
+static int eval_operand(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, std::uint32_t node,
+                        NodeResult* cache, int allow_packed, PostingList* out) {
+    return eval_node(idx, arena, plan, node, cache, out) && (allow_packed || materialize(idx, arena, out));
+}
+
+static int eval_union(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, const QueryNode& n,
+                      NodeResult* cache, PostingList* out) {
+    PostingList* lists = static_cast<PostingList*>(arena_alloc(arena, sizeof(PostingList) * n.kid_count));
+    if (!lists) {
+        return 0;
+    }
+    int ok = 1;
+    for (std::uint32_t i = 0; ok && i < n.kid_count; ++i) {
+        ok = eval_operand(idx, arena, plan, n.kids[i], cache, 1, &lists[i]);
+    }
+    return ok && op_union(idx, arena, lists, n.kid_count, out);
+}
+
+static int eval_nary(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, const QueryNode& n,
+                     NodeResult* cache, PostingList* out) {
+    if (n.type == NODE_OR) {
+        return eval_union(idx, arena, plan, n, cache, out);
+    }
+    std::uint32_t* order = arena_ids(arena, n.kid_count);
+    int* negated = static_cast<int*>(arena_alloc(arena, sizeof(int) * n.kid_count));
+    if (!order || !negated) {
+        return 0;
+    }
+    std::uint32_t positive_count = 0;
+    order_operands(plan, n, order, negated, &positive_count);
+
+    PostingList acc{idx->universe_ids, idx->universe_count, nullptr};
+    std::uint32_t first = 0;
+    if (positive_count > 0) {
+        if (!eval_operand(idx, arena, plan, order[0], cache, 0, &acc)) {
+            return 0;
+        }
+        first = 1;
+    }
+    for (std::uint32_t i = first; i < n.kid_count && acc.count > 0; ++i) {
+        PostingList b{nullptr, 0, nullptr};
+        if (!eval_operand(idx, arena, plan, order[i], cache, 1, &b)) {
+            return 0;
+        }
+        if (negated[i]) {
+            acc = b.packed ? op_andnot_packed(idx, arena, acc, b) : op_andnot(arena, acc, b);
+        } else {
+            acc = b.packed ? op_and_packed(idx, arena, acc, b) : op_and(arena, acc, b);
+        }
+        if (!acc.ids) {
+            return 0;
+        }
+    }
+    *out = acc;
+    return 1;
+}
+
+static int eval_node(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, std::uint32_t node,
+                     NodeResult* cache, PostingList* out) {
+    const QueryNode& n = plan->nodes[node];
+    if (cache[node].ready) {
+        *out = cache[node].list;
+        return 1;
+    }
+
+    PostingList res{nullptr, 0, nullptr};
+    int ok = 1;
+    if (n.type == NODE_ALL) {
+        res = PostingList{idx->universe_ids, idx->universe_count, nullptr};
+    } else if (n.type == NODE_TERM && idx->postings_codec != INDEX_CODEC_RAW) {
+        if (n.postings_offset > idx->postings_data_bytes) {
+            return 0;
+        }
+        res = PostingList{nullptr, n.postings_count, idx->postings_bytes + n.postings_offset};
+    } else if (n.type == NODE_TERM) {
+        std::uint64_t start = n.postings_offset / sizeof(std::uint32_t);
+        if (start + n.postings_count > idx->postings_total) {
+            return 0;
+        }
+        res = PostingList{idx->postings_data + start, n.postings_count, nullptr};
+    } else if (n.type == NODE_NOT) {
+        PostingList a{nullptr, 0, nullptr};
+        ok = eval_operand(idx, arena, plan, n.kids[0], cache, 0, &a);
+        if (ok) {
+            res = op_not(idx, arena, a);
+            ok = res.ids != nullptr;
+        }
+    } else if (n.type == NODE_AND || n.type == NODE_OR) {
+        ok = eval_nary(idx, arena, plan, n, cache, &res);
+    }
+    if (!ok) {
+        return 0;
+    }
+
+    /* Results live until the arena is dropped, so a shared node just hands out its list again. */
+    if (n.uses > 1 && !res.packed) {
+        cache[node].list = res;
+        cache[node].ready = 1;
+    }
+    *out = res;
+    return 1;
+}
+
+/* The result points into the index or the arena and lives as long as both. */
+static PostingList eval_plan(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, int* ok) {
+    *ok = 0;
+    NodeResult* cache = static_cast<NodeResult*>(arena_alloc(arena, sizeof(NodeResult) * plan->count));
+    if (!cache) {
+        return PostingList{nullptr, 0, nullptr};
+    }
+    std::memset(cache, 0, sizeof(NodeResult) * plan->count);
+    PostingList out{nullptr, 0, nullptr};
+    *ok = eval_node(idx, arena, plan, plan->root, cache, &out) && materialize(idx, arena, &out);
+    return out;
+}
+
+/*
+ * Evaluation for INDEX_CODEC_HYBRID indexes. Term lists are viewed in place as
+ * container sets and every operator works chunk by chunk, so dense chunks are
+ * combined a word at a time and NOT is a difference against the document set.
+ */
+struct SetResult {
+    RoaringSet set;
+    int ready;
+};
+
+static int eval_node_hybrid(const IndexData* idx, const QueryPlan* plan, std::uint32_t node, SetResult* cache,
+                            RoaringSet* out);
+
+static int eval_nary_hybrid(const IndexData* idx, const QueryPlan* plan, const QueryNode& n, SetResult* cache,
+                            RoaringSet* out) {
+    std::uint32_t* order = arena_ids(plan->arena, n.kid_count);
+    int* negated = static_cast<int*>(arena_alloc(plan->arena, sizeof(int) * n.kid_count));
+    if (!order || !negated) {
+        return 0;
+    }
+    std::uint32_t positive_count = 0;
+    order_operands(plan, n, order, negated, &positive_count);
+
+    RoaringSet acc{};
+    std::uint32_t first = 1;
+    int ok = 1;
+    if (positive_count == 0) {
+        ok = roaring_copy(&idx->universe_set, &acc);
+        first = 0;
+    } else {
+        ok = eval_node_hybrid(idx, plan, order[0], cache, &acc);
+    }
+    for (std::uint32_t i = first; ok && i < n.kid_count; ++i) {
+        if (n.type == NODE_AND && acc.cardinality == 0) {
+            break;
+        }
+        RoaringSet b{};
+        if (!eval_node_hybrid(idx, plan, order[i], cache, &b)) {
+            ok = 0;
+            break;
+        }
+        RoaringSet c{};
+        if (n.type == NODE_OR) {
+            ok = roaring_or(&acc, &b, &c);
+        } else if (negated[i]) {
+            ok = roaring_andnot(&acc, &b, &c);
+        } else {
+            ok = roaring_and(&acc, &b, &c);
+        }
+        roaring_free(&acc);
+        roaring_free(&b);
+        acc = c;
+    }
+    if (!ok) {
+        roaring_free(&acc);
+        return 0;
+    }
+    *out = acc;
+    return 1;
+}
+
+static int eval_node_hybrid(const IndexData* idx, const QueryPlan* plan, std::uint32_t node, SetResult* cache,
+                            RoaringSet* out) {
+    const QueryNode& n = plan->nodes[node];
+    if (cache[node].ready) {
+        return roaring_copy(&cache[node].set, out);
+    }
+
+    RoaringSet res{};
+    int ok = 1;
+    if (n.type == NODE_ALL) {
+        ok = roaring_copy(&idx->universe_set, &res);
+    } else if (n.type == NODE_TERM) {
+        ok = n.postings_offset + sizeof(RoaringListHeader) <= idx->postings_data_bytes &&
+             roaring_view(idx->postings_bytes + n.postings_offset, &res);
+    } else if (n.type == NODE_NOT) {
+        RoaringSet a{};
+        ok = eval_node_hybrid(idx, plan, n.kids[0], cache, &a) && roaring_andnot(&idx->universe_set, &a, &res);
+        roaring_free(&a);
+    } else if (n.type == NODE_AND || n.type == NODE_OR) {
+        ok = eval_nary_hybrid(idx, plan, n, cache, &res);
+    }
+    if (!ok) {
+        return 0;
+    }
+
+    if (n.uses > 1 && n.type != NODE_TERM) {
+        cache[node].ready = roaring_copy(&res, &cache[node].set);
+    }
+    *out = res;
+    return 1;
+}
+
+static int eval_plan_hybrid(const IndexData* idx, const QueryPlan* plan, RoaringSet* out) {
+    SetResult* cache = static_cast<SetResult*>(arena_alloc(plan->arena, sizeof(SetResult) * plan->count));
+    if (!cache) {
+        return 0;
+    }
+    std::memset(cache, 0, sizeof(SetResult) * plan->count);
+    int ok = eval_node_hybrid(idx, plan, plan->root, cache, out);
+    for (std::uint32_t i = 0; i < plan->count; ++i) {
+        roaring_free(&cache[i].set);
+    }
+    return ok;
+}
+
+/*
+ * Document-at-a-time evaluation for pages of results. The plan is turned
+ * into a tree of DocIters that all expose advance(target) (move to the first
+ * doc >= target) and next(); the root is pulled only until offset + limit + 1
+ * docs have been seen, so a first page touches a prefix of every list, and a
+ * page that starts from a cursor (the last doc id of the previous page)
+ * starts with one advance instead of recomputing the pages before it.
+ */
+enum {
+    ITER_LIST = 0,   /* sorted ids in memory: raw postings or the document set */
+    ITER_PACKED = 1, /* compressed term list read through a PackedCursor */
+    ITER_AND = 2,    /* kids[0..positive_count) intersected, the rest subtracted */
+    ITER_OR = 3,
+    ITER_NOT = 4 /* document set (ids) minus kids[0] */
+};
 
-    Token* rpn = nullptr;
-    std::uint32_t rpn_count = 0;
-    if (!to_rpn(tokens, tok_count, &rpn, &rpn_count)) {
-        std::fprintf(stderr, "Failed to parse query\n");
-        free_tokens(tokens, tok_count);
-        return 0;
-    }
-
+struct DocIter {
+    int type;
+    int started;
+    int done;
+    std::uint32_t doc;
+
+    const std::uint32_t* ids;
+    std::uint32_t count;
+    std::uint32_t pos;
+    PackedCursor* cur;
+
+    DocIter** kids;
+    std::uint32_t kid_count;
+    std::uint32_t positive_count;
+};
+
+static DocIter* iter_new(QueryArena* arena, int type, std::uint32_t kid_count) {
+    DocIter* it = static_cast<DocIter*>(arena_alloc(arena, sizeof(DocIter)));
+    DocIter** kids = static_cast<DocIter**>(arena_alloc(arena, sizeof(DocIter*) * kid_count));
+    if (!it || !kids) {
+        return nullptr;
+    }
+    std::memset(it, 0, sizeof(DocIter));
+    it->type = type;
+    it->kids = kids;
+    it->kid_count = kid_count;
+    return it;
+}
+
+/* Moves pos to the first id >= target by galloping; returns 0 past the end. */
+static int list_seek(const std::uint32_t* ids, std::uint32_t count, std::uint32_t* pos, std::uint32_t target) {
+    std::uint32_t i = *pos;
+    if (i < count && ids[i] < target) {
+        std::uint32_t bound = 1;
+        while (bound < count - i && ids[i + bound] < target) {
+            bound <<= 1;
+        }
+        std::uint32_t lo = i + bound / 2 + 1;
+        std::uint32_t hi = (bound < count - i) ? i + bound : count;
+        while (lo < hi) {
+            std::uint32_t mid = lo + (hi - lo) / 2;
+            if (ids[mid] < target) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        i = lo;
+    }
+    *pos = i;
+    return i < count;
+}
+
+static void iter_advance(DocIter* it, std::uint32_t target);
+
+static void iter_next(DocIter* it) {
+    if (it->doc == UINT32_MAX) {
+        it->done = 1;
+        return;
+    }
+    iter_advance(it, it->doc + 1);
+}
+
+static void iter_advance(DocIter* it, std::uint32_t target) {
+    if (it->done || (it->started && it->doc >= target)) {
+        return;
+    }
+    it->started = 1;
+    std::uint32_t t = target;
+    if (it->type == ITER_LIST) {
+        if (!list_seek(it->ids, it->count, &it->pos, t)) {
+            it->done = 1;
+            return;
+        }
+        it->doc = it->ids[it->pos];
+    } else if (it->type == ITER_PACKED) {
+        if (!packed_cursor_next_geq(it->cur, t, &it->doc)) {
+            it->done = 1;
+        }
+    } else if (it->type == ITER_OR) {
+        int any = 0;
+        for (std::uint32_t i = 0; i < it->kid_count; ++i) {
+            DocIter* k = it->kids[i];
+            iter_advance(k, t);
+            if (!k->done && (!any || k->doc < it->doc)) {
+                it->doc = k->doc;
+                any = 1;
+            }
+        }
+        it->done = !any;
+    } else if (it->type == ITER_NOT) {
+        while (true) {
+            if (!list_seek(it->ids, it->count, &it->pos, t)) {
+                it->done = 1;
+                return;
+            }
+            t = it->ids[it->pos];
+            DocIter* k = it->kids[0];
+            iter_advance(k, t);
+            if (k->done || k->doc != t) {
+                break;
+            }
+            if (t == UINT32_MAX) {
+                it->done = 1;
+                return;
+            }
+            ++t;
+        }
+        it->doc = t;
+    } else {
+        /* Leapfrog the positive operands to a common doc, then reject it if a negated one has it. */
+        std::uint32_t i = 0;
+        while (i < it->kid_count) {
+            DocIter* k = it->kids[i];
+            iter_advance(k, t);
+            if (k->done) {
+                if (i < it->positive_count) {
+                    it->done = 1;
+                    return;
+                }
+                ++i;
+                continue;
+            }
+            if (i < it->positive_count) {
+                if (k->doc > t) {
+                    t = k->doc;
+                    i = (i == 0) ? 1 : 0;
+                    continue;
+                }
+            } else if (k->doc == t) {
+                if (t == UINT32_MAX) {
+                    it->done = 1;
+                    return;
+                }
+                ++t;
+                i = 0;
+                continue;
+            }
+            ++i;
+        }
+        it->doc = t;
+    }
+}
+
+static DocIter* iter_list(QueryArena* arena, const std::uint32_t* ids, std::uint32_t count) {
+    DocIter* it = iter_new(arena, ITER_LIST, 0);
+    if (it) {
+        it->ids = ids;
+        it->count = count;
+    }
+    return it;
+}
+
+static DocIter* build_iter(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, std::uint32_t node) {
+    const QueryNode& n = plan->nodes[node];
+    if (n.type == NODE_EMPTY) {
+        return iter_list(arena, nullptr, 0);
+    }
+    if (n.type == NODE_ALL) {
+        return iter_list(arena, idx->universe_ids, idx->universe_count);
+    }
+    if (n.type == NODE_TERM && idx->postings_codec == INDEX_CODEC_RAW) {
+        std::uint64_t start = n.postings_offset / sizeof(std::uint32_t);
+        if (start + n.postings_count > idx->postings_total) {
+            return nullptr;
+        }
+        return iter_list(arena, idx->postings_data + start, n.postings_count);
+    }
+    if (n.type == NODE_TERM) {
+        if (n.postings_offset > idx->postings_data_bytes) {
+            return nullptr;
+        }
+        DocIter* it = iter_new(arena, ITER_PACKED, 0);
+        PackedCursor* cur = static_cast<PackedCursor*>(arena_alloc(arena, sizeof(PackedCursor)));
+        if (!it || !cur) {
+            return nullptr;
+        }
+        PostingList packed{nullptr, n.postings_count, idx->postings_bytes + n.postings_offset};
+        packed_cursor_init(cur, idx->postings_codec, packed);
+        it->cur = cur;
+        return it;
+    }
+    if (n.type == NODE_NOT) {
+        DocIter* it = iter_new(arena, ITER_NOT, 1);
+        if (!it) {
+            return nullptr;
+        }
+        it->ids = idx->universe_ids;
+        it->count = idx->universe_count;
+        it->kids[0] = build_iter(idx, arena, plan, n.kids[0]);
+        return it->kids[0] ? it : nullptr;
+    }
+
+    std::uint32_t* order = arena_ids(arena, n.kid_count);
+    int* negated = static_cast<int*>(arena_alloc(arena, sizeof(int) * n.kid_count));
+    if (!order || !negated) {
+        return nullptr;
+    }
+    std::uint32_t positive_count = 0;
+    order_operands(plan, n, order, negated, &positive_count);
+    /* An AND of negations only walks the document set as its positive operand. */
+    std::uint32_t extra = (n.type == NODE_AND && positive_count == 0) ? 1 : 0;
+    DocIter* it = iter_new(arena, n.type == NODE_AND ? ITER_AND : ITER_OR, n.kid_count + extra);
+    if (!it) {
+        return nullptr;
+    }
+    if (extra) {
+        it->kids[0] = iter_list(arena, idx->universe_ids, idx->universe_count);
+        if (!it->kids[0]) {
+            return nullptr;
+        }
+    }
+    for (std::uint32_t i = 0; i < n.kid_count; ++i) {
+        it->kids[i + extra] = build_iter(idx, arena, plan, order[i]);
+        if (!it->kids[i + extra]) {
+            return nullptr;
+        }
+    }
+    it->positive_count = positive_count + extra;
+    return it;
+}
+
+/* Fraction of the document set a node is expected to match, assuming independent terms. */
+static double node_selectivity(const QueryPlan* plan, std::uint32_t node) {
+    const QueryNode& n = plan->nodes[node];
+    if (n.type == NODE_EMPTY || plan->universe == 0) {
+        return 0.0;
+    }
+    if (n.type == NODE_ALL) {
+        return 1.0;
+    }
+    if (n.type == NODE_TERM) {
+        double s = static_cast<double>(n.postings_count) / static_cast<double>(plan->universe);
+        return (s < 1.0) ? s : 1.0;
+    }
+    if (n.type == NODE_NOT) {
+        return 1.0 - node_selectivity(plan, n.kids[0]);
+    }
+    double s = 1.0;
+    for (std::uint32_t i = 0; i < n.kid_count; ++i) {
+        double k = node_selectivity(plan, n.kids[i]);
+        s *= (n.type == NODE_AND) ? k : (1.0 - k);
+    }
+    return (n.type == NODE_AND) ? s : 1.0 - s;
+}
+
+/*
+ * Which slice of the results a query asks for. A cursor is the token printed
+ * on the NEXT line of the previous page; the page then starts right after
+ * the doc it names, and offset counts from there.
+ */
+struct PageRequest {
+    std::uint32_t offset;
+    std::uint32_t limit;
+    int has_cursor;
+    std::uint32_t after; /* last doc id of the previous page */
+    int exact_total;     /* count every match instead of estimating TOTAL */
+};
+
+/* ids live in the query arena. */
+struct ResultPage {
+    std::uint32_t* ids;
+    std::uint32_t count;
+    std::uint32_t cap;
+    std::uint64_t total;
+    int total_exact;
+    int has_more;
+};
+
+static int parse_cursor(const char* token, std::uint32_t* after) {
+    if (token[0] != 'c' || !std::isxdigit(static_cast<unsigned char>(token[1]))) {
+        return 0;
+    }
+    char* end = nullptr;
+    unsigned long long v = std::strtoull(token + 1, &end, 16);
+    if (*end != '\0' || v > UINT32_MAX) {
+        return 0;
+    }
+    *after = static_cast<std::uint32_t>(v);
+    return 1;
+}
+
+static int page_push(QueryArena* arena, ResultPage* page, std::uint32_t doc_id) {
+    if (page->count >= page->cap) {
+        std::uint32_t new_cap = (page->cap == 0) ? 64 : (page->cap * 2);
+        std::uint32_t* grown = arena_ids(arena, new_cap);
+        if (!grown) {
+            return 0;
+        }
+        if (page->count > 0) {
+            std::memcpy(grown, page->ids, sizeof(std::uint32_t) * page->count);
+            arena->copied += sizeof(std::uint32_t) * page->count;
+        }
+        page->ids = grown;
+        page->cap = new_cap;
+    }
+    page->ids[page->count++] = doc_id;
+    return 1;
+}
+
+/* Lazy evaluation: stops as soon as the page and one doc past it are known. */
+static int page_lazy(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, const PageRequest* req,
+                     ResultPage* page) {
+    DocIter* root = build_iter(idx, arena, plan, plan->root);
+    if (!root) {
+        return 0;
+    }
+    if (req->has_cursor && req->after == UINT32_MAX) {
+        root->done = 1;
+    } else {
+        iter_advance(root, req->has_cursor ? req->after + 1 : 0);
+    }
+    std::uint64_t skipped = 0;
+    while (!root->done && skipped < req->offset) {
+        iter_next(root);
+        ++skipped;
+    }
+    int ok = 1;
+    while (ok && !root->done && page->count < req->limit) {
+        ok = page_push(arena, page, root->doc);
+        iter_next(root);
+    }
+    page->has_more = !root->done;
+    int root_type = plan->nodes[plan->root].type;
+    if (!req->has_cursor && root->done) {
+        page->total = skipped + page->count;
+        page->total_exact = 1;
+    } else if (root_type == NODE_TERM || root_type == NODE_ALL || root_type == NODE_EMPTY) {
+        page->total = plan->nodes[plan->root].cost;
+        page->total_exact = 1;
+    } else {
+        std::uint64_t seen = (req->has_cursor ? 0 : skipped) + page->count + (page->has_more ? 1 : 0);
+        std::uint64_t estimate =
+            static_cast<std::uint64_t>(node_selectivity(plan, plan->root) * static_cast<double>(plan->universe) + 0.5);
+        page->total = (estimate > seen) ? estimate : seen;
+    }
+    return ok;
+}
+
+/* Full evaluation, for exact totals. */
+static int page_materialized(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, const PageRequest* req,
+                             ResultPage* page) {
     int ok = 0;
-    PostingList result = eval_rpn(idx, rpn, rpn_count, &ok);
+    PostingList result = eval_plan(idx, arena, plan, &ok);
     if (!ok) {
-        std::fprintf(stderr, "Failed to evaluate query\n");
-        std::free(rpn);
-        free_tokens(tokens, tok_count);
         return 0;
     }
+    std::uint32_t start = 0;
+    if (req->has_cursor) {
+        std::uint32_t hi = result.count;
+        while (start < hi) {
+            std::uint32_t mid = start + (hi - start) / 2;
+            if (result.ids[mid] <= req->after) {
+                start = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+    start = (result.count - start > req->offset) ? start + req->offset : result.count;
+    std::uint32_t want = (result.count - start < req->limit) ? result.count - start : req->limit;
+    page->ids = arena_ids(arena, want);
+    if (!page->ids) {
+        return 0;
+    }
+    if (want > 0) {
+        std::memcpy(page->ids, result.ids + start, sizeof(std::uint32_t) * want);
+        arena->copied += sizeof(std::uint32_t) * want;
+    }
+    page->count = want;
+    page->cap = want;
+    page->has_more = start + want < result.count;
+    page->total = result.count;
+    page->total_exact = 1;
+    return 1;
+}
+
+static int page_hybrid(const IndexData* idx, QueryArena* arena, const QueryPlan* plan, const PageRequest* req,
+                       ResultPage* page) {
+    RoaringSet result{};
+    if (!eval_plan_hybrid(idx, plan, &result)) {
+        return 0;
+    }
+    std::uint64_t start = req->has_cursor ? roaring_rank(&result, req->after) : 0;
+    start = (result.cardinality - start > req->offset) ? start + req->offset : result.cardinality;
+    std::uint64_t left = result.cardinality - start;
+    std::uint32_t want = (left < req->limit) ? static_cast<std::uint32_t>(left) : req->limit;
+    page->ids = arena_ids(arena, want);
+    int ok = page->ids != nullptr;
+    if (ok) {
+        page->cap = want;
+        page->count = roaring_extract(&result, start, want, page->ids);
+    }
+    page->has_more = start + page->count < result.cardinality;
+    page->total = result.cardinality;
+    page->total_exact = 1;
+    roaring_free(&result);
+    return ok;
+}
+
+static void print_results(const IndexData* idx, const ResultPage* page, FILE* out) {
+    std::fprintf(out, page->total_exact ? "TOTAL\t%llu\n" : "TOTAL\t%llu\testimate\n",
+                 static_cast<unsigned long long>(page->total));
+    for (std::uint32_t i = 0; i < page->count; ++i) {
+        std::uint32_t doc_id = page->ids[i];
+        const char* title = "";
+        const char* url = "";
+        const ForwardSlot* slot = forward_slot(idx, doc_id);
+        if (slot) {
+            const char* t = forward_string(idx, slot->title_offset);
+            const char* u = forward_string(idx, slot->url_offset);
+            if (t && u) {
+                title = t;
+                url = u;
+            }
+        }
+        std::fprintf(out, "DOC\t%u\t%s\t%s\n", doc_id, title, url);
+    }
+    if (page->has_more && page->count > 0) {
+        std::fprintf(out, "NEXT\tc%x\n", page->ids[page->count - 1]);
+    }
+}
 
-    print_results(idx, result, offset, limit);
-    std::free(result.ids);
-    std::free(rpn);
-    free_tokens(tokens, tok_count);
+/* Per-query allocation counters, one line on stderr per query under --profile. */
+static void print_profile(const QueryArena* arena) {
+    std::fprintf(stderr, "profile\tallocs=%llu heap_allocs=%llu arena_bytes=%llu copied_bytes=%llu\n",
+                 static_cast<unsigned long long>(arena->allocs), static_cast<unsigned long long>(arena->heap_allocs),
+                 static_cast<unsigned long long>(arena->bytes), static_cast<unsigned long long>(arena->copied));
+}
+
+/* Evaluates one query out of arena, which is reset first and can be reused for the next one. */
+static int run_single_query(const IndexData* idx, QueryArena* arena, const char* query, const PageRequest* req,
+                            FILE* out, const char** error) {
+    arena_reset(arena);
+    Token* tokens = nullptr;
+    std::uint32_t tok_count = 0;
+    if (!tokenize_query(arena, query, &tokens, &tok_count)) {
+        *error = "Failed to tokenize query";
+        return 0;
+    }
+    if (tok_count == 0) {
+        std::fprintf(out, "TOTAL\t0\n");
+        return 1;
+    }
+
+    Token* rpn = nullptr;
+    std::uint32_t rpn_count = 0;
+    if (!to_rpn(arena, tokens, tok_count, &rpn, &rpn_count)) {
+        *error = "Failed to parse query";
+        return 0;
+    }
+
+    QueryPlan plan;
+    if (!build_plan(idx, arena, rpn, rpn_count, &plan)) {
+        *error = "Failed to evaluate query";
+        return 0;
+    }
+
+    ResultPage page{nullptr, 0, 0, 0, 0, 0};
+    int ok = 0;
+    if (idx->postings_codec == INDEX_CODEC_HYBRID) {
+        ok = page_hybrid(idx, arena, &plan, req, &page);
+    } else if (req->exact_total) {
+        ok = page_materialized(idx, arena, &plan, req, &page);
+    } else {
+        ok = page_lazy(idx, arena, &plan, req, &page);
+    }
+    if (!ok) {
+        *error = "Failed to evaluate query";
+        return 0;
+    }
+    print_results(idx, &page, out);
+    return 1;
+}
+
+/*
+ * Server mode: the index is loaded once and queries arrive over a Unix domain
+ * socket or a localhost TCP port. Each connection is served by its own thread
+ * and may carry any number of requests, so clients can keep pooled connections.
+ *
+ * Protocol (one request per line, tab separated, UTF-8):
+ *   QUERY\t<offset>\t<limit>\t<query>   ->  TOTAL/DOC/NEXT lines as in CLI mode
+ *   QUERY\t<cursor>\t<limit>\t<query>   ->  the page after a NEXT cursor
+ *   COUNT\t<query>                       ->  exact TOTAL only
+ *   PING                                 ->  PONG
+ * Every response ends with a line "END"; failures are reported as
+ * "ERROR\t<message>" before it. A request line longer than
+ * MAX_REQUEST_BYTES is skipped and answered with an error, and a
+ * connection beyond MAX_CLIENTS is refused with "ERROR\tServer busy".
+ */
+const size_t MAX_REQUEST_BYTES = 64 * 1024; /* including the newline */
+const int MAX_CLIENTS = 64;
+
+static volatile std::sig_atomic_t g_stop_server = 0;
+static std::atomic<int> g_active_clients(0);
+
+static void on_stop_signal(int) {
+    g_stop_server = 1;
+}
+
+struct ClientConn {
+    const IndexData* idx;
+    int fd;
+    int profile;
+};
+
+static int parse_query_request(char* line, PageRequest* req, const char** query) {
+    char* p1 = std::strchr(line, '\t');
+    if (!p1) {
+        return 0;
+    }
+    char* p2 = std::strchr(p1 + 1, '\t');
+    if (!p2) {
+        return 0;
+    }
+    char* p3 = std::strchr(p2 + 1, '\t');
+    if (!p3) {
+        return 0;
+    }
+    *p2 = '\0';
+    *p3 = '\0';
+    if (p1[1] == 'c') {
+        if (!parse_cursor(p1 + 1, &req->after)) {
+            return 0;
+        }
+        req->has_cursor = 1;
+    } else {
+        req->offset = static_cast<std::uint32_t>(std::strtoul(p1 + 1, nullptr, 10));
+    }
+    req->limit = static_cast<std::uint32_t>(std::strtoul(p2 + 1, nullptr, 10));
+    *query = p3 + 1;
     return 1;
 }
 
+static void* serve_client(void* arg) {
+    ClientConn* conn = static_cast<ClientConn*>(arg);
+    const IndexData* idx = conn->idx;
+    int fd = conn->fd;
+    int profile = conn->profile;
+    std::free(conn);
+
+    int out_fd = dup(fd);
+    FILE* in = fdopen(fd, "rb");
+    FILE* out = (out_fd >= 0) ? fdopen(out_fd, "wb") : nullptr;
+    if (!in || !out) {
+        if (in) {
+            std::fclose(in);
+        } else {
+            close(fd);
+        }
+        if (out) {
+            std::fclose(out);
+        } else if (out_fd >= 0) {
+            close(out_fd);
+        }
+        g_active_clients.fetch_sub(1);
+        return nullptr;
+    }
+
+    QueryArena arena{};
+    char* line = static_cast<char*>(std::malloc(MAX_REQUEST_BYTES + 1));
+    while (line && std::fgets(line, static_cast<int>(MAX_REQUEST_BYTES + 1), in)) {
+        size_t n = std::strlen(line);
+        if (n == MAX_REQUEST_BYTES && line[n - 1] != '\n') {
+            /* skip the rest of the line without buffering it */
+            int c;
+            while ((c = std::getc(in)) != EOF && c != '\n') {
+            }
+            std::fputs("ERROR\tRequest too long\nEND\n", out);
+            if (c == EOF || std::fflush(out) != 0) {
+                break;
+            }
+            continue;
+        }
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (std::strcmp(line, "PING") == 0) {
+            std::fputs("PONG\n", out);
+        } else if (std::strncmp(line, "QUERY\t", 6) == 0) {
+            PageRequest req{0, 0, 0, 0, 0};
+            const char* query = nullptr;
+            const char* error = nullptr;
+            if (!parse_query_request(line, &req, &query)) {
+                std::fputs("ERROR\tMalformed QUERY request\n", out);
+            } else if (!run_single_query(idx, &arena, query, &req, out, &error)) {
+                std::fprintf(out, "ERROR\t%s\n", error);
+            } else if (profile) {
+                print_profile(&arena);
+            }
+        } else if (std::strncmp(line, "COUNT\t", 6) == 0) {
+            PageRequest req{0, 0, 0, 0, 1};
+            const char* error = nullptr;
+            if (!run_single_query(idx, &arena, line + 6, &req, out, &error)) {
+                std::fprintf(out, "ERROR\t%s\n", error);
+            } else if (profile) {
+                print_profile(&arena);
+            }
+        } else {
+            std::fputs("ERROR\tUnknown command\n", out);
+        }
+        std::fputs("END\n", out);
+        if (std::fflush(out) != 0) {
+            break;
+        }
+    }
+
+    arena_free(&arena);
+    std::free(line);
+    std::fclose(in);
+    std::fclose(out);
+    g_active_clients.fetch_sub(1);
+    return nullptr;
+}
+
+static int open_listen_socket(const char* socket_path, int port) {
+    int fd = -1;
+    if (socket_path) {
+        sockaddr_un addr{};
+        if (std::strlen(socket_path) >= sizeof(addr.sun_path)) {
+            std::fprintf(stderr, "Socket path too long: %s\n", socket_path);
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            std::fprintf(stderr, "Failed to create socket: %s\n", std::strerror(errno));
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::fprintf(stderr, "Failed to bind %s: %s\n", socket_path, std::strerror(errno));
+            close(fd);
+            return -1;
+        }
+    } else {
+        sockaddr_in addr{};
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            std::fprintf(stderr, "Failed to create socket: %s\n", std::strerror(errno));
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<std::uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::fprintf(stderr, "Failed to bind 127.0.0.1:%d: %s\n", port, std::strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 128) != 0) {
+        std::fprintf(stderr, "Failed to listen: %s\n", std::strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run_server(const IndexData* idx, const char* socket_path, int port, int profile) {
+    int listen_fd = open_listen_socket(socket_path, port);
+    if (listen_fd < 0) {
+        return 0;
+    }
+
+    struct sigaction sa {};
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (socket_path) {
+        std::printf("search_cli serving %u terms, %u docs on unix:%s\n", idx->term_count, idx->docs_with_meta,
+                    socket_path);
+    } else {
+        std::printf("search_cli serving %u terms, %u docs on 127.0.0.1:%d\n", idx->term_count, idx->docs_with_meta,
+                    port);
+    }
+    std::fflush(stdout);
+
+    int ok = 1;
+    while (!g_stop_server) {
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::fprintf(stderr, "accept failed: %s\n", std::strerror(errno));
+            ok = 0;
+            break;
+        }
+        if (!socket_path) {
+            int one = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (g_active_clients.load() >= MAX_CLIENTS) {
+            static const char busy[] = "ERROR\tServer busy\nEND\n";
+            ssize_t sent = send(client_fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            (void)sent;
+            close(client_fd);
+            continue;
+        }
+        ClientConn* conn = static_cast<ClientConn*>(std::malloc(sizeof(ClientConn)));
+        if (!conn) {
+            close(client_fd);
+            continue;
+        }
+        g_active_clients.fetch_add(1);
+        conn->idx = idx;
+        conn->fd = client_fd;
+        conn->profile = profile;
+
+        /* Stop signals must interrupt accept() here, not land in a client thread. */
+        sigset_t old_mask;
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+        pthread_t thread;
+        int rc = pthread_create(&thread, &attr, serve_client, conn);
+        pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+        if (rc != 0) {
+            std::fprintf(stderr, "Failed to start client thread: %s\n", std::strerror(rc));
+            close(client_fd);
+            std::free(conn);
+            g_active_clients.fetch_sub(1);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    close(listen_fd);
+    if (socket_path) {
+        unlink(socket_path);
+    }
+    return ok;
+}
+
 int main(int argc, char** argv) {
     const char* index_dir = nullptr;
     const char* query = nullptr;
-    std::uint32_t offset = 0;
-    std::uint32_t limit = 50;
+    const char* listen_path = nullptr;
+    int listen_port = 0;
+    PageRequest req{0, 50, 0, 0, 0};
+    int prefault = 0;
+    int profile = 0;
+    int has_offset = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (std::strcmp(argv[i], "--index-dir") == 0 && i + 1 < argc) {
@@ -847,14 +2468,44 @@ int main(int argc, char** argv) {
         } else if (std::strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
             query = argv[++i];
         } else if (std::strcmp(argv[i], "--offset") == 0 && i + 1 < argc) {
-            offset = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            req.offset = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            has_offset = 1;
         } else if (std::strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
-            limit = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            req.limit = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--cursor") == 0 && i + 1 < argc) {
+            if (!parse_cursor(argv[++i], &req.after)) {
+                std::fprintf(stderr, "Invalid --cursor %s\n", argv[i]);
+                return 1;
+            }
+            req.has_cursor = 1;
+        } else if (std::strcmp(argv[i], "--exact-total") == 0) {
+            req.exact_total = 1;
+        } else if (std::strcmp(argv[i], "--prefault") == 0) {
+            prefault = 1;
+        } else if (std::strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (std::strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            listen_port = std::atoi(argv[++i]);
         }
     }
 
     if (!index_dir) {
-        std::fprintf(stderr, "Usage: search_cli --index-dir <dir> [--query q] [--offset n] [--limit n]\n");
+        std::fprintf(stderr,
+                     "Usage: search_cli --index-dir <dir> [--prefault] [--query q] [--offset n] [--limit n]\n"
+                     "                  [--cursor c] [--exact-total] [--profile]   (--offset or --cursor, not both)\n"
+                     "       search_cli --index-dir <dir> [--prefault] [--profile]\n"
+                     "                  (--listen <socket_path> | --port <n>)\n");
+        return 1;
+    }
+    if (listen_port < 0 || listen_port > 65535) {
+        std::fprintf(stderr, "Invalid --port %d\n", listen_port);
+        return 1;
+    }
+    /* a cursor already says where the page starts; an offset would skip that many more results */
+    if (has_offset && req.has_cursor) {
+        std::fprintf(stderr, "--offset and --cursor cannot be used together\n");
         return 1;
     }
 
@@ -870,7 +2521,7 @@ int main(int argc, char** argv) {
     }
 
     IndexData idx{};
-    if (!load_postings(&idx, postings_path) || !load_lexicon(&idx, lexicon_path) || !load_forward(&idx, forward_path)) {
+    if (!load_index(&idx, postings_path, lexicon_path, forward_path, prefault)) {
         std::fprintf(stderr, "Failed to load index files\n");
         std::free(postings_path);
         std::free(lexicon_path);
@@ -883,8 +2534,20 @@ int main(int argc, char** argv) {
     std::free(forward_path);
 
     int ok = 1;
+    const char* error = nullptr;
+    if (listen_path || listen_port > 0) {
+        ok = run_server(&idx, listen_path, listen_port, profile);
+        /* Detached client threads may still be reading the index; let process exit reclaim it. */
+        return ok ? 0 : 1;
+    }
+    QueryArena arena{};
     if (query) {
-        ok = run_single_query(&idx, query, offset, limit);
+        ok = run_single_query(&idx, &arena, query, &req, stdout, &error);
+        if (!ok) {
+            std::fprintf(stderr, "%s\n", error);
+        } else if (profile) {
+            print_profile(&arena);
+        }
     } else {
         char line[4096];
         while (std::fgets(line, sizeof(line), stdin)) {
@@ -897,14 +2560,19 @@ int main(int argc, char** argv) {
                 continue;
             }
             std::printf("QUERY\t%s\n", line);
-            if (!run_single_query(&idx, line, offset, limit)) {
+            if (!run_single_query(&idx, &arena, line, &req, stdout, &error)) {
+                std::fprintf(stderr, "%s\n", error);
                 ok = 0;
                 break;
             }
+            if (profile) {
+                print_profile(&arena);
+            }
             std::printf("\n");
         }
     }
 
+    arena_free(&arena);
     free_index(&idx);
     return ok ? 0 : 1;
 }
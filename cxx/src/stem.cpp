@@ -0,0 +1,419 @@
+#include "stem.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * The stemming rules, in order of preference: the first rule whose suffix
+ * ends the token, for a token longer than min_len bytes, swaps that suffix
+ * for the replacement. Tokens no rule applies to are kept as they are.
+ */
+struct StemRule {
+    const char* suffix;
+    std::size_t min_len;
+    const char* replacement;
+};
+
+static constexpr StemRule STEM_RULES[] = {
+    {"ingly", 5, ""}, {"edly", 4, ""}, {"ing", 4, ""}, {"ed", 3, ""},
+    {"ies", 4, "y"},  {"es", 3, ""},   {"ly", 3, ""},  {"s", 3, ""},
+};
+
+const std::size_t STEM_RULE_COUNT = sizeof(STEM_RULES) / sizeof(STEM_RULES[0]);
+
+static constexpr std::size_t const_strlen(const char* s) {
+    std::size_t n = 0;
+    while (s[n] != '\0') {
+        ++n;
+    }
+    return n;
+}
+
+/* Bytes the rules' suffixes use, each once; every other byte falls in class 0. */
+static constexpr std::size_t stem_class_count() {
+    bool used[256] = {};
+    std::size_t count = 1;
+    for (const StemRule& rule : STEM_RULES) {
+        for (const char* c = rule.suffix; *c != '\0'; ++c) {
+            unsigned char b = static_cast<unsigned char>(*c);
+            count += used[b] ? 0 : 1;
+            used[b] = true;
+        }
+    }
+    return count;
+}
+
+/* A state for every suffix byte at most, plus the dead state and the root. */
+static constexpr std::size_t stem_state_limit() {
+    std::size_t count = 2;
+    for (const StemRule& rule : STEM_RULES) {
+        count += const_strlen(rule.suffix);
+    }
+    return count;
+}
+
+static constexpr bool stem_rules_valid() {
+    for (const StemRule& rule : STEM_RULES) {
+        std::size_t len = const_strlen(rule.suffix);
+        /* a stem never outgrows its token, and min_len keeps at least one byte before the suffix */
+        if (len == 0 || const_strlen(rule.replacement) > len || rule.min_len < len) {
+            return false;
+        }
+    }
+    return STEM_RULE_COUNT < 255 && stem_state_limit() <= 256;
+}
+
+static_assert(stem_rules_valid(), "STEM_RULES must not lengthen a token and must fit the automaton's byte-sized ids");
+
+const std::size_t STEM_CLASSES = stem_class_count();
+const std::size_t STEM_STATES = stem_state_limit();
+const std::uint8_t STEM_DEAD = 0;
+const std::uint8_t STEM_ROOT = 1;
+const std::uint8_t STEM_NO_RULE = 0xFF;
+
+/*
+ * The suffixes as a trie read from the last byte of a token backwards:
+ * next[state][class of byte] is the state after one more byte, STEM_DEAD
+ * once no suffix can match. The state reached by a whole suffix names its
+ * rule, so one right-to-left pass over at most the longest suffix finds
+ * every rule that could apply.
+ */
+struct StemAutomaton {
+    std::uint8_t byte_class[256];
+    std::uint8_t next[STEM_STATES][STEM_CLASSES];
+    std::uint8_t rule[STEM_STATES];
+    std::uint8_t cut[STEM_RULE_COUNT];     /* suffix length */
+    std::uint8_t replace[STEM_RULE_COUNT]; /* replacement length */
+    std::uint8_t min_len[STEM_RULE_COUNT];
+};
+
+static constexpr StemAutomaton make_stem_automaton() {
+    StemAutomaton a{};
+    std::uint8_t classes = 1;
+    for (const StemRule& rule : STEM_RULES) {
+        for (const char* c = rule.suffix; *c != '\0'; ++c) {
+            unsigned char b = static_cast<unsigned char>(*c);
+            if (a.byte_class[b] == 0) {
+                a.byte_class[b] = classes++;
+            }
+        }
+    }
+    for (std::size_t s = 0; s < STEM_STATES; ++s) {
+        a.rule[s] = STEM_NO_RULE;
+    }
+    std::uint8_t states = STEM_ROOT + 1;
+    for (std::size_t r = 0; r < STEM_RULE_COUNT; ++r) {
+        const StemRule& rule = STEM_RULES[r];
+        std::size_t len = const_strlen(rule.suffix);
+        std::uint8_t state = STEM_ROOT;
+        for (std::size_t i = len; i > 0; --i) {
+            std::uint8_t c = a.byte_class[static_cast<unsigned char>(rule.suffix[i - 1])];
+            if (a.next[state][c] == STEM_DEAD) {
+                a.next[state][c] = states++;
+            }
+            state = a.next[state][c];
+        }
+        if (a.rule[state] == STEM_NO_RULE) { /* of two rules for one suffix the first wins */
+            a.rule[state] = static_cast<std::uint8_t>(r);
+        }
+        a.cut[r] = static_cast<std::uint8_t>(len);
+        a.replace[r] = static_cast<std::uint8_t>(const_strlen(rule.replacement));
+        a.min_len[r] = static_cast<std::uint8_t>(rule.min_len);
+    }
+    return a;
+}
+
+static constexpr StemAutomaton STEM_AUTOMATON = make_stem_automaton();
+
+std::size_t stem_token(char* token, std::size_t len) {
+    std::uint8_t state = STEM_ROOT;
+    std::uint8_t best = STEM_NO_RULE;
+    for (std::size_t i = len; i > 0; --i) {
+        state = STEM_AUTOMATON.next[state][STEM_AUTOMATON.byte_class[static_cast<unsigned char>(token[i - 1])]];
+        if (state == STEM_DEAD) {
+            break;
+        }
+        std::uint8_t r = STEM_AUTOMATON.rule[state];
+        if (r < best && len > STEM_AUTOMATON.min_len[r]) {
+            best = r;
+        }
+    }
+    std::size_t n = len;
+    if (best != STEM_NO_RULE) {
+        n -= STEM_AUTOMATON.cut[best];
+        for (std::size_t i = 0; i < STEM_AUTOMATON.replace[best]; ++i) {
+            token[n++] = STEM_RULES[best].replacement[i];
+        }
+    }
+    token[n] = '\0';
+    return n;
+}
+
+static_assert(sizeof(StemCacheSlot) == 32, "two stem cache slots per cache line");
+
+int stem_cache_init(StemCache* cache, std::size_t bytes) {
+    *cache = StemCache{};
+    bytes = (bytes == 0) ? STEM_CACHE_DEFAULT_BYTES : bytes;
+    std::size_t sets = 1;
+    while (sets * 2 * 2 * sizeof(StemCacheSlot) <= bytes) {
+        sets *= 2;
+    }
+    cache->slots = static_cast<StemCacheSlot*>(std::calloc(sets * 2, sizeof(StemCacheSlot)));
+    cache->set_mask = sets - 1;
+    return cache->slots != nullptr;
+}
+
+void stem_cache_free(StemCache* cache) {
+    std::free(cache->slots);
+    *cache = StemCache{};
+}
+
+static std::uint64_t load_u64(const char* p) {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static std::uint64_t load_u32(const char* p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* The words of a slot for token[0, len), len 1..STEM_CACHE_MAX_TOKEN; loads overlap rather than loop. */
+static void stem_cache_words(const char* token, std::size_t len, std::uint64_t* words) {
+    words[1] = 0;
+    words[2] = 0;
+    if (len >= 16) {
+        words[0] = load_u64(token);
+        words[1] = load_u64(token + 8);
+        words[2] = load_u64(token + len - 8);
+    } else if (len >= 8) {
+        words[0] = load_u64(token);
+        words[1] = load_u64(token + len - 8);
+    } else if (len >= 4) {
+        words[0] = (load_u32(token) << 32) | load_u32(token + len - 4);
+    } else {
+        words[0] = (static_cast<std::uint64_t>(static_cast<unsigned char>(token[0])) << 16) |
+                   (static_cast<std::uint64_t>(static_cast<unsigned char>(token[len >> 1])) << 8) |
+                   static_cast<unsigned char>(token[len - 1]);
+    }
+}
+
+std::size_t stem_cache_stem(StemCache* cache, char* token, std::size_t len) {
+    if (len == 0 || len > STEM_CACHE_MAX_TOKEN) {
+        ++cache->uncached;
+        return stem_token(token, len);
+    }
+    std::uint64_t words[3];
+    stem_cache_words(token, len, words);
+    std::uint64_t hash = (words[0] * 0x9E3779B97F4A7C15ULL) ^ (words[1] * 0xC2B2AE3D27D4EB4FULL) ^
+                         (words[2] * 0x165667B19E3779F9ULL) ^ len;
+    StemCacheSlot* set = &cache->slots[(static_cast<std::size_t>(hash >> 32) & cache->set_mask) * 2];
+    for (int way = 0; way < 2; ++way) {
+        StemCacheSlot* slot = &set[way];
+        if (slot->token_len != len || slot->words[0] != words[0] || slot->words[1] != words[1] ||
+            slot->words[2] != words[2]) {
+            continue;
+        }
+        ++cache->hits;
+        std::memcpy(token + slot->keep, slot->tail, slot->tail_len);
+        std::size_t n = static_cast<std::size_t>(slot->keep) + slot->tail_len;
+        token[n] = '\0';
+        if (way == 1) {
+            StemCacheSlot hit = *slot;
+            set[1] = set[0];
+            set[0] = hit;
+        }
+        return n;
+    }
+
+    ++cache->misses;
+    StemCacheSlot fresh{};
+    fresh.words[0] = words[0];
+    fresh.words[1] = words[1];
+    fresh.words[2] = words[2];
+    fresh.token_len = static_cast<std::uint8_t>(len);
+    char original[STEM_CACHE_MAX_TOKEN];
+    std::memcpy(original, token, len);
+    std::size_t n = stem_token(token, len);
+    std::size_t keep = 0;
+    while (keep < n && keep < len && token[keep] == original[keep]) {
+        ++keep;
+    }
+    if (n - keep <= STEM_CACHE_MAX_TAIL) {
+        fresh.keep = static_cast<std::uint8_t>(keep);
+        fresh.tail_len = static_cast<std::uint8_t>(n - keep);
+        std::memcpy(fresh.tail, token + keep, n - keep);
+        set[1] = set[0];
+        set[0] = fresh;
+    }
+    return n;
+}
+
+int stem_stage_run(void* ctx, DocBatch* batch) {
+    StemStage* stage = static_cast<StemStage*>(ctx);
+    PipeBuf* out = &batch->next;
+    /* stems are never longer than their tokens and separators only shrink to one space */
+    if (!pipe_buf_reserve(out, batch->text.len)) {
+        std::fprintf(stderr, "Failed to allocate stemmer output\n");
+        return 0;
+    }
+    std::uint64_t docs = 0;
+    char* text_end = batch->text.data + batch->text.len;
+    for (char* line = batch->text.data; line < text_end;) {
+        char* nl = static_cast<char*>(std::memchr(line, '\n', static_cast<std::size_t>(text_end - line)));
+        /* the line ends at a NUL, as it does for a C string */
+        char* end = static_cast<char*>(std::memchr(line, '\0', static_cast<std::size_t>(nl - line)));
+        end = end ? end : nl;
+        char* tab = static_cast<char*>(std::memchr(line, '\t', static_cast<std::size_t>(end - line)));
+        if (tab) {
+            std::size_t id_len = static_cast<std::size_t>(tab - line) + 1;
+            std::memcpy(out->data + out->len, line, id_len);
+            out->len += id_len;
+            int first = 1;
+            for (char* p = tab + 1; p < end;) {
+                if (line_is_space(static_cast<unsigned char>(*p))) {
+                    ++p;
+                    continue;
+                }
+                char* start = p;
+                while (p < end && !line_is_space(static_cast<unsigned char>(*p))) {
+                    ++p;
+                }
+                char saved = *p; /* stem_token terminates the stem, which may be where p is */
+                std::size_t len = static_cast<std::size_t>(p - start);
+                std::size_t n = stage->cache ? stem_cache_stem(stage->cache, start, len) : stem_token(start, len);
+                *p = saved;
+                if (!first) {
+                    out->data[out->len++] = ' ';
+                }
+                std::memcpy(out->data + out->len, start, n);
+                out->len += n;
+                first = 0;
+                ++stage->tokens;
+            }
+            out->data[out->len++] = '\n';
+            ++docs;
+        }
+        line = nl + 1;
+    }
+    stage->docs += docs;
+    batch->docs = docs;
+    doc_batch_swap(batch);
+    return 1;
+}
+
+int stem_stream_stage_init(StemStreamStage* stage) {
+    *stage = StemStreamStage{};
+    return term_dict_init(&stage->stems, 0, 0);
+}
+
+void stem_stream_stage_free(StemStreamStage* stage) {
+    term_dict_free(&stage->stems);
+    std::free(stage->stem_ids);
+    std::free(stage->terms.data);
+    std::free(stage->docs_out.data);
+    std::free(stage->scratch.data);
+    *stage = StemStreamStage{};
+}
+
+/* Stems the tokens block defines and gives each its stem id; the new stems go to stage->terms. */
+static int stem_block_terms(StemStreamStage* stage, const TokenStreamBlock* block, std::uint32_t* stem_count) {
+    if (block->term_count > UINT32_MAX - stage->token_count) {
+        return 0;
+    }
+    std::uint32_t need = stage->token_count + block->term_count;
+    if (need > stage->token_cap) {
+        std::uint32_t new_cap = (stage->token_cap == 0) ? 1024 : stage->token_cap;
+        while (new_cap < need) {
+            new_cap = (new_cap > UINT32_MAX / 2) ? UINT32_MAX : new_cap * 2;
+        }
+        std::uint32_t* grown =
+            static_cast<std::uint32_t*>(std::realloc(stage->stem_ids, sizeof(std::uint32_t) * new_cap));
+        if (!grown) {
+            return 0;
+        }
+        stage->stem_ids = grown;
+        stage->token_cap = new_cap;
+    }
+    const unsigned char* p = block->terms;
+    for (std::uint32_t i = 0; i < block->term_count; ++i) {
+        std::uint32_t len = 0;
+        if (!token_stream_varint(&p, block->terms_end, &len) || len > static_cast<std::size_t>(block->terms_end - p)) {
+            return 0;
+        }
+        stage->scratch.len = 0;
+        if (!pipe_buf_reserve(&stage->scratch, static_cast<std::size_t>(len) + 1)) {
+            return 0;
+        }
+        std::memcpy(stage->scratch.data, p, len);
+        p += len;
+        std::size_t n = stem_token(stage->scratch.data, len);
+        std::uint32_t id = 0;
+        int inserted = 0;
+        if (!term_dict_intern(&stage->stems, stage->scratch.data, n, &id, &inserted)) {
+            return 0;
+        }
+        if (inserted) {
+            if (!pipe_buf_reserve(&stage->terms, n + 5)) {
+                return 0;
+            }
+            token_stream_put_varint(&stage->terms, static_cast<std::uint32_t>(n));
+            std::memcpy(stage->terms.data + stage->terms.len, stage->scratch.data, n);
+            stage->terms.len += n;
+            ++*stem_count;
+        }
+        stage->stem_ids[stage->token_count++] = id;
+    }
+    return p == block->terms_end;
+}
+
+/* Rewrites the documents of block with stem ids; a stem id is never longer as a varint than its token id. */
+static int stem_block_docs(StemStreamStage* stage, const TokenStreamBlock* block) {
+    if (!pipe_buf_reserve(&stage->docs_out, static_cast<std::size_t>(block->docs_end - block->docs))) {
+        return 0;
+    }
+    const unsigned char* p = block->docs;
+    for (std::uint32_t d = 0; d < block->doc_count; ++d) {
+        std::uint32_t doc_id = 0;
+        std::uint32_t tokens = 0;
+        if (!token_stream_varint(&p, block->docs_end, &doc_id) || !token_stream_varint(&p, block->docs_end, &tokens)) {
+            return 0;
+        }
+        token_stream_put_varint(&stage->docs_out, doc_id);
+        token_stream_put_varint(&stage->docs_out, tokens);
+        for (std::uint32_t t = 0; t < tokens; ++t) {
+            std::uint32_t id = 0;
+            if (!token_stream_varint(&p, block->docs_end, &id) || id >= stage->token_count) {
+                return 0;
+            }
+            token_stream_put_varint(&stage->docs_out, stage->stem_ids[id]);
+        }
+        stage->tokens += tokens;
+    }
+    return p == block->docs_end;
+}
+
+int stem_stream_stage_run(void* ctx, DocBatch* batch) {
+    StemStreamStage* stage = static_cast<StemStreamStage*>(ctx);
+    std::uint64_t docs = 0;
+    for (std::size_t pos = 0; pos < batch->text.len;) {
+        TokenStreamBlock block;
+        std::uint32_t stem_count = 0;
+        stage->terms.len = 0;
+        stage->docs_out.len = 0;
+        if (!token_stream_parse_next(batch->text.data, batch->text.len, &pos, &block) ||
+            !stem_block_terms(stage, &block, &stem_count) || !stem_block_docs(stage, &block) ||
+            !token_stream_append_block(&batch->next, stem_count, &stage->terms, block.doc_count, &stage->docs_out)) {
+            std::fprintf(stderr, "Failed to stem token stream block (malformed or out of memory)\n");
+            return 0;
+        }
+        docs += block.doc_count;
+    }
+    stage->docs += docs;
+    batch->docs = docs;
+    doc_batch_swap(batch);
+    return 1;
+}
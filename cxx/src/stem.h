@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "pipeline.h"
+#include "term_dict.h"
+#include "token_stream.h"
+
+/*
+ * Suffix-stripping stemmer shared by stemmer, ingest and search_cli, so that
+ * query terms are stemmed exactly like the indexed ones. The rules are a
+ * table in stem.cpp, compiled into a suffix automaton when this is built.
+ */
+
+/* Stems token[0, len) in place, NUL-terminates it and returns its new length. */
+std::size_t stem_token(char* token, std::size_t len);
+
+/*
+ * Bounded memo of stem_token for callers that stem the same few words over
+ * and over. Slots are 32 bytes, two to a 64-byte set; the set is picked by
+ * a hash of the token, a hit moves to the front of its set and a miss takes
+ * the place of the set's older slot. A slot holds the token as up to three
+ * overlapping 8-byte words, which with its length pin down every byte, so a
+ * lookup compares three words instead of the string. The stem is kept as
+ * the length of its common prefix with the token plus the bytes after it,
+ * so a stem that replaces a suffix costs no more room than one that cuts
+ * it. Tokens longer than STEM_CACHE_MAX_TOKEN bytes, and stems that rewrite
+ * more than STEM_CACHE_MAX_TAIL bytes, are stemmed every time. Not
+ * thread-safe.
+ */
+const std::size_t STEM_CACHE_MAX_TOKEN = 24;
+const std::size_t STEM_CACHE_MAX_TAIL = 5;
+const std::size_t STEM_CACHE_DEFAULT_BYTES = 256 * 1024;
+
+struct StemCacheSlot {
+    std::uint64_t words[3];
+    std::uint8_t token_len; /* 0 in an empty slot */
+    std::uint8_t keep;      /* stem = token[0, keep) + tail */
+    std::uint8_t tail_len;
+    char tail[STEM_CACHE_MAX_TAIL];
+};
+
+struct StemCache {
+    StemCacheSlot* slots;
+    std::size_t set_mask; /* sets - 1 */
+    std::uint64_t hits;
+    std::uint64_t misses;   /* looked up and stemmed, then stored */
+    std::uint64_t uncached; /* stemmed without a lookup: too long to keep */
+};
+
+/* Sizes the cache to at most bytes (0 for STEM_CACHE_DEFAULT_BYTES), at least one set. */
+int stem_cache_init(StemCache* cache, std::size_t bytes);
+void stem_cache_free(StemCache* cache);
+
+/* stem_token through the cache: the same result, NUL included. */
+std::size_t stem_cache_stem(StemCache* cache, char* token, std::size_t len);
+
+/*
+ * Pipeline stage turning tokenized.txt lines into stemmed.txt lines: the
+ * doc id, a tab and the stems of the whitespace-separated tokens, one space
+ * apart. Lines without a tab are dropped. With cache set the tokens are
+ * stemmed through it; the stage is then its only user.
+ */
+struct StemStage {
+    StemCache* cache;
+    std::uint64_t docs;
+    std::uint64_t tokens;
+};
+
+int stem_stage_run(void* ctx, DocBatch* batch);
+
+/*
+ * Pipeline stage stemming token stream blocks (token_stream.h) into blocks
+ * of stems. A token is stemmed once, when the block defining its id comes
+ * by; documents are then rewritten id for id, with no string touched. Call
+ * stem_stream_stage_init first and stem_stream_stage_free after.
+ */
+struct StemStreamStage {
+    TermDict stems;          /* the stem ids handed out so far */
+    std::uint32_t* stem_ids; /* stem id of every token id seen */
+    std::uint32_t token_count;
+    std::uint32_t token_cap;
+    PipeBuf terms;
+    PipeBuf docs_out;
+    PipeBuf scratch;
+
+    std::uint64_t docs;
+    std::uint64_t tokens;
+};
+
+int stem_stream_stage_init(StemStreamStage* stage);
+void stem_stream_stage_free(StemStreamStage* stage);
+int stem_stream_stage_run(void* ctx, DocBatch* batch);
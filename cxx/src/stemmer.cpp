@@ -1,179 +1,161 @@
-#include <cctype>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <unistd.h>
 
-static int read_line(FILE* in, char** buffer, size_t* capacity) {
-    if (!in || !buffer || !capacity) {
-        return -1;
-    }
-    if (*buffer == nullptr || *capacity == 0) {
-        *capacity = 4096;
-        *buffer = static_cast<char*>(std::malloc(*capacity));
-        if (!*buffer) {
-            return -1;
-        }
+#include "pipeline.h"
+#include "stem.h"
+#include "token_stream.h"
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "Usage: stemmer <tokenized.txt|token stream> <stemmed.txt> [--format text|binary]\n"
+                             "               [--stem-cache-kb n] [--threads n]\n");
+        return 1;
     }
 
-    size_t len = 0;
-    while (1) {
-        int c = std::fgetc(in);
-        if (c == EOF) {
-            if (len == 0) {
-                return -1;
+    /* A token stream is read as one and, unless --format says otherwise, written as one. */
+    int binary_in = token_stream_is_file(argv[1]);
+    int binary_out = binary_in;
+    /*
+     * The suffix chain costs less than a cache lookup, so tokens are stemmed
+     * one by one unless --stem-cache-kb asks for a cache (stem.h).
+     */
+    std::size_t cache_bytes = 0;
+    std::uint32_t thread_count = 1;
+    for (int i = 3; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "text") != 0 && std::strcmp(argv[i], "binary") != 0) {
+                std::fprintf(stderr, "Unknown output format %s (expected text or binary)\n", argv[i]);
+                return 1;
             }
-            break;
-        }
-        if (len + 1 >= *capacity) {
-            size_t new_cap = (*capacity) * 2;
-            char* new_buf = static_cast<char*>(std::realloc(*buffer, new_cap));
-            if (!new_buf) {
-                return -1;
+            binary_out = std::strcmp(argv[i], "binary") == 0;
+        } else if (std::strcmp(argv[i], "--stem-cache-kb") == 0 && i + 1 < argc) {
+            cache_bytes = static_cast<std::size_t>(std::strtoull(argv[++i], nullptr, 10)) * 1024;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            if (thread_count == 0) {
+                long online = sysconf(_SC_NPROCESSORS_ONLN);
+                thread_count = (online > 0) ? static_cast<std::uint32_t>(online) : 1;
             }
-            *buffer = new_buf;
-            *capacity = new_cap;
-        }
-        (*buffer)[len++] = static_cast<char>(c);
-        if (c == '\n') {
-            break;
+        } else {
+            std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
         }
     }
-    (*buffer)[len] = '\0';
-    return static_cast<int>(len);
-}
-
-static int ends_with(const char* s, int n, const char* suffix) {
-    int m = static_cast<int>(std::strlen(suffix));
-    if (n < m) {
-        return 0;
-    }
-    return std::memcmp(s + n - m, suffix, static_cast<size_t>(m)) == 0;
-}
-
-static void stem_token(char* token) {
-    int n = static_cast<int>(std::strlen(token));
-    if (n <= 2) {
-        return;
-    }
-
-    if (n > 5 && ends_with(token, n, "ingly")) {
-        token[n - 5] = '\0';
-        return;
-    }
-    if (n > 4 && ends_with(token, n, "edly")) {
-        token[n - 4] = '\0';
-        return;
-    }
-    if (n > 4 && ends_with(token, n, "ing")) {
-        token[n - 3] = '\0';
-        return;
-    }
-    if (n > 3 && ends_with(token, n, "ed")) {
-        token[n - 2] = '\0';
-        return;
-    }
-    if (n > 4 && ends_with(token, n, "ies")) {
-        token[n - 3] = 'y';
-        token[n - 2] = '\0';
-        return;
-    }
-    if (n > 3 && ends_with(token, n, "es")) {
-        token[n - 2] = '\0';
-        return;
-    }
-    if (n > 3 && ends_with(token, n, "ly")) {
-        token[n - 2] = '\0';
-        return;
-    }
-    if (n > 3 && token[n - 1] == 's') {
-        token[n - 1] = '\0';
-    }
-}
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        std::fprintf(stderr, "Usage: stemmer <tokenized.txt> <stemmed.txt>\n");
-        return 1;
-    }
-
-    FILE* in = std::fopen(argv[1], "rb");
-    if (!in) {
+    LineSource source;
+    TokenStreamSource stream_source;
+    if (binary_in ? !token_stream_open(&stream_source.reader, argv[1]) : !line_source_open(&source, argv[1])) {
         std::fprintf(stderr, "Failed to open input: %s\n", argv[1]);
         return 1;
     }
+    /*
+     * A token stream hands out stem ids in order, so it is stemmed on one
+     * thread; text batches go to thread_count workers, each with its own
+     * cache and batch buffers, and the pipeline writes them in input order,
+     * so the output is the same for every thread count.
+     */
+    thread_count = binary_in ? 1 : thread_count;
+    /* a token stream names each token once, so only text input is stemmed through the cache */
+    int use_cache = !binary_in && cache_bytes > 0;
     FILE* out = std::fopen(argv[2], "wb");
+    StemStreamStage stem_stream{};
+    TokenStreamEncoder encoder{};
+    StemStage* workers = static_cast<StemStage*>(std::calloc(thread_count, sizeof(StemStage)));
+    StemCache* caches = static_cast<StemCache*>(std::calloc(thread_count, sizeof(StemCache)));
+    PipeStage* worker_stages = static_cast<PipeStage*>(std::calloc(thread_count, sizeof(PipeStage)));
+    int ready = out && workers && caches && worker_stages;
+    for (std::uint32_t w = 0; ready && w < thread_count; ++w) {
+        ready = !use_cache || stem_cache_init(&caches[w], cache_bytes);
+        workers[w].cache = use_cache ? &caches[w] : nullptr;
+        worker_stages[w] = pipe_stage("stem", stem_stage_run, &workers[w]);
+    }
+    ready = ready && (!binary_out || token_stream_write_header(out)) &&
+            (!binary_in || stem_stream_stage_init(&stem_stream)) &&
+            (binary_in || !binary_out || token_stream_encoder_init(&encoder));
     if (!out) {
         std::fprintf(stderr, "Failed to open output: %s\n", argv[2]);
-        std::fclose(in);
-        return 1;
-    }
-
-    char* line = nullptr;
-    size_t line_cap = 0;
-    std::uint64_t docs = 0;
-    std::uint64_t tokens = 0;
-
-    while (1) {
-        int line_len = read_line(in, &line, &line_cap);
-        if (line_len < 0) {
-            break;
+    } else if (!ready) {
+        std::fprintf(stderr, "Failed to allocate stemmer tables\n");
+    }
+
+    TokenStreamDecoder decoder{};
+    LineSink sink{out};
+    PipeStage stages[4];
+    std::uint32_t stage_count = 0;
+    if (binary_in) {
+        stages[stage_count++] = pipe_stage("read", token_stream_source_run, &stream_source);
+        stages[stage_count++] = pipe_stage("stem", stem_stream_stage_run, &stem_stream);
+        if (!binary_out) {
+            stages[stage_count++] = pipe_stage("decode", token_stream_decode_run, &decoder);
         }
-        if (line_len == 0) {
-            continue;
+    } else {
+        stages[stage_count++] = pipe_stage("read", line_source_run, &source);
+        stages[stage_count++] = (thread_count > 1) ? pipe_stage_workers("stem", worker_stages, thread_count)
+                                                   : pipe_stage("stem", stem_stage_run, &workers[0]);
+        if (binary_out) {
+            stages[stage_count++] = pipe_stage("encode", token_stream_encode_run, &encoder);
         }
-
-        char* tab = std::strchr(line, '\t');
-        if (!tab) {
-            continue;
-        }
-        *tab = '\0';
-        const char* doc_id = line;
-        char* body = tab + 1;
-
-        std::fprintf(out, "%s\t", doc_id);
-        int first = 1;
-
-        char* p = body;
-        while (*p) {
-            while (*p && std::isspace(static_cast<unsigned char>(*p))) {
-                ++p;
-            }
-            if (!*p) {
-                break;
-            }
-            char* start = p;
-            while (*p && !std::isspace(static_cast<unsigned char>(*p))) {
-                ++p;
-            }
-            char saved = *p;
-            *p = '\0';
-
-            stem_token(start);
-            if (start[0] != '\0') {
-                if (!first) {
-                    std::fputc(' ', out);
-                }
-                std::fputs(start, out);
-                first = 0;
-                ++tokens;
-            }
-
-            if (!saved) {
-                break;
-            }
-            *p = saved;
+    }
+    stages[stage_count++] = pipe_stage("write", line_sink_run, &sink);
+    auto started = std::chrono::steady_clock::now();
+    int ok = ready && pipeline_run(stages, stage_count, thread_count > 1 || pipeline_threads_default());
+    double elapsed_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    if (binary_in) {
+        token_stream_close(&stream_source.reader);
+    } else {
+        line_source_close(&source);
+    }
+    if (out && std::fclose(out) != 0) {
+        ok = 0;
+    }
+    std::uint64_t docs = stem_stream.docs;
+    std::uint64_t tokens = stem_stream.tokens;
+    StemCache cache_stats{};
+    for (std::uint32_t w = 0; workers && caches && w < thread_count; ++w) {
+        docs += workers[w].docs;
+        tokens += workers[w].tokens;
+        cache_stats.hits += caches[w].hits;
+        cache_stats.misses += caches[w].misses;
+        cache_stats.uncached += caches[w].uncached;
+        stem_cache_free(&caches[w]);
+    }
+    std::free(workers);
+    std::free(caches);
+    stem_stream_stage_free(&stem_stream);
+    token_stream_encoder_free(&encoder);
+    token_stream_decoder_free(&decoder);
+    if (!ok) {
+        if (ready) {
+            std::fprintf(stderr, "Failed to stem %s\n", argv[1]);
         }
-        std::fputc('\n', out);
-        ++docs;
+        std::free(worker_stages);
+        return 1;
     }
 
-    std::free(line);
-    std::fclose(in);
-    std::fclose(out);
-
     std::printf("Stemmer finished\n");
     std::printf("documents=%llu\n", static_cast<unsigned long long>(docs));
     std::printf("tokens=%llu\n", static_cast<unsigned long long>(tokens));
+    std::printf("format=%s\n", binary_out ? "binary" : "text");
+    std::printf("threads=%u\n", thread_count);
+    double mb = static_cast<double>(stages[0].bytes_out) / (1024.0 * 1024.0);
+    std::printf("elapsed_seconds=%.3f\n", elapsed_sec);
+    std::printf("mb_per_second=%.1f\n", elapsed_sec > 0.0 ? mb / elapsed_sec : 0.0);
+    std::printf("tokens_per_second=%.0f\n", elapsed_sec > 0.0 ? static_cast<double>(tokens) / elapsed_sec : 0.0);
+    if (use_cache) {
+        std::uint64_t lookups = cache_stats.hits + cache_stats.misses;
+        std::printf("stem_cache_kb=%llu\n", static_cast<unsigned long long>(cache_bytes / 1024));
+        std::printf("stem_cache_hits=%llu\n", static_cast<unsigned long long>(cache_stats.hits));
+        std::printf("stem_cache_misses=%llu\n", static_cast<unsigned long long>(cache_stats.misses));
+        std::printf("stem_cache_uncached=%llu\n", static_cast<unsigned long long>(cache_stats.uncached));
+        std::printf("stem_cache_hit_rate=%.4f\n",
+                    lookups == 0 ? 0.0 : static_cast<double>(cache_stats.hits) / static_cast<double>(lookups));
+    }
+    pipeline_print_stats(stdout, stages, stage_count);
+    std::free(worker_stages);
     return 0;
 }
@@ -0,0 +1,283 @@
+#include "term_dict.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static std::uint64_t load_u64(const char* p) {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static std::uint64_t load_u32(const char* p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* One multiply per word; the finalizer in term_hash does the avalanching. */
+static std::uint64_t mix_word(std::uint64_t h, std::uint64_t k) {
+    return (((h << 5) | (h >> 59)) ^ k) * 0x517cc1b727220a95ULL;
+}
+
+/*
+ * Word-at-a-time multiplicative hash (FxHash's step) with the MurmurHash3
+ * finalizer. The bytes past the last full word are read with fixed-size
+ * loads that overlap what was already hashed, so short stems hash without
+ * a length-dependent loop.
+ */
+std::uint64_t term_hash(const char* s, std::size_t len) {
+    std::uint64_t h = static_cast<std::uint64_t>(len);
+    if (len >= 8) {
+        const char* end = s + len - 8;
+        for (; s < end; s += 8) {
+            h = mix_word(h, load_u64(s));
+        }
+        h = mix_word(h, load_u64(end));
+    } else if (len >= 4) {
+        h = mix_word(h, (load_u32(s) << 32) | load_u32(s + len - 4));
+    } else if (len > 0) {
+        std::uint64_t k = (static_cast<std::uint64_t>(static_cast<unsigned char>(s[0])) << 16) |
+                          (static_cast<std::uint64_t>(static_cast<unsigned char>(s[len >> 1])) << 8) |
+                          static_cast<unsigned char>(s[len - 1]);
+        h = mix_word(h, k);
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Low 7 bits of the hash tag the slot; the rest picks the first group to probe. */
+static std::uint8_t hash_tag(std::uint64_t hash) {
+    return static_cast<std::uint8_t>(hash & 0x7f);
+}
+
+/* Bit i is set where group byte i equals tag. */
+static std::uint32_t group_match(const std::uint8_t* group, std::uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    __m128i hits = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(tag)));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(hits));
+#else
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < TERM_DICT_GROUP; ++i) {
+        mask |= static_cast<std::uint32_t>(group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+/* Same overlapping loads as term_hash, for the same reason. */
+static int same_bytes(const char* a, const char* b, std::size_t len) {
+    if (len >= 8) {
+        for (std::size_t i = 0; i + 8 < len; i += 8) {
+            if (load_u64(a + i) != load_u64(b + i)) {
+                return 0;
+            }
+        }
+        return load_u64(a + len - 8) == load_u64(b + len - 8);
+    }
+    if (len >= 4) {
+        return load_u32(a) == load_u32(b) && load_u32(a + len - 4) == load_u32(b + len - 4);
+    }
+    for (std::size_t i = 0; i < len; ++i) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static std::size_t round_capacity(std::size_t hint) {
+    std::size_t cap = TERM_DICT_MIN_CAPACITY;
+    while (cap < hint && cap < (static_cast<std::size_t>(1) << 31)) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+/* Slot for a hash that is known to be absent: the first empty slot on its probe sequence. */
+static std::size_t find_empty(const TermDict* dict, std::uint64_t hash) {
+    std::size_t group_mask = dict->capacity / TERM_DICT_GROUP - 1;
+    std::size_t g = static_cast<std::size_t>(hash >> 7) & group_mask;
+    for (std::size_t step = 1;; ++step) {
+        std::uint32_t empty = group_match(dict->ctrl + g * TERM_DICT_GROUP, TERM_DICT_EMPTY);
+        if (empty) {
+            return g * TERM_DICT_GROUP + static_cast<std::size_t>(__builtin_ctz(empty));
+        }
+        g = (g + step) & group_mask; /* triangular steps visit every group of a power-of-two table */
+    }
+}
+
+static int alloc_index(TermDict* dict, std::size_t capacity) {
+    std::uint8_t* ctrl = static_cast<std::uint8_t*>(std::malloc(capacity));
+    std::uint32_t* slots = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) * capacity));
+    if (!ctrl || !slots) {
+        std::free(ctrl);
+        std::free(slots);
+        return 0;
+    }
+    std::memset(ctrl, TERM_DICT_EMPTY, capacity);
+    std::free(dict->ctrl);
+    std::free(dict->slots);
+    dict->ctrl = ctrl;
+    dict->slots = slots;
+    dict->capacity = capacity;
+    for (std::uint32_t id = 0; id < dict->count; ++id) {
+        std::uint64_t hash = term_dict_record(dict, id)->hash;
+        std::size_t slot = find_empty(dict, hash);
+        dict->ctrl[slot] = hash_tag(hash);
+        dict->slots[slot] = id;
+    }
+    return 1;
+}
+
+static int ensure_record_cap(TermDict* dict) {
+    if (dict->count < dict->record_cap) {
+        return 1;
+    }
+    if (dict->record_cap >= 0x80000000U) {
+        return 0;
+    }
+    std::uint32_t new_cap = (dict->record_cap == 0) ? 256 : dict->record_cap * 2;
+    unsigned char* records = static_cast<unsigned char*>(std::realloc(dict->records, dict->record_size * new_cap));
+    if (!records) {
+        return 0;
+    }
+    dict->records = records;
+    dict->record_cap = new_cap;
+    return 1;
+}
+
+int term_dict_init(TermDict* dict, std::size_t capacity_hint, std::size_t value_size) {
+    *dict = TermDict{};
+    dict->value_size = value_size;
+    dict->record_size = (sizeof(TermKey) + value_size + alignof(TermKey) - 1) / alignof(TermKey) * alignof(TermKey);
+    dict->initial_capacity = round_capacity(capacity_hint);
+    return alloc_index(dict, dict->initial_capacity);
+}
+
+static void free_heap_keys(TermDict* dict) {
+    while (dict->chunks) {
+        TermDictChunk* next = dict->chunks->next;
+        std::free(dict->chunks);
+        dict->chunks = next;
+    }
+    dict->heap_key_bytes = 0;
+}
+
+/* Copies a term too long to inline into the newest chunk, starting a chunk when it does not fit. */
+static char* store_heap_key(TermDict* dict, const char* term, std::size_t len) {
+    TermDictChunk* chunk = dict->chunks;
+    if (!chunk || chunk->size - chunk->used < len + 1) {
+        std::size_t size = (len + 1 > TERM_DICT_CHUNK) ? len + 1 : TERM_DICT_CHUNK;
+        chunk = static_cast<TermDictChunk*>(std::malloc(sizeof(TermDictChunk) + size));
+        if (!chunk) {
+            return nullptr;
+        }
+        chunk->next = dict->chunks;
+        chunk->size = size;
+        chunk->used = 0;
+        dict->chunks = chunk;
+        dict->heap_key_bytes += sizeof(TermDictChunk) + size;
+    }
+    char* out = reinterpret_cast<char*>(chunk + 1) + chunk->used;
+    chunk->used += len + 1;
+    std::memcpy(out, term, len);
+    out[len] = '\0';
+    return out;
+}
+
+void term_dict_free(TermDict* dict) {
+    free_heap_keys(dict);
+    std::free(dict->ctrl);
+    std::free(dict->slots);
+    std::free(dict->records);
+    *dict = TermDict{};
+}
+
+int term_dict_clear(TermDict* dict) {
+    free_heap_keys(dict);
+    dict->count = 0;
+    std::free(dict->records);
+    dict->records = nullptr;
+    dict->record_cap = 0;
+    if (dict->capacity == dict->initial_capacity) {
+        std::memset(dict->ctrl, TERM_DICT_EMPTY, dict->capacity);
+        return 1;
+    }
+    return alloc_index(dict, dict->initial_capacity);
+}
+
+static int probe(const TermDict* dict, const char* term, std::size_t len, std::uint64_t hash, std::uint32_t* id) {
+    std::uint8_t tag = hash_tag(hash);
+    std::size_t group_mask = dict->capacity / TERM_DICT_GROUP - 1;
+    std::size_t g = static_cast<std::size_t>(hash >> 7) & group_mask;
+    for (std::size_t step = 1;; ++step) {
+        const std::uint8_t* group = dict->ctrl + g * TERM_DICT_GROUP;
+        for (std::uint32_t hits = group_match(group, tag); hits != 0; hits &= hits - 1) {
+            std::uint32_t cand = dict->slots[g * TERM_DICT_GROUP + static_cast<std::size_t>(__builtin_ctz(hits))];
+            const TermKey* k = term_dict_record(dict, cand);
+            if (k->hash == hash && k->len == len && same_bytes(term_dict_key(dict, cand), term, len)) {
+                *id = cand;
+                return 1;
+            }
+        }
+        /* Nothing is ever removed, so a group with a free slot ends the probe sequence. */
+        if (group_match(group, TERM_DICT_EMPTY) != 0) {
+            return 0;
+        }
+        g = (g + step) & group_mask;
+    }
+}
+
+int term_dict_find(const TermDict* dict, const char* term, std::size_t len, std::uint32_t* id) {
+    return probe(dict, term, len, term_hash(term, len), id);
+}
+
+int term_dict_intern(TermDict* dict, const char* term, std::size_t len, std::uint32_t* id, int* inserted) {
+    std::uint64_t hash = term_hash(term, len);
+    if (probe(dict, term, len, hash, id)) {
+        *inserted = 0;
+        return 1;
+    }
+    if (dict->count == 0xffffffffU || !ensure_record_cap(dict)) {
+        return 0;
+    }
+    if (static_cast<std::size_t>(dict->count) + 1 > dict->capacity / 8 * 7 &&
+        !alloc_index(dict, dict->capacity * 2)) {
+        return 0;
+    }
+    TermKey* k = term_dict_record(dict, dict->count);
+    k->hash = hash;
+    k->len = static_cast<std::uint32_t>(len);
+    if (len < TERM_DICT_INLINE) {
+        std::memcpy(k->bytes, term, len);
+        k->bytes[len] = '\0';
+    } else {
+        char* heap = store_heap_key(dict, term, len);
+        if (!heap) {
+            return 0;
+        }
+        std::memcpy(k->bytes, &heap, sizeof(heap));
+    }
+    std::memset(term_dict_value(dict, dict->count), 0, dict->value_size);
+    std::size_t slot = find_empty(dict, hash);
+    dict->ctrl[slot] = hash_tag(hash);
+    dict->slots[slot] = dict->count;
+    *id = dict->count++;
+    *inserted = 1;
+    return 1;
+}
+
+std::uint64_t term_dict_bytes(const TermDict* dict) {
+    return static_cast<std::uint64_t>(dict->capacity) * (1 + sizeof(std::uint32_t)) +
+           static_cast<std::uint64_t>(dict->record_cap) * dict->record_size + dict->heap_key_bytes;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * String -> value dictionary for the term tables of term_stats and
+ * index_builder.
+ *
+ * Terms get dense ids in insertion order; each id owns a record holding its
+ * key and then a value_size value (zeroed on insert), so a hit touches one
+ * record. The hash index is open addressing
+ * over a power-of-two number of slots, split into groups of
+ * TERM_DICT_GROUP. Every slot has a control byte holding 7 bits of the
+ * term's hash (or TERM_DICT_EMPTY), so a probe compares a whole group of
+ * tags in one SSE2 step and only looks at a stored key when its tag
+ * matches, and then only at the full 64-bit hash and length before the
+ * bytes. The index doubles once it is 7/8 full, reusing the stored hashes.
+ * Terms shorter than TERM_DICT_INLINE bytes live inside their key record,
+ * longer ones are packed into TERM_DICT_CHUNK blocks.
+ *
+ * Key and value pointers stay valid until the next insert or clear.
+ */
+
+const std::size_t TERM_DICT_GROUP = 16;
+const std::size_t TERM_DICT_INLINE = 20; /* inline bytes per key, NUL included */
+const std::size_t TERM_DICT_MIN_CAPACITY = 64;
+const std::uint8_t TERM_DICT_EMPTY = 0x80;
+const std::size_t TERM_DICT_CHUNK = 64 * 1024;
+
+struct TermKey {
+    std::uint64_t hash;
+    std::uint32_t len;
+    char bytes[TERM_DICT_INLINE]; /* the term, or a char* to it when it does not fit */
+};
+
+struct TermDictChunk {
+    TermDictChunk* next;
+    std::size_t size; /* bytes after the header */
+    std::size_t used;
+};
+
+struct TermDict {
+    std::uint8_t* ctrl;
+    std::uint32_t* slots; /* term id per slot, valid where ctrl is not empty */
+    std::size_t capacity;
+    std::size_t initial_capacity;
+    unsigned char* records; /* TermKey then value, record_size bytes per id */
+    std::size_t value_size;
+    std::size_t record_size;
+    std::uint32_t count;
+    std::uint32_t record_cap;
+    TermDictChunk* chunks;        /* strings too long to be inlined, newest chunk first */
+    std::uint64_t heap_key_bytes; /* size of chunks */
+};
+
+std::uint64_t term_hash(const char* s, std::size_t len);
+
+/* capacity_hint is the initial slot count (rounded up to a power of two); the index grows past it as needed. */
+int term_dict_init(TermDict* dict, std::size_t capacity_hint, std::size_t value_size);
+void term_dict_free(TermDict* dict);
+
+/* Drops every term and shrinks the dictionary back to its initial capacity. */
+int term_dict_clear(TermDict* dict);
+
+/* Finds term[0, len) or adds it; *inserted says which. Returns 0 when out of memory. */
+int term_dict_intern(TermDict* dict, const char* term, std::size_t len, std::uint32_t* id, int* inserted);
+
+/* Finds term[0, len) without adding it; returns 0 when it is absent. */
+int term_dict_find(const TermDict* dict, const char* term, std::size_t len, std::uint32_t* id);
+
+/* Bytes of heap the dictionary holds, index and keys included. */
+std::uint64_t term_dict_bytes(const TermDict* dict);
+
+inline TermKey* term_dict_record(const TermDict* dict, std::uint32_t id) {
+    return reinterpret_cast<TermKey*>(dict->records + static_cast<std::size_t>(id) * dict->record_size);
+}
+
+inline const char* term_dict_key(const TermDict* dict, std::uint32_t id) {
+    const TermKey* k = term_dict_record(dict, id);
+    if (k->len < TERM_DICT_INLINE) {
+        return k->bytes;
+    }
+    const char* heap = nullptr;
+    std::memcpy(&heap, k->bytes, sizeof(heap));
+    return heap;
+}
+
+inline void* term_dict_value(const TermDict* dict, std::uint32_t id) {
+    return term_dict_record(dict, id) + 1;
+}
@@ -0,0 +1,25 @@
+#include "term_freq.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static int term_compare(const void* a, const void* b) {
+    const TermFreqRow* ta = static_cast<const TermFreqRow*>(a);
+    const TermFreqRow* tb = static_cast<const TermFreqRow*>(b);
+    if (ta->count > tb->count) {
+        return -1;
+    }
+    if (ta->count < tb->count) {
+        return 1;
+    }
+    return std::strcmp(ta->term, tb->term);
+}
+
+int write_term_freq(FILE* out, TermFreqRow* rows, std::uint64_t count) {
+    std::qsort(rows, static_cast<size_t>(count), sizeof(TermFreqRow), term_compare);
+    std::fprintf(out, "term,count\n");
+    for (std::uint64_t i = 0; i < count; ++i) {
+        std::fprintf(out, "%s,%u\n", rows[i].term, rows[i].count);
+    }
+    return !std::ferror(out);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+/* One line of term_freq.csv, as written by term_stats and ingest. */
+struct TermFreqRow {
+    const char* term;
+    std::uint32_t count;
+};
+
+/* Sorts rows most frequent first, ties by term, and writes them under a "term,count" header. */
+int write_term_freq(FILE* out, TermFreqRow* rows, std::uint64_t count);
@@ -1,252 +1,192 @@
-#include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
-struct TermSlot {
-    char* term;
-    std::uint32_t count;
-    int used;
-};
-
-struct TermRow {
-    char* term;
-    std::uint32_t count;
-};
+#include "line_reader.h"
+#include "term_dict.h"
+#include "term_freq.h"
+#include "token_stream.h"
 
-static int read_line(FILE* in, char** buffer, size_t* capacity) {
-    if (*buffer == nullptr || *capacity == 0) {
-        *capacity = 4096;
-        *buffer = static_cast<char*>(std::malloc(*capacity));
-        if (!*buffer) {
-            return -1;
-        }
+static int add_term(TermDict* dict, const char* term, size_t len) {
+    std::uint32_t id = 0;
+    int inserted = 0;
+    if (!term_dict_intern(dict, term, len, &id, &inserted)) {
+        return 0;
     }
-    size_t len = 0;
-    while (1) {
-        int c = std::fgetc(in);
-        if (c == EOF) {
-            if (len == 0) {
-                return -1;
-            }
-            break;
-        }
-        if (len + 1 >= *capacity) {
-            size_t new_cap = (*capacity) * 2;
-            char* new_buf = static_cast<char*>(std::realloc(*buffer, new_cap));
-            if (!new_buf) {
-                return -1;
-            }
-            *buffer = new_buf;
-            *capacity = new_cap;
-        }
-        (*buffer)[len++] = static_cast<char>(c);
-        if (c == '\n') {
-            break;
-        }
-    }
-    (*buffer)[len] = '\0';
-    return static_cast<int>(len);
+    *static_cast<std::uint32_t*>(term_dict_value(dict, id)) += 1;
+    return 1;
 }
 
-static std::uint64_t djb2(const char* s) {
-    std::uint64_t hash = 5381;
-    while (*s) {
-        hash = ((hash << 5) + hash) + static_cast<unsigned char>(*s);
-        ++s;
-    }
-    return hash;
-}
-
-static char* xstrdup(const char* s) {
-    size_t n = std::strlen(s);
-    char* out = static_cast<char*>(std::malloc(n + 1));
-    if (!out) {
-        return nullptr;
-    }
-    std::memcpy(out, s, n + 1);
-    return out;
-}
+struct StreamCounts {
+    TokenStreamDict dict;
+    std::uint32_t* counts; /* by term id */
+    std::uint32_t counts_cap;
+};
 
-static int term_compare(const void* a, const void* b) {
-    const TermRow* ta = static_cast<const TermRow*>(a);
-    const TermRow* tb = static_cast<const TermRow*>(b);
-    if (ta->count > tb->count) {
-        return -1;
-    }
-    if (ta->count < tb->count) {
+static int grow_counts(StreamCounts* sc) {
+    if (sc->dict.count <= sc->counts_cap) {
         return 1;
     }
-    return std::strcmp(ta->term, tb->term);
+    std::uint32_t* grown = static_cast<std::uint32_t*>(
+        std::realloc(sc->counts, sizeof(std::uint32_t) * static_cast<size_t>(sc->dict.offsets_cap)));
+    if (!grown) {
+        return 0;
+    }
+    std::memset(grown + sc->counts_cap, 0, sizeof(std::uint32_t) * (sc->dict.offsets_cap - sc->counts_cap));
+    sc->counts = grown;
+    sc->counts_cap = sc->dict.offsets_cap;
+    return 1;
 }
 
-static int add_term(TermSlot* table, std::size_t capacity, const char* term, std::uint64_t* used_slots) {
-    std::uint64_t hash = djb2(term);
-    std::size_t idx = static_cast<std::size_t>(hash % capacity);
-    for (std::size_t step = 0; step < capacity; ++step) {
-        TermSlot* slot = &table[idx];
-        if (!slot->used) {
-            slot->term = xstrdup(term);
-            if (!slot->term) {
-                return 0;
+/* A token stream's documents only count ids; each term's string is read once, with its block. */
+static int count_stream(const char* path, StreamCounts* sc, std::uint64_t* docs, std::uint64_t* all_tokens) {
+    TokenStreamReader in;
+    if (!token_stream_open(&in, path)) {
+        std::fprintf(stderr, "Failed to open input: %s\n", path);
+        return 0;
+    }
+    const char* data = nullptr;
+    std::size_t len = 0;
+    TokenStreamBlock block;
+    int ok = 1;
+    while (ok && token_stream_next(&in, &data, &len, &block)) {
+        ok = token_stream_dict_add(&sc->dict, &block) && grow_counts(sc);
+        const unsigned char* p = block.docs;
+        for (std::uint32_t d = 0; ok && d < block.doc_count; ++d) {
+            std::uint32_t doc_id = 0;
+            std::uint32_t tokens = 0;
+            ok = token_stream_varint(&p, block.docs_end, &doc_id) && token_stream_varint(&p, block.docs_end, &tokens);
+            for (std::uint32_t t = 0; ok && t < tokens; ++t) {
+                std::uint32_t id = 0;
+                ok = token_stream_varint(&p, block.docs_end, &id) && id < sc->dict.count;
+                if (ok) {
+                    ++sc->counts[id];
+                }
             }
-            slot->count = 1;
-            slot->used = 1;
-            ++(*used_slots);
-            return 1;
-        }
-        if (std::strcmp(slot->term, term) == 0) {
-            slot->count += 1;
-            return 1;
+            *all_tokens += tokens;
+            ++*docs;
         }
-        idx = (idx + 1) % capacity;
     }
-    return 0;
+    ok = ok && !in.error;
+    token_stream_close(&in);
+    if (!ok) {
+        std::fprintf(stderr, "Failed to read input: %s\n", path);
+    }
+    return ok;
 }
 
 int main(int argc, char** argv) {
     if (argc < 3) {
-        std::fprintf(stderr, "Usage: term_stats <stemmed.txt> <term_freq.csv> [hash_capacity]\n");
+        std::fprintf(stderr, "Usage: term_stats <stemmed.txt|token stream> <term_freq.csv> [hash_capacity]\n");
         return 1;
     }
 
-    std::size_t capacity = (argc >= 4) ? static_cast<std::size_t>(std::strtoull(argv[3], nullptr, 10)) : (1u << 20);
-    if (capacity < 1024) {
-        capacity = 1024;
-    }
+    /* Only a starting size: the dictionary grows with the vocabulary. */
+    std::size_t capacity = (argc >= 4) ? static_cast<std::size_t>(std::strtoull(argv[3], nullptr, 10)) : 0;
+    int stream = token_stream_is_file(argv[1]);
 
-    FILE* in = std::fopen(argv[1], "rb");
-    if (!in) {
+    LineReader in;
+    if (!stream && !line_reader_open(&in, argv[1], LINE_READER_AUTO)) {
         std::fprintf(stderr, "Failed to open input: %s\n", argv[1]);
         return 1;
     }
+    if (stream) {
+        in = LineReader{};
+        in.fd = -1;
+    }
     FILE* out = std::fopen(argv[2], "wb");
     if (!out) {
         std::fprintf(stderr, "Failed to open output: %s\n", argv[2]);
-        std::fclose(in);
+        line_reader_close(&in);
         return 1;
     }
 
-    TermSlot* table = static_cast<TermSlot*>(std::calloc(capacity, sizeof(TermSlot)));
-    if (!table) {
+    TermDict dict;
+    StreamCounts sc{};
+    if (!term_dict_init(&dict, stream ? 0 : capacity, sizeof(std::uint32_t))) {
         std::fprintf(stderr, "Failed to allocate hash table\n");
-        std::fclose(in);
+        line_reader_close(&in);
         std::fclose(out);
         return 1;
     }
 
-    char* line = nullptr;
-    size_t line_cap = 0;
+    LineView line;
     std::uint64_t docs = 0;
     std::uint64_t all_tokens = 0;
-    std::uint64_t unique_terms = 0;
     std::uint64_t total_term_len = 0;
 
-    while (1) {
-        int line_len = read_line(in, &line, &line_cap);
-        if (line_len < 0) {
-            break;
-        }
-        if (line_len == 0) {
-            continue;
-        }
-        char* tab = std::strchr(line, '\t');
+    int ok = !stream || count_stream(argv[1], &sc, &docs, &all_tokens);
+    while (ok && !stream && line_reader_next(&in, &line)) {
+        line = line_view_cstr(line);
+        const char* tab = line_view_find(line, '\t');
         if (!tab) {
             continue;
         }
-        char* body = tab + 1;
-
-        char* p = body;
-        while (*p) {
-            while (*p && std::isspace(static_cast<unsigned char>(*p))) {
+        const char* end = line.data + line.len;
+        for (const char* p = tab + 1; ok && p < end;) {
+            if (line_is_space(static_cast<unsigned char>(*p))) {
                 ++p;
+                continue;
             }
-            if (!*p) {
-                break;
-            }
-            char* start = p;
-            while (*p && !std::isspace(static_cast<unsigned char>(*p))) {
+            const char* start = p;
+            while (p < end && !line_is_space(static_cast<unsigned char>(*p))) {
                 ++p;
             }
-            char saved = *p;
-            *p = '\0';
-
-            if (start[0] != '\0') {
-                if (!add_term(table, capacity, start, &unique_terms)) {
-                    std::fprintf(stderr, "Term hash table is full; increase capacity\n");
-                    std::free(line);
-                    std::fclose(in);
-                    std::fclose(out);
-                    for (std::size_t i = 0; i < capacity; ++i) {
-                        if (table[i].used) {
-                            std::free(table[i].term);
-                        }
-                    }
-                    std::free(table);
-                    return 1;
-                }
-                ++all_tokens;
-                total_term_len += static_cast<std::uint64_t>(std::strlen(start));
-            }
-
-            if (!saved) {
-                break;
+            size_t term_len = static_cast<size_t>(p - start);
+            ok = add_term(&dict, start, term_len);
+            if (!ok) {
+                std::fprintf(stderr, "Failed to add term (out of memory)\n");
             }
-            *p = saved;
+            ++all_tokens;
+            total_term_len += static_cast<std::uint64_t>(term_len);
         }
         ++docs;
     }
+    if (ok && in.error) {
+        std::fprintf(stderr, "Failed to read input: %s\n", argv[1]);
+        ok = 0;
+    }
 
-    TermRow* rows = static_cast<TermRow*>(std::malloc(sizeof(TermRow) * unique_terms));
-    if (!rows) {
+    std::uint64_t unique_terms = stream ? sc.dict.count : dict.count;
+    TermFreqRow* rows =
+        ok ? static_cast<TermFreqRow*>(std::malloc(sizeof(TermFreqRow) * (unique_terms + 1))) : nullptr;
+    if (ok && !rows) {
         std::fprintf(stderr, "Failed to allocate rows\n");
-        std::free(line);
-        std::fclose(in);
-        std::fclose(out);
-        for (std::size_t i = 0; i < capacity; ++i) {
-            if (table[i].used) {
-                std::free(table[i].term);
-            }
+        ok = 0;
+    }
+    for (std::uint32_t i = 0; ok && i < unique_terms; ++i) {
+        if (stream) {
+            rows[i].term = token_stream_term(&sc.dict, i);
+            rows[i].count = sc.counts[i];
+            total_term_len += static_cast<std::uint64_t>(token_stream_term_len(&sc.dict, i)) * sc.counts[i];
+        } else {
+            rows[i].term = term_dict_key(&dict, i);
+            rows[i].count = *static_cast<const std::uint32_t*>(term_dict_value(&dict, i));
         }
-        std::free(table);
-        return 1;
     }
 
-    std::uint64_t row_idx = 0;
-    for (std::size_t i = 0; i < capacity; ++i) {
-        if (!table[i].used) {
-            continue;
-        }
-        rows[row_idx].term = table[i].term;
-        rows[row_idx].count = table[i].count;
-        ++row_idx;
+    int written = ok && write_term_freq(out, rows, unique_terms);
+    if (ok && !written) {
+        std::fprintf(stderr, "Failed to write output: %s\n", argv[2]);
     }
 
-    std::qsort(rows, static_cast<size_t>(unique_terms), sizeof(TermRow), term_compare);
-
-    std::fprintf(out, "term,count\n");
-    for (std::uint64_t i = 0; i < unique_terms; ++i) {
-        std::fprintf(out, "%s,%u\n", rows[i].term, rows[i].count);
+    if (ok) {
+        double avg_term_len =
+            all_tokens == 0 ? 0.0 : static_cast<double>(total_term_len) / static_cast<double>(all_tokens);
+        std::printf("Term stats finished\n");
+        std::printf("documents=%llu\n", static_cast<unsigned long long>(docs));
+        std::printf("all_tokens=%llu\n", static_cast<unsigned long long>(all_tokens));
+        std::printf("unique_terms=%llu\n", static_cast<unsigned long long>(unique_terms));
+        std::printf("avg_term_length=%.4f\n", avg_term_len);
     }
 
-    double avg_term_len = all_tokens == 0 ? 0.0 : static_cast<double>(total_term_len) / static_cast<double>(all_tokens);
-    std::printf("Term stats finished\n");
-    std::printf("documents=%llu\n", static_cast<unsigned long long>(docs));
-    std::printf("all_tokens=%llu\n", static_cast<unsigned long long>(all_tokens));
-    std::printf("unique_terms=%llu\n", static_cast<unsigned long long>(unique_terms));
-    std::printf("avg_term_length=%.4f\n", avg_term_len);
-
     std::free(rows);
-    std::free(line);
-    std::fclose(in);
+    line_reader_close(&in);
     std::fclose(out);
 
-    for (std::size_t i = 0; i < capacity; ++i) {
-        if (table[i].used) {
-            std::free(table[i].term);
-        }
-    }
-    std::free(table);
-    return 0;
+    term_dict_free(&dict);
+    token_stream_dict_free(&sc.dict);
+    std::free(sc.counts);
+    return written ? 0 : 1;
 }
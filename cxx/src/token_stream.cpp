@@ -0,0 +1,424 @@
+#include "token_stream.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "line_reader.h"
+
+const std::size_t TOKEN_STREAM_BLOCK_HEADER_BYTES = sizeof(TokenStreamBlockHeader);
+
+int token_stream_is_file(const char* path) {
+    /* peeking into a pipe would eat the bytes the tool reads next */
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    FILE* in = std::fopen(path, "rb");
+    if (!in) {
+        return 0;
+    }
+    std::uint32_t magic = 0;
+    int is_stream = std::fread(&magic, sizeof(magic), 1, in) == 1 && magic == TOKEN_STREAM_MAGIC;
+    std::fclose(in);
+    return is_stream;
+}
+
+int token_stream_write_header(FILE* out) {
+    std::uint32_t header[2] = {TOKEN_STREAM_MAGIC, TOKEN_STREAM_VERSION};
+    return std::fwrite(header, sizeof(header), 1, out) == 1;
+}
+
+int token_stream_parse_block(const char* data, std::size_t len, TokenStreamBlock* block) {
+    TokenStreamBlockHeader h;
+    if (len < TOKEN_STREAM_BLOCK_HEADER_BYTES) {
+        return 0;
+    }
+    std::memcpy(&h, data, sizeof(h));
+    if (static_cast<std::uint64_t>(h.term_bytes) + h.doc_bytes != len - TOKEN_STREAM_BLOCK_HEADER_BYTES) {
+        return 0;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data) + TOKEN_STREAM_BLOCK_HEADER_BYTES;
+    block->term_count = h.term_count;
+    block->doc_count = h.doc_count;
+    block->terms = p;
+    block->terms_end = p + h.term_bytes;
+    block->docs = block->terms_end;
+    block->docs_end = block->docs + h.doc_bytes;
+    return 1;
+}
+
+int token_stream_parse_next(const char* data, std::size_t len, std::size_t* pos, TokenStreamBlock* block) {
+    TokenStreamBlockHeader h;
+    if (len - *pos < sizeof(h)) {
+        return 0;
+    }
+    std::memcpy(&h, data + *pos, sizeof(h));
+    std::uint64_t size = TOKEN_STREAM_BLOCK_HEADER_BYTES + static_cast<std::uint64_t>(h.term_bytes) + h.doc_bytes;
+    if (size > len - *pos || !token_stream_parse_block(data + *pos, static_cast<std::size_t>(size), block)) {
+        return 0;
+    }
+    *pos += static_cast<std::size_t>(size);
+    return 1;
+}
+
+int token_stream_dict_add(TokenStreamDict* dict, const TokenStreamBlock* block) {
+    if (block->term_count > UINT32_MAX - dict->count) {
+        return 0;
+    }
+    std::uint32_t need = dict->count + block->term_count;
+    if (need > dict->offsets_cap) {
+        std::uint32_t new_cap = (dict->offsets_cap == 0) ? 1024 : dict->offsets_cap;
+        while (new_cap < need) {
+            new_cap = (new_cap > UINT32_MAX / 2) ? UINT32_MAX : new_cap * 2;
+        }
+        std::uint64_t* grown =
+            static_cast<std::uint64_t*>(std::realloc(dict->offsets, sizeof(std::uint64_t) * new_cap));
+        if (!grown) {
+            return 0;
+        }
+        dict->offsets = grown;
+        dict->offsets_cap = new_cap;
+    }
+    /* the section holds every term once, so its size plus one NUL per term bounds what is added */
+    std::size_t extra = static_cast<std::size_t>(block->terms_end - block->terms) + block->term_count;
+    if (dict->cap - dict->len < extra) {
+        std::size_t new_cap = (dict->cap == 0) ? 64 * 1024 : dict->cap;
+        while (new_cap - dict->len < extra) {
+            new_cap *= 2;
+        }
+        char* grown = static_cast<char*>(std::realloc(dict->bytes, new_cap));
+        if (!grown) {
+            return 0;
+        }
+        dict->bytes = grown;
+        dict->cap = new_cap;
+    }
+    const unsigned char* p = block->terms;
+    for (std::uint32_t i = 0; i < block->term_count; ++i) {
+        std::uint32_t len = 0;
+        if (!token_stream_varint(&p, block->terms_end, &len) || len > static_cast<std::size_t>(block->terms_end - p)) {
+            return 0;
+        }
+        dict->offsets[dict->count++] = dict->len;
+        std::memcpy(dict->bytes + dict->len, p, len);
+        dict->len += len;
+        dict->bytes[dict->len++] = '\0';
+        p += len;
+    }
+    return p == block->terms_end;
+}
+
+void token_stream_dict_free(TokenStreamDict* dict) {
+    std::free(dict->bytes);
+    std::free(dict->offsets);
+    *dict = TokenStreamDict{};
+}
+
+int token_stream_open(TokenStreamReader* r, const char* path) {
+    *r = TokenStreamReader{};
+    r->in = std::fopen(path, "rb");
+    if (!r->in) {
+        return 0;
+    }
+    std::uint32_t header[2] = {0, 0};
+    if (std::fread(header, sizeof(header), 1, r->in) != 1 || header[0] != TOKEN_STREAM_MAGIC ||
+        header[1] != TOKEN_STREAM_VERSION) {
+        token_stream_close(r);
+        return 0;
+    }
+    r->offset = sizeof(header);
+    return 1;
+}
+
+void token_stream_close(TokenStreamReader* r) {
+    if (r->in) {
+        std::fclose(r->in);
+    }
+    std::free(r->buf);
+    *r = TokenStreamReader{};
+}
+
+int token_stream_seek(TokenStreamReader* r, std::uint64_t offset) {
+    if (fseeko(r->in, static_cast<off_t>(offset), SEEK_SET) != 0) {
+        r->error = 1;
+        return 0;
+    }
+    r->offset = offset;
+    return 1;
+}
+
+int token_stream_next(TokenStreamReader* r, const char** data, std::size_t* len, TokenStreamBlock* block) {
+    TokenStreamBlockHeader h;
+    std::size_t got = std::fread(&h, 1, sizeof(h), r->in);
+    if (got != sizeof(h)) {
+        r->error = got != 0 || std::ferror(r->in);
+        return 0;
+    }
+    std::size_t total = TOKEN_STREAM_BLOCK_HEADER_BYTES + h.term_bytes + static_cast<std::size_t>(h.doc_bytes);
+    if (total > r->cap) {
+        std::size_t new_cap = (r->cap == 0) ? 256 * 1024 : r->cap;
+        while (new_cap < total) {
+            new_cap *= 2;
+        }
+        char* grown = static_cast<char*>(std::realloc(r->buf, new_cap));
+        if (!grown) {
+            r->error = 1;
+            return 0;
+        }
+        r->buf = grown;
+        r->cap = new_cap;
+    }
+    std::memcpy(r->buf, &h, sizeof(h));
+    std::size_t payload = total - TOKEN_STREAM_BLOCK_HEADER_BYTES;
+    if (std::fread(r->buf + TOKEN_STREAM_BLOCK_HEADER_BYTES, 1, payload, r->in) != payload ||
+        !token_stream_parse_block(r->buf, total, block)) {
+        r->error = 1;
+        return 0;
+    }
+    r->offset += total;
+    *data = r->buf;
+    *len = total;
+    return 1;
+}
+
+int token_stream_load_dict(TokenStreamReader* r, TokenStreamDict* dict, std::uint64_t** block_starts,
+                           std::uint64_t* block_count) {
+    std::uint64_t cap = 0;
+    *block_starts = nullptr;
+    *block_count = 0;
+    while (1) {
+        TokenStreamBlockHeader h;
+        std::size_t got = std::fread(&h, 1, sizeof(h), r->in);
+        if (got != sizeof(h)) {
+            r->error = got != 0 || std::ferror(r->in);
+            return !r->error;
+        }
+        if (h.term_bytes > r->cap) {
+            char* grown = static_cast<char*>(std::realloc(r->buf, h.term_bytes));
+            if (!grown) {
+                r->error = 1;
+                return 0;
+            }
+            r->buf = grown;
+            r->cap = h.term_bytes;
+        }
+        if (*block_count == cap) {
+            cap = (cap == 0) ? 256 : cap * 2;
+            std::uint64_t* grown =
+                static_cast<std::uint64_t*>(std::realloc(*block_starts, sizeof(std::uint64_t) * cap));
+            if (!grown) {
+                r->error = 1;
+                return 0;
+            }
+            *block_starts = grown;
+        }
+        (*block_starts)[(*block_count)++] = r->offset;
+        const unsigned char* terms = reinterpret_cast<const unsigned char*>(r->buf);
+        TokenStreamBlock block = {h.term_count, 0, terms, terms + h.term_bytes, terms + h.term_bytes,
+                                  terms + h.term_bytes};
+        if ((h.term_bytes > 0 && std::fread(r->buf, 1, h.term_bytes, r->in) != h.term_bytes) ||
+            !token_stream_dict_add(dict, &block) || fseeko(r->in, static_cast<off_t>(h.doc_bytes), SEEK_CUR) != 0) {
+            r->error = 1;
+            return 0;
+        }
+        r->offset += sizeof(h) + static_cast<std::uint64_t>(h.term_bytes) + h.doc_bytes;
+    }
+}
+
+int token_stream_source_run(void* ctx, DocBatch* batch) {
+    TokenStreamSource* src = static_cast<TokenStreamSource*>(ctx);
+    PipeBuf* text = &batch->text;
+    text->len = 0;
+    const char* data = nullptr;
+    std::size_t len = 0;
+    TokenStreamBlock block;
+    if (token_stream_next(&src->reader, &data, &len, &block)) {
+        if (!pipe_buf_reserve(text, len)) {
+            std::fprintf(stderr, "Failed to allocate pipeline batch\n");
+            return 0;
+        }
+        std::memcpy(text->data, data, len);
+        text->len = len;
+        batch->docs = block.doc_count;
+        batch->last = 0;
+    } else if (src->reader.error) {
+        std::fprintf(stderr, "Failed to read token stream\n");
+        return 0;
+    } else {
+        batch->docs = 0;
+        batch->last = 1;
+    }
+    return 1;
+}
+
+int token_stream_append_block(PipeBuf* out, std::uint32_t term_count, const PipeBuf* terms, std::uint32_t doc_count,
+                              const PipeBuf* docs) {
+    if (terms->len > UINT32_MAX || docs->len > UINT32_MAX ||
+        !pipe_buf_reserve(out, TOKEN_STREAM_BLOCK_HEADER_BYTES + terms->len + docs->len)) {
+        return 0;
+    }
+    TokenStreamBlockHeader h = {term_count, static_cast<std::uint32_t>(terms->len), doc_count,
+                                static_cast<std::uint32_t>(docs->len)};
+    std::memcpy(out->data + out->len, &h, sizeof(h));
+    out->len += sizeof(h);
+    if (terms->len > 0) {
+        std::memcpy(out->data + out->len, terms->data, terms->len);
+        out->len += terms->len;
+    }
+    if (docs->len > 0) {
+        std::memcpy(out->data + out->len, docs->data, docs->len);
+        out->len += docs->len;
+    }
+    return 1;
+}
+
+int token_stream_encoder_init(TokenStreamEncoder* enc) {
+    *enc = TokenStreamEncoder{};
+    return term_dict_init(&enc->dict, 0, 0);
+}
+
+void token_stream_encoder_free(TokenStreamEncoder* enc) {
+    term_dict_free(&enc->dict);
+    std::free(enc->terms.data);
+    std::free(enc->docs.data);
+    std::free(enc->ids.data);
+    *enc = TokenStreamEncoder{};
+}
+
+/* Encodes one line into enc->docs, adding its new terms to enc->terms; 0 when out of memory. */
+static int encode_line(TokenStreamEncoder* enc, LineView line, std::uint32_t* term_count) {
+    const char* tab = line_view_find(line, '\t');
+    std::uint32_t doc_id = line_parse_u32(line.data, static_cast<std::size_t>(tab - line.data));
+    const char* end = line.data + line.len;
+    std::uint32_t tokens = 0;
+    enc->ids.len = 0;
+    /* at most one token per two bytes, five bytes per id */
+    if (!pipe_buf_reserve(&enc->ids, (line.len / 2 + 1) * 5)) {
+        return 0;
+    }
+    for (const char* p = tab + 1; p < end;) {
+        if (line_is_space(static_cast<unsigned char>(*p))) {
+            ++p;
+            continue;
+        }
+        const char* start = p;
+        while (p < end && !line_is_space(static_cast<unsigned char>(*p))) {
+            ++p;
+        }
+        std::size_t len = static_cast<std::size_t>(p - start);
+        std::uint32_t id = 0;
+        int inserted = 0;
+        if (!term_dict_intern(&enc->dict, start, len, &id, &inserted)) {
+            return 0;
+        }
+        if (inserted) {
+            if (!pipe_buf_reserve(&enc->terms, len + 5)) {
+                return 0;
+            }
+            token_stream_put_varint(&enc->terms, static_cast<std::uint32_t>(len));
+            std::memcpy(enc->terms.data + enc->terms.len, start, len);
+            enc->terms.len += len;
+            ++*term_count;
+        }
+        token_stream_put_varint(&enc->ids, id);
+        ++tokens;
+    }
+    if (!pipe_buf_reserve(&enc->docs, enc->ids.len + 10)) {
+        return 0;
+    }
+    token_stream_put_varint(&enc->docs, doc_id);
+    token_stream_put_varint(&enc->docs, tokens);
+    if (enc->ids.len > 0) {
+        std::memcpy(enc->docs.data + enc->docs.len, enc->ids.data, enc->ids.len);
+        enc->docs.len += enc->ids.len;
+    }
+    return 1;
+}
+
+int token_stream_encode_run(void* ctx, DocBatch* batch) {
+    TokenStreamEncoder* enc = static_cast<TokenStreamEncoder*>(ctx);
+    enc->terms.len = 0;
+    enc->docs.len = 0;
+    std::uint32_t term_count = 0;
+    std::uint32_t doc_count = 0;
+    const char* text_end = batch->text.data + batch->text.len;
+    for (const char* line = batch->text.data; line < text_end;) {
+        const char* nl = static_cast<const char*>(std::memchr(line, '\n', static_cast<std::size_t>(text_end - line)));
+        /* the line ends at a NUL, as it does for the text tools */
+        LineView view = line_view_cstr(LineView{line, static_cast<std::size_t>(nl - line)});
+        if (line_view_find(view, '\t')) {
+            if (!encode_line(enc, view, &term_count)) {
+                std::fprintf(stderr, "Failed to allocate token stream block\n");
+                return 0;
+            }
+            ++doc_count;
+        }
+        line = nl + 1;
+    }
+    if ((term_count > 0 || doc_count > 0) &&
+        !token_stream_append_block(&batch->next, term_count, &enc->terms, doc_count, &enc->docs)) {
+        std::fprintf(stderr, "Failed to allocate token stream block\n");
+        return 0;
+    }
+    batch->docs = doc_count;
+    doc_batch_swap(batch);
+    return 1;
+}
+
+void token_stream_decoder_free(TokenStreamDecoder* dec) {
+    token_stream_dict_free(&dec->dict);
+}
+
+/* Appends the lines of one block to out. */
+static int decode_block(TokenStreamDecoder* dec, const TokenStreamBlock* block, PipeBuf* out) {
+    if (!token_stream_dict_add(&dec->dict, block)) {
+        return 0;
+    }
+    const unsigned char* p = block->docs;
+    for (std::uint32_t d = 0; d < block->doc_count; ++d) {
+        std::uint32_t doc_id = 0;
+        std::uint32_t tokens = 0;
+        if (!token_stream_varint(&p, block->docs_end, &doc_id) || !token_stream_varint(&p, block->docs_end, &tokens) ||
+            !pipe_buf_reserve(out, 12)) {
+            return 0;
+        }
+        out->len += static_cast<std::size_t>(std::snprintf(out->data + out->len, 12, "%u", doc_id));
+        out->data[out->len++] = '\t';
+        for (std::uint32_t t = 0; t < tokens; ++t) {
+            std::uint32_t id = 0;
+            if (!token_stream_varint(&p, block->docs_end, &id) || id >= dec->dict.count) {
+                return 0;
+            }
+            const char* term = token_stream_term(&dec->dict, id);
+            std::size_t len = std::strlen(term);
+            if (!pipe_buf_reserve(out, len + 2)) {
+                return 0;
+            }
+            if (t > 0) {
+                out->data[out->len++] = ' ';
+            }
+            std::memcpy(out->data + out->len, term, len);
+            out->len += len;
+        }
+        out->data[out->len++] = '\n';
+    }
+    return p == block->docs_end;
+}
+
+int token_stream_decode_run(void* ctx, DocBatch* batch) {
+    TokenStreamDecoder* dec = static_cast<TokenStreamDecoder*>(ctx);
+    std::uint64_t docs = 0;
+    for (std::size_t pos = 0; pos < batch->text.len;) {
+        TokenStreamBlock block;
+        if (!token_stream_parse_next(batch->text.data, batch->text.len, &pos, &block) ||
+            !decode_block(dec, &block, &batch->next)) {
+            std::fprintf(stderr, "Malformed token stream block\n");
+            return 0;
+        }
+        docs += block.doc_count;
+    }
+    batch->docs = docs;
+    doc_batch_swap(batch);
+    return 1;
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "pipeline.h"
+#include "term_dict.h"
+
+/*
+ * Binary form of tokenized.txt and stemmed.txt. Terms are numbered in the
+ * order they first appear and every document is a list of term ids, so a
+ * tool reading the stream sees each distinct string once instead of
+ * splitting and hashing every token.
+ *
+ *   header  uint32 magic | uint32 version
+ *   blocks  TokenStreamBlockHeader
+ *           | terms: term_count x (varint len | bytes), the next term_count ids
+ *           | docs:  doc_count x (varint doc_id | varint tokens | tokens x varint term id)
+ *
+ * Varints are LEB128; every other integer is little-endian, as written by
+ * the host. A block is what one pipeline batch holds, and its terms section
+ * defines every id its documents use for the first time, so the stream can
+ * be written and read front to back without holding more than one block.
+ * The doc id is the number the text tools read from the first column, and a
+ * document keeps its line even with no tokens, so term_stats and
+ * index_builder get the same result from either form.
+ */
+
+const std::uint32_t TOKEN_STREAM_MAGIC = 0x5354494DU; /* "MITS" */
+const std::uint32_t TOKEN_STREAM_VERSION = 1;
+
+struct TokenStreamBlockHeader {
+    std::uint32_t term_count;
+    std::uint32_t term_bytes;
+    std::uint32_t doc_count;
+    std::uint32_t doc_bytes;
+};
+
+/* A parsed block; the sections point into its bytes. */
+struct TokenStreamBlock {
+    std::uint32_t term_count;
+    std::uint32_t doc_count;
+    const unsigned char* terms;
+    const unsigned char* terms_end;
+    const unsigned char* docs;
+    const unsigned char* docs_end;
+};
+
+/* Whether path is a regular file starting with the token stream header; 0 also when it cannot be read. */
+int token_stream_is_file(const char* path);
+
+int token_stream_write_header(FILE* out);
+
+/* Checks a whole block (header included) of len bytes and fills *block. Returns 0 when it is malformed. */
+int token_stream_parse_block(const char* data, std::size_t len, TokenStreamBlock* block);
+
+/* The block at data[*pos] of data[0, len), blocks back to back as in a batch; moves *pos past it. */
+int token_stream_parse_next(const char* data, std::size_t len, std::size_t* pos, TokenStreamBlock* block);
+
+/* Reads one LEB128 value below 2^32 at *p, before end; returns 0 when it is cut off or too long. */
+inline int token_stream_varint(const unsigned char** p, const unsigned char* end, std::uint32_t* value) {
+    const unsigned char* s = *p;
+    std::uint32_t v = 0;
+    for (int shift = 0; shift < 35 && s < end; shift += 7) {
+        unsigned char b = *s++;
+        v |= static_cast<std::uint32_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *p = s;
+            *value = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Ids to strings, built block by block as a reader goes; every term is kept NUL-terminated. */
+struct TokenStreamDict {
+    char* bytes;
+    std::size_t len;
+    std::size_t cap;
+    std::uint64_t* offsets; /* of term id i in bytes */
+    std::uint32_t count;
+    std::uint32_t offsets_cap;
+};
+
+/* Adds the terms section of block, which must continue the ids where the dictionary ends. */
+int token_stream_dict_add(TokenStreamDict* dict, const TokenStreamBlock* block);
+void token_stream_dict_free(TokenStreamDict* dict);
+
+inline const char* token_stream_term(const TokenStreamDict* dict, std::uint32_t id) {
+    return dict->bytes + dict->offsets[id];
+}
+
+inline std::size_t token_stream_term_len(const TokenStreamDict* dict, std::uint32_t id) {
+    std::uint64_t end = (id + 1 < dict->count) ? dict->offsets[id + 1] : dict->len;
+    return static_cast<std::size_t>(end - dict->offsets[id] - 1);
+}
+
+/*
+ * Reads a stream front to back one block at a time. The block stays valid
+ * until the next call. offset is the file offset of the next block.
+ */
+struct TokenStreamReader {
+    FILE* in;
+    char* buf;
+    std::size_t cap;
+    std::uint64_t offset;
+    int error; /* a read failed or a block is malformed */
+};
+
+/* Opens path and checks its header; returns 0 when it cannot be opened or is no token stream. */
+int token_stream_open(TokenStreamReader* r, const char* path);
+void token_stream_close(TokenStreamReader* r);
+
+/* Continues at offset, which must be where a block starts. */
+int token_stream_seek(TokenStreamReader* r, std::uint64_t offset);
+
+/* Next block, header included, as data[0, *len) and parsed; returns 0 at the end or on error. */
+int token_stream_next(TokenStreamReader* r, const char** data, std::size_t* len, TokenStreamBlock* block);
+
+/*
+ * Reads every terms section from the reader's position to the end into
+ * dict, skipping the documents, and the offset of every block into
+ * *block_starts (malloc'd, *block_count of them). r->offset ends up at the
+ * end of the stream.
+ */
+int token_stream_load_dict(TokenStreamReader* r, TokenStreamDict* dict, std::uint64_t** block_starts,
+                           std::uint64_t* block_count);
+
+/* Source stage: one block of the stream per batch, docs set to its documents. */
+struct TokenStreamSource {
+    TokenStreamReader reader;
+};
+
+int token_stream_source_run(void* ctx, DocBatch* batch);
+
+/*
+ * Stage turning "doc_id\tterm term ..." lines (tokenized or stemmed) into one
+ * block per batch. Lines without a tab are dropped, as the text tools do.
+ * Call token_stream_encoder_init first and token_stream_encoder_free after.
+ */
+struct TokenStreamEncoder {
+    TermDict dict; /* the ids handed out so far */
+    PipeBuf terms;
+    PipeBuf docs;
+    PipeBuf ids; /* of the line being encoded */
+};
+
+int token_stream_encoder_init(TokenStreamEncoder* enc);
+void token_stream_encoder_free(TokenStreamEncoder* enc);
+int token_stream_encode_run(void* ctx, DocBatch* batch);
+
+/* Stage turning blocks back into lines, the doc id written as a decimal number. */
+struct TokenStreamDecoder {
+    TokenStreamDict dict;
+};
+
+void token_stream_decoder_free(TokenStreamDecoder* dec);
+int token_stream_decode_run(void* ctx, DocBatch* batch);
+
+/* Appends a block with the given sections, already encoded, to out. */
+int token_stream_append_block(PipeBuf* out, std::uint32_t term_count, const PipeBuf* terms, std::uint32_t doc_count,
+                              const PipeBuf* docs);
+
+/* Appends v as a LEB128 varint to buf, which needs 5 bytes free. */
+inline void token_stream_put_varint(PipeBuf* buf, std::uint32_t v) {
+    while (v >= 0x80) {
+        buf->data[buf->len++] = static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    buf->data[buf->len++] = static_cast<char>(v);
+}
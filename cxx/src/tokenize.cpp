@@ -0,0 +1,554 @@
+#include "tokenize.h"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZE_X86 1
+#endif
+
+/*
+ * Token characters: letters, digits and combining marks. Each range says how
+ * its uppercase letters map to lowercase; code points outside every range
+ * separate tokens. The scripts are the ones the music press writes in, not
+ * all of Unicode.
+ */
+const int FOLD_NONE = 0;  /* lowercase or caseless */
+const int FOLD_SHIFT = 1; /* every code point moves by delta */
+const int FOLD_EVEN = 2;  /* upper/lower pairs, the even code point uppercase */
+const int FOLD_ODD = 3;   /* upper/lower pairs, the odd code point uppercase */
+
+struct TokenRange {
+    std::uint32_t first;
+    std::uint32_t last;
+    int fold;
+    std::int32_t delta;
+};
+
+static constexpr TokenRange TOKEN_RANGES[] = {
+    {'0', '9', FOLD_NONE, 0},
+    {'A', 'Z', FOLD_SHIFT, 32},
+    {'a', 'z', FOLD_NONE, 0},
+    {0x00AA, 0x00AA, FOLD_NONE, 0},
+    {0x00B5, 0x00B5, FOLD_NONE, 0},
+    {0x00BA, 0x00BA, FOLD_NONE, 0},
+    {0x00C0, 0x00D6, FOLD_SHIFT, 32}, /* Latin-1 */
+    {0x00D8, 0x00DE, FOLD_SHIFT, 32},
+    {0x00DF, 0x00F6, FOLD_NONE, 0},
+    {0x00F8, 0x00FF, FOLD_NONE, 0},
+    {0x0100, 0x012F, FOLD_EVEN, 0}, /* Latin Extended-A */
+    {0x0130, 0x0130, FOLD_SHIFT, 'i' - 0x0130},
+    {0x0131, 0x0131, FOLD_NONE, 0},
+    {0x0132, 0x0137, FOLD_EVEN, 0},
+    {0x0138, 0x0138, FOLD_NONE, 0},
+    {0x0139, 0x0148, FOLD_ODD, 0},
+    {0x0149, 0x0149, FOLD_NONE, 0},
+    {0x014A, 0x0177, FOLD_EVEN, 0},
+    {0x0178, 0x0178, FOLD_SHIFT, 0x00FF - 0x0178},
+    {0x0179, 0x017E, FOLD_ODD, 0},
+    {0x017F, 0x01CC, FOLD_NONE, 0}, /* Latin Extended-B, irregular pairs kept as they are */
+    {0x01CD, 0x01DC, FOLD_ODD, 0},
+    {0x01DD, 0x01DD, FOLD_NONE, 0},
+    {0x01DE, 0x01EF, FOLD_EVEN, 0},
+    {0x01F0, 0x01F7, FOLD_NONE, 0},
+    {0x01F8, 0x021F, FOLD_EVEN, 0},
+    {0x0220, 0x0221, FOLD_NONE, 0},
+    {0x0222, 0x0233, FOLD_EVEN, 0},
+    {0x0234, 0x0245, FOLD_NONE, 0},
+    {0x0246, 0x024F, FOLD_EVEN, 0},
+    {0x0250, 0x02C1, FOLD_NONE, 0}, /* IPA, modifier letters */
+    {0x0300, 0x036F, FOLD_NONE, 0}, /* combining accents stay inside their word */
+    {0x0386, 0x0386, FOLD_SHIFT, 38}, /* Greek */
+    {0x0388, 0x038A, FOLD_SHIFT, 37},
+    {0x038C, 0x038C, FOLD_SHIFT, 64},
+    {0x038E, 0x038F, FOLD_SHIFT, 63},
+    {0x0390, 0x0390, FOLD_NONE, 0},
+    {0x0391, 0x03A1, FOLD_SHIFT, 32},
+    {0x03A3, 0x03AB, FOLD_SHIFT, 32},
+    {0x03AC, 0x03D7, FOLD_NONE, 0},
+    {0x03D8, 0x03EF, FOLD_EVEN, 0},
+    {0x03F0, 0x03F5, FOLD_NONE, 0},
+    {0x0400, 0x040F, FOLD_SHIFT, 80}, /* Cyrillic */
+    {0x0410, 0x042F, FOLD_SHIFT, 32},
+    {0x0430, 0x045F, FOLD_NONE, 0},
+    {0x0460, 0x0481, FOLD_EVEN, 0},
+    {0x0483, 0x0489, FOLD_NONE, 0},
+    {0x048A, 0x04BF, FOLD_EVEN, 0},
+    {0x04C0, 0x04C0, FOLD_SHIFT, 15},
+    {0x04C1, 0x04CE, FOLD_ODD, 0},
+    {0x04CF, 0x04CF, FOLD_NONE, 0},
+    {0x04D0, 0x052F, FOLD_EVEN, 0},
+    {0x0531, 0x0556, FOLD_SHIFT, 48}, /* Armenian */
+    {0x0561, 0x0587, FOLD_NONE, 0},
+    {0x05D0, 0x05EA, FOLD_NONE, 0}, /* Hebrew */
+    {0x0620, 0x064A, FOLD_NONE, 0}, /* Arabic */
+    {0x0660, 0x0669, FOLD_NONE, 0},
+    {0x0671, 0x06D3, FOLD_NONE, 0},
+    {0x06F0, 0x06F9, FOLD_NONE, 0},
+    {0x0900, 0x097F, FOLD_NONE, 0}, /* Devanagari */
+    {0x0E01, 0x0E4E, FOLD_NONE, 0}, /* Thai */
+    {0x0E50, 0x0E59, FOLD_NONE, 0},
+    {0x1E00, 0x1E95, FOLD_EVEN, 0}, /* Latin Extended Additional */
+    {0x1E96, 0x1E9D, FOLD_NONE, 0},
+    {0x1E9E, 0x1E9E, FOLD_SHIFT, 0x00DF - 0x1E9E},
+    {0x1E9F, 0x1E9F, FOLD_NONE, 0},
+    {0x1EA0, 0x1EFF, FOLD_EVEN, 0},
+    {0x1F00, 0x1FBC, FOLD_NONE, 0}, /* Greek Extended */
+    {0x3041, 0x3096, FOLD_NONE, 0}, /* Hiragana */
+    {0x30A1, 0x30FA, FOLD_NONE, 0}, /* Katakana */
+    {0x3400, 0x4DBF, FOLD_NONE, 0}, /* CJK */
+    {0x4E00, 0x9FFF, FOLD_NONE, 0},
+    {0xAC00, 0xD7A3, FOLD_NONE, 0}, /* Hangul */
+    {0xFF10, 0xFF19, FOLD_NONE, 0}, /* fullwidth forms */
+    {0xFF21, 0xFF3A, FOLD_SHIFT, 32},
+    {0xFF41, 0xFF5A, FOLD_NONE, 0},
+};
+
+const std::size_t TOKEN_RANGE_COUNT = sizeof(TOKEN_RANGES) / sizeof(TOKEN_RANGES[0]);
+const std::uint32_t NARROW_LIMIT = 0x800; /* code points of one- and two-byte UTF-8 */
+
+static constexpr std::uint32_t range_fold(const TokenRange& range, std::uint32_t cp) {
+    if (range.fold == FOLD_SHIFT) {
+        return static_cast<std::uint32_t>(static_cast<std::int32_t>(cp) + range.delta);
+    }
+    if (range.fold == FOLD_EVEN) {
+        return (cp % 2 == 0) ? cp + 1 : cp;
+    }
+    if (range.fold == FOLD_ODD) {
+        return (cp % 2 == 1) ? cp + 1 : cp;
+    }
+    return cp;
+}
+
+static constexpr std::size_t utf8_length(std::uint32_t cp) {
+    return (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+}
+
+/* Sorted, disjoint, and no lowercase form longer in UTF-8 than its letter, so output never outgrows input. */
+static constexpr bool token_ranges_valid() {
+    for (std::size_t r = 0; r < TOKEN_RANGE_COUNT; ++r) {
+        const TokenRange& range = TOKEN_RANGES[r];
+        if (range.first > range.last || (r > 0 && TOKEN_RANGES[r - 1].last >= range.first)) {
+            return false;
+        }
+        for (std::uint32_t cp = range.first; cp <= range.last; ++cp) {
+            std::uint32_t lower = range_fold(range, cp);
+            if (lower == 0 || utf8_length(lower) > utf8_length(cp)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(token_ranges_valid(), "TOKEN_RANGES must be sorted, disjoint and never lengthen a character");
+
+/* Lowercase form of every code point below NARROW_LIMIT, 0 for separators; ascii holds the first 128 as bytes. */
+struct NarrowTable {
+    std::uint16_t lower[NARROW_LIMIT];
+    unsigned char ascii[256];
+};
+
+static constexpr NarrowTable make_narrow_table() {
+    NarrowTable table{};
+    for (std::size_t r = 0; r < TOKEN_RANGE_COUNT && TOKEN_RANGES[r].first < NARROW_LIMIT; ++r) {
+        const TokenRange& range = TOKEN_RANGES[r];
+        for (std::uint32_t cp = range.first; cp <= range.last && cp < NARROW_LIMIT; ++cp) {
+            table.lower[cp] = static_cast<std::uint16_t>(range_fold(range, cp));
+        }
+    }
+    for (std::uint32_t c = 0; c < 0x80; ++c) {
+        table.ascii[c] = static_cast<unsigned char>(table.lower[c]);
+    }
+    return table;
+}
+
+static constexpr NarrowTable NARROW_TABLE = make_narrow_table();
+
+/* Lowercase form of a token character, 0 for a separator. */
+static std::uint32_t fold_code_point(std::uint32_t cp) {
+    if (cp < NARROW_LIMIT) {
+        return NARROW_TABLE.lower[cp];
+    }
+    std::size_t lo = 0;
+    std::size_t hi = TOKEN_RANGE_COUNT;
+    while (lo < hi) {
+        std::size_t mid = (lo + hi) / 2;
+        if (TOKEN_RANGES[mid].last < cp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == TOKEN_RANGE_COUNT || TOKEN_RANGES[lo].first > cp) {
+        return 0;
+    }
+    return range_fold(TOKEN_RANGES[lo], cp);
+}
+
+/* Decodes one well-formed UTF-8 character of s[0, avail); returns its length, or 0 if there is none. */
+static std::size_t decode_utf8(const unsigned char* s, std::size_t avail, std::uint32_t* cp) {
+    unsigned char b0 = s[0];
+    if (b0 < 0xC2 || b0 > 0xF4) {
+        return 0; /* ASCII, a continuation byte or a lead byte that is never valid */
+    }
+    std::size_t len = (b0 < 0xE0) ? 2 : (b0 < 0xF0) ? 3 : 4;
+    if (avail < len) {
+        return 0;
+    }
+    std::uint32_t value = b0 & (0x7F >> len);
+    for (std::size_t k = 1; k < len; ++k) {
+        if ((s[k] & 0xC0) != 0x80) {
+            return 0;
+        }
+        value = (value << 6) | (s[k] & 0x3F);
+    }
+    if ((len == 3 && (value < 0x800 || (value >= 0xD800 && value <= 0xDFFF))) ||
+        (len == 4 && (value < 0x10000 || value > 0x10FFFF))) {
+        return 0;
+    }
+    *cp = value;
+    return len;
+}
+
+static std::size_t encode_utf8(std::uint32_t cp, char* out) {
+    if (cp < 0x80) {
+        out[0] = static_cast<char>(cp);
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (cp >> 6));
+        out[1] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (cp >> 12));
+        out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (cp >> 18));
+    out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+std::size_t token_char_length(const char* text, std::size_t len) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(text);
+    if (len == 0) {
+        return 0;
+    }
+    if (s[0] < 0x80) {
+        return NARROW_TABLE.ascii[s[0]] ? 1 : 0;
+    }
+    std::uint32_t cp = 0;
+    std::size_t n = decode_utf8(s, len, &cp);
+    return (n > 0 && fold_code_point(cp) != 0) ? n : 0;
+}
+
+struct TokenOut {
+    char* out;
+    std::size_t n;
+    std::uint64_t count;
+    int in_token; /* the last character seen was part of a token */
+};
+
+static inline void start_token(TokenOut* t) {
+    if (!t->in_token) {
+        if (t->count > 0) {
+            t->out[t->n++] = ' '; /* the separator that ended the previous token pays for this byte */
+        }
+        ++t->count;
+        t->in_token = 1;
+    }
+}
+
+/* The non-ASCII character at text[i]; returns the index after it. Malformed bytes separate tokens one at a time. */
+static std::size_t tokenize_wide_char(TokenOut* t, const unsigned char* text, std::size_t len, std::size_t i) {
+    std::uint32_t cp = 0;
+    std::size_t n = decode_utf8(text + i, len - i, &cp);
+    std::uint32_t lower = (n > 0) ? fold_code_point(cp) : 0;
+    if (!lower) {
+        t->in_token = 0;
+        return i + ((n > 0) ? n : 1);
+    }
+    start_token(t);
+    t->n += encode_utf8(lower, t->out + t->n);
+    return i + n;
+}
+
+/* The run of non-ASCII bytes starting at text[i]; returns the index of the next ASCII byte or len. */
+static std::size_t tokenize_wide_run(TokenOut* t, const unsigned char* text, std::size_t len, std::size_t i) {
+    while (i < len && text[i] >= 0x80) {
+        i = tokenize_wide_char(t, text, len, i);
+    }
+    return i;
+}
+
+static void tokenize_scalar(TokenOut* t, const unsigned char* text, std::size_t len) {
+    std::size_t i = 0;
+    while (i < len) {
+        unsigned char c = text[i];
+        if (c >= 0x80) {
+            i = tokenize_wide_char(t, text, len, i);
+            continue;
+        }
+        unsigned char lower = NARROW_TABLE.ascii[c];
+        if (!lower) {
+            t->in_token = 0;
+        } else {
+            start_token(t);
+            t->out[t->n++] = static_cast<char>(lower);
+        }
+        ++i;
+    }
+}
+
+/*
+ * Copies the runs of set bits in mask (bit i: low[i] is an ASCII letter or
+ * digit) among the first lanes bytes of low, a block of W lowercased bytes,
+ * to the output. low must be readable for 2 * W bytes. Each run is copied
+ * with one fixed-size move that may write past it, into the output's slack.
+ */
+template <int W>
+static inline void emit_runs(TokenOut* t, std::uint64_t mask, const char* low, unsigned lanes) {
+    if (lanes == 0) {
+        return;
+    }
+    int continues = t->in_token;
+    t->in_token = static_cast<int>((mask >> (lanes - 1)) & 1);
+    while (mask) {
+        unsigned start = static_cast<unsigned>(__builtin_ctzll(mask));
+        std::uint64_t after = ~mask & (~0ULL << start);
+        unsigned end = (after && __builtin_ctzll(after) < W) ? static_cast<unsigned>(__builtin_ctzll(after)) : W;
+        if (start > 0 || !continues) {
+            if (t->count > 0) {
+                t->out[t->n++] = ' ';
+            }
+            ++t->count;
+        }
+        if (end - start <= 16) {
+            std::memcpy(t->out + t->n, low + start, 16);
+        } else {
+            std::memcpy(t->out + t->n, low + start, W);
+        }
+        t->n += end - start;
+        mask = (end >= 64) ? 0 : (mask & (~0ULL << end));
+    }
+}
+
+/*
+ * The vector kernels take W bytes at a time. A block of plain ASCII is
+ * classified and copied out whole; in a block with a non-ASCII byte only the
+ * lanes before it are, the run of non-ASCII bytes is decoded one character
+ * at a time, and the next block starts right after it.
+ */
+#if defined(TOKENIZE_X86)
+/* Letters are the bytes whose (b | 0x20) - 'a' is at most 25 unsigned, digits those whose b - '0' is at most 9. */
+__attribute__((target("sse2"))) static void tokenize_sse2(TokenOut* t, const unsigned char* text, std::size_t len) {
+    alignas(16) char low[32] = {};
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    std::size_t i = 0;
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i letter = _mm_sub_epi8(_mm_or_si128(v, case_bit), _mm_set1_epi8('a'));
+        __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+        __m128i upper = _mm_sub_epi8(v, _mm_set1_epi8('A'));
+        __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter);
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+        __m128i is_upper = _mm_cmpeq_epi8(_mm_min_epu8(upper, _mm_set1_epi8(25)), upper);
+        std::uint64_t mask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_or_si128(is_letter, is_digit)));
+        unsigned wide = static_cast<unsigned>(_mm_movemask_epi8(v));
+        unsigned lanes = wide ? static_cast<unsigned>(__builtin_ctz(wide)) : 16;
+        mask &= (1ULL << lanes) - 1;
+        if (mask) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(low), _mm_or_si128(v, _mm_and_si128(is_upper, case_bit)));
+            emit_runs<16>(t, mask, low, lanes);
+        } else if (lanes > 0) {
+            t->in_token = 0;
+        }
+        i = wide ? tokenize_wide_run(t, text, len, i + lanes) : i + 16;
+    }
+    tokenize_scalar(t, text + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void tokenize_avx2(TokenOut* t, const unsigned char* text, std::size_t len) {
+    alignas(32) char low[64] = {};
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    std::size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i letter = _mm256_sub_epi8(_mm256_or_si256(v, case_bit), _mm256_set1_epi8('a'));
+        __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+        __m256i upper = _mm256_sub_epi8(v, _mm256_set1_epi8('A'));
+        __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter);
+        __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+        __m256i is_upper = _mm256_cmpeq_epi8(_mm256_min_epu8(upper, _mm256_set1_epi8(25)), upper);
+        std::uint64_t mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(is_letter, is_digit)));
+        unsigned wide = static_cast<unsigned>(_mm256_movemask_epi8(v));
+        unsigned lanes = wide ? static_cast<unsigned>(__builtin_ctz(wide)) : 32;
+        mask &= (1ULL << lanes) - 1;
+        if (mask) {
+            _mm256_store_si256(reinterpret_cast<__m256i*>(low),
+                               _mm256_or_si256(v, _mm256_and_si256(is_upper, case_bit)));
+            emit_runs<32>(t, mask, low, lanes);
+        } else if (lanes > 0) {
+            t->in_token = 0;
+        }
+        i = wide ? tokenize_wide_run(t, text, len, i + lanes) : i + 32;
+    }
+    tokenize_sse2(t, text + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void tokenize_avx512(TokenOut* t, const unsigned char* text,
+                                                                         std::size_t len) {
+    alignas(64) char low[128] = {};
+    const __m512i case_bit = _mm512_set1_epi8(0x20);
+    std::size_t i = 0;
+    while (i + 64 <= len) {
+        __m512i v = _mm512_loadu_si512(text + i);
+        __m512i letter = _mm512_sub_epi8(_mm512_or_si512(v, case_bit), _mm512_set1_epi8('a'));
+        __m512i digit = _mm512_sub_epi8(v, _mm512_set1_epi8('0'));
+        __m512i upper = _mm512_sub_epi8(v, _mm512_set1_epi8('A'));
+        std::uint64_t mask = _mm512_cmple_epu8_mask(letter, _mm512_set1_epi8(25)) |
+                             _mm512_cmple_epu8_mask(digit, _mm512_set1_epi8(9));
+        std::uint64_t wide = _mm512_movepi8_mask(v);
+        unsigned lanes = wide ? static_cast<unsigned>(__builtin_ctzll(wide)) : 64;
+        mask &= (lanes < 64) ? (1ULL << lanes) - 1 : ~0ULL;
+        if (mask) {
+            __mmask64 is_upper = _mm512_cmple_epu8_mask(upper, _mm512_set1_epi8(25));
+            _mm512_store_si512(low, _mm512_mask_blend_epi8(is_upper, v, _mm512_or_si512(v, case_bit)));
+            emit_runs<64>(t, mask, low, lanes);
+        } else if (lanes > 0) {
+            t->in_token = 0;
+        }
+        i = wide ? tokenize_wide_run(t, text, len, i + lanes) : i + 64;
+    }
+    tokenize_avx2(t, text + i, len - i);
+}
+#endif
+
+int tokenize_kernel_available(int kernel) {
+    if (kernel == TOKENIZE_SCALAR) {
+        return 1;
+    }
+#if defined(TOKENIZE_X86)
+    if (kernel == TOKENIZE_SSE2) {
+        static const int has_sse2 = __builtin_cpu_supports("sse2") ? 1 : 0;
+        return has_sse2;
+    }
+    if (kernel == TOKENIZE_AVX2) {
+        static const int has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        return has_avx2;
+    }
+    if (kernel == TOKENIZE_AVX512) {
+        static const int has_avx512 = __builtin_cpu_supports("avx512bw") ? 1 : 0;
+        return has_avx512;
+    }
+#endif
+    return 0;
+}
+
+const char* tokenize_kernel_name(int kernel) {
+    switch (kernel) {
+    case TOKENIZE_SCALAR:
+        return "scalar";
+    case TOKENIZE_SSE2:
+        return "sse2";
+    case TOKENIZE_AVX2:
+        return "avx2";
+    case TOKENIZE_AVX512:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
+
+std::size_t tokenize_text_with(int kernel, const char* text, std::size_t len, char* out, std::uint64_t* tokens) {
+    TokenOut t{out, 0, 0, 0};
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text);
+    while (kernel > TOKENIZE_SCALAR && !tokenize_kernel_available(kernel)) {
+        --kernel;
+    }
+#if defined(TOKENIZE_X86)
+    if (kernel == TOKENIZE_AVX512) {
+        tokenize_avx512(&t, bytes, len);
+    } else if (kernel == TOKENIZE_AVX2) {
+        tokenize_avx2(&t, bytes, len);
+    } else if (kernel == TOKENIZE_SSE2) {
+        tokenize_sse2(&t, bytes, len);
+    } else {
+        tokenize_scalar(&t, bytes, len);
+    }
+#else
+    tokenize_scalar(&t, bytes, len);
+#endif
+    *tokens = t.count;
+    return t.n;
+}
+
+std::size_t tokenize_text(const char* text, std::size_t len, char* out, std::uint64_t* tokens) {
+    /* AVX-512 only classifies faster; copying the runs out costs the same and it measured slower than AVX2 */
+    static const int kernel = tokenize_kernel_available(TOKENIZE_AVX2)   ? TOKENIZE_AVX2
+                              : tokenize_kernel_available(TOKENIZE_SSE2) ? TOKENIZE_SSE2
+                                                                         : TOKENIZE_SCALAR;
+    return tokenize_text_with(kernel, text, len, out, tokens);
+}
+
+int tokenize_stage_run(void* ctx, DocBatch* batch) {
+    TokenizeStage* stage = static_cast<TokenizeStage*>(ctx);
+    PipeBuf* out = &batch->next;
+    /* an output line is never longer than its input line */
+    if (!pipe_buf_reserve(out, batch->text.len + TOKENIZE_OUT_SLACK)) {
+        std::fprintf(stderr, "Failed to allocate tokenizer output\n");
+        return 0;
+    }
+    std::uint64_t docs = 0;
+    char* text_end = batch->text.data + batch->text.len;
+    for (char* line = batch->text.data; line < text_end;) {
+        char* nl = static_cast<char*>(std::memchr(line, '\n', static_cast<std::size_t>(text_end - line)));
+        std::size_t len = static_cast<std::size_t>(nl - line);
+        stage->input_bytes += len + 1;
+
+        char* tabs[4] = {nullptr, nullptr, nullptr, nullptr};
+        char* p = line;
+        for (int t = 0; t < 4; ++t) {
+            tabs[t] = static_cast<char*>(std::memchr(p, '\t', static_cast<std::size_t>(nl - p)));
+            if (!tabs[t]) {
+                break;
+            }
+            p = tabs[t] + 1;
+        }
+        std::size_t id_len = tabs[0] ? static_cast<std::size_t>(tabs[0] - line) : len;
+        if (tabs[3] && id_len > 0 && tabs[3] + 1 < nl) {
+            std::size_t start = out->len;
+            std::memcpy(out->data + out->len, line, id_len);
+            out->len += id_len;
+            out->data[out->len++] = '\t';
+            const char* text = tabs[3] + 1;
+            std::uint64_t doc_tokens = 0;
+            std::size_t n = tokenize_text(text, static_cast<std::size_t>(nl - text), out->data + out->len, &doc_tokens);
+            if (doc_tokens == 0) {
+                out->len = start;
+            } else {
+                out->len += n;
+                out->data[out->len++] = '\n';
+                ++docs;
+                stage->tokens += doc_tokens;
+                stage->token_length_sum += n - (doc_tokens - 1); /* minus the separators */
+            }
+        }
+        if (stage->raw_line) {
+            if (!stage->raw_line(stage->raw_line_ctx, line, len)) {
+                return 0;
+            }
+        }
+        line = nl + 1;
+    }
+    stage->docs += docs;
+    batch->docs = docs;
+    doc_batch_swap(batch);
+    return 1;
+}
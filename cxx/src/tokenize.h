@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "pipeline.h"
+
+/*
+ * Document tokenization shared by tokenizer, ingest and the query side of
+ * search_cli. Text is UTF-8; tokens are runs of letters, digits and
+ * combining marks, lowercased, and everything else separates them. The
+ * letters are those of the Latin, Greek, Cyrillic, Armenian, Hebrew, Arabic,
+ * Devanagari, Thai, kana, CJK and Hangul blocks; case folding is the simple
+ * one-to-one mapping (tables built at compile time in tokenize.cpp), so "ß"
+ * stays "ß" and "ẞ" becomes it. Bytes that are not well-formed UTF-8 and
+ * characters outside the Basic Multilingual Plane are separators.
+ */
+
+/*
+ * Tokenizer kernels; all of them produce the same output.
+ *
+ *   TOKENIZE_SCALAR  one character at a time through the lookup tables
+ *   TOKENIZE_SSE2    classifies and lowercases 16 ASCII bytes per step, then
+ *                    copies each run of letters and digits out whole; a
+ *                    block with non-ASCII bytes goes vector up to the first
+ *                    of them and scalar through the run of them
+ *   TOKENIZE_AVX2    the same, 32 bytes per step
+ *   TOKENIZE_AVX512  the same, 64 bytes per step (AVX-512BW)
+ *
+ * A kernel the CPU or the compiler lacks falls back to the next narrower one.
+ */
+const int TOKENIZE_SCALAR = 0;
+const int TOKENIZE_SSE2 = 1;
+const int TOKENIZE_AVX2 = 2;
+const int TOKENIZE_AVX512 = 3;
+const int TOKENIZE_KERNEL_COUNT = 4;
+
+/* Bytes past the output that a vector kernel may scribble on; out needs len + this. */
+const std::size_t TOKENIZE_OUT_SLACK = 64;
+
+/* Whether the kernel runs natively on this CPU. */
+int tokenize_kernel_available(int kernel);
+const char* tokenize_kernel_name(int kernel);
+
+/*
+ * Writes the tokens of text[0, len) to out, one space between tokens, and
+ * returns the bytes written (never more than len). *tokens gets the count.
+ * tokenize_text uses AVX2 where the CPU has it, else SSE2, else the scalar
+ * kernel (bench_tokenize has the numbers).
+ */
+std::size_t tokenize_text_with(int kernel, const char* text, std::size_t len, char* out, std::uint64_t* tokens);
+std::size_t tokenize_text(const char* text, std::size_t len, char* out, std::uint64_t* tokens);
+
+/* Length in bytes of the token character at text[0, len), or 0 if it starts with a separator. */
+std::size_t token_char_length(const char* text, std::size_t len);
+
+/*
+ * Pipeline stage turning raw_text.tsv lines into tokenized.txt lines,
+ * "doc_id\ttoken token ...". The doc id is the first column and the text
+ * everything after the fourth tab; lines where either is empty, or the text
+ * has no token, are dropped.
+ */
+struct TokenizeStage {
+    /* Optional; sees every raw line, newline cut off, once it is tokenized. With workers, on several threads. */
+    int (*raw_line)(void* ctx, const char* line, std::size_t len);
+    void* raw_line_ctx;
+
+    std::uint64_t docs;
+    std::uint64_t tokens;
+    std::uint64_t token_length_sum;
+    std::uint64_t input_bytes;
+};
+
+int tokenize_stage_run(void* ctx, DocBatch* batch);
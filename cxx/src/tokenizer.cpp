@@ -1,122 +1,138 @@
 #include <chrono>
-#include <cctype>
-#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
-static void split_tsv_5(const std::string& line, std::string& c1, std::string& c2, std::string& c3,
-                        std::string& c4, std::string& c5) {
-    size_t p1 = line.find('\t');
-    if (p1 == std::string::npos) {
-        c1 = line;
-        c2.clear();
-        c3.clear();
-        c4.clear();
-        c5.clear();
-        return;
-    }
-    size_t p2 = line.find('\t', p1 + 1);
-    size_t p3 = (p2 == std::string::npos) ? std::string::npos : line.find('\t', p2 + 1);
-    size_t p4 = (p3 == std::string::npos) ? std::string::npos : line.find('\t', p3 + 1);
-
-    c1 = line.substr(0, p1);
-    c2 = (p2 == std::string::npos) ? "" : line.substr(p1 + 1, p2 - p1 - 1);
-    c3 = (p3 == std::string::npos) ? "" : line.substr(p2 + 1, p3 - p2 - 1);
-    c4 = (p4 == std::string::npos) ? "" : line.substr(p3 + 1, p4 - p3 - 1);
-    c5 = (p4 == std::string::npos) ? "" : line.substr(p4 + 1);
-}
-
-static std::vector<std::string> tokenize_text(const std::string& text) {
-    std::vector<std::string> tokens;
-    std::string current;
-    current.reserve(32);
-
-    for (unsigned char ch : text) {
-        if (std::isalnum(ch)) {
-            current.push_back(static_cast<char>(std::tolower(ch)));
-        } else if (!current.empty()) {
-            tokens.push_back(current);
-            current.clear();
-        }
-    }
-    if (!current.empty()) {
-        tokens.push_back(current);
-    }
-    return tokens;
-}
+#include "pipeline.h"
+#include "token_stream.h"
+#include "tokenize.h"
 
 int main(int argc, char** argv) {
     if (argc < 3) {
-        std::cerr << "Usage: tokenizer <raw_text.tsv> <tokenized.txt>\n";
+        std::cerr << "Usage: tokenizer <raw_text.tsv> <tokenized.txt> [--threads n] [--format text|binary]\n";
         return 1;
     }
 
     const std::string input_path = argv[1];
     const std::string output_path = argv[2];
+    std::uint32_t thread_count = 1;
+    bool binary = false;
+    for (int i = 3; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            if (thread_count == 0) {
+                long online = sysconf(_SC_NPROCESSORS_ONLN);
+                thread_count = (online > 0) ? static_cast<std::uint32_t>(online) : 1;
+            }
+        } else if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "text") != 0 && std::strcmp(argv[i], "binary") != 0) {
+                std::cerr << "Unknown output format " << argv[i] << " (expected text or binary)\n";
+                return 1;
+            }
+            binary = std::strcmp(argv[i], "binary") == 0;
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+            return 1;
+        }
+    }
 
-    std::ifstream in(input_path);
-    if (!in) {
+    LineSource source;
+    if (!line_source_open(&source, input_path.c_str())) {
         std::cerr << "Failed to open input: " << input_path << "\n";
         return 1;
     }
-    std::ofstream out(output_path);
-    if (!out) {
+    FILE* out = std::fopen(output_path.c_str(), "wb");
+    if (!out || (binary && !token_stream_write_header(out))) {
         std::cerr << "Failed to open output: " << output_path << "\n";
+        line_source_close(&source);
+        if (out) {
+            std::fclose(out);
+        }
         return 1;
     }
 
     auto started = std::chrono::steady_clock::now();
 
-    std::string line;
-    std::uint64_t doc_count = 0;
-    std::uint64_t token_count = 0;
-    std::uint64_t token_length_sum = 0;
-    std::uint64_t input_bytes = 0;
-
-    while (std::getline(in, line)) {
-        input_bytes += static_cast<std::uint64_t>(line.size() + 1);
-        if (line.empty()) {
-            continue;
-        }
-
-        std::string doc_id, source, url, title, text;
-        split_tsv_5(line, doc_id, source, url, title, text);
-        if (doc_id.empty() || text.empty()) {
-            continue;
-        }
-
-        std::vector<std::string> tokens = tokenize_text(text);
-        if (tokens.empty()) {
-            continue;
-        }
-
-        ++doc_count;
-        out << doc_id << '\t';
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (i > 0) {
-                out << ' ';
-            }
-            out << tokens[i];
-            ++token_count;
-            token_length_sum += static_cast<std::uint64_t>(tokens[i].size());
-        }
-        out << '\n';
+    /*
+     * With --threads n the batches are tokenized by n workers, each into its
+     * own batch buffers, and the pipeline hands them to the writer in input
+     * order, so the output is the same for every n.
+     */
+    std::vector<TokenizeStage> workers(thread_count, TokenizeStage{});
+    std::vector<PipeStage> worker_stages;
+    for (TokenizeStage& worker : workers) {
+        worker_stages.push_back(pipe_stage("tokenize", tokenize_stage_run, &worker));
+    }
+    /* --format binary writes a token stream (token_stream.h) instead of lines */
+    TokenStreamEncoder encoder;
+    if (binary && !token_stream_encoder_init(&encoder)) {
+        std::cerr << "Failed to allocate term table\n";
+        line_source_close(&source);
+        std::fclose(out);
+        return 1;
+    }
+    LineSink sink{out};
+    std::vector<PipeStage> stages = {
+        pipe_stage("read", line_source_run, &source),
+        (thread_count > 1) ? pipe_stage_workers("tokenize", worker_stages.data(), thread_count) : worker_stages[0],
+    };
+    if (binary) {
+        stages.push_back(pipe_stage("encode", token_stream_encode_run, &encoder));
+    }
+    stages.push_back(pipe_stage("write", line_sink_run, &sink));
+    std::uint32_t stage_count = static_cast<std::uint32_t>(stages.size());
+    bool ok = pipeline_run(stages.data(), stage_count, thread_count > 1 || pipeline_threads_default());
+    line_source_close(&source);
+    if (binary) {
+        token_stream_encoder_free(&encoder);
+    }
+    if (std::fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        std::cerr << "Failed to tokenize " << input_path << "\n";
+        return 1;
     }
 
     auto ended = std::chrono::steady_clock::now();
     double elapsed_sec = std::chrono::duration<double>(ended - started).count();
-    double avg_len = token_count == 0 ? 0.0 : static_cast<double>(token_length_sum) / static_cast<double>(token_count);
-    double kb = static_cast<double>(input_bytes) / 1024.0;
+    TokenizeStage tokenize{};
+    for (const TokenizeStage& worker : workers) {
+        tokenize.docs += worker.docs;
+        tokenize.tokens += worker.tokens;
+        tokenize.token_length_sum += worker.token_length_sum;
+        tokenize.input_bytes += worker.input_bytes;
+    }
+    double token_count = static_cast<double>(tokenize.tokens);
+    double avg_len = tokenize.tokens == 0 ? 0.0 : static_cast<double>(tokenize.token_length_sum) / token_count;
+    double kb = static_cast<double>(tokenize.input_bytes) / 1024.0;
     double sec_per_kb = kb > 0.0 ? elapsed_sec / kb : 0.0;
+    double mb_per_sec = elapsed_sec > 0.0 ? kb / 1024.0 / elapsed_sec : 0.0;
+    /* Batch buffers are the only heap memory the stages take; they stop growing once they fit the largest batch. */
+    std::uint64_t allocations = 0;
+    for (const PipeStage& stage : stages) {
+        allocations += stage.allocations;
+    }
+    double allocs_per_doc = tokenize.docs == 0 ? 0.0 : static_cast<double>(allocations) / tokenize.docs;
 
     std::cout << "Tokenizer finished\n";
-    std::cout << "documents=" << doc_count << "\n";
-    std::cout << "tokens=" << token_count << "\n";
+    std::cout << "documents=" << tokenize.docs << "\n";
+    std::cout << "tokens=" << tokenize.tokens << "\n";
     std::cout << "avg_token_length=" << avg_len << "\n";
     std::cout << "elapsed_seconds=" << elapsed_sec << "\n";
     std::cout << "seconds_per_kb=" << sec_per_kb << "\n";
+    std::cout << "mb_per_second=" << mb_per_sec << "\n";
+    std::cout << "allocations=" << allocations << "\n";
+    std::cout << "allocations_per_document=" << allocs_per_doc << "\n";
+    std::cout << "threads=" << thread_count << "\n";
+    std::cout << "format=" << (binary ? "binary" : "text") << std::endl;
+    pipeline_print_stats(stdout, stages.data(), stage_count);
 
     return 0;
 }
@@ -30,15 +30,20 @@ INDEX_DIR="$("${PYTHON_BIN}" -c "import sys,yaml; cfg=yaml.safe_load(open(sys.ar
 
 mkdir -p "$(dirname "${ROOT_DIR}/${TOKENIZED}")" "$(dirname "${ROOT_DIR}/${TERM_CSV}")" "${ROOT_DIR}/${INDEX_DIR}"
 
-echo "[4/7] tokenizer (C++ with STL)"
-"${ROOT_DIR}/cxx/build/tokenizer" "${ROOT_DIR}/${RAW_TSV}" "${ROOT_DIR}/${TOKENIZED}"
-
-echo "[5/7] stemmer + term stats (C++ no STL)"
-"${ROOT_DIR}/cxx/build/stemmer" "${ROOT_DIR}/${TOKENIZED}" "${ROOT_DIR}/${STEMMED}"
-"${ROOT_DIR}/cxx/build/term_stats" "${ROOT_DIR}/${STEMMED}" "${ROOT_DIR}/${TERM_CSV}"
-
-echo "[6/7] boolean index build (C++ no STL)"
-"${ROOT_DIR}/cxx/build/index_builder" "${ROOT_DIR}/${STEMMED}" "${ROOT_DIR}/${RAW_TSV}" "${ROOT_DIR}/${INDEX_DIR}"
+if [[ "${FUSED_INGEST:-0}" == "1" ]]; then
+  echo "[4-6/7] fused ingest: tokenize + stem + term stats + index in one pass (C++ no STL)"
+  "${ROOT_DIR}/cxx/build/ingest" "${ROOT_DIR}/${RAW_TSV}" "${ROOT_DIR}/${INDEX_DIR}" "${ROOT_DIR}/${TERM_CSV}"
+else
+  echo "[4/7] tokenizer (C++ with STL)"
+  "${ROOT_DIR}/cxx/build/tokenizer" "${ROOT_DIR}/${RAW_TSV}" "${ROOT_DIR}/${TOKENIZED}"
+
+  echo "[5/7] stemmer + term stats (C++ no STL)"
+  "${ROOT_DIR}/cxx/build/stemmer" "${ROOT_DIR}/${TOKENIZED}" "${ROOT_DIR}/${STEMMED}"
+  "${ROOT_DIR}/cxx/build/term_stats" "${ROOT_DIR}/${STEMMED}" "${ROOT_DIR}/${TERM_CSV}"
+
+  echo "[6/7] boolean index build (C++ no STL)"
+  "${ROOT_DIR}/cxx/build/index_builder" "${ROOT_DIR}/${STEMMED}" "${ROOT_DIR}/${RAW_TSV}" "${ROOT_DIR}/${INDEX_DIR}" --threads 0
+fi
 
 echo "[7/7] build Zipf PNG"
 "${PYTHON_BIN}" "${ROOT_DIR}/scripts/build_zipf_png.py" "${CONFIG_ABS}"
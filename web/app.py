@@ -2,8 +2,10 @@
 from __future__ import annotations
 
 import os
+import queue
+import socket
 import subprocess
-from typing import Dict, List, Tuple
+from typing import Dict, List, Optional, Tuple
 
 import yaml
 from flask import Flask, redirect, render_template, request, url_for
@@ -21,8 +23,11 @@ def load_config(path: str) -> dict:
     return data
 
 
-def parse_cli_output(raw: str) -> Tuple[int, List[Dict[str, str]]]:
+def parse_cli_output(raw: str) -> Tuple[int, bool, List[Dict[str, str]], str]:
+    """Returns (total, total_is_estimate, docs, next_cursor)."""
     total = 0
+    estimated = False
+    next_cursor = ""
     docs: List[Dict[str, str]] = []
     for line in raw.splitlines():
         if not line.strip():
@@ -33,6 +38,9 @@ def parse_cli_output(raw: str) -> Tuple[int, List[Dict[str, str]]]:
                 total = int(parts[1])
             except ValueError:
                 total = 0
+            estimated = len(parts) >= 3 and parts[2] == "estimate"
+        elif parts[0] == "NEXT" and len(parts) >= 2:
+            next_cursor = parts[1]
         elif parts[0] == "DOC" and len(parts) >= 4:
             docs.append(
                 {
@@ -41,7 +49,72 @@ def parse_cli_output(raw: str) -> Tuple[int, List[Dict[str, str]]]:
                     "url": parts[3],
                 }
             )
-    return total, docs
+    return total, estimated, docs, next_cursor
+
+
+class SearchServerClient:
+    """Pooled client for `search_cli --listen <socket>` / `search_cli --port <n>`.
+
+    `address` is either a Unix socket path or `host:port`. Connections are kept
+    open and reused across requests; a broken connection is dropped and the
+    request is retried once on a fresh one.
+    """
+
+    def __init__(self, address: str, pool_size: int = 8, timeout: float = 60.0) -> None:
+        self.address = address
+        self.timeout = timeout
+        self.pool: "queue.LifoQueue[Tuple[socket.socket, object]]" = queue.LifoQueue(maxsize=pool_size)
+
+    def _connect(self) -> Tuple[socket.socket, object]:
+        if self.address.startswith("/") or self.address.startswith("unix:"):
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.settimeout(self.timeout)
+            sock.connect(self.address[5:] if self.address.startswith("unix:") else self.address)
+        else:
+            host, _, port = self.address.rpartition(":")
+            sock = socket.create_connection((host or "127.0.0.1", int(port)), timeout=self.timeout)
+        return sock, sock.makefile("rb")
+
+    def _release(self, conn: Tuple[socket.socket, object]) -> None:
+        try:
+            self.pool.put_nowait(conn)
+        except queue.Full:
+            conn[1].close()
+            conn[0].close()
+
+    def _roundtrip(self, conn: Tuple[socket.socket, object], request: bytes) -> str:
+        sock, reader = conn
+        sock.sendall(request)
+        lines: List[str] = []
+        while True:
+            line = reader.readline()
+            if not line:
+                raise ConnectionError("search server closed the connection")
+            text = line.decode("utf-8", errors="replace").rstrip("\r\n")
+            if text == "END":
+                return "\n".join(lines)
+            lines.append(text)
+
+    def query(self, query: str, offset: int, limit: int, cursor: str = "") -> str:
+        clean = " ".join(query.split())
+        position = cursor or str(offset)
+        request = f"QUERY\t{position}\t{limit}\t{clean}\n".encode("utf-8")
+        for attempt in range(2):
+            try:
+                conn = self.pool.get_nowait()
+            except queue.Empty:
+                conn = self._connect()
+            try:
+                raw = self._roundtrip(conn, request)
+            except (OSError, ConnectionError):
+                conn[1].close()
+                conn[0].close()
+                if attempt == 1:
+                    raise
+                continue
+            self._release(conn)
+            return raw
+        return ""
 
 
 def create_app() -> Flask:
@@ -54,25 +127,23 @@ def create_app() -> Flask:
         os.path.join(ROOT_DIR, "cxx", "build", "search_cli"),
     )
 
-    app = Flask(__name__, template_folder="templates")
-
-    @app.get("/")
-    def home():
-        return render_template("index.html")
+    server_address = os.environ.get("MUSIC_IR_SEARCH_SERVER", "")
+    server_client: Optional[SearchServerClient] = (
+        SearchServerClient(server_address) if server_address else None
+    )
 
-    @app.get("/search")
-    def search():
-        query = request.args.get("q", "").strip()
-        if not query:
-            return redirect(url_for("home"))
+    app = Flask(__name__, template_folder="templates")
 
-        page = request.args.get("page", "1")
-        try:
-            page_int = max(1, int(page))
-        except ValueError:
-            page_int = 1
-        limit = 50
-        offset = (page_int - 1) * limit
+    def run_search(query: str, offset: int, limit: int, cursor: str) -> Tuple[str, str]:
+        if server_client is not None:
+            try:
+                raw = server_client.query(query, offset, limit, cursor)
+            except OSError as exc:
+                return "", f"search server unavailable at {server_address}: {exc}"
+            for line in raw.splitlines():
+                if line.startswith("ERROR\t"):
+                    return "", f"search server failed: {line[6:]}"
+            return raw, ""
 
         cmd = [
             search_cli,
@@ -80,11 +151,14 @@ def create_app() -> Flask:
             index_dir,
             "--query",
             query,
-            "--offset",
-            str(offset),
             "--limit",
             str(limit),
         ]
+        # A cursor already marks where the page starts; search_cli rejects an offset on top of it.
+        if cursor:
+            cmd += ["--cursor", cursor]
+        else:
+            cmd += ["--offset", str(offset)]
         try:
             completed = subprocess.run(
                 cmd,
@@ -95,38 +169,58 @@ def create_app() -> Flask:
                 timeout=60,
             )
         except subprocess.CalledProcessError as exc:
-            return render_template(
-                "results.html",
-                query=query,
-                total=0,
-                docs=[],
-                page=page_int,
-                has_next=False,
-                has_prev=page_int > 1,
-                error=f"search_cli failed: {exc.stderr.strip()}",
-            )
+            return "", f"search_cli failed: {exc.stderr.strip()}"
         except FileNotFoundError:
+            return "", f"search_cli not found at {search_cli}"
+        return completed.stdout, ""
+
+    @app.get("/")
+    def home():
+        return render_template("index.html")
+
+    @app.get("/search")
+    def search():
+        query = request.args.get("q", "").strip()
+        if not query:
+            return redirect(url_for("home"))
+
+        page = request.args.get("page", "1")
+        try:
+            page_int = max(1, int(page))
+        except ValueError:
+            page_int = 1
+        limit = 50
+        offset = (page_int - 1) * limit
+        # "Next" links carry the cursor of the page before, so deep pages resume instead of recounting.
+        cursor = request.args.get("cursor", "")
+
+        raw, error = run_search(query, offset, limit, cursor)
+        if error:
             return render_template(
                 "results.html",
                 query=query,
                 total=0,
+                total_estimated=False,
                 docs=[],
                 page=page_int,
                 has_next=False,
+                next_cursor="",
                 has_prev=page_int > 1,
-                error=f"search_cli not found at {search_cli}",
+                error=error,
             )
 
-        total, docs = parse_cli_output(completed.stdout)
+        total, total_estimated, docs, next_cursor = parse_cli_output(raw)
         has_prev = page_int > 1
-        has_next = offset + len(docs) < total
+        has_next = bool(next_cursor)
         return render_template(
             "results.html",
             query=query,
             total=total,
+            total_estimated=total_estimated,
             docs=docs,
             page=page_int,
             has_next=has_next,
+            next_cursor=next_cursor,
             has_prev=has_prev,
             error="",
         )